@@ -168,8 +168,11 @@ ioapic_t * initIoApic(hv_t *hv) {
 
   ioapic->hv = hv;
   ioapic->max_irqs = NR_MAX_IOAPIC_IRQS;
-  ioapic->interrupt_queue = NULL;
-  pthread_mutex_init(&ioapic->queue_lock, NULL);
+  int i;
+  for (i=0; i < NR_MAX_VCPUS; i++) {
+    ioapic->interrupt_queue[i] = NULL;
+    pthread_mutex_init(&ioapic->queue_lock[i], NULL);
+  }
   if (socketpair(AF_UNIX, SOCK_DGRAM, 0, ioapic->s) < 0) {
     perror("socketpair failed in initIoApic\n");
     goto err;
@@ -255,7 +258,9 @@ int ioApicMmio(vcpu_t *vcpu, uint64_t phys_addr, uint64_t *data,
   return ret;
 }
 
-int ioApicSendInterrupt(hv_t *hv, uint8_t irq) {
+// NOTE: called from the dest vcpu's own thread, the irq was routed to it
+// when it was queued
+int ioApicSendInterrupt(hv_t *hv, vcpu_t *dest_vcpu, uint8_t irq) {
   if(DEBUG) {
     printf("Being asked to send irq %d\n", irq);
   }
@@ -267,39 +272,9 @@ int ioApicSendInterrupt(hv_t *hv, uint8_t irq) {
   pthread_mutex_lock(&hv->ioapic_access_mutex);
   union redirTableEntry entry;
   entry.val= hv->ioapic->irq_redir_table[irq];
-  uint16_t dest_vcpu_id = entry.fields.dest_cpu;
-  // ensure the dest cpu exists
-  if (dest_vcpu_id >= g_nvcpus) {
-    ret = -1;
-    goto end_handle_intrrupt2;
-  }
-
-  vcpu_t *dest_vcpu = hv->vcpus[dest_vcpu_id];
-
-  // check if vcpu exists
-  if (!dest_vcpu) {
-    ret = -1;
-    goto end_handle_intrrupt2;
-  }
+  uint16_t dest_vcpu_id = dest_vcpu->id;
 
-  // if cpu has never been started, we won't wake it with a device irq
-  if (dest_vcpu->state == STATE_NOT_STARTED) {
-    ret = -1;
-    goto end_handle_intrrupt2;
-  }
-
-  // if it's currently halted, we'll wake it
-  if (dest_vcpu->state == STATE_HALTED) {
-    if (DEBUG)
-      printf("Going to wake vcpu %d for a device irq\n", dest_vcpu_id);
-    pthread_mutex_lock(&dest_vcpu->state_access_mutex);
-    dest_vcpu->state = STATE_RUNNING;
-    pthread_cond_signal(&dest_vcpu->startcpu);
-    pthread_mutex_unlock(&dest_vcpu->state_access_mutex);
-  }
-
-  // if it exists, take the lapic lock for that vcpu
-  // so we can check the isr
+  // take the lapic lock for that vcpu so we can check the isr
   pthread_mutex_lock(&dest_vcpu->lapic_access_mutex);
 
   // we're still waiting on an interrupt from earlier to be serviced
@@ -337,7 +312,6 @@ int ioApicSendInterrupt(hv_t *hv, uint8_t irq) {
 
 end_handle_intrrupt1:
   pthread_mutex_unlock(&dest_vcpu->lapic_access_mutex);
-end_handle_intrrupt2:
   pthread_mutex_unlock(&hv->ioapic_access_mutex);
   if(DEBUG) {
     printf("Returning from trying to send irq %d\n", irq);
@@ -345,6 +319,45 @@ end_handle_intrrupt2:
   return ret;
 }
 
+// looks up which vcpu an irq is routed to. returns NULL if the irq can't be
+// delivered
+static vcpu_t *ioApicRouteInterrupt(hv_t *hv, uint8_t irq) {
+  irq = irq & 0x1f;
+  pthread_mutex_lock(&hv->ioapic_access_mutex);
+  union redirTableEntry entry;
+  entry.val = hv->ioapic->irq_redir_table[irq];
+  pthread_mutex_unlock(&hv->ioapic_access_mutex);
+
+  uint16_t dest_vcpu_id = entry.fields.dest_cpu;
+  // ensure the dest cpu exists
+  if (dest_vcpu_id >= g_nvcpus)
+    return NULL;
+
+  vcpu_t *dest_vcpu = hv->vcpus[dest_vcpu_id];
+  if (!dest_vcpu)
+    return NULL;
+
+  // if cpu has never been started, we won't wake it with a device irq
+  if (dest_vcpu->state == STATE_NOT_STARTED)
+    return NULL;
+
+  return dest_vcpu;
+}
+
+// wakes vcpu if it's halted, so it can pick up an irq that has already been
+// queued for it. a vcpu only halts after finding its queue empty under the
+// same lock (see haltVcpu), so one of the two always sees the other
+static void ioApicWakeVcpu(vcpu_t *vcpu) {
+  pthread_mutex_lock(&vcpu->state_access_mutex);
+  if (vcpu->state == STATE_HALTED) {
+    if (DEBUG)
+      printf("Going to wake vcpu %d for a device irq\n", vcpu->id);
+    vcpu->state = STATE_RUNNING;
+    pthread_cond_signal(&vcpu->startcpu);
+  }
+  pthread_mutex_unlock(&vcpu->state_access_mutex);
+}
+
 void * ioApicThread(void *arg) {
   hv_t *hv = (hv_t *)arg;
   int sock = hv->ioapic->s[0];
@@ -366,9 +379,14 @@ void * ioApicThread(void *arg) {
 int queueInterrupt(ioapic_t *ioapic, uint8_t irq) {
   int ret = 0;
 
-  pthread_mutex_lock(&ioapic->queue_lock);
+  vcpu_t *dest_vcpu = ioApicRouteInterrupt(ioapic->hv, irq);
+  if (!dest_vcpu)
+    return -1;
+  uint32_t id = dest_vcpu->id;
 
-  if (ioapic->nr_pending >= QUEUE_MAX_INTERRUPTS) {
+  pthread_mutex_lock(&ioapic->queue_lock[id]);
+
+  if (ioapic->nr_pending[id] >= QUEUE_MAX_INTERRUPTS) {
     ret = -1;
     goto end;
   }
@@ -381,12 +399,12 @@ int queueInterrupt(ioapic_t *ioapic, uint8_t irq) {
 
   entry->irq = irq;
 
-  if (!ioapic->interrupt_queue) {
-    ioapic->interrupt_queue = entry;
+  if (!ioapic->interrupt_queue[id]) {
+    ioapic->interrupt_queue[id] = entry;
     goto end;
   }
 
-  struct interrupt_entry *cur = ioapic->interrupt_queue;
+  struct interrupt_entry *cur = ioapic->interrupt_queue[id];
   while (cur->next) {
     cur = cur->next;
   }
@@ -394,53 +412,70 @@ int queueInterrupt(ioapic_t *ioapic, uint8_t irq) {
 
 end:
   if (!ret)
-    ioapic->nr_pending++;
-  pthread_mutex_unlock(&ioapic->queue_lock);
+    ioapic->nr_pending[id]++;
+  pthread_mutex_unlock(&ioapic->queue_lock[id]);
+
+  // only once the entry is there to be found
+  if (!ret)
+    ioApicWakeVcpu(dest_vcpu);
   return ret;
 }
 
-struct interrupt_entry * dequeueInterrupt(ioapic_t *ioapic) {
+struct interrupt_entry * dequeueInterrupt(ioapic_t *ioapic, uint32_t vcpu_id) {
   struct interrupt_entry *ret = NULL;
   int err = 0;
-  pthread_mutex_lock(&ioapic->queue_lock);
-  if (ioapic->nr_pending == 0) {
+  pthread_mutex_lock(&ioapic->queue_lock[vcpu_id]);
+  if (ioapic->nr_pending[vcpu_id] == 0) {
     err = -1;
     goto end;
   }
 
-  if (!ioapic->interrupt_queue) {
+  if (!ioapic->interrupt_queue[vcpu_id]) {
     err = -1;
     goto end;
   }
 
-  ret = ioapic->interrupt_queue;
-  ioapic->interrupt_queue = ret->next;
+  ret = ioapic->interrupt_queue[vcpu_id];
+  ioapic->interrupt_queue[vcpu_id] = ret->next;
 
 end:
   if (!err)
-    ioapic->nr_pending--;
-  pthread_mutex_unlock(&ioapic->queue_lock);
+    ioapic->nr_pending[vcpu_id]--;
+  pthread_mutex_unlock(&ioapic->queue_lock[vcpu_id]);
   return ret;
 }
 
-bool haveInterrupts(ioapic_t *ioapic) {
-  pthread_mutex_lock(&ioapic->queue_lock);
-  bool ret = (ioapic->nr_pending != 0);
-  pthread_mutex_unlock(&ioapic->queue_lock);
+bool haveInterrupts(ioapic_t *ioapic, uint32_t vcpu_id) {
+  pthread_mutex_lock(&ioapic->queue_lock[vcpu_id]);
+  bool ret = (ioapic->nr_pending[vcpu_id] != 0);
+  pthread_mutex_unlock(&ioapic->queue_lock[vcpu_id]);
   return ret;
 }
 
+// marks vcpu halted after a hlt, unless an irq was queued for it since it
+// last checked. returns false if it should go straight back to running
+bool haltVcpu(hv_t *hv, vcpu_t *vcpu) {
+  bool halted = false;
+  pthread_mutex_lock(&vcpu->state_access_mutex);
+  if (!haveInterrupts(hv->ioapic, vcpu->id)) {
+    vcpu->state = STATE_HALTED;
+    halted = true;
+  }
+  pthread_mutex_unlock(&vcpu->state_access_mutex);
+  return halted;
+}
+
 
 int checkAndSendInterrupt(hv_t *hv, vcpu_t *vcpu) {
-  // do we have any interrupts queued?
-  if (haveInterrupts(hv->ioapic)) {
+  // do we have any interrupts queued for this vcpu?
+  if (haveInterrupts(hv->ioapic, vcpu->id)) {
 
     // Can we send an interrupt?
     if ( ((struct kvm_run *)vcpu->comm)->ready_for_interrupt_injection) {
-      struct interrupt_entry *entry = dequeueInterrupt(hv->ioapic);
+      struct interrupt_entry *entry = dequeueInterrupt(hv->ioapic, vcpu->id);
       if (!entry)
         return -1;
-      ioApicSendInterrupt(hv, entry->irq);
+      ioApicSendInterrupt(hv, vcpu, entry->irq);
       free(entry);
     }
 
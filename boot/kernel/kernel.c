@@ -16,6 +16,7 @@
 #define IDT_MAX_DESCRIPTORS 10
 
 #define OGX_READY_IRQ 2
+#define NET_IRQ 3
 #define P9_RESPONSE_IRQ 9
 
 static int OGX_READY = 0;
@@ -27,6 +28,7 @@ int p9_ready_to_race = 0;
 void* p9_race_addr = NULL;
 
 volatile int p9_intrs = 0;
+volatile int net_intrs = 0;
 
 int _rdmsr(int msr);
 void _out(int p, int a);
@@ -125,6 +127,9 @@ void intr_handler(int irq) {
             p9_intrs += 1;
             VGA[0] = p9_intrs;
             break;
+        case NET_IRQ:
+            net_intrs += 1;
+            break;
         default:
             break;
     }
@@ -560,8 +565,15 @@ void test_ipv4_pkt_tx(struct virtq* vq, int idx) {
 }
 
 void test_pkt_rx(struct virtq* vq, int idx) {
+    volatile uint16_t* used_idx = &vq->used->idx;
+    uint16_t last_used = *used_idx;
+
     commit_and_ready_vq(net, 2, vq);
 
+    // rx is completed asynchronously, wait for the device to hand it back
+    while (*used_idx == last_used)
+        ;
+
     uint16_t size = ((uint16_t*)vq->desc[idx].addr)[0];
 
     kprinti(size);
@@ -57,6 +57,11 @@ int add_buf(uint32_t *device, uint32_t vq_idx, struct virtq *vq, void *buf, uint
   vq->avail->ring[desc_idx] = desc_idx;
   // increment the avail head idx
   vq->avail->idx++;
+  // the idx store has to be visible before we look at the device's flags
+  __sync_synchronize();
+  // a busy polling device will see the new idx on its own
+  if (((volatile struct virtq_used *)vq->used)->flags & VIRTQ_USED_F_NO_NOTIFY)
+    return 0;
   // notify the device of the index we just wrote
   device[REG_QUEUE_NOTIFY/4] = vq_idx;
   return 0;
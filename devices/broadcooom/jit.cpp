@@ -0,0 +1,412 @@
+#include <string.h>
+#include <sys/mman.h>
+
+#include "jit.hpp"
+
+// host registers. blocks follow the SysV calling convention and only touch
+// rax and rcx besides their arguments, so they need no prologue
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RSI 6
+#define RDI 7
+
+// where a block's arguments are
+#define STATE RDI
+#define REGISTERS RSI
+#define CODE RDX
+
+// condition codes, for jcc
+#define CC_E 0x4
+#define CC_NE 0x5
+#define CC_L 0xc
+#define CC_GE 0xd
+#define CC_LE 0xe
+#define CC_G 0xf
+
+MicroengineJit::MicroengineJit():
+   m_used(0),
+   m_writable(false),
+   m_blocks{0}
+{
+   void* buffer = mmap(NULL, JIT_BUFFER_SIZE, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   m_buffer = buffer == MAP_FAILED ? NULL : (uint8_t*)buffer;
+}
+
+MicroengineJit::~MicroengineJit()
+{
+   if (m_buffer)
+   {
+      munmap(m_buffer, JIT_BUFFER_SIZE);
+   }
+}
+
+void MicroengineJit::flush()
+{
+   m_used = 0;
+   memset(m_blocks, 0, sizeof(m_blocks));
+}
+
+void MicroengineJit::seal()
+{
+   if (m_writable)
+   {
+      mprotect(m_buffer, JIT_BUFFER_SIZE, PROT_READ | PROT_EXEC);
+      m_writable = false;
+   }
+}
+
+jit_block MicroengineJit::compile(const decoded_instruction* code, uint8_t ctx, uint32_t pc, uint32_t end)
+{
+   if (!m_buffer || pc >= end || !compilable(code[pc].op))
+   {
+      return NULL;
+   }
+
+   assemble(code, pc, end);
+   // blocks that changed get compiled again and leave the old ones behind,
+   // start over when they fill the buffer
+   if (m_used + m_out.size() > JIT_BUFFER_SIZE)
+   {
+      flush();
+   }
+   if (!m_writable)
+   {
+      mprotect(m_buffer, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE);
+      m_writable = true;
+   }
+
+   jit_block block = (jit_block)(m_buffer + m_used);
+   memcpy(m_buffer + m_used, m_out.data(), m_out.size());
+   // keep blocks 16 byte aligned
+   m_used = (m_used + m_out.size() + 15) & ~(size_t)15;
+   m_blocks[ctx * MICROENGINE_CODE_SIZE + pc] = block;
+   return block;
+}
+
+// Translates code from pc into m_out, until an instruction that has to go
+// through the runtime, a branch, end or JIT_MAX_BLOCK instructions
+void MicroengineJit::assemble(const decoded_instruction* code, uint32_t pc, uint32_t end)
+{
+   m_out.clear();
+   m_stale.clear();
+
+   uint32_t i;
+   bool branched = false;
+   for (i = pc; i < end && i - pc < JIT_MAX_BLOCK; i++)
+   {
+      const decoded_instruction* d = &code[i];
+      if (!compilable(d->op))
+      {
+         break;
+      }
+
+      emit_check(d, i, i - pc);
+      if (d->op >= D_BR)
+      {
+         emit_branch(d, i, i - pc + 1);
+         branched = true;
+         break;
+      }
+      switch (d->op)
+      {
+         case D_ALU:
+            emit_alu(d);
+            break;
+         case D_IMMED:
+            emit_immed(d);
+            break;
+         case D_LD_FIELD:
+         case D_LD_FIELD_W_CLR:
+            emit_ld_field(d);
+            break;
+         default:
+            break;
+      }
+   }
+   if (!branched)
+   {
+      emit_exit(i, i - pc);
+   }
+
+   // instructions that changed under the block go back to the runtime
+   // before they run, out of the way of the rest
+   for (size_t s = 0; s < m_stale.size(); s++)
+   {
+      patch(m_stale[s].fixup);
+      emit_exit(m_stale[s].pc | JIT_STALE, m_stale[s].executed);
+   }
+}
+
+void MicroengineJit::emit32(uint32_t v)
+{
+   for (int i = 0; i < 4; i++)
+   {
+      emit(v >> (i * 8));
+   }
+}
+
+// the modrm byte and displacement for reg and [base + disp]. none of the
+// bases used need a sib byte
+void MicroengineJit::emit_mem(uint8_t reg, uint8_t base, int32_t disp)
+{
+   if (disp >= -128 && disp < 128)
+   {
+      emit(0x40 | (reg << 3) | base);
+      emit(disp);
+   }
+   else
+   {
+      emit(0x80 | (reg << 3) | base);
+      emit32(disp);
+   }
+}
+
+// opcode reg, [registers + src]
+void MicroengineJit::emit_op(uint8_t opcode, uint8_t reg, register_ref src)
+{
+   emit(opcode);
+   emit_mem(reg, REGISTERS, src * sizeof(register_type));
+}
+
+// jcc rel32, to be patched
+size_t MicroengineJit::emit_jcc(uint8_t cc)
+{
+   emit(0x0f);
+   emit(0x80 | cc);
+   emit32(0);
+   return m_out.size() - 4;
+}
+
+// points the rel32 at fixup to what comes next
+void MicroengineJit::patch(size_t fixup)
+{
+   uint32_t rel = m_out.size() - (fixup + 4);
+   memcpy(&m_out[fixup], &rel, sizeof(rel));
+}
+
+// the same comparison the threaded interpreter makes, against the five
+// bytes in code
+void MicroengineJit::emit_check(const decoded_instruction* d, uint32_t pc, uint32_t executed)
+{
+   int32_t disp = pc * sizeof(instruction);
+   stale_exit stale;
+   stale.pc = pc;
+   stale.executed = executed;
+
+   // cmp dword [code + disp], imm32
+   emit(0x81);
+   emit_mem(7, CODE, disp);
+   emit32(d->raw);
+   stale.fixup = emit_jcc(CC_NE);
+   m_stale.push_back(stale);
+
+   // cmp byte [code + disp + 4], imm8
+   emit(0x80);
+   emit_mem(7, CODE, disp + 4);
+   emit(d->raw >> 32);
+   stale.fixup = emit_jcc(CC_NE);
+   m_stale.push_back(stale);
+}
+
+void MicroengineJit::emit_exit(uint32_t next, uint32_t executed)
+{
+   if (executed)
+   {
+      // add qword [state + executed], imm32
+      emit(0x48);
+      emit(0x81);
+      emit_mem(0, STATE, offsetof(jit_state, executed));
+      emit32(executed);
+   }
+   // mov eax, next
+   emit(0xb8);
+   emit32(next);
+   // ret
+   emit(0xc3);
+}
+
+// Each case computes the 64 bit result interpret_alu_instruction does in
+// rax, so carry and sign come out of bits 32 and 31 the same way.
+void MicroengineJit::emit_alu(const decoded_instruction* d)
+{
+   instruction inst;
+   memcpy(&inst, &d->raw, sizeof(inst));
+
+   switch (inst.alu_inst.type)
+   {
+      case PLUS:
+      case PLUS_CARRY:
+      case PLUS_IF_SIGN:
+         emit_op(0x8b, RAX, d->src_1);
+         emit_op(0x8b, RCX, d->src_2);
+         // add rax, rcx
+         emit(0x48); emit(0x01); emit(0xc8);
+         if (inst.alu_inst.type == PLUS_CARRY)
+         {
+            // movzx ecx, byte [state + carry]; add rax, rcx
+            emit(0x0f); emit(0xb6);
+            emit_mem(RCX, STATE, offsetof(jit_state, carry));
+            emit(0x48); emit(0x01); emit(0xc8);
+         }
+         else if (inst.alu_inst.type == PLUS_IF_SIGN)
+         {
+            // cmp byte [state + sign], 0; cmovz rax, rcx
+            emit(0x80);
+            emit_mem(7, STATE, offsetof(jit_state, sign));
+            emit(0);
+            emit(0x48); emit(0x0f); emit(0x44); emit(0xc1);
+         }
+         break;
+      case MINUS:
+         emit_op(0x8b, RAX, d->src_1);
+         emit_op(0x2b, RAX, d->src_2);
+         break;
+      case BACKWARDS_MINUS:
+         emit_op(0x8b, RAX, d->src_2);
+         emit_op(0x2b, RAX, d->src_1);
+         break;
+      case SECOND:
+         emit_op(0x8b, RAX, d->src_2);
+         break;
+      case BIT_NOT_SECOND:
+         emit_op(0x8b, RAX, d->src_2);
+         // not eax
+         emit(0xf7); emit(0xd0);
+         break;
+      case AND:
+         emit_op(0x8b, RAX, d->src_1);
+         emit_op(0x23, RAX, d->src_2);
+         break;
+      case OR:
+         emit_op(0x8b, RAX, d->src_1);
+         emit_op(0x0b, RAX, d->src_2);
+         break;
+      case XOR:
+         emit_op(0x8b, RAX, d->src_1);
+         emit_op(0x33, RAX, d->src_2);
+         break;
+      case ALU_SHIFT_LEFT:
+      case ALU_SHIFT_RIGHT:
+         emit_op(0x8b, RAX, d->src_1);
+         emit_op(0x8b, RCX, d->src_2);
+         // shl/shr eax, cl
+         emit(0xd3); emit(inst.alu_inst.type == ALU_SHIFT_LEFT ? 0xe0 : 0xe8);
+         break;
+      case PLUS_FOUR:
+      case PLUS_EIGHT:
+      case PLUS_SIXTEEN:
+         emit_op(0x8b, RAX, d->src_1);
+         emit_op(0x03, RAX, d->src_2);
+         // and eax, imm32
+         emit(0x25);
+         emit32(inst.alu_inst.type == PLUS_FOUR ? 0xf : inst.alu_inst.type == PLUS_EIGHT ? 0xff : 0xffff);
+         break;
+   }
+
+   // bt rax, 32; setc [state + carry]
+   emit(0x48); emit(0x0f); emit(0xba); emit(0xe0); emit(32);
+   emit(0x0f); emit(0x92);
+   emit_mem(0, STATE, offsetof(jit_state, carry));
+   // bt eax, 31; setc [state + sign]
+   emit(0x0f); emit(0xba); emit(0xe0); emit(31);
+   emit(0x0f); emit(0x92);
+   emit_mem(0, STATE, offsetof(jit_state, sign));
+
+   if (d->shift_left)
+   {
+      // shl eax, imm8
+      emit(0xc1); emit(0xe0); emit(d->shift_left);
+   }
+   if (d->shift_right)
+   {
+      // shr eax, imm8
+      emit(0xc1); emit(0xe8); emit(d->shift_right);
+   }
+
+   emit_op(0x89, RAX, d->dst);
+   // mov [state + last_alu], eax
+   emit(0x89);
+   emit_mem(RAX, STATE, offsetof(jit_state, last_alu));
+}
+
+void MicroengineJit::emit_immed(const decoded_instruction* d)
+{
+   if (!d->mask)
+   {
+      // mov dword [registers + dst], imm32
+      emit_op(0xc7, 0, d->dst);
+      emit32(d->value);
+      return;
+   }
+   emit_op(0x8b, RAX, d->dst);
+   // and eax, imm32; add eax, imm32
+   emit(0x25);
+   emit32(d->mask);
+   emit(0x05);
+   emit32(d->value);
+   emit_op(0x89, RAX, d->dst);
+}
+
+void MicroengineJit::emit_ld_field(const decoded_instruction* d)
+{
+   if (d->op == D_LD_FIELD_W_CLR)
+   {
+      // before src is read, it may be dst
+      emit_op(0xc7, 0, d->dst);
+      emit32(0);
+   }
+   emit_op(0x8b, RAX, d->src_1);
+   if (d->shift_left)
+   {
+      // shl eax, imm8
+      emit(0xc1); emit(0xe0); emit(d->shift_left);
+   }
+   // and eax, imm32
+   emit(0x25);
+   emit32(d->mask);
+   emit_op(0x8b, RCX, d->dst);
+   // and ecx, imm32
+   emit(0x81); emit(0xe1);
+   emit32(~d->mask);
+   // xor eax, ecx
+   emit(0x31); emit(0xc8);
+   emit_op(0x89, RAX, d->dst);
+}
+
+// Ends the block: falls through to pc + 1 or exits to the target
+void MicroengineJit::emit_branch(const decoded_instruction* d, uint32_t pc, uint32_t executed)
+{
+   uint8_t cc;
+   switch (d->op)
+   {
+      case D_BR:
+         emit_exit(d->target, executed);
+         return;
+      case D_BR_EQ_CTX:
+      case D_BR_NEQ_CTX:
+         // cmp dword [registers + src_1], imm32
+         emit_op(0x81, 7, d->src_1);
+         emit32(d->value);
+         cc = d->op == D_BR_EQ_CTX ? CC_E : CC_NE;
+         break;
+      default:
+         emit_op(0x8b, RAX, d->src_1);
+         emit_op(0x3b, RAX, d->src_2);
+         switch (d->op)
+         {
+            case D_BR_EQ: cc = CC_E; break;
+            case D_BR_NEQ: cc = CC_NE; break;
+            case D_BR_LESS: cc = CC_L; break;
+            case D_BR_LESS_EQ: cc = CC_LE; break;
+            case D_BR_GREATER: cc = CC_G; break;
+            default: cc = CC_GE; break;
+         }
+         break;
+   }
+
+   size_t taken = emit_jcc(cc);
+   emit_exit(pc + 1, executed);
+   patch(taken);
+   emit_exit(d->target, executed);
+}
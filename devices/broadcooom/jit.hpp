@@ -0,0 +1,94 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "microengine.hpp"
+
+// code for all the blocks until it fills up and everything is dropped
+#define JIT_BUFFER_SIZE MB(1)
+// instructions in a block at most, so a long run still gets back to the
+// runtime now and then
+#define JIT_MAX_BLOCK 64
+// or'd into the pc a block returns when the instruction there isn't the
+// one it was compiled from
+#define JIT_STALE 0x80000000
+
+// What a block keeps outside the register file. The runtime copies it to
+// and from the engine around everything that isn't compiled.
+typedef struct jit_state {
+   uint64_t executed;
+   register_type last_alu;
+   uint8_t carry;
+   uint8_t sign;
+} jit_state;
+
+// Runs decoded instructions from where it was compiled until a branch, a
+// reference, a ctx_arb or the end of the block, and returns the pc to go
+// on from. registers is the host's copy of the 256 register file, code is
+// m_code, which every instruction is checked against before it runs.
+typedef uint32_t (*jit_block)(jit_state* state, register_type* registers, const instruction* code);
+
+// Translates runs of decoded microengine instructions into x86-64. ALU,
+// immediate, ld_field and branch instructions become a few native
+// instructions each, operating on the register file in place; anything
+// that hands off to another thread or changes context ends the block.
+class MicroengineJit {
+public:
+   MicroengineJit();
+   ~MicroengineJit();
+
+   // false if there's no memory for the code
+   bool ok(void) { return m_buffer != NULL; }
+
+   // the block for ctx starting at pc, NULL if it hasn't been compiled
+   jit_block block(uint8_t ctx, uint32_t pc) { return m_blocks[ctx * MICROENGINE_CODE_SIZE + pc]; }
+   // Compiles the block for ctx starting at pc. code is that context's
+   // decoded instructions, which have to be current up to end or
+   // JIT_MAX_BLOCK after pc. NULL if pc can't start a block.
+   jit_block compile(const decoded_instruction* code, uint8_t ctx, uint32_t pc, uint32_t end);
+   // the block for ctx at pc gets compiled again next time
+   void invalidate(uint8_t ctx, uint32_t pc) { m_blocks[ctx * MICROENGINE_CODE_SIZE + pc] = NULL; }
+   // Makes what's been compiled runnable. The buffer is never writable
+   // and executable at once.
+   void seal(void);
+
+   // whether a block can start with op
+   static bool compilable(uint8_t op) { return op != D_SLOW && op != D_CTX_ARB; }
+
+private:
+   uint8_t* m_buffer;
+   size_t m_used;
+   bool m_writable;
+   jit_block m_blocks[NUM_THREADS * MICROENGINE_CODE_SIZE];
+
+   // the block being assembled
+   std::vector<uint8_t> m_out;
+   // jumps to an exit for an instruction that changed: where the rel32
+   // is, its pc and how many instructions ran before it
+   struct stale_exit {
+      size_t fixup;
+      uint32_t pc;
+      uint32_t executed;
+   };
+   std::vector<stale_exit> m_stale;
+
+   void assemble(const decoded_instruction* code, uint32_t pc, uint32_t end);
+   void flush(void);
+
+   void emit(uint8_t b) { m_out.push_back(b); }
+   void emit32(uint32_t v);
+   void emit_mem(uint8_t reg, uint8_t base, int32_t disp);
+   void emit_op(uint8_t opcode, uint8_t reg, register_ref src);
+   size_t emit_jcc(uint8_t cc);
+   void patch(size_t fixup);
+
+   void emit_check(const decoded_instruction* d, uint32_t pc, uint32_t executed);
+   void emit_exit(uint32_t next, uint32_t executed);
+   void emit_alu(const decoded_instruction* d);
+   void emit_immed(const decoded_instruction* d);
+   void emit_ld_field(const decoded_instruction* d);
+   void emit_branch(const decoded_instruction* d, uint32_t pc, uint32_t executed);
+};
@@ -1,5 +1,20 @@
+// Packets per second through the tx_thread of the microengine firmware.
+//
+//   microcode-enginetest [-n packets] [-s size] [-c] [-i] [-S] [-J] [-D] [firmware]
+//
+// The core's side of the tx ring is played here: all 16 descriptors start
+// out ready, and a stand-in for the phy takes each packet off the tx fifo
+// and hands the descriptor before it back, which the firmware has marked
+// as sent by then. -c and -i turn on the ethernet CRC and IP checksum
+// offloads, which run most of the firmware's instructions. -S decodes
+// every instruction as it runs instead of using the threaded interpreter,
+// -J runs the code compiled to x86-64, and -D does too but checks each
+// compiled block against the interpreter.
 #include <stdlib.h>
+#include <stdio.h>
 #include <ctype.h>
+#include <getopt.h>
+#include <time.h>
 
 #include <sys/types.h>
 #include <sys/uio.h>
@@ -11,14 +26,85 @@
 
 #include "microengine.hpp"
 
-#include "phy.hpp"
+// where the tx ring is in scratch, and how many descriptors it has
+#define TX_RING 2
+#define TX_RING_SIZE 16
+#define TX_READY 0x80000000
 
+static double now()
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char* prog)
+{
+   fprintf(stderr, "usage: %s [-n packets] [-s size] [-c] [-i] [-S] [-J] [-D] [firmware]\n", prog);
+   exit(1);
+}
 
 int main(int argc, char**argv)
 {
+   uint32_t packets = 20000;
+   uint32_t size = 64;
+   bool crc = false;
+   bool ip_checksum = false;
+   bool threaded = true;
+   bool jit = false;
+   bool jit_check = false;
+   const char* firmware = "devices-bin/net-firmware";
+   int c;
+
+   while ((c = getopt(argc, argv, "n:s:ciSJD")) != -1)
+   {
+      switch (c)
+      {
+         case 'n':
+            packets = strtoul(optarg, NULL, 0);
+            break;
+         case 's':
+            size = strtoul(optarg, NULL, 0);
+            break;
+         case 'c':
+            crc = true;
+            break;
+         case 'i':
+            ip_checksum = true;
+            break;
+         case 'S':
+            threaded = false;
+            break;
+         case 'J':
+            jit = true;
+            break;
+         case 'D':
+            jit = true;
+            jit_check = true;
+            break;
+         default:
+            usage(argv[0]);
+      }
+   }
+   if (optind < argc)
+   {
+      firmware = argv[optind];
+   }
+   // the firmware only handles whole words
+   if (!packets || size < 34 || size > MAX_ETHERNET_SIZE || size % 4)
+   {
+      usage(argv[0]);
+   }
+
    instruction test[1024];
-   int fd = open(argv[1], 0);
-   int size = read(fd, (void*)test, sizeof(test));
+   int fd = open(firmware, 0);
+   if (fd < 0)
+   {
+      perror(firmware);
+      return 1;
+   }
+   int code_size = read(fd, (void*)test, sizeof(test));
+   close(fd);
 
    uint32_t* ram = (uint32_t*)calloc(MB(8), 1);
 
@@ -27,88 +113,79 @@ int main(int argc, char**argv)
    ThreadedQueue<fifo_job> rx_queue;
    ThreadedQueue<fifo_job> pkt_in_queue;
 
-   Phy* p = new Phy(&tx_queue, &rx_queue);
-
-   Microengine* m = new Microengine((instruction*)test, size, ram, &tx_queue, &rx_queue, &pkt_in_queue);
+   Microengine* m = new Microengine((instruction*)test, code_size, ram, &tx_queue, &rx_queue, &pkt_in_queue);
    uint32_t* scratch = m->m_scratch;
 
-
-   // Set up some "packets" to send for testing
-
-   char* str = "DSTMACSRCMACLN\x4fGTLIDFOTP\x01\x01IPIPDTDTDTDTAA";
-   //char* crashing_input = "DSTMACSRCMACLN\x4fGTLIDFOTP\x01\x01IPIPDTDTDTDTA";
-   int str_size = strlen(str);
-   strcpy((char*)ram, str);
-
-   auto send_all = [=]() {
-      while (true)
+   // An IPv4 packet with a 20 byte header, the rest of it filler, well
+   // clear of the CRC table at 0x400
+   uint32_t pkt_idx = 0x1000;
+   uint8_t* pkt = (uint8_t*)(ram + pkt_idx);
+   memcpy(pkt, "DSTMACSRCMAC\x08\x00\x45\x00", 16);
+   for (uint32_t i = 16; i < size; i++)
+   {
+      pkt[i] = i;
+   }
+
+   for (int i = 0; i < TX_RING_SIZE; i++)
+   {
+      scratch[TX_RING + (i*2) + 1] = pkt_idx;
+      scratch[TX_RING + (i*2)] = TX_READY | size;
+   }
+
+   auto phy = [=, &tx_queue]() {
+      double start = 0;
+      uint64_t start_executed = 0;
+      for (uint32_t i = 0; ; i++)
       {
-         for (int i = 0; i < 16; i++)
+         fifo_job job = tx_queue.get();
+
+         // the first one warms up, time from there
+         if (i == 0)
+         {
+            start = now();
+            start_executed = m->executed();
+         }
+         else
          {
-            int idx = 2 + (i*2);
-            scratch[idx] = 0x80000000 | str_size;
-            scratch[idx+1] = 0;
+            int idx = TX_RING + (((i - 1) % TX_RING_SIZE) * 2);
+            scratch[idx] = TX_READY | size;
          }
-      }};
 
-   auto read_all = [=]() {
-      while (true)
-      {
-         for (int i = 0; i < 16; i++)
+         if (i == packets)
          {
-            int idx = 34 + (i*2);
-            if (scratch[idx] & 0x80000000)
+            double elapsed = now() - start;
+            uint64_t executed = m->executed() - start_executed;
+            printf("%u packets of %u bytes%s%s, %s\n",
+                   packets, size, crc ? ", crc" : "", ip_checksum ? ", ip checksum" : "",
+                   jit_check ? "checked jit" : jit ? "jit" : threaded ? "threaded interpreter" : "switch interpreter");
+            printf("  %.0f packets/s, %.2f M instructions/s, %.0f instructions/packet\n",
+                   packets / elapsed, executed / elapsed / 1e6, (double)executed / packets);
+            if (jit_check)
             {
-               int pkt_idx = scratch[idx+1];
-               printf("%s", ram+pkt_idx);
+               printf("  %lu blocks differed from the interpreter\n", m->jit_mismatches());
             }
+            fflush(stdout);
+            _exit(0);
+         }
+
+         if (job.callback)
+         {
+            job.callback();
          }
-         std::this_thread::sleep_for(std::chrono::milliseconds(3000));
       }
    };
 
-   //std::thread read_all_thread = std::thread(read_all);
-
-   std::thread send_all_thread = std::thread(send_all);
-
-//    auto process_pkt_in = [=, &pkt_in_queue]() {
-//       int i = 0;
-//       while(true)
-//       {
-//          fifo_job job = pkt_in_queue.get();
-//          job.start[*job.size] = '\0';
-//          TRACE_PRINT("Core received PKT: %s", (char*)job.start);
-
-//          // mess with the packet, increment everything by one
-//          for (int j = 0; j < *job.size; j++)
-//          {
-//             char c = ((char*)job.start)[j];
-//             ((char*)job.start)[j] = toupper(c);
-//          }
-
-//          // put packet on the tx queue
-//          int idx = 2 + (i*2);
-//          int micro_mem_location = ((char*)job.start - (char*)ram) / 4;
-//          scratch[idx+1] = micro_mem_location;
-//          scratch[idx] = 0x80000000 | *job.size;
-//          i += 1;
-//          i = i % 16;
-
-//          if (job.callback)
-//          {
-//             job.callback();
-//          }
-//       }
-//    };
-
-//    std::thread process_pkt_thread = std::thread(process_pkt_in);
+   std::thread phy_thread = std::thread(phy);
 
    char mac[6] = {'B', 'C', 'D', 'E', 'F', 'G'};
 
    m->set_mac_address(mac);
-   //m->set_promisc_mode(1);
-   //m->set_chksum_tx_offload(1);
-   //m->set_tx_eth_crc_offload_mode(1);
+   m->set_tx_eth_crc_offload_mode(crc);
+   m->set_chksum_tx_offload(ip_checksum);
+   m->set_threaded_dispatch(threaded);
+   m->set_jit(jit);
+   m->set_jit_check(jit_check);
+   // only the tx_thread
    m->m_ctx_ready[0] = false;
    m->m_ctx_ready[1] = false;
    m->m_ctx_ready[2] = false;
@@ -0,0 +1,193 @@
+// Runs random microengine programs through the switch interpreter and
+// through the JIT (or the threaded interpreter with -S) and checks they
+// leave the same registers, flags, pcs and instruction count. A program
+// that reads over its own code makes sure compiled blocks notice.
+//
+//   microengine-jittest [-n programs] [-r seed] [-S] [-D]
+//
+// -D runs the JIT with set_jit_check as well, any block the interpreter
+// disagrees with fails the test. Exits non-zero on any mismatch.
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+
+#include "microengine.hpp"
+
+#define MAX_PROGRAM 200
+// seconds
+#define SELF_MODIFYING_TIMEOUT 10
+
+static uint32_t ram_ref[MB(1)], ram_test[MB(1)];
+static ThreadedQueue<fifo_job> tx_queue, rx_queue, pkt_in_queue;
+
+// what the test compares, friend of Microengine
+class MicroengineJitTest
+{
+public:
+   static Microengine* create(instruction* code, int n, uint32_t* ram, bool threaded, bool jit, bool check)
+   {
+      Microengine* me = new Microengine(code, n * sizeof(instruction), ram, &tx_queue, &rx_queue, &pkt_in_queue);
+      // the constructor takes bytes, the interpreter stops at an instruction count
+      me->m_code_len = n;
+      me->set_threaded_dispatch(threaded);
+      me->set_jit(jit);
+      me->set_jit_check(check);
+      return me;
+   }
+
+   static bool same(Microengine* a, Microengine* b)
+   {
+      return !memcmp(a->m_registers, b->m_registers, sizeof(a->m_registers))
+         && a->m_flags.carry == b->m_flags.carry
+         && a->m_flags.sign == b->m_flags.sign
+         && a->m_last_alu == b->m_last_alu
+         && !memcmp(a->m_pc_ctx, b->m_pc_ctx, sizeof(a->m_pc_ctx))
+         && a->m_current_ctx == b->m_current_ctx
+         && a->executed() == b->executed();
+   }
+};
+
+static instruction random_instruction(int pc, int n)
+{
+   static const opcode_type straight[] = {
+      ALU, ALU_SHF, DBL_SHF, IMMED, IMMED_B0, IMMED_B1, IMMED_B2, IMMED_B3,
+      IMMED_W0, IMMED_W1, LD_FIELD, LD_FIELD_W_CLR, NOP, RTN, HASH1_48,
+   };
+   instruction in;
+   uint64_t raw = ((uint64_t)rand() << 31) ^ rand() ^ ((uint64_t)rand() << 50);
+   memcpy(&in, &raw, sizeof(in));
+
+   // mostly straight line code, forward branches so every program ends
+   int kind = rand() % 10;
+   if (kind < 7)
+   {
+      in.opcode = straight[rand() % (sizeof(straight) / sizeof(straight[0]))];
+   }
+   else if (kind < 9)
+   {
+      in.opcode = (opcode_type)(BR + rand() % (BR_NOT_SIGNAL - BR + 1));
+      in.branch_inst.target = pc + 1 + rand() % (n - pc);
+   }
+   else
+   {
+      in.opcode = CTX_ARB;
+   }
+   return in;
+}
+
+// ctx 0 reads 15 words of scratch into the read transfer registers from
+// 251 up. the last 10 land over m_code[0..4] and turn the first immed's 7
+// into 0x55, the branch back then has to run the new one. code that
+// misses the change loops forever, so that fails on SIGALRM
+static int self_modifying(bool jit, bool check)
+{
+   alarm(SELF_MODIFYING_TIMEOUT);
+
+   instruction code[6];
+   memset(code, 0, sizeof(code));
+   code[0].immediate_inst = {IMMED, RELATIVE, 1, 7, NO_ROT};
+   code[1].memory_inst = {SCRATCH, READ, ABSOLUTE, 251, RELATIVE, 2, RELATIVE, 2, 15, CTX_SWAP};
+   code[2].branch_inst = {BR_EQ, RELATIVE, 1, RELATIVE, 3, 5};
+   code[3].immediate_inst = {IMMED, RELATIVE, 3, 0x55, NO_ROT};
+   code[4].branch_inst = {BR, RELATIVE, 0, RELATIVE, 0, 0};
+   code[5].opcode = NOP;
+
+   instruction image[5];
+   memcpy(image, code, sizeof(image));
+   image[0].immediate_inst.ival = 0x55;
+
+   Microengine* me[2];
+   int i;
+   for (i = 0; i < 2; i++)
+   {
+      me[i] = MicroengineJitTest::create(code, 6, i ? ram_test : ram_ref, i, i && jit, i && check);
+      // scratch 0..4 fill registers 251..255, the image goes over the code
+      memcpy(&me[i]->m_scratch[5], image, sizeof(image));
+      me[i]->m_ctx_ready[1] = me[i]->m_ctx_ready[2] = me[i]->m_ctx_ready[3] = false;
+      me[i]->interpreter_loop();
+   }
+
+   if (!MicroengineJitTest::same(me[0], me[1]) || me[1]->m_registers[1] != 0x55)
+   {
+      printf("self-modifying program: reg 1 is %x, %x after switch dispatch\n",
+             me[1]->m_registers[1], me[0]->m_registers[1]);
+      return 1;
+   }
+   if (me[1]->jit_mismatches())
+   {
+      printf("self-modifying program: %lu blocks disagreed with the interpreter\n",
+             me[1]->jit_mismatches());
+      return 1;
+   }
+   return 0;
+}
+
+int main(int argc, char** argv)
+{
+   int programs = 3000;
+   unsigned seed = 1;
+   bool jit = true;
+   bool check = false;
+   int c;
+
+   while ((c = getopt(argc, argv, "n:r:SD")) != -1)
+   {
+      switch (c)
+      {
+         case 'n':
+            programs = atoi(optarg);
+            break;
+         case 'r':
+            seed = strtoul(optarg, NULL, 0);
+            break;
+         case 'S':
+            jit = false;
+            break;
+         case 'D':
+            check = true;
+            break;
+         default:
+            fprintf(stderr, "usage: %s [-n programs] [-r seed] [-S] [-D]\n", argv[0]);
+            return 2;
+      }
+   }
+
+   srand(seed);
+   int failed = 0;
+   int t;
+   for (t = 0; t < programs; t++)
+   {
+      int n = 1 + rand() % MAX_PROGRAM;
+      instruction code[MICROENGINE_CODE_SIZE];
+      int i;
+      for (i = 0; i < n; i++)
+      {
+         code[i] = random_instruction(i, n);
+      }
+
+      Microengine* ref = MicroengineJitTest::create(code, n, ram_ref, false, false, false);
+      Microengine* test = MicroengineJitTest::create(code, n, ram_test, true, jit, check);
+      for (i = 0; i < 256; i++)
+      {
+         ref->m_registers[i] = test->m_registers[i] = rand() * 2654435761u;
+      }
+      ref->interpreter_loop();
+      test->interpreter_loop();
+
+      if (!MicroengineJitTest::same(ref, test) || test->jit_mismatches())
+      {
+         printf("program %d (%d instructions, seed %u) differs\n", t, n, seed);
+         failed++;
+      }
+   }
+
+   failed += self_modifying(jit, check);
+
+   printf("%s: %d of %d programs differ\n", jit ? (check ? "checked jit" : "jit") : "threaded",
+          failed, programs + 1);
+   fflush(stdout);
+   // the engines' memory threads never return
+   _exit(failed != 0);
+}
@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <stdio.h>
 #include <ctype.h>
 
 #include <sys/types.h>
@@ -10,9 +11,7 @@
 #include <chrono>
 
 #include "microengine.hpp"
-
-// TODO: remove, only needed for testing
-#include "phy.hpp"
+#include "jit.hpp"
 
 const uint32_t crc32_tab[] = {
 	0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f,
@@ -60,6 +59,52 @@ const uint32_t crc32_tab[] = {
 	0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d
 };
 
+static uint64_t alu_plus(register_type a, register_type b, uint8_t carry, uint8_t sign) { return (uint64_t)a + (uint64_t)b; }
+static uint64_t alu_minus(register_type a, register_type b, uint8_t carry, uint8_t sign) { return a - b; }
+static uint64_t alu_backwards_minus(register_type a, register_type b, uint8_t carry, uint8_t sign) { return b - a; }
+static uint64_t alu_second(register_type a, register_type b, uint8_t carry, uint8_t sign) { return b; }
+static uint64_t alu_bit_not_second(register_type a, register_type b, uint8_t carry, uint8_t sign) { return ~b; }
+static uint64_t alu_and(register_type a, register_type b, uint8_t carry, uint8_t sign) { return a & b; }
+static uint64_t alu_or(register_type a, register_type b, uint8_t carry, uint8_t sign) { return a | b; }
+static uint64_t alu_xor(register_type a, register_type b, uint8_t carry, uint8_t sign) { return a ^ b; }
+static uint64_t alu_plus_carry(register_type a, register_type b, uint8_t carry, uint8_t sign) { return (uint64_t)a + (uint64_t)b + (uint64_t)carry; }
+static uint64_t alu_shift_left(register_type a, register_type b, uint8_t carry, uint8_t sign) { return a<<b; }
+static uint64_t alu_shift_right(register_type a, register_type b, uint8_t carry, uint8_t sign) { return a>>b; }
+static uint64_t alu_plus_if_sign(register_type a, register_type b, uint8_t carry, uint8_t sign) { return sign ? (uint64_t)a + (uint64_t)b : b; }
+static uint64_t alu_plus_four(register_type a, register_type b, uint8_t carry, uint8_t sign) { return (a + b) & 0xF; }
+static uint64_t alu_plus_eight(register_type a, register_type b, uint8_t carry, uint8_t sign) { return (a + b) & 0xFF; }
+static uint64_t alu_plus_sixteen(register_type a, register_type b, uint8_t carry, uint8_t sign) { return (a + b) & 0xFFFF; }
+
+static_assert(sizeof(instruction) == 5, "raw_instruction reads 5 bytes");
+
+// the 5 bytes of an instruction, built in registers. a memcpy into a
+// uint64_t goes through the stack and stalls the load that follows it
+static inline uint64_t raw_instruction(const instruction* inst)
+{
+   uint32_t low;
+   memcpy(&low, inst, sizeof(low));
+   return low | ((uint64_t)((const uint8_t*)inst)[4] << 32);
+}
+
+// indexed by alu_ops_type, each the same as its case in interpret_alu_instruction
+static const alu_fn alu_fns[] = {
+   alu_plus,
+   alu_minus,
+   alu_backwards_minus,
+   alu_second,
+   alu_bit_not_second,
+   alu_and,
+   alu_or,
+   alu_xor,
+   alu_plus_carry,
+   alu_shift_left,
+   alu_shift_right,
+   alu_plus_if_sign,
+   alu_plus_four,
+   alu_plus_eight,
+   alu_plus_sixteen,
+};
+
 Microengine::Microengine(instruction* code, uint32_t code_len, uint32_t* ram, ThreadedQueue<fifo_job>* tx_queue, ThreadedQueue<fifo_job>* rx_queue, ThreadedQueue<fifo_job>* pkt_in_queue):
    m_done(0),
    m_pc_ctx{0},
@@ -72,7 +117,12 @@ Microengine::Microengine(instruction* code, uint32_t code_len, uint32_t* ram, Th
    m_tx_queue(tx_queue),
    m_rx_queue(rx_queue),
    m_pkt_in_queue(pkt_in_queue),
-   m_csr(0)
+   m_csr(0),
+   m_threaded(true),
+   m_executed(0),
+   m_decoded(new decoded_instruction[NUM_THREADS * MICROENGINE_CODE_SIZE]),
+   m_jit_check(false),
+   m_jit_mismatches(0)
 {
 
    if (code_len > sizeof(m_code))
@@ -81,6 +131,16 @@ Microengine::Microengine(instruction* code, uint32_t code_len, uint32_t* ram, Th
    }
    memcpy(m_code, code, code_len);
 
+   // decode the code for each context up front, the threaded interpreter
+   // only decodes again what gets overwritten
+   for (int ctx = 0; ctx < NUM_THREADS; ctx++)
+   {
+      for (int pc = 0; pc < MICROENGINE_CODE_SIZE; pc++)
+      {
+         decode(&m_decoded[ctx * MICROENGINE_CODE_SIZE + pc], raw_instruction(&m_code[pc]), ctx);
+      }
+   }
+
    // set up the crc32 table at the correct offset
    memcpy(m_ram+0x400, crc32_tab, sizeof(crc32_tab));
 
@@ -100,6 +160,44 @@ void Microengine::set_mac_address(char new_mac[6])
    memcpy(m_mac, new_mac, 6);
 }
 
+void Microengine::set_jit(bool new_val)
+{
+#if defined(__x86_64__)
+   m_jit.reset();
+   if (!new_val)
+   {
+      return;
+   }
+   m_jit.reset(new MicroengineJit());
+   if (!m_jit->ok())
+   {
+      m_jit.reset();
+      return;
+   }
+
+   // compile the blocks that code can start at, the rest as it gets there
+   uint32_t end = m_code_len < MICROENGINE_CODE_SIZE ? m_code_len : MICROENGINE_CODE_SIZE;
+   for (int ctx = 0; ctx < NUM_THREADS; ctx++)
+   {
+      decoded_instruction* code = &m_decoded[ctx * MICROENGINE_CODE_SIZE];
+      bool leader = true;
+      for (uint32_t pc = 0; pc < end; pc++)
+      {
+         if (leader && !m_jit->block(ctx, pc))
+         {
+            jit_compile(ctx, pc);
+         }
+         leader = code[pc].op >= D_BR || !MicroengineJit::compilable(code[pc].op);
+         if (code[pc].op >= D_BR && code[pc].target < end && !m_jit->block(ctx, code[pc].target))
+         {
+            jit_compile(ctx, code[pc].target);
+         }
+      }
+   }
+   m_jit->seal();
+#endif
+}
+
 void Microengine::change_csr(bool new_val, register_type mask)
 {
    TRACE_PRINT("new_val=%d mask=0x%x csr=0x%x", new_val, mask, m_csr);
@@ -137,12 +235,44 @@ void Microengine::thread_ready_to_run()
       if ((i % NUM_THREADS) == 0)
       {
          TRACE_PRINT("%d threads ready, sleep for a bit", 0);
-         std::this_thread::sleep_for(std::chrono::milliseconds(100));
+         m_idle.wait([this]{
+               for (int ctx = 0; ctx < NUM_THREADS; ctx++)
+               {
+                  if (m_ctx_ready[ctx])
+                  {
+                     return true;
+                  }
+               }
+               return false;
+            });
       }
    }
 }
 
+void Microengine::ctx_done(uint8_t ctx)
+{
+   m_ctx_ready[ctx] = 1;
+   m_idle.wake_one();
+}
+
 void Microengine::interpreter_loop()
+{
+#ifndef TRACE
+   if (m_jit)
+   {
+      jit_loop();
+      return;
+   }
+   if (m_threaded)
+   {
+      threaded_loop();
+      return;
+   }
+#endif
+   switch_loop();
+}
+
+void Microengine::switch_loop()
 {
    // test is_memory_*_register
    // for (int i = 0; i < 256; i++)
@@ -170,6 +300,7 @@ void Microengine::interpreter_loop()
          break;
       }
 
+      m_executed.store(m_executed.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
       instruction inst = m_code[current_pc];
       interpret_instruction(inst);
       #ifdef TRACE
@@ -179,6 +310,447 @@ void Microengine::interpreter_loop()
    }
 }
 
+// Works out everything about inst that doesn't change between runs in ctx:
+// which registers it touches, its constants and what to jump to. Anything
+// that hands off to another thread, or that the switch leaves undefined,
+// stays on the slow path through interpret_instruction.
+void Microengine::decode(decoded_instruction* decoded, uint64_t raw, uint8_t ctx)
+{
+   instruction inst;
+   memcpy(&inst, &raw, sizeof(inst));
+   memset(decoded, 0, sizeof(*decoded));
+   decoded->raw = raw;
+   decoded->op = D_SLOW;
+
+   opcode_type opcode = inst.opcode;
+   if (opcode == ALU || opcode == ALU_SHF)
+   {
+      alu* alu_inst = &inst.alu_inst;
+      if (alu_inst->type > PLUS_SIXTEEN)
+      {
+         return;
+      }
+      decoded->op = D_ALU;
+      decoded->alu = alu_fns[alu_inst->type];
+      decoded->dst = context_register(alu_inst->dst_type, alu_inst->dst, ctx);
+      decoded->src_1 = context_register(alu_inst->src_1_type, alu_inst->src_1, ctx);
+      decoded->src_2 = context_register(alu_inst->src_2_type, alu_inst->src_2, ctx);
+      if (opcode == ALU_SHF && alu_inst->shift == SHIFT_LEFT)
+      {
+         decoded->shift_left = alu_inst->num_shift;
+      }
+      else if (opcode == ALU_SHF)
+      {
+         decoded->shift_right = alu_inst->num_shift;
+      }
+   }
+   else if (opcode >= IMMED && opcode <= IMMED_W1)
+   {
+      immediate* immed_inst = &inst.immediate_inst;
+      decoded->op = D_IMMED;
+      decoded->dst = context_register(immed_inst->dst_type, immed_inst->dst, ctx);
+      // every immediate is (dst & mask) + value
+      switch (opcode)
+      {
+         case IMMED:
+            decoded->mask = 0;
+            decoded->value = perform_rot(immed_inst->ival, immed_inst->rot);
+            break;
+         case IMMED_B0:
+            decoded->mask = 0xffffff00;
+            decoded->value = immed_inst->ival & 0xff;
+            break;
+         case IMMED_B1:
+            decoded->mask = 0xffff00ff;
+            decoded->value = (immed_inst->ival & 0xff) << 8;
+            break;
+         case IMMED_B2:
+            decoded->mask = 0xff00ffff;
+            decoded->value = (immed_inst->ival & 0xff) << 16;
+            break;
+         case IMMED_B3:
+            decoded->mask = 0x00ffffff;
+            decoded->value = (immed_inst->ival & 0xff) << 24;
+            break;
+         case IMMED_W0:
+            decoded->mask = 0xffff0000;
+            decoded->value = immed_inst->ival & 0xffff;
+            break;
+         default:
+            decoded->mask = 0x0000ffff;
+            decoded->value = (immed_inst->ival & 0xffff) << 16;
+            break;
+      }
+   }
+   else if (opcode >= BR && opcode <= BR_NOT_SIGNAL)
+   {
+      branch* branch_inst = &inst.branch_inst;
+      decoded->src_1 = context_register(branch_inst->src_1_type, branch_inst->src_1, ctx);
+      decoded->src_2 = context_register(branch_inst->src_2_type, branch_inst->src_2, ctx);
+      decoded->target = branch_inst->target;
+      decoded->value = ctx;
+      switch (opcode)
+      {
+         case BR: decoded->op = D_BR; break;
+         case BR_EQ: decoded->op = D_BR_EQ; break;
+         case BR_NEQ: decoded->op = D_BR_NEQ; break;
+         case BR_LESS: decoded->op = D_BR_LESS; break;
+         case BR_LESS_EQ: decoded->op = D_BR_LESS_EQ; break;
+         case BR_GREATER: decoded->op = D_BR_GREATER; break;
+         case BR_GREATER_EQ: decoded->op = D_BR_GREATER_EQ; break;
+         case BR_EQ_CTX: decoded->op = D_BR_EQ_CTX; break;
+         case BR_NEQ_CTX: decoded->op = D_BR_NEQ_CTX; break;
+         // the rest aren't implemented and never branch
+         default: decoded->op = D_NOP; break;
+      }
+   }
+   else if (opcode == LD_FIELD || opcode == LD_FIELD_W_CLR)
+   {
+      load* load_inst = &inst.load_inst;
+      decoded->op = opcode == LD_FIELD ? D_LD_FIELD : D_LD_FIELD_W_CLR;
+      decoded->dst = context_register(load_inst->dst_type, load_inst->dst, ctx);
+      decoded->src_1 = context_register(load_inst->src_type, load_inst->src, ctx);
+      decoded->mask = bytemask_to_bitmask(load_inst->mask);
+      decoded->shift_left = load_inst->rot == LEFT_EIGHT ? 8 : load_inst->rot == LEFT_SIXTEEN ? 16 : 0;
+   }
+   else if (opcode == SCRATCH || opcode == RAM || opcode == T_FIFO_WR
+            || opcode == R_FIFO_RD || opcode == RX_PKT || opcode == CSR)
+   {
+      return;
+   }
+   else if (opcode == CTX_ARB)
+   {
+      decoded->op = D_CTX_ARB;
+   }
+   else
+   {
+      // DBL_SHF, NOP and whatever interpret_instruction doesn't know
+      decoded->op = D_NOP;
+   }
+}
+
+// The same steps as switch_loop, but each instruction is looked up already
+// decoded for the running context, and every handler ends in its own copy
+// of the dispatch so the indirect jumps predict per instruction.
+//
+// Only the engine makes a context not ready, and only references write the
+// engine's memory from other threads, so between references and ctx_arbs
+// the context can't change under us. Runs of decoded instructions keep the
+// context, pc and code length in locals and go back through
+// thread_ready_to_run only after the slow path.
+void Microengine::threaded_loop()
+{
+   static const void* const handlers[NUM_DECODED_OPS] = {
+      &&op_slow,
+      &&op_nop,
+      &&op_ctx_arb,
+      &&op_alu,
+      &&op_immed,
+      &&op_ld_field,
+      &&op_ld_field_w_clr,
+      &&op_br,
+      &&op_br_eq,
+      &&op_br_neq,
+      &&op_br_less,
+      &&op_br_less_eq,
+      &&op_br_greater,
+      &&op_br_greater_eq,
+      &&op_br_eq_ctx,
+      &&op_br_neq_ctx,
+   };
+
+   decoded_instruction* code;
+   decoded_instruction* d;
+   uint8_t ctx;
+   uint32_t pc;
+   uint32_t current_pc;
+   uint32_t code_len;
+   uint64_t executed = m_executed.load(std::memory_order_relaxed);
+   uint64_t raw;
+
+   // the labels only exist in here
+   for (int i = 0; i < NUM_THREADS * MICROENGINE_CODE_SIZE; i++)
+   {
+      m_decoded[i].handler = handlers[m_decoded[i].op];
+   }
+
+   // write back what's kept in locals
+#define SYNC()                                                          \
+   do {                                                                 \
+      m_pc_ctx[ctx] = pc;                                               \
+      m_executed.store(executed, std::memory_order_relaxed);            \
+   } while (0)
+
+   // m_code_len is in bytes, so pcs past the end of m_code can still run.
+   // those are read from wherever they land, like switch_loop does
+#define NEXT()                                                          \
+   do {                                                                 \
+      current_pc = pc++;                                                \
+      if (current_pc >= code_len)                                       \
+      {                                                                 \
+         SYNC();                                                        \
+         m_done = 1;                                                    \
+         return;                                                        \
+      }                                                                 \
+      executed++;                                                       \
+      if (current_pc >= MICROENGINE_CODE_SIZE)                          \
+      {                                                                 \
+         goto op_beyond;                                                \
+      }                                                                 \
+      d = &code[current_pc];                                            \
+      raw = raw_instruction(&m_code[current_pc]);                       \
+      if (raw != d->raw)                                                \
+      {                                                                 \
+         decode(d, raw, ctx);                                           \
+         d->handler = handlers[d->op];                                  \
+      }                                                                 \
+      goto *d->handler;                                                 \
+   } while (0)
+
+#define DISPATCH()                                                      \
+   do {                                                                 \
+      if (m_done)                                                       \
+      {                                                                 \
+         return;                                                        \
+      }                                                                 \
+      thread_ready_to_run();                                            \
+      ctx = m_current_ctx;                                              \
+      code = &m_decoded[ctx * MICROENGINE_CODE_SIZE];                   \
+      pc = m_pc_ctx[ctx];                                               \
+      code_len = m_code_len;                                            \
+      NEXT();                                                           \
+   } while (0)
+
+#define BRANCH_IF(cond)                                                 \
+   do {                                                                 \
+      if (cond)                                                         \
+      {                                                                 \
+         pc = d->target;                                                \
+      }                                                                 \
+      NEXT();                                                           \
+   } while (0)
+
+   DISPATCH();
+
+op_beyond:
+   SYNC();
+   interpret_instruction(m_code[current_pc]);
+   DISPATCH();
+
+op_slow:
+   SYNC();
+   {
+      instruction inst;
+      memcpy(&inst, &raw, sizeof(inst));
+      interpret_instruction(inst);
+   }
+   DISPATCH();
+
+op_ctx_arb:
+   SYNC();
+   next_context();
+   DISPATCH();
+
+op_nop:
+   NEXT();
+
+op_alu:
+   {
+      uint64_t result = d->alu(m_registers[d->src_1], m_registers[d->src_2], m_flags.carry, m_flags.sign);
+      m_flags.carry = (result & 0x100000000) >> 32;
+      m_flags.sign = (result & 0x80000000) >> 31;
+      uint32_t tmp = (uint32_t)result;
+      tmp <<= d->shift_left;
+      tmp >>= d->shift_right;
+      m_registers[d->dst] = tmp;
+      m_last_alu = m_registers[d->dst];
+   }
+   NEXT();
+
+op_immed:
+   m_registers[d->dst] = (m_registers[d->dst] & d->mask) + d->value;
+   NEXT();
+
+op_ld_field_w_clr:
+   m_registers[d->dst] = 0;
+   // fall through, src may be dst
+op_ld_field:
+   {
+      register_type val = m_registers[d->src_1] << d->shift_left;
+      register_type orig = m_registers[d->dst];
+      m_registers[d->dst] = (orig & (~d->mask)) ^ (val & d->mask);
+   }
+   NEXT();
+
+op_br:
+   BRANCH_IF(true);
+op_br_eq:
+   BRANCH_IF(m_registers[d->src_1] == m_registers[d->src_2]);
+op_br_neq:
+   BRANCH_IF(m_registers[d->src_1] != m_registers[d->src_2]);
+op_br_less:
+   BRANCH_IF((int32_t)m_registers[d->src_1] < (int32_t)m_registers[d->src_2]);
+op_br_less_eq:
+   BRANCH_IF((int32_t)m_registers[d->src_1] <= (int32_t)m_registers[d->src_2]);
+op_br_greater:
+   BRANCH_IF((int32_t)m_registers[d->src_1] > (int32_t)m_registers[d->src_2]);
+op_br_greater_eq:
+   BRANCH_IF((int32_t)m_registers[d->src_1] >= (int32_t)m_registers[d->src_2]);
+op_br_eq_ctx:
+   BRANCH_IF(m_registers[d->src_1] == d->value);
+op_br_neq_ctx:
+   BRANCH_IF(m_registers[d->src_1] != d->value);
+
+#undef BRANCH_IF
+#undef DISPATCH
+#undef NEXT
+#undef SYNC
+}
+
+// Runs compiled blocks for as long as one leads to the next, and steps
+// through what isn't compiled the way switch_loop does. Blocks keep the
+// flags and the instruction count in a jit_state, which goes back into
+// the engine before anything else can see them.
+void Microengine::jit_loop()
+{
+   uint32_t end = m_code_len < MICROENGINE_CODE_SIZE ? m_code_len : MICROENGINE_CODE_SIZE;
+   jit_state state;
+   state.executed = m_executed.load(std::memory_order_relaxed);
+
+   while (!m_done)
+   {
+      thread_ready_to_run();
+
+      uint8_t ctx = m_current_ctx;
+      uint32_t pc = m_pc_ctx[ctx];
+      decoded_instruction* code = &m_decoded[ctx * MICROENGINE_CODE_SIZE];
+      state.last_alu = m_last_alu;
+      state.carry = m_flags.carry;
+      state.sign = m_flags.sign;
+
+      while (pc < end)
+      {
+         jit_block block = m_jit->block(ctx, pc);
+         if (!block)
+         {
+            uint64_t raw = raw_instruction(&m_code[pc]);
+            if (raw != code[pc].raw)
+            {
+               decode(&code[pc], raw, ctx);
+            }
+            if (!MicroengineJit::compilable(code[pc].op) || !jit_compile(ctx, pc))
+            {
+               break;
+            }
+            m_jit->seal();
+            block = m_jit->block(ctx, pc);
+         }
+
+         uint32_t next = m_jit_check ? jit_run_checked(ctx, pc, &state) : block(&state, m_registers, m_code);
+         if (next & JIT_STALE)
+         {
+            // both the block that ran into the change and the one from
+            // there have to be compiled again
+            next &= ~JIT_STALE;
+            m_jit->invalidate(ctx, pc);
+            m_jit->invalidate(ctx, next);
+         }
+         pc = next;
+      }
+
+      m_last_alu = state.last_alu;
+      m_flags.carry = state.carry;
+      m_flags.sign = state.sign;
+
+      // one step of switch_loop for what stopped the blocks
+      m_pc_ctx[ctx] = pc + 1;
+      if (pc >= m_code_len)
+      {
+         m_executed.store(state.executed, std::memory_order_relaxed);
+         m_done = 1;
+         break;
+      }
+      state.executed++;
+      m_executed.store(state.executed, std::memory_order_relaxed);
+      instruction inst = m_code[pc];
+      interpret_instruction(inst);
+   }
+}
+
+// Brings ctx's decoded instructions from pc up to date and compiles a block
+// from there
+bool Microengine::jit_compile(uint8_t ctx, uint32_t pc)
+{
+   uint32_t end = m_code_len < MICROENGINE_CODE_SIZE ? m_code_len : MICROENGINE_CODE_SIZE;
+   decoded_instruction* code = &m_decoded[ctx * MICROENGINE_CODE_SIZE];
+   for (uint32_t i = pc; i < end && i - pc < JIT_MAX_BLOCK; i++)
+   {
+      uint64_t raw = raw_instruction(&m_code[i]);
+      if (raw != code[i].raw)
+      {
+         decode(&code[i], raw, ctx);
+      }
+   }
+   return m_jit->compile(code, ctx, pc, end) != NULL;
+}
+
+// Runs the block for ctx at pc on a copy of the registers, then the same
+// instructions through interpret_instruction on the real ones, and reports
+// everything the two disagree on. The interpreter's results are the ones
+// kept. A reference that completes in between shows up as a difference
+// in its transfer registers.
+uint32_t Microengine::jit_run_checked(uint8_t ctx, uint32_t pc, jit_state* state)
+{
+   register_type registers[sizeof(m_registers) / sizeof(m_registers[0])];
+   memcpy(registers, m_registers, sizeof(registers));
+   jit_state jitted = *state;
+   uint32_t next = m_jit->block(ctx, pc)(&jitted, registers, m_code);
+   uint32_t jit_pc = next & ~JIT_STALE;
+
+   m_last_alu = state->last_alu;
+   m_flags.carry = state->carry;
+   m_flags.sign = state->sign;
+   m_pc_ctx[ctx] = pc;
+   for (uint64_t i = state->executed; i < jitted.executed; i++)
+   {
+      uint32_t current_pc = m_pc_ctx[ctx]++;
+      interpret_instruction(m_code[current_pc]);
+   }
+
+   bool mismatch = false;
+   if (m_pc_ctx[ctx] != jit_pc)
+   {
+      fprintf(stderr, "jit: ctx %d block %u: next pc %u, interpreter %u\n", ctx, pc, jit_pc, m_pc_ctx[ctx]);
+      mismatch = true;
+   }
+   if (jitted.carry != m_flags.carry || jitted.sign != m_flags.sign || jitted.last_alu != m_last_alu)
+   {
+      fprintf(stderr, "jit: ctx %d block %u: carry %d sign %d last alu 0x%x, interpreter %d %d 0x%x\n",
+              ctx, pc, jitted.carry, jitted.sign, jitted.last_alu,
+              m_flags.carry, m_flags.sign, m_last_alu);
+      mismatch = true;
+   }
+   for (size_t i = 0; i < sizeof(registers) / sizeof(registers[0]); i++)
+   {
+      if (registers[i] != m_registers[i])
+      {
+         fprintf(stderr, "jit: ctx %d block %u: register %zu 0x%x, interpreter 0x%x\n",
+                 ctx, pc, i, registers[i], m_registers[i]);
+         mismatch = true;
+      }
+   }
+   if (mismatch)
+   {
+      m_jit_mismatches.fetch_add(1, std::memory_order_relaxed);
+   }
+
+   state->executed = jitted.executed;
+   state->last_alu = m_last_alu;
+   state->carry = m_flags.carry;
+   state->sign = m_flags.sign;
+   return m_pc_ctx[ctx] | (next & JIT_STALE);
+}
+
 // Essentially decode the instruction to understand what other function to dispath it to
 void Microengine::interpret_instruction(instruction inst)
 {
@@ -425,7 +997,7 @@ void Microengine::handle_ram(void)
 {
    while (true)
    {
-      ThreadedQueue<memory_job>* queue = &m_ram_queue;
+      SpscRingQueue<memory_job>* queue = &m_ram_queue;
       uint32_t* mem = m_ram;
       memory_job job = queue->get();
 
@@ -465,7 +1037,7 @@ void Microengine::handle_scratch(void)
    // handle_memory(&m_scratch_queue, m_scratch);
    while (true)
    {
-      ThreadedQueue<memory_job>* queue = &m_scratch_queue;
+      SpscRingQueue<memory_job>* queue = &m_scratch_queue;
       uint32_t* mem = m_scratch;
       memory_job job = queue->get();
 
@@ -498,7 +1070,7 @@ void Microengine::handle_scratch(void)
 
 }
 
-void Microengine::handle_memory(ThreadedQueue<memory_job>* queue, uint32_t* mem)
+void Microengine::handle_memory(SpscRingQueue<memory_job>* queue, uint32_t* mem)
 {
    while (true)
    {
@@ -589,7 +1161,7 @@ void Microengine::interpret_memory_instruction(memory* memory_inst)
          if (memory_inst->token == CTX_SWAP)
          {
             auto current_ctx = m_current_ctx;
-            job.callback = [=]{ m_ctx_ready[current_ctx] = 1; TRACE_PRINT("Scratch CB: Thread %d now ready", current_ctx); };
+            job.callback = [=]{ ctx_done(current_ctx); TRACE_PRINT("Scratch CB: Thread %d now ready", current_ctx); };
          }
          m_scratch_queue.put(job);
          break;
@@ -606,7 +1178,7 @@ void Microengine::interpret_memory_instruction(memory* memory_inst)
          if (memory_inst->token == CTX_SWAP)
          {
             auto current_ctx = m_current_ctx;
-            job.callback = [=]{ m_ctx_ready[current_ctx] = 1; TRACE_PRINT("RAM CB: Thread %d now ready", current_ctx); };
+            job.callback = [=]{ ctx_done(current_ctx); TRACE_PRINT("RAM CB: Thread %d now ready", current_ctx); };
          }
          m_ram_queue.put(job);
          break;
@@ -797,7 +1369,7 @@ void Microengine::interpret_fifo_instruction(fifo* fifo_inst)
    {
       auto current_ctx = m_current_ctx;
       auto opcode = fifo_inst->opcode;
-      job.callback = [=]{ m_ctx_ready[current_ctx] = 1; TRACE_PRINT("%s CB: Thread %d now ready", opcode_to_name[opcode], current_ctx); };
+      job.callback = [=]{ ctx_done(current_ctx); TRACE_PRINT("%s CB: Thread %d now ready", opcode_to_name[opcode], current_ctx); };
    }
 
    if (fifo_inst->opcode == T_FIFO_WR)
@@ -862,6 +1434,11 @@ register_type Microengine::perform_rot(register_type val, rot_type rot)
 }
 
 register_ref Microengine::absolute_register(reg_ref_type ref_type, register_ref reg)
+{
+   return context_register(ref_type, reg, m_current_ctx);
+}
+
+register_ref Microengine::context_register(reg_ref_type ref_type, register_ref reg, uint8_t ctx)
 {
    if (ref_type == ABSOLUTE)
    {
@@ -871,17 +1448,17 @@ register_ref Microengine::absolute_register(reg_ref_type ref_type, register_ref
    {
       if (reg < 32)
       {
-         return (reg + (m_current_ctx*32)) % sizeof(m_registers);
+         return (reg + (ctx*32)) % sizeof(m_registers);
       }
       else if (reg >= 32 && reg < 48)
       {
          register_ref start_reg = (reg - 32) + 128;
-         return (start_reg + (m_current_ctx*16)) % sizeof(m_registers);
+         return (start_reg + (ctx*16)) % sizeof(m_registers);
       }
       else
       {
          register_ref start_reg = (reg - 48) + 192;
-         return (start_reg + (m_current_ctx*16)) % sizeof(m_registers);
+         return (start_reg + (ctx*16)) % sizeof(m_registers);
       }
 
    }
@@ -4,12 +4,14 @@
 
 #include <atomic>
 #include <functional>
+#include <memory>
 #include <mutex>
 #include <set>
 #include <thread>
 
 #include "types.hpp"
 #include "myqueue.hpp"
+#include "ringqueue.hpp"
 
 #define PROMISC_MODE_MASK 0x1
 #define CHXSUM_RX_OFFLOAD_MASK 0x1<<1
@@ -17,6 +19,54 @@
 #define RX_ETH_CRC_CHECK_MASK 0x1<<3
 #define TX_ETH_CRC_OFFLOAD_MASK 0x1<<4
 
+#define MICROENGINE_CODE_SIZE 1024
+
+class MicroengineJit;
+struct jit_state;
+
+typedef uint64_t (*alu_fn)(register_type src_1, register_type src_2, uint8_t carry, uint8_t sign);
+
+// What the threaded interpreter jumps to for a decoded instruction.
+// Anything that isn't worth decoding goes through interpret_instruction.
+typedef enum {
+   D_SLOW,
+   D_NOP,
+   D_CTX_ARB,
+   D_ALU,
+   D_IMMED,
+   D_LD_FIELD,
+   D_LD_FIELD_W_CLR,
+   D_BR,
+   D_BR_EQ,
+   D_BR_NEQ,
+   D_BR_LESS,
+   D_BR_LESS_EQ,
+   D_BR_GREATER,
+   D_BR_GREATER_EQ,
+   D_BR_EQ_CTX,
+   D_BR_NEQ_CTX,
+   NUM_DECODED_OPS,
+} decoded_op;
+
+// An instruction decoded for one context: registers resolved to absolute
+// indices, immediates and masks worked out ahead of time. raw is the
+// instruction it was decoded from, code that has been overwritten since
+// gets decoded again.
+typedef struct {
+   const void* handler;
+   uint64_t raw;
+   alu_fn alu;
+   register_type mask; // ld_field's bitmask, the bits an immediate keeps
+   register_type value; // what an immediate adds, the ctx br=ctx compares with
+   uint16_t target;
+   uint8_t op;
+   uint8_t dst;
+   uint8_t src_1;
+   uint8_t src_2;
+   uint8_t shift_left; // alu_shf's shift, ld_field's rotate
+   uint8_t shift_right;
+} decoded_instruction;
+
 
 class Microengine {
 public:
@@ -25,6 +75,19 @@ public:
 
    void interpreter_loop(void);
 
+   // false goes back to decoding every instruction as it runs
+   void set_threaded_dispatch(bool new_val) { m_threaded = new_val; }
+   // Compile the code to x86-64 and run that instead, falls back to the
+   // threaded interpreter where there's no JIT. Set before interpreter_loop
+   void set_jit(bool new_val);
+   // Run the interpreter after each compiled block as well, and report
+   // where the registers they leave differ
+   void set_jit_check(bool new_val) { m_jit_check = new_val; }
+   // how many instructions have run, for benchmarks
+   uint64_t executed(void) { return m_executed.load(std::memory_order_relaxed); }
+   // how many blocks the interpreter disagreed with, with set_jit_check
+   uint64_t jit_mismatches(void) { return m_jit_mismatches.load(std::memory_order_relaxed); }
+
    void set_mac_address(char new_mac[6]);
    void set_chksum_tx_offload(bool new_val) { change_csr(new_val, CHXSUM_TX_OFFLOAD_MASK); }
    void set_chksum_rx_offload(bool new_val) { change_csr(new_val, CHXSUM_RX_OFFLOAD_MASK); }
@@ -39,12 +102,15 @@ public:
    uint32_t m_scratch[1024];
    register_type m_csr;
    register_type m_registers[256];
-   instruction m_code[1024];
+   instruction m_code[MICROENGINE_CODE_SIZE];
 
 
    std::atomic_bool m_ctx_ready[NUM_THREADS];
 
 private:
+   // microengine-jittest compares what the interpreters leave behind
+   friend class MicroengineJitTest;
+
    uint32_t m_code_len;
    uint8_t m_done;
 
@@ -64,19 +130,34 @@ private:
    std::thread m_scratch_thread;
    std::thread m_ram_thread;
 
-   ThreadedQueue<memory_job> m_scratch_queue;
-   ThreadedQueue<memory_job> m_ram_queue;
+   // only the engine's thread puts and only the memory threads get
+   SpscRingQueue<memory_job> m_scratch_queue;
+   SpscRingQueue<memory_job> m_ram_queue;
    ThreadedQueue<fifo_job>* m_tx_queue;
    ThreadedQueue<fifo_job>* m_rx_queue;
    ThreadedQueue<fifo_job>* m_pkt_in_queue;
 
+   // where the engine sleeps when no context is ready, until a completion
+   // makes one ready
+   RingParker m_idle;
+
+   bool m_threaded;
+   std::atomic<uint64_t> m_executed;
+   // m_code decoded for each context, NUM_THREADS * MICROENGINE_CODE_SIZE
+   std::unique_ptr<decoded_instruction[]> m_decoded;
+
+   std::unique_ptr<MicroengineJit> m_jit;
+   bool m_jit_check;
+   std::atomic<uint64_t> m_jit_mismatches;
+
    // Function that manages all memory access
    void handle_scratch(void);
    void handle_ram(void);
-   static void handle_memory(ThreadedQueue<memory_job>* queue, uint32_t* mem);
+   static void handle_memory(SpscRingQueue<memory_job>* queue, uint32_t* mem);
 
    // some helper functions
    register_ref absolute_register(reg_ref_type ref_type, register_ref reg);
+   static register_ref context_register(reg_ref_type ref_type, register_ref reg, uint8_t ctx);
    static bool is_memory_read_register(register_ref reg, uint8_t count);
    static bool is_memory_write_register(register_ref reg, uint8_t count);
    static register_type perform_rot(register_type val, rot_type rot);
@@ -84,6 +165,12 @@ private:
    void change_csr(bool new_val, register_type mask);
 
    // Interpreter functions
+   void switch_loop(void);
+   void threaded_loop(void);
+   void jit_loop(void);
+   bool jit_compile(uint8_t ctx, uint32_t pc);
+   uint32_t jit_run_checked(uint8_t ctx, uint32_t pc, jit_state* state);
+   void decode(decoded_instruction* decoded, uint64_t raw, uint8_t ctx);
    void interpret_instruction(instruction inst);
    void interpret_alu_instruction(alu* alu_inst);
    void interpret_immediate_instruction(immediate* immed_inst);
@@ -99,4 +186,7 @@ private:
    // Function to set the context to the next thread
    void next_context();
 
+   // Called when a ctx_swap reference completes
+   void ctx_done(uint8_t ctx);
+
 };
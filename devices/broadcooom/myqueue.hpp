@@ -3,6 +3,7 @@
 #include <mutex>
 #include <queue>
 #include <condition_variable>
+#include <utility>
 
 template <class T>
 class ThreadedQueue {
@@ -15,6 +16,9 @@ public:
    // Blocks until an item is present
    T get();
 
+   // Takes an item if one is present, without blocking
+   bool try_get(T &item);
+
    // Get current size
    int size();
 
@@ -30,7 +34,7 @@ void ThreadedQueue<T>::put(T item)
 {
    {
       std::unique_lock<std::mutex> lock(m_mutex);
-      m_queue.push(item);
+      m_queue.push(std::move(item));
    }
    m_cv.notify_one();
 }
@@ -40,11 +44,23 @@ T ThreadedQueue<T>::get()
 {
    std::unique_lock<std::mutex> lock(m_mutex);
    m_cv.wait(lock, [&]{ return !m_queue.empty(); });
-   auto to_return = m_queue.front();
+   auto to_return = std::move(m_queue.front());
    m_queue.pop();
    return to_return;
 }
 
+template <class T>
+bool ThreadedQueue<T>::try_get(T &item)
+{
+   std::unique_lock<std::mutex> lock(m_mutex);
+   if (m_queue.empty()) {
+      return false;
+   }
+   item = std::move(m_queue.front());
+   m_queue.pop();
+   return true;
+}
+
 template <class T>
 int ThreadedQueue<T>::size()
 {
@@ -0,0 +1,682 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+// Bounded ring buffer queues with the same put/get/try_get/size as
+// ThreadedQueue, plus try_put and batched puts and gets. SpscRingQueue is
+// for exactly one thread putting and one getting, MpmcRingQueue for any
+// number of each. A put on a full queue or a get on an empty one spins for
+// a while before it parks, and the other side only touches the lock when
+// somebody is parked. Gets only wake parked puts once the queue is half
+// empty, so producers that outrun the consumer don't pay for a wakeup on
+// every item.
+
+#define RING_QUEUE_DEFAULT_CAPACITY 1024
+// how many times a blocked put or get polls before it goes to sleep, when
+// there's another CPU the other side could be running on
+#define RING_QUEUE_SPINS 512
+#define RING_QUEUE_CACHELINE 64
+
+static inline void ring_queue_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+   __builtin_ia32_pause();
+#else
+   std::atomic_signal_fence(std::memory_order_seq_cst);
+#endif
+}
+
+// on a single CPU whoever we're waiting for can't run while we spin
+static inline int ring_queue_spins()
+{
+   static const int spins = std::thread::hardware_concurrency() > 1 ? RING_QUEUE_SPINS : 0;
+   return spins;
+}
+
+static inline size_t ring_queue_capacity(size_t capacity)
+{
+   size_t size = 2;
+   while (size < capacity)
+   {
+      size <<= 1;
+   }
+   return size;
+}
+
+// Where the puts waiting for room or the gets waiting for an item sleep.
+// A waiter registers before it checks one last time under the lock, and
+// the wakes only take the lock when they see a registered waiter, so a
+// wakeup is never lost and an uncontended queue never makes a syscall.
+class RingParker {
+
+public:
+
+   // Returns once ready() does, spinning first
+   template <class F>
+   void wait(F ready);
+
+   // Whether anyone is parked, after making ready() true for them
+   bool waiting();
+
+   // Call after making ready() true for somebody
+   void wake_one();
+   void wake_all();
+
+private:
+   std::atomic<uint32_t> m_waiters{0};
+   std::mutex m_mutex;
+   std::condition_variable m_cv;
+};
+
+template <class F>
+void RingParker::wait(F ready)
+{
+   int spins = ring_queue_spins();
+   for (int i = 0; i < spins; i++)
+   {
+      if (ready())
+      {
+         return;
+      }
+      ring_queue_relax();
+   }
+
+   std::unique_lock<std::mutex> lock(m_mutex);
+   m_waiters.fetch_add(1, std::memory_order_relaxed);
+   // pairs with the fence in waiting(): either they see us or we see them
+   std::atomic_thread_fence(std::memory_order_seq_cst);
+   while (!ready())
+   {
+      m_cv.wait(lock);
+   }
+   m_waiters.fetch_sub(1, std::memory_order_relaxed);
+}
+
+inline bool RingParker::waiting()
+{
+   std::atomic_thread_fence(std::memory_order_seq_cst);
+   return m_waiters.load(std::memory_order_relaxed) != 0;
+}
+
+// a registered waiter holds the lock until it's in wait(), so once we've
+// had the lock it's either asleep or will see ready(). notifying after
+// letting go means it doesn't wake up straight into our lock
+inline void RingParker::wake_one()
+{
+   if (waiting())
+   {
+      {
+         std::lock_guard<std::mutex> lock(m_mutex);
+      }
+      m_cv.notify_one();
+   }
+}
+
+inline void RingParker::wake_all()
+{
+   if (waiting())
+   {
+      {
+         std::lock_guard<std::mutex> lock(m_mutex);
+      }
+      m_cv.notify_all();
+   }
+}
+
+
+// Single producer, single consumer. Each side owns its index and keeps a
+// cached copy of the other's, so it only reads the shared one when the
+// cached copy says the ring is full or empty.
+template <class T>
+class SpscRingQueue {
+
+public:
+
+   // capacity is rounded up to a power of two
+   explicit SpscRingQueue(size_t capacity = RING_QUEUE_DEFAULT_CAPACITY);
+   ~SpscRingQueue();
+   SpscRingQueue(const SpscRingQueue &) = delete;
+   SpscRingQueue &operator=(const SpscRingQueue &) = delete;
+
+   // Put an item on the queue, blocks while it's full
+   void put(T item);
+
+   // Puts an item if there's room, without blocking. item is only moved
+   // from if it went in
+   bool try_put(T &item);
+
+   // Puts all n items, blocking while the queue is full
+   void put_batch(T *items, size_t n);
+
+   // Blocks until an item is present
+   T get();
+
+   // Takes an item if one is present, without blocking
+   bool try_get(T &item);
+
+   // Blocks until there's at least one item and takes up to max
+   size_t get_batch(T *items, size_t max);
+
+   // Takes up to max items without blocking
+   size_t try_get_batch(T *items, size_t max);
+
+   // Get current size
+   int size();
+
+private:
+   typedef typename std::aligned_storage<sizeof(T), alignof(T)>::type Slot;
+
+   Slot* m_slots;
+   size_t m_mask;
+
+   // the consumer's side
+   char m_pad0[RING_QUEUE_CACHELINE];
+   std::atomic<size_t> m_head{0};
+   size_t m_cached_tail = 0;
+
+   // the producer's side
+   char m_pad1[RING_QUEUE_CACHELINE];
+   std::atomic<size_t> m_tail{0};
+   size_t m_cached_head = 0;
+
+   char m_pad2[RING_QUEUE_CACHELINE];
+   RingParker m_not_empty;
+   RingParker m_not_full;
+
+   T* slot(size_t pos) { return reinterpret_cast<T*>(&m_slots[pos & m_mask]); }
+   size_t room();
+   size_t ready();
+   void drained(size_t head);
+};
+
+template <class T>
+SpscRingQueue<T>::SpscRingQueue(size_t capacity)
+{
+   capacity = ring_queue_capacity(capacity);
+   m_slots = new Slot[capacity];
+   m_mask = capacity - 1;
+}
+
+template <class T>
+SpscRingQueue<T>::~SpscRingQueue()
+{
+   size_t tail = m_tail.load(std::memory_order_acquire);
+   for (size_t pos = m_head.load(std::memory_order_relaxed); pos != tail; pos++)
+   {
+      slot(pos)->~T();
+   }
+   delete[] m_slots;
+}
+
+// free slots as far as the producer knows, refreshing the cached head only
+// when that looks like none
+template <class T>
+size_t SpscRingQueue<T>::room()
+{
+   size_t tail = m_tail.load(std::memory_order_relaxed);
+   size_t free = m_mask + 1 - (tail - m_cached_head);
+   if (!free)
+   {
+      m_cached_head = m_head.load(std::memory_order_acquire);
+      free = m_mask + 1 - (tail - m_cached_head);
+   }
+   return free;
+}
+
+template <class T>
+size_t SpscRingQueue<T>::ready()
+{
+   size_t head = m_head.load(std::memory_order_relaxed);
+   size_t avail = m_cached_tail - head;
+   if (!avail)
+   {
+      m_cached_tail = m_tail.load(std::memory_order_acquire);
+      avail = m_cached_tail - head;
+   }
+   return avail;
+}
+
+// wakes a parked put once the consumer has made it down to half. the cached
+// tail is never ahead of the real one, so this can only wake early
+template <class T>
+void SpscRingQueue<T>::drained(size_t head)
+{
+   if (m_not_full.waiting() && m_cached_tail - head <= (m_mask + 1) / 2)
+   {
+      m_not_full.wake_one();
+   }
+}
+
+template <class T>
+bool SpscRingQueue<T>::try_put(T &item)
+{
+   if (!room())
+   {
+      return false;
+   }
+   size_t tail = m_tail.load(std::memory_order_relaxed);
+   new (slot(tail)) T(std::move(item));
+   m_tail.store(tail + 1, std::memory_order_release);
+   m_not_empty.wake_one();
+   return true;
+}
+
+template <class T>
+void SpscRingQueue<T>::put(T item)
+{
+   if (try_put(item))
+   {
+      return;
+   }
+   m_not_full.wait([&]{ return room() != 0; });
+   try_put(item);
+}
+
+template <class T>
+void SpscRingQueue<T>::put_batch(T *items, size_t n)
+{
+   while (n)
+   {
+      size_t free = room();
+      if (!free)
+      {
+         m_not_full.wait([&]{ return room() != 0; });
+         continue;
+      }
+
+      size_t tail = m_tail.load(std::memory_order_relaxed);
+      size_t count = free < n ? free : n;
+      for (size_t i = 0; i < count; i++)
+      {
+         new (slot(tail + i)) T(std::move(items[i]));
+      }
+      m_tail.store(tail + count, std::memory_order_release);
+      m_not_empty.wake_one();
+      items += count;
+      n -= count;
+   }
+}
+
+template <class T>
+size_t SpscRingQueue<T>::try_get_batch(T *items, size_t max)
+{
+   size_t avail = ready();
+   size_t count = avail < max ? avail : max;
+   if (!count)
+   {
+      return 0;
+   }
+
+   size_t head = m_head.load(std::memory_order_relaxed);
+   for (size_t i = 0; i < count; i++)
+   {
+      T* item = slot(head + i);
+      items[i] = std::move(*item);
+      item->~T();
+   }
+   m_head.store(head + count, std::memory_order_release);
+   drained(head + count);
+   return count;
+}
+
+template <class T>
+bool SpscRingQueue<T>::try_get(T &item)
+{
+   return try_get_batch(&item, 1) == 1;
+}
+
+template <class T>
+size_t SpscRingQueue<T>::get_batch(T *items, size_t max)
+{
+   size_t count = try_get_batch(items, max);
+   while (!count)
+   {
+      m_not_empty.wait([&]{ return ready() != 0; });
+      count = try_get_batch(items, max);
+   }
+   return count;
+}
+
+template <class T>
+T SpscRingQueue<T>::get()
+{
+   if (!ready())
+   {
+      m_not_empty.wait([&]{ return ready() != 0; });
+   }
+   size_t head = m_head.load(std::memory_order_relaxed);
+   T* item = slot(head);
+   T to_return = std::move(*item);
+   item->~T();
+   m_head.store(head + 1, std::memory_order_release);
+   drained(head + 1);
+   return to_return;
+}
+
+template <class T>
+int SpscRingQueue<T>::size()
+{
+   return m_tail.load(std::memory_order_acquire) - m_head.load(std::memory_order_acquire);
+}
+
+
+// Multiple producers and consumers, after Dmitry Vyukov's bounded MPMC
+// queue. Every slot carries a sequence number saying whose turn it is, so
+// a put or get is one CAS on its index and nobody waits on anyone else
+// who's halfway through. A batch claims a run of slots with a single CAS.
+template <class T>
+class MpmcRingQueue {
+
+public:
+
+   // capacity is rounded up to a power of two
+   explicit MpmcRingQueue(size_t capacity = RING_QUEUE_DEFAULT_CAPACITY);
+   ~MpmcRingQueue();
+   MpmcRingQueue(const MpmcRingQueue &) = delete;
+   MpmcRingQueue &operator=(const MpmcRingQueue &) = delete;
+
+   // Put an item on the queue, blocks while it's full
+   void put(T item);
+
+   // Puts an item if there's room, without blocking. item is only moved
+   // from if it went in
+   bool try_put(T &item);
+
+   // Puts all n items, blocking while the queue is full
+   void put_batch(T *items, size_t n);
+
+   // Blocks until an item is present
+   T get();
+
+   // Takes an item if one is present, without blocking
+   bool try_get(T &item);
+
+   // Blocks until there's at least one item and takes up to max
+   size_t get_batch(T *items, size_t max);
+
+   // Takes up to max items without blocking
+   size_t try_get_batch(T *items, size_t max);
+
+   // Get current size
+   int size();
+
+private:
+   struct Cell {
+      std::atomic<size_t> seq;
+      typename std::aligned_storage<sizeof(T), alignof(T)>::type value;
+   };
+
+   Cell* m_cells;
+   size_t m_mask;
+
+   char m_pad0[RING_QUEUE_CACHELINE];
+   std::atomic<size_t> m_tail{0};
+   char m_pad1[RING_QUEUE_CACHELINE];
+   std::atomic<size_t> m_head{0};
+   char m_pad2[RING_QUEUE_CACHELINE];
+   RingParker m_not_empty;
+   RingParker m_not_full;
+
+   T* item(Cell &cell) { return reinterpret_cast<T*>(&cell.value); }
+   size_t claim_put(size_t max, size_t *pos);
+   size_t claim_get(size_t max, size_t *pos);
+   bool can_put();
+   bool can_get();
+   void drained();
+};
+
+template <class T>
+MpmcRingQueue<T>::MpmcRingQueue(size_t capacity)
+{
+   capacity = ring_queue_capacity(capacity);
+   m_cells = new Cell[capacity];
+   m_mask = capacity - 1;
+   for (size_t i = 0; i < capacity; i++)
+   {
+      m_cells[i].seq.store(i, std::memory_order_relaxed);
+   }
+}
+
+template <class T>
+MpmcRingQueue<T>::~MpmcRingQueue()
+{
+   size_t tail = m_tail.load(std::memory_order_acquire);
+   for (size_t pos = m_head.load(std::memory_order_relaxed); pos != tail; pos++)
+   {
+      item(m_cells[pos & m_mask])->~T();
+   }
+   delete[] m_cells;
+}
+
+// claims up to max free slots from *pos on, returning how many. a slot is
+// free for position p once its sequence number is p
+template <class T>
+size_t MpmcRingQueue<T>::claim_put(size_t max, size_t *pos)
+{
+   size_t tail = m_tail.load(std::memory_order_relaxed);
+   while (1)
+   {
+      size_t count = 0;
+      while (count < max)
+      {
+         size_t seq = m_cells[(tail + count) & m_mask].seq.load(std::memory_order_acquire);
+         if (seq != tail + count)
+         {
+            break;
+         }
+         count++;
+      }
+
+      if (!count)
+      {
+         size_t seq = m_cells[tail & m_mask].seq.load(std::memory_order_acquire);
+         // still holding last lap's item, the queue is full
+         if ((intptr_t)(seq - tail) < 0)
+         {
+            return 0;
+         }
+         // someone else took it, try again from where they left off
+         tail = m_tail.load(std::memory_order_relaxed);
+         continue;
+      }
+
+      if (m_tail.compare_exchange_weak(tail, tail + count, std::memory_order_relaxed))
+      {
+         *pos = tail;
+         return count;
+      }
+   }
+}
+
+// the same for filled slots, which position p's has sequence number p + 1
+template <class T>
+size_t MpmcRingQueue<T>::claim_get(size_t max, size_t *pos)
+{
+   size_t head = m_head.load(std::memory_order_relaxed);
+   while (1)
+   {
+      size_t count = 0;
+      while (count < max)
+      {
+         size_t seq = m_cells[(head + count) & m_mask].seq.load(std::memory_order_acquire);
+         if (seq != head + count + 1)
+         {
+            break;
+         }
+         count++;
+      }
+
+      if (!count)
+      {
+         size_t seq = m_cells[head & m_mask].seq.load(std::memory_order_acquire);
+         // not filled this lap yet, the queue is empty
+         if ((intptr_t)(seq - (head + 1)) < 0)
+         {
+            return 0;
+         }
+         head = m_head.load(std::memory_order_relaxed);
+         continue;
+      }
+
+      if (m_head.compare_exchange_weak(head, head + count, std::memory_order_relaxed))
+      {
+         *pos = head;
+         return count;
+      }
+   }
+}
+
+template <class T>
+bool MpmcRingQueue<T>::can_put()
+{
+   size_t tail = m_tail.load(std::memory_order_relaxed);
+   size_t seq = m_cells[tail & m_mask].seq.load(std::memory_order_acquire);
+   return (intptr_t)(seq - tail) >= 0;
+}
+
+template <class T>
+bool MpmcRingQueue<T>::can_get()
+{
+   size_t head = m_head.load(std::memory_order_relaxed);
+   size_t seq = m_cells[head & m_mask].seq.load(std::memory_order_acquire);
+   return (intptr_t)(seq - (head + 1)) >= 0;
+}
+
+// wakes the parked puts once the queue is down to half, they all have room
+// by then
+template <class T>
+void MpmcRingQueue<T>::drained()
+{
+   if (m_not_full.waiting() && size() <= (int)((m_mask + 1) / 2))
+   {
+      m_not_full.wake_all();
+   }
+}
+
+template <class T>
+bool MpmcRingQueue<T>::try_put(T &value)
+{
+   size_t pos;
+   if (!claim_put(1, &pos))
+   {
+      return false;
+   }
+   Cell &cell = m_cells[pos & m_mask];
+   new (item(cell)) T(std::move(value));
+   cell.seq.store(pos + 1, std::memory_order_release);
+   m_not_empty.wake_one();
+   return true;
+}
+
+template <class T>
+void MpmcRingQueue<T>::put(T value)
+{
+   while (!try_put(value))
+   {
+      m_not_full.wait([&]{ return can_put(); });
+   }
+}
+
+template <class T>
+void MpmcRingQueue<T>::put_batch(T *values, size_t n)
+{
+   while (n)
+   {
+      size_t pos;
+      size_t count = claim_put(n, &pos);
+      if (!count)
+      {
+         m_not_full.wait([&]{ return can_put(); });
+         continue;
+      }
+
+      for (size_t i = 0; i < count; i++)
+      {
+         Cell &cell = m_cells[(pos + i) & m_mask];
+         new (item(cell)) T(std::move(values[i]));
+         cell.seq.store(pos + i + 1, std::memory_order_release);
+      }
+      if (count == 1)
+      {
+         m_not_empty.wake_one();
+      }
+      else
+      {
+         m_not_empty.wake_all();
+      }
+      values += count;
+      n -= count;
+   }
+}
+
+template <class T>
+size_t MpmcRingQueue<T>::try_get_batch(T *values, size_t max)
+{
+   size_t pos;
+   size_t count = claim_get(max, &pos);
+   for (size_t i = 0; i < count; i++)
+   {
+      Cell &cell = m_cells[(pos + i) & m_mask];
+      T* value = item(cell);
+      values[i] = std::move(*value);
+      value->~T();
+      // free for the put a lap from now
+      cell.seq.store(pos + i + m_mask + 1, std::memory_order_release);
+   }
+   if (count)
+   {
+      drained();
+   }
+   return count;
+}
+
+template <class T>
+bool MpmcRingQueue<T>::try_get(T &value)
+{
+   return try_get_batch(&value, 1) == 1;
+}
+
+template <class T>
+size_t MpmcRingQueue<T>::get_batch(T *values, size_t max)
+{
+   size_t count = try_get_batch(values, max);
+   while (!count)
+   {
+      m_not_empty.wait([&]{ return can_get(); });
+      count = try_get_batch(values, max);
+   }
+   return count;
+}
+
+template <class T>
+T MpmcRingQueue<T>::get()
+{
+   size_t pos;
+   while (!claim_get(1, &pos))
+   {
+      m_not_empty.wait([&]{ return can_get(); });
+   }
+   Cell &cell = m_cells[pos & m_mask];
+   T* value = item(cell);
+   T to_return = std::move(*value);
+   value->~T();
+   cell.seq.store(pos + m_mask + 1, std::memory_order_release);
+   drained();
+   return to_return;
+}
+
+template <class T>
+int MpmcRingQueue<T>::size()
+{
+   size_t head = m_head.load(std::memory_order_acquire);
+   size_t tail = m_tail.load(std::memory_order_acquire);
+   return tail > head ? tail - head : 0;
+}
@@ -55,16 +55,16 @@ int NetDev::handleTx(class VirtBuf *vbuf) {
 
 int NetDev::got_data(uint16_t vq_idx) {
   int ret = 0;
-  VirtBuf *vbuf = get_buf(vq_idx);
+  VirtBufHandle vbuf = get_buf(vq_idx);
   if (!vbuf)
     return ret;
 
   if (vq_idx == VQ_DATA_TX) {
-    ret = handleTx(vbuf);
+    ret = handleTx(vbuf.get());
   }
 
   else if (vq_idx == VQ_DATA_RX) {
-    ret = handleRx(vbuf);
+    ret = handleRx(vbuf.get());
   }
 
   return ret;
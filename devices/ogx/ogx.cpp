@@ -95,7 +95,7 @@ private:
     /** Enclave execution futures. */
     std::vector<std::tuple<size_t, std::vector<uint8_t>, ThreadPool::Future>> enclave_futures_;
     /** Response buffers. */
-    std::deque<VirtBuf*> response_buffers_;
+    std::deque<VirtBufHandle> response_buffers_;
     /** Mutex. */
     std::mutex device_mutex_;
 };
@@ -143,7 +143,7 @@ int GuestDevice::got_data(uint16_t vq_idx) {
             auto buffer = get_buf(vq_idx);
             while (buffer) {
                 log->debug("pushing a read buffer");
-                response_buffers_.push_back(buffer);
+                response_buffers_.push_back(std::move(buffer));
                 buffer = get_buf(vq_idx);
             }
             break;
@@ -152,8 +152,8 @@ int GuestDevice::got_data(uint16_t vq_idx) {
             log->debug("write buffer notification");
             auto buffer = get_buf(vq_idx);
             while (buffer) {
-                ReadDriverMessage(buffer);
-                ret = put_buf(vq_idx, buffer);
+                ReadDriverMessage(buffer.get());
+                ret = put_buf(vq_idx, std::move(buffer));
                 if (!ret) {
                     break;
                 }
@@ -232,7 +232,7 @@ void GuestDevice::Execute() {
                     const auto event_data = event.Serialize();
                     const auto ciphertext = Event::Encrypt(pub_key_, sec_key_, sender_pub_key, event_data);
                     const uint16_t ciphertext_size = ciphertext.size();
-                    auto buffer = response_buffers_.front();
+                    auto buffer = std::move(response_buffers_.front());
                     response_buffers_.pop_front();
                     // log->debug("writing size ({} bytes)", ciphertext_size);
                     buffer->write(0, (void*)&ciphertext_size, sizeof(ciphertext_size));
@@ -244,7 +244,7 @@ void GuestDevice::Execute() {
                     }
                     // log->debug("ciphertext sum: {}", sum);
                     // log->debug("putting buffer");
-                    put_buf(VQ_READ, buffer);
+                    put_buf(VQ_READ, std::move(buffer));
                     // log->debug("raising interrupt");
                     send_irq(READY_IRQ);
                     // log->debug("driver notified");
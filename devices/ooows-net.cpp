@@ -5,6 +5,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "broadcooom/microengine.hpp"
@@ -14,13 +15,14 @@
 
 #define DEBUG 0
 
-NetDev::NetDev(uint64_t mmio_start, uint32_t num_vqs) : MMIOVirtioDev(mmio_start, num_vqs) {
+NetDev::NetDev(uint64_t mmio_start, uint32_t num_queue_pairs) : MMIOVirtioDev(mmio_start, NUM_NET_VQS(num_queue_pairs)) {
   m_device_id = VIRTIO_NIC;
   set_device_features(FEATURE_CHKSUM_TX_OFFLOAD_MASK ^ FEATURE_CHKSUM_RX_OFFLOAD_MASK ^ FEATURE_PROMISC_MODE_MASK ^ FEATURE_RX_ETH_CRC_CHECK_MASK ^ FEATURE_TX_ETH_CRC_OFFLOAD_MASK);
 
   m_tx_ring_buf_idx = 0;
   m_rx_ring_buf_idx = 0;
   m_ram_pool_idx = 0;
+  m_num_queue_pairs = num_queue_pairs;
 
   m_ram = (uint32_t*)calloc(MB(8), 1);
 
@@ -44,15 +46,17 @@ NetDev::NetDev(uint64_t mmio_start, uint32_t num_vqs) : MMIOVirtioDev(mmio_start
 
   m_scratch = m_microengine->m_scratch;
 
-  struct {
+  struct __attribute__((packed)) {
      uint8_t mac[6];
-     uint8_t microcode[CONFIG_SPACE_MAX-6];
+     uint8_t microcode[CONFIG_SPACE_MAX-8];
+     uint16_t max_queue_pairs;
   } config_space;
   int fd = open("/dev/random", O_RDONLY);
   read(fd, config_space.mac, 0x6);
   close(fd);
 
   memcpy(config_space.microcode, m_microengine->m_code, sizeof(config_space.microcode));
+  config_space.max_queue_pairs = m_num_queue_pairs;
   set_config_space(&config_space, sizeof(config_space));
 
   // m_microengine->m_ctx_ready[0] = true;
@@ -60,7 +64,24 @@ NetDev::NetDev(uint64_t mmio_start, uint32_t num_vqs) : MMIOVirtioDev(mmio_start
   // m_microengine->m_ctx_ready[2] = true;
   // m_microengine->m_ctx_ready[3] = false;
 
+  // an rx buffer can sit in handleRx until a packet shows up, don't park
+  // the guest's vCPU on it. control stays synchronous so a setting is
+  // applied before the guest's next access
+  uint32_t pair;
+  for (pair = 0; pair < m_num_queue_pairs; pair++) {
+    set_queue_async(VQ_DATA_TX_PAIR(pair));
+    set_queue_async(VQ_DATA_RX_PAIR(pair));
+    set_queue_irq(VQ_DATA_TX_PAIR(pair), NET_IRQ + pair);
+    set_queue_irq(VQ_DATA_RX_PAIR(pair), NET_IRQ + pair);
+  }
+
   m_microengine->set_mac_address((char*)config_space.mac);
+  char *jit = getenv(NET_JIT_ENV);
+  if (jit) {
+    uint32_t mode = strtoul(jit, NULL, 0);
+    m_microengine->set_jit(mode != 0);
+    m_microengine->set_jit_check(mode == 2);
+  }
   m_microengine_thread = std::thread([=]{ m_microengine->interpreter_loop();});
   return;
 }
@@ -236,26 +257,37 @@ int NetDev::handleControl(class VirtBuf *vbuf)
 
 int NetDev::got_data(uint16_t vq_idx) {
   int ret = 0;
-  VirtBuf *vbuf = get_buf(vq_idx);
+  VirtBufHandle vbuf = get_buf(vq_idx);
   if (!vbuf)
     return ret;
 
   TRACE_PRINT("0x%x", vq_idx);
 
   if (vq_idx == VQ_CONTROL) {
-     ret = handleControl(vbuf);
+     ret = handleControl(vbuf.get());
+     ret = put_buf(vq_idx, std::move(vbuf));
+     return ret;
   }
 
-  if (vq_idx == VQ_DATA_TX) {
-    ret = handleTx(vbuf);
+  // data queues run on their own worker with notifies coalesced, so drain
+  // everything the guest has posted
+  uint32_t pair = VQ_PAIR(vq_idx);
+  for (; vbuf; vbuf = get_buf(vq_idx)) {
+    if (vq_idx == VQ_DATA_TX_PAIR(pair)) {
+      std::lock_guard<std::mutex> lock(m_tx_lock);
+      ret = handleTx(vbuf.get());
+    }
+
+    // every rx queue waits on the same packet queue, so packets spread
+    // across whichever pairs have buffers posted
+    else if (vq_idx == VQ_DATA_RX_PAIR(pair)) {
+      ret = handleRx(vbuf.get());
+    }
+
+    ret = put_buf(vq_idx, std::move(vbuf));
+    send_queue_irq(vq_idx);
   }
 
-  else if (vq_idx == VQ_DATA_RX) {
-    ret = handleRx(vbuf);
-  }
-
-  ret = put_buf(vq_idx, vbuf);
-
   return ret;
 }
 
@@ -303,7 +335,8 @@ int NetDev::add_to_tx_ring_buf(uint16_t size, uint32_t pkt_idx)
 
 int main(void) {
   int err;
-  class NetDev *dev = new NetDev(MMIO_START, NUM_NET_VQS);
+  uint32_t pairs = virtio_queue_pairs(NET_QUEUE_PAIRS_ENV, NET_MAX_QUEUE_PAIRS);
+  class NetDev *dev = new NetDev(MMIO_START, pairs);
   err = dev->handle_IO();
   return err;
 }
@@ -1,5 +1,6 @@
 #pragma once
 #include <thread>
+#include <mutex>
 
 #include "utils/virtio.hpp"
 
@@ -10,11 +11,26 @@
 
 #define MMIO_START 0xe1b00000
 #define MMIO_END MMIO_START + 0x200
-#define NUM_NET_VQS 3
 #define VQ_CONTROL 0
 #define VQ_DATA_TX 1
 #define VQ_DATA_RX 2
 
+// multi-queue: the control queue is followed by one tx/rx pair per queue
+// pair, pair 0 being VQ_DATA_TX/VQ_DATA_RX
+#define NET_MAX_QUEUE_PAIRS 4
+#define NET_QUEUE_PAIRS_ENV "OOOWS_NET_QUEUE_PAIRS"
+// 1 runs the microengine code compiled to x86-64, 2 also checks every
+// compiled block against the interpreter
+#define NET_JIT_ENV "OOOWS_NET_JIT"
+#define NUM_NET_VQS(pairs) (1 + 2*(pairs))
+#define VQ_DATA_TX_PAIR(pair) (VQ_DATA_TX + 2*(pair))
+#define VQ_DATA_RX_PAIR(pair) (VQ_DATA_RX + 2*(pair))
+#define VQ_PAIR(vq_idx) (((vq_idx) - 1) / 2)
+
+// raised when tx/rx buffers have been placed in the used ring, queue pair
+// n uses NET_IRQ + n
+#define NET_IRQ 3
+
 #define SCRATCH_TX_PACKETS 0
 #define SCRATCH_RX_PACKETS 1
 #define SCRATCH_TX_RING_BUF 2
@@ -89,6 +105,9 @@ class NetDev : public MMIOVirtioDev {
 
   public:
   uint32_t m_nice;
+  uint32_t m_num_queue_pairs;
+  // new_pkt and the tx ring buf are shared by every tx queue
+  std::mutex m_tx_lock;
   uint32_t* m_scratch;
   uint32_t* m_ram;
   ThreadedQueue<fifo_job>* m_tx_queue;
@@ -103,7 +122,7 @@ class NetDev : public MMIOVirtioDev {
   int handleTx(class VirtBuf *vbuf);
   int handleRx(class VirtBuf *vbuf);
   int handleControl(class VirtBuf *vbuf);
-  NetDev(uint64_t mmio_start, uint32_t num_vqs);
+  NetDev(uint64_t mmio_start, uint32_t num_queue_pairs);
 
   // overwrite parent
   int config_space_write(uint64_t offset, uint64_t data, uint32_t size);
@@ -3,20 +3,26 @@
 #include <sys/types.h>
 #include "iostructs.h"
 #include <sys/stat.h>
+#include <limits.h>
 #include <unistd.h>
 #include <cstring>
 #include <memory>
 #include <thread>
 #include "vmm.h"
 
-#include "broadcooom/myqueue.hpp"
+#include "broadcooom/ringqueue.hpp"
 #include "p9fs/rresponses.hpp"
 #include "p9fs/trequests.hpp"
 
-P9FsDev::P9FsDev(uint64_t mmio_start, uint32_t num_vqs) : MMIOVirtioDev(mmio_start, num_vqs, (void *)HOST_SYS_MEM_VADDR) {
+P9FsDev::P9FsDev(uint64_t mmio_start, uint32_t num_queue_pairs) : MMIOVirtioDev(mmio_start, NUM_9P_VQS(num_queue_pairs), (void *)HOST_SYS_MEM_VADDR) {
   m_device_id = VIRTIO_9P_TRANSPORT;
+  m_num_queue_pairs = num_queue_pairs;
 
-  set_config_space(NULL, 0);
+  struct {
+    uint16_t num_queue_pairs;
+  } config_space;
+  config_space.num_queue_pairs = m_num_queue_pairs;
+  set_config_space(&config_space, sizeof(config_space));
 
   char *store = getenv("OOOWS_VM_STORE_DIR");
   if (store == NULL) {
@@ -40,38 +46,166 @@ P9FsDev::P9FsDev(uint64_t mmio_start, uint32_t num_vqs) : MMIOVirtioDev(mmio_sta
     }
   }
 
-  m_core = new P9Core(false, "share", mntpoint);
-  m_trequest_queue = new ThreadedQueue<TRequest *>();
-  m_rresponse_queue = new ThreadedQueue<RResponse *>();
-  m_rmesgvbuf_queue = new ThreadedQueue<VirtBuf *>();
+  // TMESG parsing and RMESG buffer intake are handed off to the request
+  // workers anyway, don't hold the vCPU while we do it. neither waits on
+  // anything, so the event loop can run them. responses are signalled with
+  // the pair's irq
+  uint32_t pair;
+  for (pair = 0; pair < m_num_queue_pairs; pair++) {
+    set_queue_async(VQ_TMESG_PAIR(pair));
+    set_queue_async(VQ_RMESG_PAIR(pair));
+    set_queue_nonblocking(VQ_TMESG_PAIR(pair));
+    set_queue_nonblocking(VQ_RMESG_PAIR(pair));
+    set_queue_irq(VQ_RMESG_PAIR(pair), P9FS_IRQ + pair);
+  }
+
+  // VMs handed the same lower tree share it read only, their own share
+  // holds whatever they change
+  std::string lower;
+  char *lowerdir = getenv(P9FS_LOWER_ENV);
+  if (lowerdir) {
+    char resolved[PATH_MAX];
+    if (!realpath(lowerdir, resolved) || stat(resolved, &st) < 0
+        || !S_ISDIR(st.st_mode)) {
+      throw std::exception();
+    }
+    lower = resolved;
+    TRACE_PRINT("Lower tree: %s", lower.c_str());
+  }
 
-  m_trequest_thread = std::thread([&]{ RequestLoop(); });
-  m_rresponse_thread = std::thread([&]{ ResponseLoop(); });
+  m_core = new P9Core(false, "share", mntpoint, lower);
+  for (pair = 0; pair < m_num_queue_pairs; pair++) {
+    m_rmesgvbuf_queues.push_back(new MpmcRingQueue<VirtBufHandle>(MAX_VQ_SIZE));
+  }
+
+  m_pool = new RequestPool(m_core, p9fs_workers(),
+                           [this](TRequest *trequest, bool wait) {
+                             return Begin(trequest, wait);
+                           },
+                           [this](TRequest *trequest, RResponse *rresponse) {
+                             Reply(trequest, rresponse);
+                           });
 }
 
-void P9FsDev::RequestLoop(void) {
-  while(1) {
-    TRequest *trequest = m_trequest_queue->get();
-    RResponse *rresponse = trequest->Process(m_core);
-    if (rresponse) {
-      m_rresponse_queue->put(rresponse);
-    }
-    delete trequest;
+static_assert(VIRTBUF_MAX_SEGS <= P9_MAX_IOVS, "a chain has to fit in IoVecs");
+
+// the host side of a buffer's whole descriptor chain
+static IoVecs ChainIov(VirtBuf *vbuf, uint64_t offset, uint64_t len) {
+  struct iovec iov[VIRTBUF_MAX_SEGS];
+  IoVecs chain;
+  int n = vbuf->iov(offset, len, iov, VIRTBUF_MAX_SEGS);
+  int i;
+  for (i = 0; i < n; i++) {
+    chain.push_back(iov[i]);
   }
+  return chain;
 }
 
-void P9FsDev::ResponseLoop(void) {
-  while(1) {
-    RResponse *rresponse = m_rresponse_queue->get();
-    TRACE_PRINT("Got response %p", rresponse);
-    VirtBuf *vbuf = m_rmesgvbuf_queue->get();
-    TRACE_PRINT("Got virtbuf %p", vbuf);
+// a guest buffer held by a request: the RMESG buffer a reply goes into, or
+// the TMESG buffer its data is still in. the TMESG one goes back to the
+// guest once the request is done with it
+class HeldBuf : public RequestBuffer {
+  public:
+  VirtBufHandle m_vbuf;
+
+  HeldBuf(VirtBufHandle vbuf) : m_vbuf(std::move(vbuf)) { }
+};
+
+class HeldPayload : public HeldBuf {
+  private:
+  P9FsDev *m_dev;
+  uint32_t m_pair;
+
+  public:
+  HeldPayload(P9FsDev *dev, VirtBufHandle vbuf, uint32_t pair)
+    : HeldBuf(std::move(vbuf)), m_dev(dev), m_pair(pair) { }
+  ~HeldPayload() { m_dev->put_buf(VQ_TMESG_PAIR(m_pair), std::move(m_vbuf)); }
+};
+
+// runs on a pool worker. TRead reads the file straight into the reply, so
+// it takes its buffer before it runs. everything else only takes one once
+// it's answered, a TFLUSH waiting on another request mustn't sit on a
+// buffer it needs
+bool P9FsDev::Begin(TRequest *trequest, bool wait) {
+  if (!trequest->RepliesInPlace()) {
+    return true;
+  }
+
+  uint32_t pair = trequest->QueuePair();
+  VirtBufHandle vbuf;
+  if (wait) {
+    vbuf = m_rmesgvbuf_queues[pair]->get();
+  } else if (!m_rmesgvbuf_queues[pair]->try_get(vbuf)) {
+    return false;
+  }
+
+  IoVecs reply = ChainIov(vbuf.get(), 0, vbuf->m_total_len);
+  trequest->SetReplyBuffer(reply, std::unique_ptr<RequestBuffer>(new HeldBuf(std::move(vbuf))));
+  return true;
+}
+
+// the response is serialized straight into the next RMESG buffer of the
+// pair the request came in on, or the one Begin took
+void P9FsDev::Reply(TRequest *trequest, RResponse *rresponse) {
+  uint32_t pair = trequest->QueuePair();
+  VirtBufHandle vbuf;
+
+  std::unique_ptr<RequestBuffer> held = trequest->TakeReplyBuffer();
+  if (held) {
+    vbuf = std::move(static_cast<HeldBuf *>(held.get())->m_vbuf);
+  }
+
+  if (!rresponse) {
+    if (vbuf) {
+      m_rmesgvbuf_queues[pair]->put(std::move(vbuf));
+    }
+    return;
+  }
+  TRACE_PRINT("Got response %p", rresponse);
+  trequest->SetReplySize(rresponse->SerializedSize());
+
+  if (!vbuf) {
+    vbuf = m_rmesgvbuf_queues[pair]->get();
+  }
+  TRACE_PRINT("Got virtbuf %p", vbuf.get());
+
+  // responses go into the head descriptor when they fit, which is all of
+  // them but an Rread's data with a small head. otherwise they're built
+  // aside and spread over the chain
+  uint32_t head = rresponse->SerializedHeadSize();
+  vbuf->m_nbytes_written = rresponse->SerializedSize();
+  if (head <= vbuf->m_len) {
     rresponse->SerializeTo((uint8_t *)vbuf->host_addr(0), vbuf->m_len);
-    vbuf->m_nbytes_written = rresponse->SerializedSize();
-    delete rresponse;
-    put_buf(VQ_RMESG, vbuf);
-    send_irq(P9FS_IRQ);
+  } else {
+    std::unique_ptr<uint8_t[]> tmp(new uint8_t[head]);
+    rresponse->SerializeTo(tmp.get(), head);
+    if (vbuf->scatter(0, tmp.get(), head)) {
+      vbuf->m_nbytes_written = 0;
+    }
+  }
+  delete rresponse;
+  put_buf(VQ_RMESG_PAIR(pair), std::move(vbuf));
+  send_queue_irq(VQ_RMESG_PAIR(pair));
+}
+
+// TWrite's data is written to the file straight out of the TMESG buffer's
+// chain, so the request takes the buffer and hands it back to the guest
+// once it's done. data running off the end of the chain is left unset and
+// TWrite fails
+void P9FsDev::HoldPayload(TRequest *trequest, VirtBufHandle &vbuf, uint32_t pair) {
+  uint32_t len = trequest->PayloadSize();
+  if (!len) {
+    return;
   }
+
+  uint64_t start = sizeof(p9_pkt_t) + trequest->PayloadOffset();
+  IoVecs payload = ChainIov(vbuf.get(), start, len);
+  if (payload.empty()) {
+    return;
+  }
+
+  trequest->SetPayload(payload, std::unique_ptr<RequestBuffer>(
+                         new HeldPayload(this, std::move(vbuf), pair)));
 }
 
 // Validate an incoming 9P request and add it to the requests
@@ -119,6 +253,24 @@ TRequest *P9FsDev::ToTRequest(p9_msg_t *msg, size_t size) {
   case P9_TWSTAT:
     ret = new TWstat(msg->tag, msg->body, size);
     break;
+  case P9_TLOPEN:
+    ret = new TLopen(msg->tag, msg->body, size);
+    break;
+  case P9_TLCREATE:
+    ret = new TLcreate(msg->tag, msg->body, size);
+    break;
+  case P9_TGETATTR:
+    ret = new TGetattr(msg->tag, msg->body, size);
+    break;
+  case P9_TREADDIR:
+    ret = new TReaddir(msg->tag, msg->body, size);
+    break;
+  case P9_TFSYNC:
+    ret = new TFsync(msg->tag, msg->body, size);
+    break;
+  case P9_TLOCK:
+    ret = new TLock(msg->tag, msg->body, size);
+    break;
   }
 
   // invalid Trequest type
@@ -129,12 +281,13 @@ TRequest *P9FsDev::ToTRequest(p9_msg_t *msg, size_t size) {
 #ifdef TRACE
   ret->show();
 #endif
+  ret->SetMessageSize(size);
 
   // insert the Treq into the list of current requests if created
   return ret;
 }
 
-int P9FsDev::handleTMesg(class VirtBuf *vbuf)
+int P9FsDev::handleTMesg(VirtBufHandle &vbuf, uint32_t pair)
 {
   if (vbuf->m_len < sizeof(p9_pkt_t)) {
     return -1;
@@ -153,28 +306,47 @@ int P9FsDev::handleTMesg(class VirtBuf *vbuf)
   if (!raw) {
     return 1;
   }
-  memcpy(raw, vbuf->host_addr(sizeof(uint32_t)), pkt->size - 4);
+  // type and tag first, the type decides how much of the rest is needed
+  memcpy(raw, vbuf->host_addr(sizeof(uint32_t)), sizeof(p9_msg_t));
+  memcpy(raw + sizeof(p9_msg_t), vbuf->host_addr(sizeof(p9_pkt_t)),
+         P9ParseLength((p9_msg_t *)raw, pkt->size - 4) - sizeof(p9_msg_t));
 
   p9_msg_t *msg = (p9_msg_t *)raw;
   TRACE_PRINT("BUG1 Incoming message size: %x %x %x",
               pkt->size, msg->tag, msg->type);
 
   TRequest *trequest = ToTRequest(msg, pkt->size);
+
+  // requests copy what they need out of the message
+  delete[] raw;
 #else
   int err = 0;
   size_t sz = 0;
-  err = vbuf->readU(&sz, sizeof(uint32_t));
+  err = vbuf->gather(0, &sz, sizeof(uint32_t));
   if (err) {
     return err;
   }
 
-  if (sz < sizeof(p9_pkt_t)) {
+  // nothing bigger fits in any msize
+  if (sz < sizeof(p9_pkt_t) || sz > P9_MAX_MSIZE) {
     return 1;
   }
   sz -= sizeof(uint32_t);
 
-  uint8_t *raw = new uint8_t[sz];
-  err = vbuf->readU(raw, sz);
+  // type and tag first, the type decides how much of the rest is needed.
+  // large messages come as descriptor chains, so copy across it. requests
+  // copy what they need out of the message, so the thread keeps the one
+  // buffer for all of them
+  static thread_local std::vector<uint8_t> scratch;
+  if (scratch.size() < sz) {
+    scratch.resize(sz);
+  }
+  uint8_t *raw = scratch.data();
+  err = vbuf->gather(sizeof(uint32_t), raw, sizeof(p9_msg_t));
+  if (!err) {
+    err = vbuf->gather(sizeof(p9_pkt_t), raw + sizeof(p9_msg_t),
+                       P9ParseLength((p9_msg_t *)raw, sz) - sizeof(p9_msg_t));
+  }
   if (err) {
     return err;
   }
@@ -187,7 +359,9 @@ int P9FsDev::handleTMesg(class VirtBuf *vbuf)
 #endif
 
   if (trequest) {
-    m_trequest_queue->put(trequest);
+    trequest->SetQueuePair(pair);
+    HoldPayload(trequest, vbuf, pair);
+    m_pool->Submit(trequest);
   }
 
   return 0;
@@ -195,23 +369,27 @@ int P9FsDev::handleTMesg(class VirtBuf *vbuf)
 
 int P9FsDev::got_data(uint16_t vq_idx) {
   int ret = 0;
-  VirtBuf *vbuf = NULL;
+  VirtBufHandle vbuf;
+  uint32_t pair = VQ_PAIR(vq_idx);
 
   TRACE_PRINT("0x%x", vq_idx);
 
   for (vbuf = get_buf(vq_idx) ; vbuf; vbuf = get_buf(vq_idx)) {
 
-    TRACE_PRINT("Vbuf %p", vbuf);
-    if (vq_idx == VQ_TMESG) {
-      ret = handleTMesg(vbuf);
+    TRACE_PRINT("Vbuf %p", vbuf.get());
+    if (vq_idx == VQ_TMESG_PAIR(pair)) {
+      ret = handleTMesg(vbuf, pair);
       // TODO: check ret here?
 
-      ret = put_buf(vq_idx, vbuf);
+      // a request holding on to its data returns the buffer itself
+      if (vbuf) {
+        ret = put_buf(vq_idx, std::move(vbuf));
+      }
       // TODO: check ret here too??
     }
 
-    if (vq_idx == VQ_RMESG) {
-      m_rmesgvbuf_queue->put(vbuf);
+    if (vq_idx == VQ_RMESG_PAIR(pair)) {
+      m_rmesgvbuf_queues[pair]->put(std::move(vbuf));
     }
   }
 
@@ -220,7 +398,8 @@ int P9FsDev::got_data(uint16_t vq_idx) {
 
 int main(void) {
   int err;
-  class P9FsDev *dev = new P9FsDev(MMIO_START, NUM_9P_VQS);
+  uint32_t pairs = virtio_queue_pairs(P9FS_QUEUE_PAIRS_ENV, P9FS_MAX_QUEUE_PAIRS);
+  class P9FsDev *dev = new P9FsDev(MMIO_START, pairs);
   err = dev->handle_IO();
   return err;
 }
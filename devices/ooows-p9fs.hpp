@@ -1,42 +1,53 @@
 #ifndef P9FS_DEV_H_
 #define P9FS_DEV_H_
 
-#include "broadcooom/myqueue.hpp"
+#include "broadcooom/ringqueue.hpp"
 #include "p9fs/rresponses.hpp"
 #include "p9fs/trequests.hpp"
 #include "p9fs/qidobject.hpp"
 #include "utils/virtio.hpp"
 #include "p9fs/p9core.hpp"
+#include "p9fs/requestpool.hpp"
 #include "p9fs/trace.h"
 #include <thread>
 #include <map>
+#include <vector>
 
 #define MMIO_START 0x9b000000
 #define MMIO_END   (MMIO_START + 0x200)
-#define NUM_9P_VQS 2
 #define VQ_TMESG 0
 #define VQ_RMESG 1
 
+// multi-queue: each queue pair is a TMESG/RMESG queue, pair 0 being
+// VQ_TMESG/VQ_RMESG. responses go back on the pair the request came in on
+#define P9FS_MAX_QUEUE_PAIRS 4
+#define P9FS_QUEUE_PAIRS_ENV "OOOWS_P9FS_QUEUE_PAIRS"
+#define NUM_9P_VQS(pairs) (2*(pairs))
+#define VQ_TMESG_PAIR(pair) (VQ_TMESG + 2*(pair))
+#define VQ_RMESG_PAIR(pair) (VQ_RMESG + 2*(pair))
+#define VQ_PAIR(vq_idx) ((vq_idx) / 2)
+
+// queue pair n raises P9FS_IRQ + n
 #define P9FS_IRQ 9
 
 class P9FsDev : public MMIOVirtioDev {
   private:
   P9Core *m_core;
-  std::thread m_trequest_thread;
-  std::thread m_rresponse_thread;
-  ThreadedQueue<TRequest *> *m_trequest_queue;
-  ThreadedQueue<RResponse *> *m_rresponse_queue;
-  ThreadedQueue<VirtBuf *> *m_rmesgvbuf_queue;
-  std::map<uint32_t, TRequest *> m_trequests_map;
-
-  void RequestLoop();
-  void ResponseLoop();
+  uint32_t m_num_queue_pairs;
+  // executes requests concurrently, in order per fid
+  RequestPool *m_pool;
+  // RMESG buffers the guest has posted, per queue pair. room for a whole
+  // virtqueue, so handing one back never blocks
+  std::vector<MpmcRingQueue<VirtBufHandle> *> m_rmesgvbuf_queues;
+  bool Begin(TRequest *trequest, bool wait);
+  void Reply(TRequest *trequest, RResponse *rresponse);
+  void HoldPayload(TRequest *trequest, VirtBufHandle &vbuf, uint32_t pair);
   TRequest *ToTRequest(p9_msg_t *msg, size_t size);
 
   public:
   int got_data(uint16_t vq_idx);
-  int handleTMesg(class VirtBuf *vbuf);
-  P9FsDev(uint64_t mmio_start, uint32_t num_vqs);
+  int handleTMesg(VirtBufHandle &vbuf, uint32_t pair);
+  P9FsDev(uint64_t mmio_start, uint32_t num_queue_pairs);
 };
 
 #endif
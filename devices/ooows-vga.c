@@ -13,6 +13,7 @@
 #include "utils/per-vm.h"
 #include "utils/handshake.h"
 #include "utils/threadpool.h"
+#include "utils/eventloop.h"
 
 #define DEBUG 0
 
@@ -319,31 +320,56 @@ int VgaHandleMmio(int fd, struct mmio_request *mmio) {
   return ret;
 }
 
-void *VgaHandleIO(void *arg) {
+int VgaHandleRequest(int fd, struct io_request *io) {
   int err = 0;
+
+  pthread_mutex_lock(&gVGA->vga_lock);
+  switch(io->type) {
+  case IOTYPE_PIO:
+    err = VgaHandlePio(fd, &io->ioport);
+    break;
+  case IOTYPE_MMIO:
+    err = VgaHandleMmio(fd, &io->mmio);
+    break;
+  default:
+    fprintf(stderr, "Unknown IO type encountered: %d\n", io->type);
+  }
+  pthread_mutex_unlock(&gVGA->vga_lock);
+
+  return err;
+}
+
+void *VgaHandleIO(void *arg) {
   int fd = *(int *)arg;
 
   struct io_request io = {0};
   while (read(fd, &io, sizeof(io)) == sizeof(io)) {
-    pthread_mutex_lock(&gVGA->vga_lock);
-    switch(io.type) {
-    case IOTYPE_PIO:
-      err = VgaHandlePio(fd, &io.ioport);
-      break;
-    case IOTYPE_MMIO:
-      err = VgaHandleMmio(fd, &io.mmio);
-      break;
-    default:
-      fprintf(stderr, "Unknown IO type encountered: %d\n", io.type);
-    }
-    pthread_mutex_unlock(&gVGA->vga_lock);
-
-    if (err == -2) return (void *)-1;
+    if (VgaHandleRequest(fd, &io) == -2) return (void *)-1;
   }
 
   return (void *)0;
 }
 
+int VgaLoopChannel(void *ctx, int fd, struct io_request *io) {
+  return VgaHandleRequest(fd, io) == -2 ? -1 : 0;
+}
+
+// everything is serialized on vga_lock anyway, so the loop mostly saves us
+// the per-vCPU threads
+int VgaEventLoop(int *vcpu_fds, size_t nvcpus, size_t workers) {
+  struct event_loop *loop = CreateEventLoop(workers, VgaLoopChannel, NULL, NULL);
+  if (!loop)
+    return -1;
+
+  int i = 0;
+  for(i=0;i<nvcpus;i++) {
+    if (EventLoopAddChannel(loop, vcpu_fds[i]) < 0)
+      return -1;
+  }
+
+  return EventLoopRun(loop);
+}
+
 int main(void) {
   int err, ret;
   size_t nvcpus = 0;
@@ -362,6 +388,13 @@ int main(void) {
     return -1;
   }
 
+  size_t loop_workers;
+  if (EventLoopRequested(&loop_workers)) {
+    err = VgaEventLoop(vcpu_fds, nvcpus, loop_workers);
+    DestroyDevice();
+    return err;
+  }
+
   int i = 0;
   pthread_t workers[NR_MAX_VCPUS] = {0};
   for(i=0;i<nvcpus;i++) {
@@ -0,0 +1,341 @@
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <vector>
+
+#include "dentrycache.hpp"
+#include "trace.h"
+
+// everything that can change what a walk or stat of an entry finds. writes
+// through p9fs raise IN_MODIFY too, but they've already invalidated
+#define DCACHE_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO \
+                           | IN_ATTRIB | IN_MODIFY | IN_DELETE_SELF        \
+                           | IN_MOVE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW)
+
+size_t p9fs_dcache_size(void) {
+  char *env = getenv(P9FS_DCACHE_ENV);
+  if (!env) {
+    return P9FS_DEFAULT_DCACHE;
+  }
+
+  size_t entries = strtoul(env, NULL, 0);
+  if (entries > P9FS_MAX_DCACHE) {
+    entries = P9FS_MAX_DCACHE;
+  }
+  return entries;
+}
+
+// the directories whose events can change what's at path: the root down to
+// its parent, or the root itself
+static std::vector<std::string> WatchedDirs(const std::string &root,
+                                            const std::string &path) {
+  std::vector<std::string> dirs;
+  dirs.push_back(root);
+
+  size_t pos = root.size();
+  while ((pos = path.find('/', pos + 1)) != std::string::npos) {
+    dirs.push_back(path.substr(0, pos));
+  }
+  return dirs;
+}
+
+static std::string Parent(const std::string &path) {
+  size_t pos = path.rfind('/');
+  if (pos == std::string::npos || pos == 0) {
+    return "/";
+  }
+  return path.substr(0, pos);
+}
+
+DentryCache::DentryCache(std::string root, size_t capacity)
+  : m_capacity(capacity) {
+  if (!m_capacity) {
+    return;
+  }
+
+  char resolved[PATH_MAX];
+  if (!realpath(root.c_str(), resolved)) {
+    TRACE_PRINT("Dentry cache off, can't resolve %s", root.c_str());
+    m_capacity = 0;
+    return;
+  }
+  m_root = resolved;
+
+  m_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  m_stop_fd = eventfd(0, EFD_CLOEXEC);
+  if (m_inotify_fd < 0 || m_stop_fd < 0) {
+    perror("DentryCache");
+    if (m_inotify_fd >= 0) {
+      close(m_inotify_fd);
+    }
+    if (m_stop_fd >= 0) {
+      close(m_stop_fd);
+    }
+    m_inotify_fd = m_stop_fd = -1;
+    m_capacity = 0;
+    return;
+  }
+
+  m_events = std::thread([this]{ EventLoop(); });
+}
+
+DentryCache::~DentryCache() {
+  if (m_events.joinable()) {
+    uint64_t one = 1;
+    if (write(m_stop_fd, &one, sizeof(one)) != sizeof(one)) {
+      perror("DentryCache stop");
+    }
+    m_events.join();
+  }
+  if (m_inotify_fd >= 0) {
+    close(m_inotify_fd);
+  }
+  if (m_stop_fd >= 0) {
+    close(m_stop_fd);
+  }
+}
+
+bool DentryCache::UnderRoot(const std::string &path) {
+  return !path.compare(0, m_root.size(), m_root)
+    && (path.size() == m_root.size() || path[m_root.size()] == '/');
+}
+
+uint64_t DentryCache::Generation() {
+  std::lock_guard<std::mutex> guard(m_lock);
+  return m_generation;
+}
+
+bool DentryCache::Lookup(const std::string &path, DentryAttr *attr) {
+  if (!m_capacity) {
+    return false;
+  }
+
+  std::lock_guard<std::mutex> guard(m_lock);
+  auto it = m_entries.find(path);
+  if (it == m_entries.end()) {
+    return false;
+  }
+
+  m_lru.splice(m_lru.begin(), m_lru, it->second.lru);
+  *attr = it->second.attr;
+  return true;
+}
+
+void DentryCache::Insert(const std::string &path, const DentryAttr &attr, uint64_t gen) {
+  if (!m_capacity) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> guard(m_lock);
+  // something changed since the caller looked, what it found may be stale
+  if (gen != m_generation || !UnderRoot(path)) {
+    return;
+  }
+
+  auto it = m_entries.find(path);
+  if (it != m_entries.end()) {
+    it->second.attr = attr;
+    m_lru.splice(m_lru.begin(), m_lru, it->second.lru);
+    return;
+  }
+
+  bool added = false;
+  if (!WatchParentsLocked(path, &added)) {
+    return;
+  }
+  // a directory that only started being watched now could have changed
+  // before then without an event. keep the watch so the next walk caches
+  if (added) {
+    UnwatchParentsLocked(path);
+    return;
+  }
+
+  m_lru.push_front(path);
+  Entry &entry = m_entries[path];
+  entry.attr = attr;
+  entry.lru = m_lru.begin();
+
+  while (m_entries.size() > m_capacity) {
+    EraseLocked(m_entries.find(m_lru.back()));
+  }
+}
+
+bool DentryCache::WatchParentsLocked(const std::string &path, bool *added) {
+  std::vector<std::string> dirs = WatchedDirs(m_root, path);
+
+  size_t i;
+  for (i = 0; i < dirs.size(); i++) {
+    auto it = m_watches.find(dirs[i]);
+    if (it != m_watches.end()) {
+      it->second.refs++;
+      continue;
+    }
+
+    int wd = inotify_add_watch(m_inotify_fd, dirs[i].c_str(), DCACHE_WATCH_MASK);
+    if (wd < 0) {
+      TRACE_PRINT("Can't watch %s, not caching %s", dirs[i].c_str(), path.c_str());
+      break;
+    }
+    m_watches[dirs[i]] = { wd, 1 };
+    m_watch_dirs[wd] = dirs[i];
+    *added = true;
+  }
+
+  if (i == dirs.size()) {
+    return true;
+  }
+
+  // drop the references taken so far, unwatching anything left unused
+  while (i--) {
+    auto it = m_watches.find(dirs[i]);
+    if (--it->second.refs == 0) {
+      inotify_rm_watch(m_inotify_fd, it->second.wd);
+      m_watch_dirs.erase(it->second.wd);
+      m_watches.erase(it);
+    }
+  }
+  return false;
+}
+
+void DentryCache::UnwatchParentsLocked(const std::string &path) {
+  std::vector<std::string> dirs = WatchedDirs(m_root, path);
+  for (auto &dir : dirs) {
+    auto it = m_watches.find(dir);
+    if (it == m_watches.end()) {
+      continue;
+    }
+    // unused watches stay until an entry under them goes away, so a
+    // directory walked once more gets cached. drop them if they pile up
+    if (--it->second.refs == 0 && m_watches.size() > m_capacity) {
+      inotify_rm_watch(m_inotify_fd, it->second.wd);
+      m_watch_dirs.erase(it->second.wd);
+      m_watches.erase(it);
+    }
+  }
+}
+
+void DentryCache::EraseLocked(std::map<std::string, Entry>::iterator it) {
+  std::string path = it->first;
+  m_lru.erase(it->second.lru);
+  m_entries.erase(it);
+  UnwatchParentsLocked(path);
+}
+
+void DentryCache::InvalidateAttrLocked(const std::string &path) {
+  m_generation++;
+  auto it = m_entries.find(path);
+  if (it != m_entries.end()) {
+    EraseLocked(it);
+  }
+}
+
+void DentryCache::InvalidateLocked(const std::string &path) {
+  InvalidateAttrLocked(path);
+  InvalidateAttrLocked(Parent(path));
+
+  // '0' follows '/', so this is everything under path
+  auto begin = m_entries.lower_bound(path + "/");
+  auto end = m_entries.lower_bound(path + "0");
+  while (begin != end) {
+    EraseLocked(begin++);
+  }
+}
+
+void DentryCache::ClearLocked() {
+  m_generation++;
+  while (!m_entries.empty()) {
+    EraseLocked(m_entries.begin());
+  }
+}
+
+void DentryCache::InvalidateAttr(const std::string &path) {
+  if (!m_capacity) {
+    return;
+  }
+  std::lock_guard<std::mutex> guard(m_lock);
+  InvalidateAttrLocked(path);
+}
+
+void DentryCache::Invalidate(const std::string &path) {
+  if (!m_capacity) {
+    return;
+  }
+  std::lock_guard<std::mutex> guard(m_lock);
+  InvalidateLocked(path);
+}
+
+void DentryCache::EventLoop() {
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  struct pollfd fds[2] = {
+    { m_inotify_fd, POLLIN, 0 },
+    { m_stop_fd, POLLIN, 0 },
+  };
+  // reused for every event, writes through p9fs raise one each
+  std::string dirpath;
+  std::string path;
+
+  while (1) {
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("DentryCache poll");
+      break;
+    }
+    if (fds[1].revents) {
+      break;
+    }
+
+    ssize_t len = read(m_inotify_fd, buf, sizeof(buf));
+    if (len <= 0) {
+      continue;
+    }
+
+    std::lock_guard<std::mutex> guard(m_lock);
+    char *p = buf;
+    while (p < buf + len) {
+      struct inotify_event *ev = (struct inotify_event *)p;
+      p += sizeof(struct inotify_event) + ev->len;
+
+      // events were dropped, anything could have changed
+      if (ev->mask & IN_Q_OVERFLOW) {
+        ClearLocked();
+        continue;
+      }
+
+      auto dir = m_watch_dirs.find(ev->wd);
+      if (dir == m_watch_dirs.end()) {
+        continue;
+      }
+      dirpath.assign(dir->second);
+      path.assign(dirpath);
+
+      if (ev->len) {
+        path.append("/");
+        path.append(ev->name);
+      }
+
+      if (ev->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO
+                      | IN_DELETE_SELF | IN_MOVE_SELF)) {
+        InvalidateLocked(path);
+      } else if (ev->mask & (IN_ATTRIB | IN_MODIFY)) {
+        InvalidateAttrLocked(path);
+      }
+
+      // the directory is gone, or moved and its path is stale. entries
+      // under it went with the invalidation above
+      if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+        auto watch = m_watches.find(dirpath);
+        if (watch != m_watches.end() && watch->second.wd == ev->wd) {
+          inotify_rm_watch(m_inotify_fd, ev->wd);
+          m_watches.erase(watch);
+        }
+        m_watch_dirs.erase(ev->wd);
+      }
+    }
+  }
+}
@@ -0,0 +1,92 @@
+#ifndef P9_DENTRYCACHE_H_
+#define P9_DENTRYCACHE_H_
+
+#include <sys/stat.h>
+#include <stdint.h>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#define P9FS_DCACHE_ENV "OOOWS_P9FS_DCACHE"
+#define P9FS_DEFAULT_DCACHE 4096
+#define P9FS_MAX_DCACHE (1 << 20)
+
+// what a walk to a path found there
+struct DentryAttr {
+  struct stat st;
+  uint8_t qid_type;
+  uint32_t qid_version;
+  uint64_t qid_path;
+};
+
+// Bounded LRU of real paths under the export root and their attributes, so
+// repeated walks and stats don't go back to realpath and stat. Entries are
+// keyed by the path realpath returned, so a walk looks up its parent's path
+// plus the name as is: that only hits when the name is a plain entry, walks
+// through symlinks, "." or ".." always resolve. Every directory between the
+// root and a cached entry has an inotify watch, events drop whatever they
+// could have changed and the watches go away with the last entry under
+// them.
+//
+// inotify is asynchronous, so a lookup racing an outside change can still
+// see the old entry until the event is read. changes made through p9fs
+// itself invalidate synchronously.
+class DentryCache {
+  public:
+  // capacity 0 turns the cache off
+  DentryCache(std::string root, size_t capacity);
+  ~DentryCache();
+
+  // bumped by every invalidation. take it before resolving a miss and hand
+  // it to Insert, which drops the result if anything changed in between
+  uint64_t Generation();
+  bool Lookup(const std::string &path, DentryAttr *attr);
+  // path must be one realpath returned
+  void Insert(const std::string &path, const DentryAttr &attr, uint64_t gen);
+  // path's attributes changed
+  void InvalidateAttr(const std::string &path);
+  // path and everything under it were created, removed or moved, which
+  // also changes its parent's attributes
+  void Invalidate(const std::string &path);
+
+  private:
+  struct Entry {
+    DentryAttr attr;
+    std::list<std::string>::iterator lru;
+  };
+  struct Watch {
+    int wd;
+    size_t refs;
+  };
+
+  std::string m_root;
+  size_t m_capacity;
+  int m_inotify_fd = -1;
+  int m_stop_fd = -1;
+  std::thread m_events;
+
+  std::mutex m_lock;
+  uint64_t m_generation = 0;
+  // ordered so everything under a path is one range
+  std::map<std::string, Entry> m_entries;
+  std::list<std::string> m_lru;
+  std::unordered_map<std::string, Watch> m_watches;
+  std::unordered_map<int, std::string> m_watch_dirs;
+
+  bool UnderRoot(const std::string &path);
+  bool WatchParentsLocked(const std::string &path, bool *added);
+  void UnwatchParentsLocked(const std::string &path);
+  void EraseLocked(std::map<std::string, Entry>::iterator it);
+  void InvalidateAttrLocked(const std::string &path);
+  void InvalidateLocked(const std::string &path);
+  void ClearLocked();
+  void EventLoop();
+};
+
+// number of cache entries from P9FS_DCACHE_ENV, clamped to P9FS_MAX_DCACHE
+size_t p9fs_dcache_size(void);
+
+#endif
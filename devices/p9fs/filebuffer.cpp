@@ -0,0 +1,304 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <condition_variable>
+#include <thread>
+
+#include "filebuffer.hpp"
+#include "trace.h"
+
+static size_t BufferSize(const char *var, size_t dflt) {
+  char *env = getenv(var);
+  if (!env) {
+    return dflt;
+  }
+
+  size_t size = strtoul(env, NULL, 0);
+  if (size > P9FS_MAX_FILEBUF) {
+    size = P9FS_MAX_FILEBUF;
+  }
+  return size;
+}
+
+size_t p9fs_readahead_size(void) {
+  static size_t size = BufferSize(P9FS_READAHEAD_ENV, P9FS_DEFAULT_READAHEAD);
+  return size;
+}
+
+size_t p9fs_writebehind_size(void) {
+  static size_t size = BufferSize(P9FS_WRITEBEHIND_ENV, P9FS_DEFAULT_WRITEBEHIND);
+  return size;
+}
+
+static size_t IovLen(const struct iovec *iov, int iovcnt) {
+  size_t len = 0;
+  int i;
+  for (i = 0; i < iovcnt; i++) {
+    len += iov[i].iov_len;
+  }
+  return len;
+}
+
+// copies len bytes of src out over the iovecs, which hold at least that
+static void CopyOut(const uint8_t *src, size_t len, const struct iovec *iov) {
+  for (; len; iov++) {
+    size_t part = iov->iov_len < len ? iov->iov_len : len;
+    memcpy(iov->iov_base, src, part);
+    src += part;
+    len -= part;
+  }
+}
+
+static void CopyIn(uint8_t *dst, const struct iovec *iov, int iovcnt) {
+  int i;
+  for (i = 0; i < iovcnt; i++) {
+    memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+    dst += iov[i].iov_len;
+  }
+}
+
+// Flushes writes held back too long. Buffers are on its list from their
+// first held back write until the flush. A buffer someone's using is
+// skipped, they'll flush it or it's picked up next time around.
+class Flusher {
+  public:
+  static Flusher &Get() {
+    static Flusher flusher;
+    return flusher;
+  }
+
+  // with buf's lock held
+  void Add(FileBuffer *buf) {
+    std::lock_guard<std::mutex> guard(m_lock);
+    if (buf->m_listed) {
+      return;
+    }
+    buf->m_listed = true;
+    buf->m_prev = NULL;
+    buf->m_next = m_head;
+    if (m_head) {
+      m_head->m_prev = buf;
+    }
+    m_head = buf;
+    m_wake.notify_one();
+  }
+
+  // without buf's lock held, after this the flusher is done with it
+  void Remove(FileBuffer *buf) {
+    std::lock_guard<std::mutex> guard(m_lock);
+    UnlinkLocked(buf);
+  }
+
+  private:
+  std::mutex m_lock;
+  std::condition_variable m_wake;
+  bool m_stop = false;
+  FileBuffer *m_head = NULL;
+  std::thread m_thread;
+
+  Flusher() : m_thread([this]{ Loop(); }) { }
+
+  ~Flusher() {
+    {
+      std::lock_guard<std::mutex> guard(m_lock);
+      m_stop = true;
+    }
+    m_wake.notify_one();
+    m_thread.join();
+  }
+
+  void UnlinkLocked(FileBuffer *buf) {
+    if (!buf->m_listed) {
+      return;
+    }
+    if (buf->m_prev) {
+      buf->m_prev->m_next = buf->m_next;
+    } else {
+      m_head = buf->m_next;
+    }
+    if (buf->m_next) {
+      buf->m_next->m_prev = buf->m_prev;
+    }
+    buf->m_listed = false;
+  }
+
+  void Loop() {
+    auto age = std::chrono::milliseconds(P9FS_WRITEBEHIND_MS);
+    std::unique_lock<std::mutex> lock(m_lock);
+
+    while (!m_stop) {
+      if (!m_head) {
+        m_wake.wait(lock);
+        continue;
+      }
+      m_wake.wait_for(lock, age);
+
+      auto now = std::chrono::steady_clock::now();
+      FileBuffer *buf = m_head;
+      while (buf) {
+        FileBuffer *next = buf->m_next;
+        if (buf->m_lock.try_lock()) {
+          if (!buf->m_wb_len) {
+            UnlinkLocked(buf);
+          } else if (now - buf->m_wb_since >= age) {
+            // a failure is reported by the next write or flush
+            buf->FlushLocked();
+            UnlinkLocked(buf);
+          }
+          buf->m_lock.unlock();
+        }
+        buf = next;
+      }
+    }
+  }
+};
+
+FileBuffer::FileBuffer(int fd, size_t readahead, size_t writebehind)
+  : m_fd(fd), m_ra_size(readahead), m_wb_size(writebehind) { }
+
+FileBuffer::~FileBuffer() {
+  if (!m_wb_size) {
+    return;
+  }
+  if (!Flush()) {
+    TRACE_PRINT("Lost held back writes: %s", strerror(errno));
+  }
+  Flusher::Get().Remove(this);
+}
+
+bool FileBuffer::Sequential(uint64_t offset) {
+  return offset == m_next_read && m_seq + 1 >= P9FS_READAHEAD_SEQ;
+}
+
+bool FileBuffer::InWindow(uint64_t offset, size_t len) {
+  return offset >= m_ra_offset && offset + len <= m_ra_offset + m_ra_len;
+}
+
+ssize_t FileBuffer::Read(uint64_t offset, const struct iovec *iov, int iovcnt) {
+  std::lock_guard<std::mutex> guard(m_lock);
+
+  // held back writes land before anything reads the file. if they fail the
+  // next write or flush says so
+  if (m_wb_len) {
+    FlushLocked();
+  }
+
+  size_t len = IovLen(iov, iovcnt);
+  bool sequential = Sequential(offset);
+  m_seq = offset == m_next_read ? m_seq + 1 : 1;
+
+  ssize_t ret;
+  if (m_ra_size && len < m_ra_size && (sequential || InWindow(offset, len))) {
+    if (!InWindow(offset, len)) {
+      if (!m_ra) {
+        m_ra.reset(new uint8_t[m_ra_size]);
+      }
+      ssize_t n = pread(m_fd, m_ra.get(), m_ra_size, offset);
+      if (n < 0) {
+        m_ra_len = 0;
+        return -1;
+      }
+      m_ra_offset = offset;
+      m_ra_len = n;
+      // have the kernel start on the next window while this one's read
+      if ((size_t)n == m_ra_size) {
+        posix_fadvise(m_fd, offset + n, m_ra_size, POSIX_FADV_WILLNEED);
+      }
+    }
+
+    size_t avail = m_ra_offset + m_ra_len - offset;
+    ret = len < avail ? len : avail;
+    CopyOut(m_ra.get() + (offset - m_ra_offset), ret, iov);
+  } else {
+    ret = preadv(m_fd, iov, iovcnt, offset);
+  }
+
+  if (ret >= 0) {
+    m_next_read = offset + ret;
+  }
+  return ret;
+}
+
+ssize_t FileBuffer::Write(uint64_t offset, const struct iovec *iov, int iovcnt) {
+  std::lock_guard<std::mutex> guard(m_lock);
+
+  if (m_wb_error) {
+    errno = m_wb_error;
+    m_wb_error = 0;
+    return -1;
+  }
+
+  // whatever the window has of the file could be stale now
+  m_ra_len = 0;
+
+  size_t len = IovLen(iov, iovcnt);
+  bool follows = offset == m_wb_offset + m_wb_len && m_wb_len + len <= m_wb_size;
+  if (m_wb_len && !follows && !FlushLocked()) {
+    errno = m_wb_error;
+    m_wb_error = 0;
+    return -1;
+  }
+
+  if (!m_wb_size || len >= m_wb_size) {
+    return pwritev(m_fd, iov, iovcnt, offset);
+  }
+
+  if (!m_wb_len) {
+    if (!m_wb) {
+      m_wb.reset(new uint8_t[m_wb_size]);
+    }
+    m_wb_offset = offset;
+    m_wb_since = std::chrono::steady_clock::now();
+    Flusher::Get().Add(this);
+  }
+  CopyIn(m_wb.get() + m_wb_len, iov, iovcnt);
+  m_wb_len += len;
+
+  if (m_wb_len == m_wb_size) {
+    FlushLocked();
+  }
+  return len;
+}
+
+bool FileBuffer::FlushLocked() {
+  size_t done = 0;
+  while (done < m_wb_len) {
+    ssize_t n = pwrite(m_fd, m_wb.get() + done, m_wb_len - done, m_wb_offset + done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      m_wb_error = n < 0 ? errno : EIO;
+      break;
+    }
+    done += n;
+  }
+  m_wb_len = 0;
+  return !m_wb_error;
+}
+
+bool FileBuffer::Flush() {
+  std::lock_guard<std::mutex> guard(m_lock);
+  if (!FlushLocked()) {
+    errno = m_wb_error;
+    m_wb_error = 0;
+    return false;
+  }
+  return true;
+}
+
+bool FileBuffer::Dirty() {
+  std::lock_guard<std::mutex> guard(m_lock);
+  return m_wb_len != 0;
+}
+
+bool FileBuffer::Handles(uint64_t offset, size_t len, bool write) {
+  std::lock_guard<std::mutex> guard(m_lock);
+  if (write) {
+    return m_wb_len || m_wb_error || (m_wb_size && len && len < m_wb_size);
+  }
+  return m_wb_len || (m_ra_size && len < m_ra_size
+                      && (Sequential(offset) || InWindow(offset, len)));
+}
@@ -0,0 +1,92 @@
+#ifndef P9_FILEBUFFER_H_
+#define P9_FILEBUFFER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <chrono>
+#include <memory>
+#include <mutex>
+
+#define P9FS_READAHEAD_ENV "OOOWS_P9FS_READAHEAD"
+#define P9FS_DEFAULT_READAHEAD (128 * 1024)
+#define P9FS_WRITEBEHIND_ENV "OOOWS_P9FS_WRITEBEHIND"
+#define P9FS_DEFAULT_WRITEBEHIND (64 * 1024)
+#define P9FS_MAX_FILEBUF (4 * 1024 * 1024)
+// reads in a row, each starting where the last one ended, before the
+// window is filled
+#define P9FS_READAHEAD_SEQ 2
+// writes held back longer than this are flushed in the background
+#define P9FS_WRITEBEHIND_MS 20
+
+// Readahead and write-behind for one open file. Reads that keep going where
+// the last one ended are served from a window filled with one pread, and
+// the kernel is told to start on the window after it. Writes that carry on
+// from the ones before are held back and go out as one pwrite once the
+// buffer is full, something reads the file, the file is flushed or synced,
+// or they've been waiting for P9FS_WRITEBEHIND_MS.
+//
+// Only this file's reads see its held back writes. other opens of the same
+// file see them once they're flushed, and a window isn't refreshed for
+// writes through other opens until it's refilled.
+class FileBuffer {
+  public:
+  // sizes of 0 turn either half off. fd has to stay open until the buffer
+  // is gone
+  FileBuffer(int fd, size_t readahead, size_t writebehind);
+  // flushes what's held back
+  ~FileBuffer();
+
+  // like preadv/pwritev. a failed background flush is reported by the
+  // next write or Flush
+  ssize_t Read(uint64_t offset, const struct iovec *iov, int iovcnt);
+  ssize_t Write(uint64_t offset, const struct iovec *iov, int iovcnt);
+  // writes out what's held back, false if that or a background flush
+  // failed, with errno set
+  bool Flush();
+  bool Dirty();
+  // whether a read or write of len bytes at offset is handled here rather
+  // than going straight to the file. a write of 0 asks whether anything
+  // has to be flushed first
+  bool Handles(uint64_t offset, size_t len, bool write);
+
+  private:
+  friend class Flusher;
+
+  int m_fd;
+  std::mutex m_lock;
+
+  // [m_ra_offset, m_ra_offset + m_ra_len) of the file is in m_ra
+  size_t m_ra_size;
+  std::unique_ptr<uint8_t[]> m_ra;
+  uint64_t m_ra_offset = 0;
+  size_t m_ra_len = 0;
+  // where the last read ended and how many in a row started there
+  uint64_t m_next_read = 0;
+  unsigned m_seq = 0;
+
+  // m_wb_len bytes held back for m_wb_offset, since m_wb_since
+  size_t m_wb_size;
+  std::unique_ptr<uint8_t[]> m_wb;
+  uint64_t m_wb_offset = 0;
+  size_t m_wb_len = 0;
+  std::chrono::steady_clock::time_point m_wb_since;
+  // errno of a background flush that failed
+  int m_wb_error = 0;
+
+  // on the flusher's list while there's something held back
+  bool m_listed = false;
+  FileBuffer *m_prev = NULL;
+  FileBuffer *m_next = NULL;
+
+  bool Sequential(uint64_t offset);
+  bool InWindow(uint64_t offset, size_t len);
+  bool FlushLocked();
+};
+
+// buffer sizes from P9FS_READAHEAD_ENV and P9FS_WRITEBEHIND_ENV, clamped to
+// P9FS_MAX_FILEBUF
+size_t p9fs_readahead_size(void);
+size_t p9fs_writebehind_size(void);
+
+#endif
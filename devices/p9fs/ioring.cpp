@@ -0,0 +1,165 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "ioring.hpp"
+#include "trace.h"
+
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup 425
+#endif
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter 426
+#endif
+
+bool p9fs_uring_enabled(void) {
+  char *env = getenv(P9FS_URING_ENV);
+  return !env || strtoul(env, NULL, 0) != 0;
+}
+
+IoRing *IoRing::Create(unsigned entries) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+
+  int fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (fd < 0) {
+    TRACE_PRINT("io_uring_setup failed: %s", strerror(errno));
+    return NULL;
+  }
+
+  IoRing *ring = new IoRing();
+  ring->m_fd = fd;
+
+  ring->m_sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->m_cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  // newer kernels put both rings in one mapping
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->m_cq_ring_size > ring->m_sq_ring_size) {
+      ring->m_sq_ring_size = ring->m_cq_ring_size;
+    }
+    ring->m_cq_ring_size = 0;
+  }
+
+  ring->m_sq_ring = mmap(NULL, ring->m_sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (ring->m_sq_ring == MAP_FAILED) {
+    ring->m_sq_ring = NULL;
+    goto err;
+  }
+
+  if (ring->m_cq_ring_size) {
+    ring->m_cq_ring = mmap(NULL, ring->m_cq_ring_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (ring->m_cq_ring == MAP_FAILED) {
+      ring->m_cq_ring = NULL;
+      goto err;
+    }
+  }
+
+  ring->m_sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->m_sqes = (struct io_uring_sqe *)mmap(NULL, ring->m_sqes_size,
+                                             PROT_READ | PROT_WRITE,
+                                             MAP_SHARED | MAP_POPULATE,
+                                             fd, IORING_OFF_SQES);
+  if (ring->m_sqes == MAP_FAILED) {
+    ring->m_sqes = NULL;
+    goto err;
+  }
+
+  {
+    uint8_t *sq = (uint8_t *)ring->m_sq_ring;
+    uint8_t *cq = ring->m_cq_ring ? (uint8_t *)ring->m_cq_ring : sq;
+
+    ring->m_sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->m_sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->m_sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    ring->m_sq_entries = *(unsigned *)(sq + params.sq_off.ring_entries);
+    ring->m_sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->m_sqe_tail = *ring->m_sq_tail;
+
+    ring->m_cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->m_cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->m_cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    ring->m_cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+  }
+
+  return ring;
+ err:
+  perror("IoRing mmap");
+  delete ring;
+  return NULL;
+}
+
+IoRing::~IoRing() {
+  if (m_sqes) {
+    munmap(m_sqes, m_sqes_size);
+  }
+  if (m_cq_ring) {
+    munmap(m_cq_ring, m_cq_ring_size);
+  }
+  if (m_sq_ring) {
+    munmap(m_sq_ring, m_sq_ring_size);
+  }
+  if (m_fd >= 0) {
+    close(m_fd);
+  }
+}
+
+struct io_uring_sqe *IoRing::GetSqe() {
+  unsigned head = __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+  if (m_sqe_tail - head >= m_sq_entries) {
+    return NULL;
+  }
+
+  unsigned idx = m_sqe_tail & m_sq_mask;
+  struct io_uring_sqe *sqe = &m_sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  m_sq_array[idx] = idx;
+  m_sqe_tail++;
+  return sqe;
+}
+
+int IoRing::Submit(unsigned wait_nr) {
+  // publish the new SQEs, the kernel reads them once it sees the tail
+  __atomic_store_n(m_sq_tail, m_sqe_tail, __ATOMIC_RELEASE);
+
+  while (1) {
+    unsigned pending = m_sqe_tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+    unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+    if (!pending && !wait_nr) {
+      return 0;
+    }
+
+    int ret = syscall(__NR_io_uring_enter, m_fd, pending, wait_nr, flags, NULL, 0);
+    if (ret >= 0) {
+      // everything's submitted. if fewer than wait_nr completions are in,
+      // the caller reaps what's there and waits again
+      return ret;
+    }
+    if (errno == EINTR || errno == EAGAIN) {
+      continue;
+    }
+
+    // some of the batch may be in flight with buffers the guest owns, there's
+    // no failing the rest back safely
+    perror("io_uring_enter");
+    exit(-1);
+  }
+}
+
+bool IoRing::Reap(uint64_t *user_data, int32_t *res) {
+  unsigned head = *m_cq_head;
+  if (head == __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE)) {
+    return false;
+  }
+
+  struct io_uring_cqe *cqe = &m_cqes[head & m_cq_mask];
+  *user_data = cqe->user_data;
+  *res = cqe->res;
+  __atomic_store_n(m_cq_head, head + 1, __ATOMIC_RELEASE);
+  return true;
+}
@@ -0,0 +1,59 @@
+#ifndef P9_IORING_H_
+#define P9_IORING_H_
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define P9FS_URING_ENV "OOOWS_P9FS_URING"
+// per worker, also the most requests a worker batches into one submission
+#define P9FS_URING_ENTRIES 64
+
+// A minimal io_uring on the raw syscalls, there's no liburing in the build.
+// Not thread safe, every worker sets up its own. SQEs are queued with
+// GetSqe and all go to the kernel with the next Submit, which can also
+// wait for completions in the same io_uring_enter.
+class IoRing {
+  public:
+  // NULL if the kernel doesn't have io_uring or it's been turned off
+  static IoRing *Create(unsigned entries);
+  ~IoRing();
+
+  // a zeroed SQE to fill in, NULL if the submission queue is full
+  struct io_uring_sqe *GetSqe();
+  // hands everything queued to the kernel and waits until at least wait_nr
+  // completions are ready, or a signal cuts the wait short. a ring that
+  // stops taking submissions takes the device down
+  int Submit(unsigned wait_nr);
+  // the next completion, false if there's none ready
+  bool Reap(uint64_t *user_data, int32_t *res);
+
+  private:
+  IoRing() { }
+
+  int m_fd = -1;
+  void *m_sq_ring = NULL;
+  size_t m_sq_ring_size = 0;
+  void *m_cq_ring = NULL;
+  size_t m_cq_ring_size = 0;
+  struct io_uring_sqe *m_sqes = NULL;
+  size_t m_sqes_size = 0;
+
+  unsigned *m_sq_head;
+  unsigned *m_sq_tail;
+  unsigned m_sq_mask;
+  unsigned m_sq_entries;
+  unsigned *m_sq_array;
+  // SQEs handed out but not yet published to the kernel end here
+  unsigned m_sqe_tail = 0;
+
+  unsigned *m_cq_head;
+  unsigned *m_cq_tail;
+  unsigned m_cq_mask;
+  struct io_uring_cqe *m_cqes;
+};
+
+// whether P9FS_URING_ENV allows io_uring, on unless it's 0
+bool p9fs_uring_enabled(void);
+
+#endif
@@ -0,0 +1,66 @@
+#include <stdint.h>
+#include <mutex>
+#include <new>
+
+#include "msgpool.hpp"
+
+struct SizeClass {
+  std::mutex lock;
+  // free slots, each holding the next one
+  void *free = NULL;
+};
+
+static SizeClass classes[P9_POOL_CLASSES];
+
+// the smallest class that fits size, -1 for none
+static int ClassOf(size_t size) {
+  size_t slot = P9_POOL_MIN_SLOT;
+  int i;
+  for (i = 0; i < P9_POOL_CLASSES; i++, slot <<= 1) {
+    if (size <= slot) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+void *MsgPool::Alloc(size_t size) {
+  int c = ClassOf(size);
+  if (c < 0) {
+    return ::operator new(size);
+  }
+
+  SizeClass &sc = classes[c];
+  std::lock_guard<std::mutex> guard(sc.lock);
+  if (!sc.free) {
+    size_t slot = (size_t)P9_POOL_MIN_SLOT << c;
+    uint8_t *chunk = (uint8_t *)::operator new(slot * P9_POOL_CHUNK);
+    size_t i;
+    for (i = 0; i < P9_POOL_CHUNK; i++) {
+      void **s = (void **)(chunk + i * slot);
+      *s = sc.free;
+      sc.free = s;
+    }
+  }
+
+  void **s = (void **)sc.free;
+  sc.free = *s;
+  return s;
+}
+
+void MsgPool::Free(void *p, size_t size) {
+  if (!p) {
+    return;
+  }
+
+  int c = ClassOf(size);
+  if (c < 0) {
+    ::operator delete(p);
+    return;
+  }
+
+  SizeClass &sc = classes[c];
+  std::lock_guard<std::mutex> guard(sc.lock);
+  *(void **)p = sc.free;
+  sc.free = p;
+}
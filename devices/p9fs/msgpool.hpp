@@ -0,0 +1,32 @@
+#ifndef P9_MSGPOOL_H_
+#define P9_MSGPOOL_H_
+
+#include <stddef.h>
+
+// slots come in powers of two from P9_POOL_MIN_SLOT up, a class grows
+// P9_POOL_CHUNK slots at a time
+#define P9_POOL_MIN_SLOT 64
+#define P9_POOL_CLASSES 6
+#define P9_POOL_CHUNK 64
+
+// Free lists of fixed size slots for the objects every 9P message goes
+// through: requests, responses and the device buffers they hold on to. Like
+// VirtBufPool, but objects come in different sizes and the pool grows to
+// the most messages in flight at once. Chunks are never given back, so
+// past that point nothing on the message path touches the heap. Anything
+// bigger than the largest slot goes to operator new.
+class MsgPool {
+  public:
+  static void *Alloc(size_t size);
+  // size has to be what it was allocated with
+  static void Free(void *p, size_t size);
+};
+
+// classes deriving from this are allocated out of MsgPool
+class Pooled {
+  public:
+  static void *operator new(size_t size) { return MsgPool::Alloc(size); }
+  static void operator delete(void *p, size_t size) { MsgPool::Free(p, size); }
+};
+
+#endif
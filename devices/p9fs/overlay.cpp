@@ -0,0 +1,269 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <vector>
+
+#include "overlay.hpp"
+#include "trace.h"
+
+bool p9fs_overlay_name(const std::string &name) {
+  return !name.compare(0, strlen(P9FS_WHITEOUT), P9FS_WHITEOUT);
+}
+
+// Child doesn't clean up the name it's given, "x/../.." would get above the
+// root and "sub/.wh.x" past the check on the first component
+bool p9fs_overlay_entry(const std::string &name) {
+  return !name.empty() && name.find('/') == std::string::npos &&
+    !p9fs_overlay_name(name);
+}
+
+// rel's directory and name within it
+static void Split(const std::string &rel, std::string *dir, std::string *name) {
+  size_t slash = rel.rfind('/');
+  if (slash == std::string::npos) {
+    *dir = "";
+    *name = rel;
+  } else {
+    *dir = rel.substr(0, slash);
+    *name = rel.substr(slash + 1);
+  }
+}
+
+static bool Exists(const std::string &path) {
+  return !access(path.c_str(), F_OK);
+}
+
+// len bytes from src's offset to dst's, in the kernel. copy_file_range
+// doesn't cross filesystems on older kernels, sendfile does
+static bool CopyData(int src, int dst, off_t len) {
+  while (len > 0) {
+    ssize_t n = copy_file_range(src, NULL, dst, NULL, len, 0);
+    if (n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL
+                  || errno == EOPNOTSUPP)) {
+      n = sendfile(dst, src, NULL, len);
+    }
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      return false;
+    }
+    // the lower file shrank under us, what's there is all there is
+    if (n == 0) {
+      break;
+    }
+    len -= n;
+  }
+  return true;
+}
+
+Overlay::Overlay(const std::string &upper, const std::string &lower)
+  : m_upper(upper), m_lower(lower) { }
+
+std::string Overlay::UpperPath(const std::string &rel) {
+  if (rel.empty()) {
+    return m_upper;
+  }
+  return m_upper + "/" + rel;
+}
+
+bool Overlay::Lookup(const std::string &rel, OverlayEntry *entry) {
+  std::vector<std::string> parts;
+  size_t pos = 0;
+  while (pos <= rel.size()) {
+    size_t slash = rel.find('/', pos);
+    if (slash == std::string::npos) {
+      slash = rel.size();
+    }
+    std::string part = rel.substr(pos, slash - pos);
+    pos = slash + 1;
+
+    if (part.empty() || !part.compare(".")) {
+      continue;
+    }
+    if (!part.compare("..")) {
+      if (!parts.empty()) {
+        parts.pop_back();
+      }
+      continue;
+    }
+    parts.push_back(part);
+  }
+
+  OverlayEntry cur;
+  cur.real = m_upper;
+  cur.lower = m_lower;
+  if (stat(m_upper.c_str(), &cur.st) < 0) {
+    return false;
+  }
+  cur.opaque = Exists(m_upper + "/" P9FS_OPAQUE);
+
+  for (auto it = parts.begin(); it != parts.end(); it++) {
+    if (!S_ISDIR(cur.st.st_mode)) {
+      errno = ENOTDIR;
+      return false;
+    }
+    OverlayEntry next;
+    if (!Child(cur, *it, &next)) {
+      return false;
+    }
+    cur = next;
+  }
+
+  *entry = cur;
+  return true;
+}
+
+bool Overlay::Child(const OverlayEntry &parent, const std::string &name,
+                    OverlayEntry *child) {
+  child->rel = parent.rel.empty() ? name : parent.rel + "/" + name;
+  child->lower.clear();
+  child->opaque = false;
+
+  std::string upper = UpperPath(child->rel);
+  bool in_upper = !stat(upper.c_str(), &child->st);
+
+  struct stat lst;
+  if (!parent.opaque && !parent.lower.empty() && !WhitedOut(parent.rel, name)) {
+    std::string lower = parent.lower + "/" + name;
+    if (!stat(lower.c_str(), &lst)) {
+      child->lower = lower;
+    }
+  }
+
+  if (in_upper) {
+    child->real = upper;
+    // an upper directory over a lower one lists both unless it's been made
+    // opaque. over anything else there's nothing to merge
+    if (S_ISDIR(child->st.st_mode) && !child->lower.empty()) {
+      child->opaque = !S_ISDIR(lst.st_mode) || Exists(upper + "/" P9FS_OPAQUE);
+    }
+    return true;
+  }
+
+  if (child->lower.empty()) {
+    errno = ENOENT;
+    return false;
+  }
+  child->real = child->lower;
+  child->st = lst;
+  return true;
+}
+
+bool Overlay::CopyUpDir(const std::string &rel) {
+  std::string upper = UpperPath(rel);
+  struct stat st;
+  if (!stat(upper.c_str(), &st)) {
+    if (!S_ISDIR(st.st_mode)) {
+      errno = ENOTDIR;
+      return false;
+    }
+    return true;
+  }
+
+  std::string dir, name;
+  Split(rel, &dir, &name);
+  if (!CopyUpDir(dir)) {
+    return false;
+  }
+
+  mode_t mode = 0755;
+  if (!stat((m_lower + "/" + rel).c_str(), &st)) {
+    mode = st.st_mode & 07777;
+  }
+  TRACE_PRINT("Copying up directory %s", rel.c_str());
+  // someone else copying up the same directory is fine
+  if (mkdir(upper.c_str(), mode) && errno != EEXIST) {
+    return false;
+  }
+  return true;
+}
+
+bool Overlay::CopyUp(OverlayEntry *entry, bool data) {
+  std::string upper = UpperPath(entry->rel);
+  if (!entry->real.compare(upper)) {
+    return true;
+  }
+
+  std::string dir, name;
+  Split(entry->rel, &dir, &name);
+  if (!CopyUpDir(dir)) {
+    return false;
+  }
+
+  int src = open(entry->lower.c_str(), O_RDONLY);
+  if (src < 0) {
+    return false;
+  }
+
+  // built under a name guests never see and linked into place, so anyone
+  // copying up the same file at the same time finds either nothing or all
+  // of it. whoever links second uses the first one's copy
+  std::string tmpl = UpperPath(dir) + "/" P9FS_WHITEOUT P9FS_WHITEOUT "copyup.XXXXXX";
+  std::vector<char> tmp(tmpl.begin(), tmpl.end());
+  tmp.push_back('\0');
+  int dst = mkstemp(&tmp[0]);
+  if (dst < 0) {
+    close(src);
+    return false;
+  }
+
+  TRACE_PRINT("Copying up %s", entry->rel.c_str());
+  struct stat st;
+  bool ok = !fstat(src, &st) && !fchmod(dst, st.st_mode & 07777)
+    && (!data || CopyData(src, dst, st.st_size));
+  if (ok && data) {
+    struct timespec times[2] = { st.st_atim, st.st_mtim };
+    futimens(dst, times);
+  }
+  close(src);
+  close(dst);
+
+  if (ok && link(&tmp[0], upper.c_str()) && errno != EEXIST) {
+    ok = false;
+  }
+  int err = errno;
+  unlink(&tmp[0]);
+  if (!ok || stat(upper.c_str(), &entry->st) < 0) {
+    errno = ok ? errno : err;
+    return false;
+  }
+
+  entry->real = upper;
+  return true;
+}
+
+bool Overlay::WhitedOut(const std::string &rel, const std::string &name) {
+  return Exists(UpperPath(rel) + "/" P9FS_WHITEOUT + name);
+}
+
+bool Overlay::Unwhiteout(const std::string &rel, const std::string &name) {
+  std::string path = UpperPath(rel) + "/" P9FS_WHITEOUT + name;
+  return !unlink(path.c_str()) || errno == ENOENT;
+}
+
+// an empty file at path
+static bool Mark(const std::string &path) {
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT, 0600);
+  if (fd < 0) {
+    return false;
+  }
+  close(fd);
+  return true;
+}
+
+bool Overlay::Whiteout(const OverlayEntry &entry) {
+  std::string dir, name;
+  Split(entry.rel, &dir, &name);
+  if (!CopyUpDir(dir)) {
+    return false;
+  }
+  TRACE_PRINT("Whiting out %s", entry.rel.c_str());
+  return Mark(UpperPath(dir) + "/" P9FS_WHITEOUT + name);
+}
+
+bool Overlay::MakeOpaque(const std::string &rel) {
+  return Mark(UpperPath(rel) + "/" P9FS_OPAQUE);
+}
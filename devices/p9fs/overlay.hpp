@@ -0,0 +1,78 @@
+#ifndef P9_OVERLAY_H_
+#define P9_OVERLAY_H_
+
+#include <sys/stat.h>
+#include <string>
+
+#define P9FS_LOWER_ENV "OOOWS_P9FS_LOWER_DIR"
+// a .wh.<name> file in an upper directory hides <name> in the lower one, and
+// one named P9FS_OPAQUE hides all of the lower directory. guests can't see,
+// walk to or create either
+#define P9FS_WHITEOUT ".wh."
+#define P9FS_OPAQUE ".wh..wh..opq"
+
+// what a path in the share resolved to
+struct OverlayEntry {
+  // relative to the share, "" for the root
+  std::string rel;
+  // the upper copy if there is one, otherwise the lower one
+  std::string real;
+  // the lower copy, if one shows through or would once the upper one is gone
+  std::string lower;
+  // nothing in the lower tree shows through under this directory
+  bool opaque = false;
+  struct stat st;
+};
+
+// A read only lower tree shared between VMs under each VM's own upper tree.
+// Paths resolve to the upper copy when there is one and to the lower one
+// otherwise, and directories in both list as one. Files are copied up the
+// first time they're opened for writing, along with the directories above
+// them, and removing something that's in the lower tree leaves a whiteout
+// behind in the upper one.
+//
+// Only the upper tree is ever written, so every VM reading the same lower
+// file shares its page cache. A copy up doesn't move opens of the lower
+// file that are already there, they keep reading the original.
+class Overlay {
+  public:
+  // both have to be directories that exist
+  Overlay(const std::string &upper, const std::string &lower);
+
+  const std::string &Upper() { return m_upper; }
+  // what rel resolves to, "." and ".." taken lexically and never above the
+  // root. false with errno set if there's nothing there
+  bool Lookup(const std::string &rel, OverlayEntry *entry);
+  // name in the directory parent resolved to
+  bool Child(const OverlayEntry &parent, const std::string &name,
+             OverlayEntry *child);
+  // where rel is or would be in the upper tree
+  std::string UpperPath(const std::string &rel);
+
+  // makes sure the directory rel and the ones above it are in the upper
+  // tree, with the modes of their lower copies
+  bool CopyUpDir(const std::string &rel);
+  // copies entry's file up unless it's there already and points entry at
+  // the copy. data is false when the contents are about to be truncated
+  bool CopyUp(OverlayEntry *entry, bool data);
+  // hides entry's lower copy, its upper one has to be gone already
+  bool Whiteout(const OverlayEntry &entry);
+  // whether name in the directory rel has a whiteout, and dropping it
+  bool WhitedOut(const std::string &rel, const std::string &name);
+  bool Unwhiteout(const std::string &rel, const std::string &name);
+  // hides everything in the lower copy of the new upper directory rel, for
+  // one made where a whiteout was
+  bool MakeOpaque(const std::string &rel);
+
+  private:
+  std::string m_upper;
+  std::string m_lower;
+};
+
+// whether name is one of the overlay's own
+bool p9fs_overlay_name(const std::string &name);
+// whether a guest may walk to or create name in a directory: a single
+// entry, so not empty and no slashes, and not one of the overlay's own
+bool p9fs_overlay_entry(const std::string &name);
+
+#endif
@@ -5,57 +5,132 @@
 
 P9Core::P9Core(bool auth_required,
                std::string sharename,
-               std::string mountpoint)
+               std::string mountpoint,
+               std::string lower)
   : m_authed(false),
     m_auth_required(auth_required),
     m_sharename(sharename),
-    m_mountpoint(mountpoint) { }
+    m_mountpoint(mountpoint),
+    m_dcache(mountpoint, lower.empty() ? p9fs_dcache_size() : 0),
+    m_requests(P9_NTAGS, NULL) {
+  if (!lower.empty()) {
+    m_overlay.reset(new Overlay(mountpoint, lower));
+  }
+}
 
 bool P9Core::Serving(std::string& point) {
   return !m_sharename.compare(point);
 }
 
 bool P9Core::BindFid(uint32_t fid, QidObject *qobj) {
-  if (m_fid_map.count(fid)) {
+  FidShard &shard = Shard(fid);
+  std::lock_guard<std::mutex> guard(shard.lock);
+  if (shard.fids.count(fid)) {
     return false;
   }
   qobj->IncRef();
-  m_fid_map[fid] = qobj;
+  shard.fids[fid] = qobj;
   return true;
 }
 
 void P9Core::RemoveFid(uint32_t fid) {
-  QidObject *qobj = m_fid_map[fid];
+  QidObject *qobj;
+  {
+    FidShard &shard = Shard(fid);
+    std::lock_guard<std::mutex> guard(shard.lock);
+    qobj = shard.fids[fid];
+    shard.fids.erase(fid);
+  }
 
-  m_fid_map.erase(fid);
   qobj->DecRef();
   TRACE_PRINT("Erased %d from map", fid);
 }
 
 QidObject * P9Core::GetFid(uint32_t fid) {
-  if (m_fid_map.count(fid)) {
-    return m_fid_map[fid];
+  FidShard &shard = Shard(fid);
+  std::lock_guard<std::mutex> guard(shard.lock);
+  auto it = shard.fids.find(fid);
+  if (it != shard.fids.end()) {
+    return it->second;
   }
   return NULL;
 }
 
 QidObject * P9Core::Attach(std::string& point) {
   // ignore point for now, could map to a list of mountpoints
-  return new QidObject(m_mountpoint, m_mountpoint);
+  if (m_overlay) {
+    OverlayEntry root;
+    if (!m_overlay->Lookup("", &root)) {
+      throw std::exception();
+    }
+    return new QidObject(m_overlay.get(), root);
+  }
+  return new QidObject(m_mountpoint, m_mountpoint, &m_dcache);
 }
 
-bool P9Core::HasRequest(uint32_t tag) {
-  return !!m_request_map.count(tag);
+void P9Core::RegisterRequest(TRequest *trequest) {
+  trequest->SetQueuedAt(P9Stats::Now());
+  bool replaced;
+  {
+    std::lock_guard<std::mutex> guard(m_request_lock);
+    TRequest *&slot = m_requests[trequest->Tag()];
+    // a reused tag supersedes whatever still had it, a TFLUSH waiting on
+    // that one is done
+    replaced = slot != NULL;
+    if (slot) {
+      slot->Cancel();
+    }
+    slot = trequest;
+  }
+  if (replaced) {
+    m_request_done.notify_all();
+  }
 }
 
-void P9Core::CancelRequest(uint32_t tag) {
-  m_request_map[tag]->Cancel();
+bool P9Core::StartRequest(TRequest *trequest) {
+  std::lock_guard<std::mutex> guard(m_request_lock);
+  if (trequest->Cancelled()) {
+    return false;
+  }
+  trequest->Start();
+  trequest->SetStartedAt(P9Stats::Now());
+  return true;
 }
 
-void P9Core::RegisterRequest(TRequest *trequest) {
-  m_request_map[trequest->Tag()] = trequest;
+void P9Core::FinishRequest(TRequest *trequest) {
+  m_stats.Record(trequest->Type(), trequest->Errored(), trequest->MessageSize(),
+                 trequest->ReplySize(), trequest->StartedAt() - trequest->QueuedAt(),
+                 P9Stats::Now() - trequest->StartedAt());
+  {
+    std::lock_guard<std::mutex> guard(m_request_lock);
+    TRequest *&slot = m_requests[trequest->Tag()];
+    if (slot == trequest) {
+      slot = NULL;
+    }
+  }
+  m_request_done.notify_all();
 }
 
-void P9Core::UnregisterRequest(TRequest *trequest) {
-  m_request_map.erase(trequest->Tag());
+void P9Core::FlushRequest(TRequest *flush, uint16_t oldtag) {
+  std::unique_lock<std::mutex> lock(m_request_lock);
+  TRequest *old = m_requests[oldtag];
+  if (!old) {
+    return;
+  }
+
+  // a TFLUSH naming itself, or another TFLUSH that may be waiting on this
+  // one, would never see it finish
+  if (old == flush || old->Type() == P9_TFLUSH) {
+    return;
+  }
+
+  if (!old->Started()) {
+    // the worker that picks it up drops it without a response
+    old->Cancel();
+    m_stats.Flushed(old->Type());
+    m_requests[oldtag] = NULL;
+    return;
+  }
+
+  m_request_done.wait(lock, [&]{ return m_requests[oldtag] != old; });
 }
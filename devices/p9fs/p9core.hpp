@@ -2,23 +2,84 @@
 #define P9CORE_H_
 
 #include "qidobject.hpp"
+#include "dentrycache.hpp"
+#include "overlay.hpp"
+#include "stats.hpp"
+#include <atomic>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+#include <vector>
 
 class TRequest;
 
+// the fid table is split by fid so requests on different fids running on
+// different workers don't contend on one lock
+#define P9_FID_SHARDS 16
+
+// Twrite's header, size[4] type[1] tag[2] fid[4] offset[8] count[4]. reads
+// and writes move at most msize minus this
+#define P9_IOHDRSZ 23
+// largest msize TVERSION will agree to, requests that big come in as
+// descriptor chains
+#define P9_MAX_MSIZE (512 * 1024)
+// until TVERSION negotiates one, reads and writes are 4KiB
+#define P9_DEFAULT_MSIZE (0x1000 + P9_IOHDRSZ)
+
+// tags are 16 bits
+#define P9_NTAGS (1 << 16)
+
+// the classic dialect keeps the version string it always had
+#define P9_VERSION_2000 "P92021"
+#define P9_VERSION_2000L "9P2000.L"
+
+enum {
+  P9_DIALECT_2000,
+  P9_DIALECT_2000L,
+};
+
+struct FidShard {
+  std::mutex lock;
+  std::unordered_map<uint32_t, QidObject *> fids;
+};
+
 class P9Core {
   private:
   bool m_authed;
   bool m_auth_required;
   std::string m_sharename;
   std::string m_mountpoint;
-  std::map<uint32_t, QidObject *> m_fid_map;
-  std::map<uint32_t, TRequest *> m_request_map;
+  std::atomic<uint32_t> m_msize{P9_DEFAULT_MSIZE};
+  std::atomic<int> m_dialect{P9_DIALECT_2000};
+  // resolved paths and attributes under m_mountpoint
+  DentryCache m_dcache;
+  // m_mountpoint over a shared lower tree, NULL if there isn't one.
+  // overlays aren't cached
+  std::unique_ptr<Overlay> m_overlay;
+  FidShard m_fid_shards[P9_FID_SHARDS];
+  // in flight requests by tag, from the time they're queued until their
+  // response has been handed off, NULL for a free tag. one slot for every
+  // tag so tracking a request never allocates. protected by m_request_lock
+  std::vector<TRequest *> m_requests;
+  std::mutex m_request_lock;
+  std::condition_variable m_request_done;
+  // per message type counts and latencies, from registration to finish
+  P9Stats m_stats;
+
+  FidShard &Shard(uint32_t fid) { return m_fid_shards[fid % P9_FID_SHARDS]; }
 
   public:
   bool Authenticated() { return m_authed; }
   bool MustAuth() { return m_auth_required; }
   int Auth(char *uname);
+  uint32_t MSize() { return m_msize; }
+  void SetMSize(uint32_t msize) { m_msize = msize; }
+  // most a single read or write moves
+  uint32_t IOUnit() { return m_msize - P9_IOHDRSZ; }
+  int Dialect() { return m_dialect; }
+  void SetDialect(int dialect) { m_dialect = dialect; }
 
   bool BindFid(uint32_t fid, QidObject *obj);
   void RemoveFid(uint32_t fid);
@@ -26,11 +87,20 @@ class P9Core {
   QidObject *Attach(std::string& point);
   bool Serving(std::string& point);
 
-  bool HasRequest(uint32_t tag);
-  void CancelRequest(uint32_t tag);
+  // a request is registered when it's queued, started when a worker picks
+  // it up and finished once its response is on its way. a flushed request
+  // that hasn't started is dropped, StartRequest returns false for it
   void RegisterRequest(TRequest *trequest);
-  void UnregisterRequest(TRequest *trequest);
+  bool StartRequest(TRequest *trequest);
+  void FinishRequest(TRequest *trequest);
+  // TFLUSH: cancels oldtag if it hasn't started yet, otherwise waits for
+  // its response to be handed off so Rflush goes out after it. flushing
+  // itself or another TFLUSH returns straight away
+  void FlushRequest(TRequest *flush, uint16_t oldtag);
+  P9Stats &Stats() { return m_stats; }
 
-  P9Core(bool m_auth_required, std::string sharename, std::string m_mountpoint);
+  // an empty lower serves m_mountpoint on its own
+  P9Core(bool m_auth_required, std::string sharename, std::string m_mountpoint,
+         std::string lower = "");
 };
 #endif
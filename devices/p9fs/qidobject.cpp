@@ -5,35 +5,154 @@
 #include <limits.h>
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <algorithm>
+#include <vector>
 #include "trace.h"
 
+// what getdents64 fills in, glibc only has a wrapper from 2.30
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  uint16_t d_reclen;
+  uint8_t d_type;
+  char d_name[];
+};
+
+#define DIRENT_BUF_SIZE 0x2000
+// Treaddir offsets with this set are into an overlay's lower directory,
+// getdents offsets never have it
+#define P9_DIROFF_LOWER (1ULL << 63)
+
 QidObject::~QidObject() {
   TRACE_PRINT("Destroying %lx", m_path);
 }
 
-QidObject::QidObject(std::string path, std::string root)
-  : m_fspath(path), m_version(0), m_root(root) {
-  struct stat st;
-  const char *cpath = m_fspath.c_str();
+// the inode, with the low bits of the device on top so a share spanning
+// mounts doesn't hand out the same path twice. it survives renames, unlike
+// a hash of the path
+static uint64_t QidPath(dev_t dev, ino_t ino) {
+  return ((uint64_t)ino & ((1ULL << 48) - 1))
+    | ((uint64_t)(dev & 0xffff) << 48);
+}
+
+// changes whenever the contents (mtime) or the inode (ctime) do, so a
+// guest can tell its cached copy is stale
+static uint32_t QidVersion(const struct stat *st) {
+  uint64_t mtime = st->st_mtim.tv_sec * 1000000000ULL + st->st_mtim.tv_nsec;
+  uint64_t ctime = st->st_ctim.tv_sec * 1000000000ULL + st->st_ctim.tv_nsec;
+  uint64_t v = mtime ^ (ctime << 1 | ctime >> 63);
+  return v ^ (v >> 32);
+}
+
+// work out the qid attr->st gets
+static void FillQid(DentryAttr *attr) {
+  TRACE_PRINT("Mode %d\n", attr->st.st_mode);
+  attr->qid_type = P9_QTFILE;
+  if (S_ISDIR(attr->st.st_mode)) {
+    attr->qid_type = P9_QTDIR;
+  } else if (S_ISLNK(attr->st.st_mode)) {
+    attr->qid_type = P9_QTSYMLINK;
+  }
+
+  attr->qid_version = QidVersion(&attr->st);
+  attr->qid_path = QidPath(attr->st.st_dev, attr->st.st_ino);
+}
+
+// stat path and work out the qid it gets
+static bool LoadAttr(const std::string &path, DentryAttr *attr) {
+  TRACE_PRINT("Trying to stat %s\n", path.c_str());
+  if (stat(path.c_str(), &attr->st) < 0) {
+    return false;
+  }
+
+  FillQid(attr);
+  return true;
+}
 
-  TRACE_PRINT("Trying to stat %s\n", cpath);
-  if (stat(cpath, &st) < 0) {
+static void FillStat(const DentryAttr &attr, p9_stat_t *p9st) {
+  memset(p9st, 0, sizeof(*p9st));
+  p9st->size = sizeof(p9_stat_t);
+  p9st->dev = attr.st.st_dev;
+  p9st->qid.type = attr.qid_type;
+  p9st->qid.version = attr.qid_version;
+  p9st->qid.path = attr.qid_path;
+  p9st->mode = attr.st.st_mode & 0777;
+  if (attr.qid_type == P9_QTDIR) {
+    p9st->mode |= DMDIR;
+  }
+  p9st->atime = attr.st.st_atime;
+  p9st->mtime = attr.st.st_mtime;
+  p9st->length = attr.st.st_size;
+}
+
+QidObject::QidObject(std::string path, std::string root, DentryCache *cache)
+  : m_fspath(path), m_root(root), m_cache(cache) {
+  DentryAttr attr;
+  if (!Attr(m_fspath, &attr)) {
     throw std::exception();
   }
+  m_type = attr.qid_type;
+  m_version = attr.qid_version;
+  m_path = attr.qid_path;
+}
+
+QidObject::QidObject(std::string path, std::string root, DentryCache *cache,
+                     const DentryAttr &attr)
+  : m_type(attr.qid_type), m_version(attr.qid_version), m_path(attr.qid_path),
+    m_fspath(path), m_root(root), m_cache(cache) { }
+
+QidObject::QidObject(Overlay *overlay, const OverlayEntry &entry)
+  : m_root(overlay->Upper()), m_overlay(overlay), m_cache(NULL) {
+  SetEntry(entry);
+}
+
+void QidObject::SetEntry(const OverlayEntry &entry) {
+  DentryAttr attr;
+  attr.st = entry.st;
+  FillQid(&attr);
+  m_type = attr.qid_type;
+  m_version = attr.qid_version;
+  m_path = attr.qid_path;
+
+  m_fspath = entry.real;
+  m_rel = entry.rel;
+  m_lower = entry.lower;
+  m_opaque = entry.opaque;
+}
+
+bool QidObject::Attr(const std::string &path, DentryAttr *attr) {
+  if (!m_cache) {
+    return LoadAttr(path, attr);
+  }
+
+  if (m_cache->Lookup(path, attr)) {
+    return true;
+  }
 
-  TRACE_PRINT("Mode %d\n", st.st_mode);
-  if (S_ISREG(st.st_mode)) {
-    m_type = P9_QTFILE;
-  } else if (S_ISDIR(st.st_mode)) {
-    m_type = P9_QTDIR;
-  } else if (S_ISLNK(st.st_mode)) {
-    m_type = P9_QTSYMLINK;
+  uint64_t gen = m_cache->Generation();
+  if (!LoadAttr(path, attr)) {
+    return false;
+  }
+  m_cache->Insert(path, *attr, gen);
+  return true;
+}
+
+bool QidObject::CurrentAttr(DentryAttr *attr) {
+  if (!m_overlay || m_fspath.compare(m_lower)) {
+    return Attr(m_fspath, attr);
   }
 
-  int c;
-  m_path = 5381;
-  while (c = *cpath++) { m_path = ((m_path << 5) + m_path) + c; }
+  OverlayEntry entry;
+  if (!m_overlay->Lookup(m_rel, &entry)) {
+    return false;
+  }
+  attr->st = entry.st;
+  FillQid(attr);
+  return true;
 }
 
 void QidObject::Qid(qid_t *q) {
@@ -42,7 +161,7 @@ void QidObject::Qid(qid_t *q) {
   q->path = m_path;
 }
 
-bool QidObject::Open(uint8_t mode) {
+bool QidObject::Open(uint8_t mode, int extra) {
   int flags = -1;
 
   if (m_opened) {
@@ -50,9 +169,38 @@ bool QidObject::Open(uint8_t mode) {
     return false;
   }
 
+  // another fid may have copied it up since, and writing copies it up here
+  if (m_overlay) {
+    OverlayEntry entry;
+    if (!m_overlay->Lookup(m_rel, &entry)) {
+      return false;
+    }
+    bool writing = mode == P9_OWRITE || mode == P9_ORDWR || (extra & O_TRUNC);
+    if (!S_ISDIR(entry.st.st_mode) && writing
+        && !m_overlay->CopyUp(&entry, !(extra & O_TRUNC))) {
+      return false;
+    }
+    SetEntry(entry);
+  }
+
+  // directories are only ever read, whatever the mode
   if(m_type == P9_QTDIR) {
+    m_fd = open(m_fspath.c_str(), O_RDONLY | O_DIRECTORY);
+    if (m_fd < 0) {
+      return false;
+    }
+    // an upper directory lists what shows through from the lower one too
+    if (m_overlay && !m_opaque && !m_lower.empty() && m_fspath.compare(m_lower)) {
+      m_lower_fd = open(m_lower.c_str(), O_RDONLY | O_DIRECTORY);
+      if (m_lower_fd < 0) {
+        close(m_fd);
+        return false;
+      }
+    }
     m_opened = true;
     m_mode = mode;
+    m_dir_offset = 0;
+    m_dir_lower = false;
     return true;
   }
 
@@ -71,11 +219,23 @@ bool QidObject::Open(uint8_t mode) {
   if (flags < 0) {
     return false;
   }
+  flags |= extra & (O_TRUNC | O_APPEND);
 
   m_fd = open(m_fspath.c_str(), flags);
   if (m_fd < 0) {
     return false;
   }
+  if ((flags & O_TRUNC) && m_cache) {
+    m_cache->InvalidateAttr(m_fspath);
+  }
+
+  // appends land wherever the end is by then, don't hold them back
+  size_t readahead = (flags & O_ACCMODE) != O_WRONLY ? p9fs_readahead_size() : 0;
+  size_t writebehind = (flags & O_ACCMODE) != O_RDONLY && !(flags & O_APPEND)
+    ? p9fs_writebehind_size() : 0;
+  if (readahead || writebehind) {
+    m_buf.reset(new FileBuffer(m_fd, readahead, writebehind));
+  }
 
   m_opened = true;
   m_mode = mode;
@@ -84,109 +244,652 @@ bool QidObject::Open(uint8_t mode) {
   return true;
 }
 
-std::unique_ptr<uint8_t[]> QidObject::Read(uint64_t offset, uint32_t& count) {
+ssize_t QidObject::Read(uint64_t offset, const struct iovec *iov, int iovcnt) {
   if (!m_opened) {
-    return NULL;
+    return -1;
   }
 
-  if (lseek(m_fd, offset, SEEK_SET) < 0) {
-    TRACE_PRINT("Failed to seek to offset %lx", offset);
-    return NULL;
+  ssize_t ret;
+  if (m_buf) {
+    ret = m_buf->Read(offset, iov, iovcnt);
+  } else {
+    ret = preadv(m_fd, iov, iovcnt, offset);
   }
+  if (ret < 0) {
+    TRACE_PRINT("Failed to read at offset %lx", offset);
+  }
+  return ret;
+}
 
-  uint8_t *raw = new uint8_t[count];
-
-  ssize_t new_count = read(m_fd, raw, count);
-  if (new_count < 0) {
-    delete[] raw;
+// queues op on m_fd, the rest of the SQE is up to the caller
+static struct io_uring_sqe *QueueOp(IoRing *ring, uint8_t op, int fd, void *data) {
+  struct io_uring_sqe *sqe = ring->GetSqe();
+  if (!sqe) {
     return NULL;
   }
+  sqe->opcode = op;
+  sqe->fd = fd;
+  sqe->user_data = (uint64_t)data;
+  return sqe;
+}
 
-  std::unique_ptr<uint8_t[]> data = std::make_unique<uint8_t[]>(new_count);
-  memcpy(data.get(), raw, new_count);
-  delete[] raw;
+bool QidObject::SubmitRead(IoRing *ring, uint64_t offset, const struct iovec *iov,
+                           int iovcnt, void *data) {
+  if (!m_opened) {
+    return false;
+  }
+
+  struct io_uring_sqe *sqe = QueueOp(ring, IORING_OP_READV, m_fd, data);
+  if (!sqe) {
+    return false;
+  }
+  sqe->addr = (uint64_t)iov;
+  sqe->len = iovcnt;
+  sqe->off = offset;
+  return true;
+}
 
-  count = new_count;
+bool QidObject::SubmitWrite(IoRing *ring, uint64_t offset, const struct iovec *iov,
+                            int iovcnt, void *data) {
+  if (!m_opened) {
+    return false;
+  }
 
-  return data;
+  struct io_uring_sqe *sqe = QueueOp(ring, IORING_OP_WRITEV, m_fd, data);
+  if (!sqe) {
+    return false;
+  }
+  sqe->addr = (uint64_t)iov;
+  sqe->len = iovcnt;
+  sqe->off = offset;
+  return true;
 }
 
-uint32_t QidObject::Write(uint64_t offset,
-                          std::unique_ptr<uint8_t[]> data,
-                          uint32_t count) {
+bool QidObject::SubmitSync(IoRing *ring, bool datasync, void *data) {
   if (!m_opened) {
     return false;
   }
 
-  if (lseek(m_fd, offset, SEEK_SET)) {
-    TRACE_PRINT("Failed to seek to offset %lx\n", offset);
+  struct io_uring_sqe *sqe = QueueOp(ring, IORING_OP_FSYNC, m_fd, data);
+  if (!sqe) {
+    return false;
   }
+  sqe->fsync_flags = datasync ? IORING_FSYNC_DATASYNC : 0;
+  return true;
+}
 
-  ssize_t ret = write(m_fd, data.get(), count);
+bool QidObject::Buffered(uint64_t offset, size_t len, bool write) {
+  return m_buf && m_buf->Handles(offset, len, write);
+}
+
+void QidObject::Settle() {
+  if (m_buf && m_buf->Dirty()) {
+    m_buf->Flush();
+    Written();
+  }
+}
+
+void QidObject::Written() {
+  if (m_cache) {
+    m_cache->InvalidateAttr(m_fspath);
+  }
+}
+
+ssize_t QidObject::Write(uint64_t offset, const struct iovec *iov, int iovcnt) {
+  if (!m_opened) {
+    return -1;
+  }
+
+  ssize_t ret;
+  if (m_buf) {
+    ret = m_buf->Write(offset, iov, iovcnt);
+  } else {
+    ret = pwritev(m_fd, iov, iovcnt, offset);
+  }
   if (ret < 0) {
-    return 0;
+    TRACE_PRINT("Failed to write at offset %lx", offset);
+  } else {
+    Written();
   }
   return ret;
 }
 
-std::unique_ptr<p9_stat_t> QidObject::Stat() {
+// the attributes of name in the directory open at dirfd, from the cache or
+// fstatat. only plain entries are cached, a symlink's path isn't real
+static bool EntryAttr(int dirfd, DentryCache *cache, uint64_t gen,
+                      const std::string &path, struct linux_dirent64 *d,
+                      DentryAttr *attr) {
+  bool link = d->d_type == DT_LNK;
+  if (cache && !link && cache->Lookup(path, attr)) {
+    return true;
+  }
+
+  if (d->d_type == DT_UNKNOWN) {
+    if (fstatat(dirfd, d->d_name, &attr->st, AT_SYMLINK_NOFOLLOW) < 0) {
+      return false;
+    }
+    link = S_ISLNK(attr->st.st_mode);
+  }
+
+  // like stat, report what a link points at. a dangling one as itself
+  if (fstatat(dirfd, d->d_name, &attr->st, 0) < 0
+      && fstatat(dirfd, d->d_name, &attr->st, AT_SYMLINK_NOFOLLOW) < 0) {
+    return false;
+  }
+  FillQid(attr);
+
+  if (cache && !link) {
+    cache->Insert(path, *attr, gen);
+  }
+  return true;
+}
+
+bool QidObject::Hidden(const char *name, bool lower) {
+  if (!m_overlay) {
+    return false;
+  }
+  if (!lower) {
+    return p9fs_overlay_name(name);
+  }
+
+  // listed from the upper directory already, or removed
+  std::string whiteout(P9FS_WHITEOUT);
+  whiteout.append(name);
   struct stat st;
+  return !strcmp(name, ".") || !strcmp(name, "..")
+    || !fstatat(m_fd, name, &st, AT_SYMLINK_NOFOLLOW)
+    || !faccessat(m_fd, whiteout.c_str(), F_OK, 0);
+}
 
-  if (stat(m_fspath.c_str(), &st) < 0) {
-    return NULL;
+ssize_t QidObject::ReadDir(uint64_t offset, const struct iovec *iov, int iovcnt) {
+  if (!m_opened || m_type != P9_QTDIR) {
+    return -1;
   }
 
-  std::unique_ptr<p9_stat_t> p9st = std::make_unique<p9_stat_t>();
+  size_t count = 0;
+  int i;
+  for (i = 0; i < iovcnt; i++) {
+    count += iov[i].iov_len;
+  }
 
-  p9st->size = sizeof(p9_stat_t);
-  Qid(&p9st->qid);
-  p9st->length = st.st_size;
+  std::lock_guard<std::mutex> guard(m_dir_lock);
+  if (offset == 0) {
+    if (lseek(m_fd, 0, SEEK_SET) < 0) {
+      return -1;
+    }
+    m_dir_offset = 0;
+    m_dir_lower = false;
+  } else if (offset != m_dir_offset) {
+    TRACE_PRINT("Directory read at %lx, expected %lx", offset, m_dir_offset);
+    return -1;
+  }
+
+  uint64_t gen = m_cache ? m_cache->Generation() : 0;
+  char buf[DIRENT_BUF_SIZE] __attribute__((aligned(8)));
+  std::vector<uint8_t> out;
+  // the upper directory of an overlay is read first, then the lower one
+  int fd = m_dir_lower ? m_lower_fd : m_fd;
+  // where the entry after the last one that made it in starts
+  off_t resume = lseek(fd, 0, SEEK_CUR);
+  bool full = false;
+
+  while (!full) {
+    long n = syscall(SYS_getdents64, fd, buf, sizeof(buf));
+    if (n < 0) {
+      return -1;
+    }
+    if (n == 0) {
+      if (m_dir_lower || m_lower_fd < 0) {
+        break;
+      }
+      fd = m_lower_fd;
+      if (lseek(fd, 0, SEEK_SET) < 0) {
+        return -1;
+      }
+      resume = 0;
+      m_dir_lower = true;
+      continue;
+    }
+
+    long pos;
+    for (pos = 0; pos < n; ) {
+      struct linux_dirent64 *d = (struct linux_dirent64 *)(buf + pos);
+      pos += d->d_reclen;
+
+      std::string name(d->d_name);
+      DentryAttr attr;
+      // gone since getdents saw it, or nothing a walk could reach
+      if (!name.compare(".") || !name.compare("..") || Hidden(d->d_name, m_dir_lower)
+          || !EntryAttr(fd, m_cache, gen, m_fspath + "/" + name, d, &attr)) {
+        resume = d->d_off;
+        continue;
+      }
+
+      uint16_t namelen = name.length();
+      size_t reclen = sizeof(p9_stat_t) + sizeof(namelen) + namelen;
+      if (out.size() + reclen > count) {
+        full = true;
+        break;
+      }
+
+      p9_stat_t p9st;
+      FillStat(attr, &p9st);
+      p9st.size = reclen;
+
+      size_t at = out.size();
+      out.resize(at + reclen);
+      memcpy(&out[at], &p9st, sizeof(p9st));
+      memcpy(&out[at + sizeof(p9st)], &namelen, sizeof(namelen));
+      memcpy(&out[at + sizeof(p9st) + sizeof(namelen)], name.c_str(), namelen);
+      resume = d->d_off;
+    }
+  }
+
+  // the rest of this batch goes out with the next read
+  if (full) {
+    if (out.empty()) {
+      TRACE_PRINT("Directory read of %lx bytes can't fit an entry", count);
+      return -1;
+    }
+    if (lseek(fd, resume, SEEK_SET) < 0) {
+      return -1;
+    }
+  }
+
+  size_t copied = 0;
+  for (i = 0; i < iovcnt && copied < out.size(); i++) {
+    size_t chunk = std::min(iov[i].iov_len, out.size() - copied);
+    memcpy(iov[i].iov_base, &out[copied], chunk);
+    copied += chunk;
+  }
+
+  m_dir_offset += out.size();
+  return out.size();
+}
+
+ssize_t QidObject::ReadDirL(uint64_t offset, const struct iovec *iov, int iovcnt) {
+  if (!m_opened || m_type != P9_QTDIR) {
+    return -1;
+  }
+
+  size_t count = 0;
+  int i;
+  for (i = 0; i < iovcnt; i++) {
+    count += iov[i].iov_len;
+  }
+
+  // every read seeks to its own offset, there's no stream to keep track of
+  std::lock_guard<std::mutex> guard(m_dir_lock);
+  bool lower = offset & P9_DIROFF_LOWER;
+  int fd = lower ? m_lower_fd : m_fd;
+  struct stat dirst;
+  if (fd < 0 || fstat(fd, &dirst) < 0
+      || lseek(fd, offset & ~P9_DIROFF_LOWER, SEEK_SET) < 0) {
+    return -1;
+  }
+
+  char buf[DIRENT_BUF_SIZE] __attribute__((aligned(8)));
+  std::vector<uint8_t> out;
+  bool full = false;
+
+  while (!full) {
+    long n = syscall(SYS_getdents64, fd, buf, sizeof(buf));
+    if (n < 0) {
+      return -1;
+    }
+    if (n == 0) {
+      if (lower || m_lower_fd < 0) {
+        break;
+      }
+      lower = true;
+      fd = m_lower_fd;
+      if (fstat(fd, &dirst) < 0 || lseek(fd, 0, SEEK_SET) < 0) {
+        return -1;
+      }
+      continue;
+    }
+
+    long pos;
+    for (pos = 0; pos < n; ) {
+      struct linux_dirent64 *d = (struct linux_dirent64 *)(buf + pos);
+      pos += d->d_reclen;
+      if (Hidden(d->d_name, lower)) {
+        continue;
+      }
+
+      uint16_t namelen = strlen(d->d_name);
+      size_t reclen = sizeof(qid_t) + sizeof(uint64_t) + sizeof(uint8_t)
+        + sizeof(namelen) + namelen;
+      if (out.size() + reclen > count) {
+        full = true;
+        break;
+      }
+
+      qid_t qid;
+      qid.type = P9_QTFILE;
+      if (d->d_type == DT_DIR) {
+        qid.type = P9_QTDIR;
+      } else if (d->d_type == DT_LNK) {
+        qid.type = P9_QTSYMLINK;
+      }
+      qid.version = 0;
+      qid.path = QidPath(dirst.st_dev, d->d_ino);
+      uint64_t next = d->d_off | (lower ? P9_DIROFF_LOWER : 0);
+
+      size_t at = out.size();
+      out.resize(at + reclen);
+      memcpy(&out[at], &qid, sizeof(qid));
+      at += sizeof(qid);
+      memcpy(&out[at], &next, sizeof(next));
+      at += sizeof(next);
+      out[at++] = d->d_type;
+      memcpy(&out[at], &namelen, sizeof(namelen));
+      at += sizeof(namelen);
+      memcpy(&out[at], d->d_name, namelen);
+    }
+  }
+
+  if (full && out.empty()) {
+    TRACE_PRINT("Directory read of %lx bytes can't fit an entry", count);
+    return -1;
+  }
+
+  size_t copied = 0;
+  for (i = 0; i < iovcnt && copied < out.size(); i++) {
+    size_t chunk = std::min(iov[i].iov_len, out.size() - copied);
+    memcpy(iov[i].iov_base, &out[copied], chunk);
+    copied += chunk;
+  }
+  return out.size();
+}
+
+bool QidObject::GetAttr(uint64_t mask, p9_attr_t *p9attr) {
+  DentryAttr attr;
+  Settle();
+  if (!CurrentAttr(&attr)) {
+    return false;
+  }
+
+  const struct stat *st = &attr.st;
+  memset(p9attr, 0, sizeof(*p9attr));
+  p9attr->valid = mask & P9_GETATTR_BASIC;
+  p9attr->qid.type = attr.qid_type;
+  p9attr->qid.version = attr.qid_version;
+  p9attr->qid.path = attr.qid_path;
+
+  if (mask & P9_GETATTR_MODE) {
+    p9attr->mode = st->st_mode;
+  }
+  if (mask & P9_GETATTR_NLINK) {
+    p9attr->nlink = st->st_nlink;
+  }
+  if (mask & P9_GETATTR_UID) {
+    p9attr->uid = st->st_uid;
+  }
+  if (mask & P9_GETATTR_GID) {
+    p9attr->gid = st->st_gid;
+  }
+  if (mask & P9_GETATTR_RDEV) {
+    p9attr->rdev = st->st_rdev;
+  }
+  if (mask & P9_GETATTR_ATIME) {
+    p9attr->atime_sec = st->st_atim.tv_sec;
+    p9attr->atime_nsec = st->st_atim.tv_nsec;
+  }
+  if (mask & P9_GETATTR_MTIME) {
+    p9attr->mtime_sec = st->st_mtim.tv_sec;
+    p9attr->mtime_nsec = st->st_mtim.tv_nsec;
+  }
+  if (mask & P9_GETATTR_CTIME) {
+    p9attr->ctime_sec = st->st_ctim.tv_sec;
+    p9attr->ctime_nsec = st->st_ctim.tv_nsec;
+  }
+  if (mask & P9_GETATTR_SIZE) {
+    p9attr->size = st->st_size;
+  }
+  if (mask & P9_GETATTR_BLOCKS) {
+    p9attr->blksize = st->st_blksize;
+    p9attr->blocks = st->st_blocks;
+  }
+  return true;
+}
 
-  return p9st;
+bool QidObject::Sync(bool datasync) {
+  if (!m_opened) {
+    return false;
+  }
+  if (m_buf && !m_buf->Flush()) {
+    return false;
+  }
+  return !(datasync ? fdatasync(m_fd) : fsync(m_fd));
+}
+
+uint8_t QidObject::Lock(uint8_t type, uint64_t start, uint64_t length) {
+  if (!m_opened) {
+    return P9_LOCK_ERROR;
+  }
+
+  struct flock fl;
+  memset(&fl, 0, sizeof(fl));
+  switch (type) {
+  case P9_LOCK_TYPE_RDLCK:
+    fl.l_type = F_RDLCK;
+    break;
+  case P9_LOCK_TYPE_WRLCK:
+    fl.l_type = F_WRLCK;
+    break;
+  case P9_LOCK_TYPE_UNLCK:
+    fl.l_type = F_UNLCK;
+    break;
+  default:
+    return P9_LOCK_ERROR;
+  }
+  fl.l_whence = SEEK_SET;
+  fl.l_start = start;
+  // 0 runs to the end of the file, like it does for fcntl
+  fl.l_len = length;
+
+  // never block a worker, the client retries a blocked lock
+  if (fcntl(m_fd, F_OFD_SETLK, &fl) < 0) {
+    if (errno == EAGAIN || errno == EACCES) {
+      return P9_LOCK_BLOCKED;
+    }
+    return P9_LOCK_ERROR;
+  }
+  return P9_LOCK_SUCCESS;
+}
+
+bool QidObject::Stat(p9_stat_t *p9st) {
+  DentryAttr attr;
+  Settle();
+
+  if (!CurrentAttr(&attr)) {
+    return false;
+  }
+
+  // the qid as of now, the object's own is from when it was walked to
+  FillStat(attr, p9st);
+
+  return true;
 }
 
 bool QidObject::Close() {
   if (!m_opened) {
     return false;
   }
+  // writes the guest was told went through are lost if this fails, or if
+  // a background flush already did, so the clunk has to say so
+  bool flushed = true;
+  int err = 0;
+  if (m_buf && !m_buf->Flush()) {
+    flushed = false;
+    err = errno;
+  }
+  m_buf.reset();
   close(m_fd);
+  if (m_lower_fd >= 0) {
+    close(m_lower_fd);
+    m_lower_fd = -1;
+  }
   m_opened = false;
-  return true;
+  if (!flushed) {
+    errno = err;
+  }
+  return flushed;
 }
 
 bool QidObject::Remove() {
+  if (m_overlay) {
+    OverlayEntry entry;
+    if (!m_overlay->Lookup(m_rel, &entry)) {
+      return false;
+    }
+    // unlink doesn't take directories either
+    if (S_ISDIR(entry.st.st_mode)) {
+      errno = EISDIR;
+      return false;
+    }
+    if (entry.real.compare(entry.lower) && unlink(entry.real.c_str())) {
+      return false;
+    }
+    return entry.lower.empty() || m_overlay->Whiteout(entry);
+  }
+
   if (unlink(m_fspath.c_str())) {
     return false;
   }
 
+  if (m_cache) {
+    m_cache->Invalidate(m_fspath);
+  }
+
   return true;
 }
 
+// a new directory, or an empty file, at path
+static bool MakeEntry(const std::string &path, uint32_t perm) {
+  if (perm & DMDIR) {
+    TRACE_PRINT("Create new directory %s with %o", path.c_str(), perm & 0777);
+    if (mkdir(path.c_str(), perm & 0777)) {
+      return false;
+    }
+  } else {
+    TRACE_PRINT("Creating new file %s with %o", path.c_str(), perm & 0777);
+    int fd = open(path.c_str(), O_CREAT|O_EXCL, perm & 0777);
+    if (fd < 0) {
+      TRACE_PRINT("Failed to create new file %s", path.c_str());
+      return false;
+    }
+    close(fd);
+  }
+  return true;
+}
+
+// new entries always go in the upper directory, which is copied up first if
+// it's only in the lower tree
+QidObject *QidObject::CreateOverlayChild(const std::string &child, uint32_t perm) {
+  if (!p9fs_overlay_entry(child)) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  // O_EXCL only sees the upper tree
+  OverlayEntry entry, existing;
+  if (!m_overlay->Lookup(m_rel, &entry)) {
+    return NULL;
+  }
+  if (m_overlay->Child(entry, child, &existing)) {
+    errno = EEXIST;
+    return NULL;
+  }
+
+  if (!m_overlay->CopyUpDir(m_rel)) {
+    return NULL;
+  }
+  bool whited = m_overlay->WhitedOut(m_rel, child);
+  std::string rel = m_rel.empty() ? child : m_rel + "/" + child;
+  if (!MakeEntry(m_overlay->UpperPath(rel), perm)) {
+    return NULL;
+  }
+
+  // a directory made where a removed one was starts out empty. the
+  // whiteout goes last so the lower copy never shows through in between
+  if (whited && (perm & DMDIR) && !m_overlay->MakeOpaque(rel)) {
+    return NULL;
+  }
+  if (whited && !m_overlay->Unwhiteout(m_rel, child)) {
+    return NULL;
+  }
+
+  return Traverse(child);
+}
+
 QidObject *QidObject::CreateChild(std::string child, uint32_t perm) {
+  if (m_overlay) {
+    return CreateOverlayChild(child, perm);
+  }
+
   std::string newpath(m_fspath);
 
   newpath.append("/");
   newpath.append(child);
 
-  if (perm & DMDIR) {
-    TRACE_PRINT("Create new directory %s with %o", newpath.c_str(), perm & 0777);
-    if (mkdir(newpath.c_str(), perm & 0777)) {
+  if (!MakeEntry(newpath, perm)) {
+    return NULL;
+  }
+
+  if (m_cache) {
+    m_cache->Invalidate(newpath);
+  }
+  return Traverse(child);
+}
+
+QidObject *QidObject::TraverseOverlay(const std::string &next) {
+  OverlayEntry entry;
+  if (!p9fs_overlay_entry(next)) {
+    errno = ENOENT;
+    return NULL;
+  }
+
+  if (!next.compare(".") || !next.compare("..")) {
+    if (!m_overlay->Lookup(m_rel + "/" + next, &entry)) {
       return NULL;
     }
   } else {
-    TRACE_PRINT("Creating new file %s with %o", newpath.c_str(), perm & 0777);
-    int fd = open(newpath.c_str(), O_CREAT|O_EXCL, perm & 0777);
-    if (fd < 0) {
-      TRACE_PRINT("Failed to create new file %s", newpath.c_str());
+    // only the parent's paths matter for looking up a child
+    OverlayEntry parent;
+    parent.rel = m_rel;
+    parent.real = m_fspath;
+    parent.lower = m_lower;
+    parent.opaque = m_opaque;
+    if (!m_overlay->Child(parent, next, &entry)) {
+      TRACE_PRINT("Traverse found nothing at %s/%s\n", m_rel.c_str(), next.c_str());
       return NULL;
     }
-    close(fd);
   }
 
-  return Traverse(child);
+  return new QidObject(m_overlay, entry);
+}
+
+QidObject *QidObject::Clone() {
+  DentryAttr attr;
+  attr.qid_type = m_type;
+  attr.qid_version = m_version;
+  attr.qid_path = m_path;
+
+  QidObject *clone = new QidObject(m_fspath, m_root, m_cache, attr);
+  clone->m_overlay = m_overlay;
+  clone->m_rel = m_rel;
+  clone->m_lower = m_lower;
+  clone->m_opaque = m_opaque;
+  return clone;
 }
 
 QidObject *QidObject::Traverse(std::string next) {
+  if (m_overlay) {
+    return TraverseOverlay(next);
+  }
+
   std::string newpath(m_fspath);
 
   newpath.append("/");
@@ -198,6 +901,13 @@ QidObject *QidObject::Traverse(std::string next) {
     newpath = m_fspath;
   }
 
+  // cached paths are all real, so one matching newpath as is resolves to
+  // itself. symlinks, "." and ".." never match and take the long way
+  DentryAttr attr;
+  if (m_cache && m_cache->Lookup(newpath, &attr)) {
+    return new QidObject(newpath, m_root, m_cache, attr);
+  }
+
   char resolved[PATH_MAX];
   if (!realpath(newpath.c_str(), resolved)) {
     TRACE_PRINT("Traverse realpath failed on %s\n", newpath.c_str());
@@ -207,7 +917,7 @@ QidObject *QidObject::Traverse(std::string next) {
   newpath = std::string(resolved);
 
   try {
-    return new QidObject(newpath, m_root);
+    return new QidObject(newpath, m_root, m_cache);
   } catch(std::exception e) {
     return NULL;
   }
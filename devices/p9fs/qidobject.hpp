@@ -2,8 +2,15 @@
 #define QIDOBJECT_H_
 
 #include "iostructs.h"
+#include "dentrycache.hpp"
+#include "ioring.hpp"
+#include "filebuffer.hpp"
+#include "overlay.hpp"
 #include "trace.h"
+#include <sys/types.h>
+#include <sys/uio.h>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <atomic>
 
@@ -26,6 +33,57 @@ typedef struct {
   uint64_t length;
 } p9_stat_t;
 
+// Rgetattr's body, only the fields named in valid are filled in
+typedef struct __attribute__((packed)) {
+  uint64_t valid;
+  qid_t qid;
+  uint32_t mode;
+  uint32_t uid;
+  uint32_t gid;
+  uint64_t nlink;
+  uint64_t rdev;
+  uint64_t size;
+  uint64_t blksize;
+  uint64_t blocks;
+  uint64_t atime_sec;
+  uint64_t atime_nsec;
+  uint64_t mtime_sec;
+  uint64_t mtime_nsec;
+  uint64_t ctime_sec;
+  uint64_t ctime_nsec;
+  uint64_t btime_sec;
+  uint64_t btime_nsec;
+  uint64_t gen;
+  uint64_t data_version;
+} p9_attr_t;
+
+// Tgetattr request mask bits
+#define P9_GETATTR_MODE 0x00000001ULL
+#define P9_GETATTR_NLINK 0x00000002ULL
+#define P9_GETATTR_UID 0x00000004ULL
+#define P9_GETATTR_GID 0x00000008ULL
+#define P9_GETATTR_RDEV 0x00000010ULL
+#define P9_GETATTR_ATIME 0x00000020ULL
+#define P9_GETATTR_MTIME 0x00000040ULL
+#define P9_GETATTR_CTIME 0x00000080ULL
+#define P9_GETATTR_INO 0x00000100ULL
+#define P9_GETATTR_SIZE 0x00000200ULL
+#define P9_GETATTR_BLOCKS 0x00000400ULL
+#define P9_GETATTR_BASIC 0x000007ffULL
+
+enum {
+    P9_LOCK_TYPE_RDLCK,
+    P9_LOCK_TYPE_WRLCK,
+    P9_LOCK_TYPE_UNLCK,
+};
+
+enum {
+    P9_LOCK_SUCCESS,
+    P9_LOCK_BLOCKED,
+    P9_LOCK_ERROR,
+    P9_LOCK_GRACE,
+};
+
 enum {
     P9_QTDIR = 0x80,
     P9_QTAPPEND = 0x40,
@@ -57,12 +115,51 @@ class QidObject {
   bool m_opened = false;
   uint8_t m_mode;
   int m_fd;
+  // readahead and write-behind while the file is open
+  std::unique_ptr<FileBuffer> m_buf;
+
+  // set when the share is an overlay. m_fspath is then whichever copy m_rel
+  // resolved to, m_lower the lower copy under it and m_opaque whether the
+  // lower directory's entries are hidden. an open directory with entries
+  // in both has the lower one open at m_lower_fd
+  Overlay *m_overlay = NULL;
+  std::string m_rel;
+  std::string m_lower;
+  bool m_opaque = false;
+  int m_lower_fd = -1;
+
+  // directory reads continue from where the last one stopped, m_dir_offset
+  // is how far into the stream of records that was and m_dir_lower whether
+  // it's got to the lower directory's
+  std::mutex m_dir_lock;
+  uint64_t m_dir_offset = 0;
+  bool m_dir_lower = false;
 
   std::atomic<uint32_t> m_refcnt{0};
 
+  // shared by every object under the same root, NULL if uncached
+  DentryCache *m_cache;
+
+  QidObject(std::string path, std::string root, DentryCache *cache,
+            const DentryAttr &attr);
+  // walks and stats go through the cache first
+  bool Attr(const std::string &path, DentryAttr *attr);
+  // writes anything held back, so the file's attributes are up to date
+  void Settle();
+  // the attributes of what's at the object's path now. in an overlay a
+  // lower copy may have been copied up since it was walked to
+  bool CurrentAttr(DentryAttr *attr);
+  void SetEntry(const OverlayEntry &entry);
+  QidObject *TraverseOverlay(const std::string &next);
+  QidObject *CreateOverlayChild(const std::string &child, uint32_t perm);
+  // whether ReadDir/ReadDirL skip name, from the lower directory if lower
+  bool Hidden(const char *name, bool lower);
+
   public:
   ~QidObject();
-  QidObject(std::string path, std::string root);
+  QidObject(std::string path, std::string root, DentryCache *cache = NULL);
+  // entry in overlay, uncached
+  QidObject(Overlay *overlay, const OverlayEntry &entry);
   uint8_t Type() { return m_type; }
   uint64_t Path() { return m_path; }
   bool Opened() { return m_opened; }
@@ -76,13 +173,49 @@ class QidObject {
     }
   }
   void Qid(qid_t *q);
-  bool Open(uint8_t mode);
+  // flags adds O_TRUNC/O_APPEND for Tlopen, anything else is ignored
+  bool Open(uint8_t mode, int flags = 0);
+  // closes the file even if writing out what's held back fails, then
+  // returns false with errno set
   bool Close();
-  std::unique_ptr<uint8_t[]> Read(uint64_t offset, uint32_t& count);
-  uint32_t Write(uint64_t offset,  std::unique_ptr<uint8_t[]> data, uint32_t count);
-  std::unique_ptr<p9_stat_t> Stat();
+  // positional, so requests on other fids sharing this object don't race
+  // on the file offset. both move at most the iovecs' total and return the
+  // byte count or -1
+  ssize_t Read(uint64_t offset, const struct iovec *iov, int iovcnt);
+  ssize_t Write(uint64_t offset, const struct iovec *iov, int iovcnt);
+  // whether a Read/Write of len at offset goes through the file's buffers
+  // instead of straight to it, so it can't be queued with SubmitRead or
+  // SubmitWrite. a write of 0 is for SubmitSync
+  bool Buffered(uint64_t offset, size_t len, bool write);
+  // the same as Read/Write/Sync, queued on ring with data as the user_data
+  // instead. false if there's nothing to queue them on. the iovecs have to
+  // stay put until the completion, and a write that went through has to be
+  // reported to Written
+  bool SubmitRead(IoRing *ring, uint64_t offset, const struct iovec *iov,
+                  int iovcnt, void *data);
+  bool SubmitWrite(IoRing *ring, uint64_t offset, const struct iovec *iov,
+                   int iovcnt, void *data);
+  bool SubmitSync(IoRing *ring, bool datasync, void *data);
+  void Written();
+  // fills the iovecs with as many whole directory records as fit: an Rstat
+  // record followed by the entry's name[s], with size covering both. offset
+  // is 0 to start over or where the previous read ended
+  ssize_t ReadDir(uint64_t offset, const struct iovec *iov, int iovcnt);
+  // Treaddir: entries of qid[13] offset[8] type[1] name[s] from the
+  // opaque offset of the one before (0 for the start). qids come from the
+  // dirent alone, nothing is stat'd, so their version is 0
+  ssize_t ReadDirL(uint64_t offset, const struct iovec *iov, int iovcnt);
+  // the attributes in mask, valid says which were filled in
+  bool GetAttr(uint64_t mask, p9_attr_t *attr);
+  bool Sync(bool datasync);
+  // open file description locks, so fids don't share them like they
+  // would a process' POSIX locks. returns a P9_LOCK_ status
+  uint8_t Lock(uint8_t type, uint64_t start, uint64_t length);
+  bool Stat(p9_stat_t *p9st);
   bool Remove();
   QidObject *CreateChild(std::string child, uint32_t perm);
   QidObject *Traverse(std::string next);
+  // the same file, unopened, for a walk that clones a fid
+  QidObject *Clone();
 };
 #endif
@@ -0,0 +1,126 @@
+// Runs Tflushes through a RequestPool that could each hold a worker for
+// good: ones that flush their own tag and pairs that flush each other,
+// more of them than there are workers. Every one has to be answered, and
+// the pool has to still answer requests afterwards.
+//
+//   requestpool-test [-w workers] [-t seconds]
+//
+// Exits non-zero if anything goes unanswered for the timeout.
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <set>
+
+#include "requestpool.hpp"
+
+static std::mutex answered_lock;
+static std::condition_variable answered_cv;
+static std::set<uint16_t> answered;
+
+static TRequest *flush(uint16_t tag, uint16_t oldtag) {
+  uint8_t body[sizeof(oldtag)];
+  memcpy(body, &oldtag, sizeof(oldtag));
+  return new TFlush(tag, body, sizeof(body));
+}
+
+// waits for every tag in [first, first + n) to be answered
+static bool wait_answered(uint16_t first, uint16_t n, int seconds) {
+  std::unique_lock<std::mutex> lock(answered_lock);
+  return answered_cv.wait_for(lock, std::chrono::seconds(seconds), [&]{
+      for (uint16_t tag = first; tag < first + n; tag++) {
+        if (!answered.count(tag)) {
+          return false;
+        }
+      }
+      return true;
+    });
+}
+
+static int check(const char *what, uint16_t first, uint16_t n, int seconds) {
+  if (!wait_answered(first, n, seconds)) {
+    printf("FAIL %s: not answered after %ds\n", what, seconds);
+    return 1;
+  }
+  printf("ok   %s\n", what);
+  return 0;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr, "usage: %s [-w workers] [-t seconds]\n", prog);
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  size_t workers = 2;
+  int seconds = 10;
+  int c;
+
+  while ((c = getopt(argc, argv, "w:t:")) != -1) {
+    switch (c) {
+    case 'w':
+      workers = strtoul(optarg, NULL, 0);
+      break;
+    case 't':
+      seconds = atoi(optarg);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (!workers || seconds < 1) {
+    usage(argv[0]);
+  }
+
+  char dir[] = "/tmp/requestpool-test.XXXXXX";
+  if (!mkdtemp(dir)) {
+    perror("mkdtemp");
+    return 1;
+  }
+
+  P9Core core(false, "share", dir, "");
+  RequestPool pool(&core, workers,
+                   [](TRequest *, bool) { return true; },
+                   [](TRequest *trequest, RResponse *rresponse) {
+                     delete rresponse;
+                     std::lock_guard<std::mutex> guard(answered_lock);
+                     answered.insert(trequest->Tag());
+                     answered_cv.notify_all();
+                   });
+
+  int failed = 0;
+  uint16_t n = workers * 2;
+  uint16_t tag;
+
+  // each flushes its own tag
+  uint16_t self = 1;
+  for (tag = self; tag < self + n; tag++) {
+    pool.Submit(flush(tag, tag));
+  }
+  failed += check("self flushes", self, n, seconds);
+
+  // pairs that flush each other
+  uint16_t mutual = self + n;
+  for (tag = mutual; tag < mutual + 2 * n; tag += 2) {
+    pool.Submit(flush(tag, tag + 1));
+    pool.Submit(flush(tag + 1, tag));
+  }
+  failed += check("mutual flushes", mutual, 2 * n, seconds);
+
+  // and every worker is still free for the next
+  uint16_t after = mutual + 2 * n;
+  for (tag = after; tag < after + n; tag++) {
+    pool.Submit(flush(tag, 0xffff));
+  }
+  failed += check("flushes afterwards", after, n, seconds);
+
+  rmdir(dir);
+  printf(failed ? "%d failed\n" : "all passed\n", failed);
+  fflush(stdout);
+  // a stuck worker would keep the pool from going away
+  _exit(failed != 0);
+}
@@ -0,0 +1,223 @@
+#include <stdlib.h>
+
+#include "requestpool.hpp"
+#include "trace.h"
+
+size_t p9fs_workers(void) {
+  char *env = getenv(P9FS_WORKERS_ENV);
+  if (!env) {
+    return P9FS_DEFAULT_WORKERS;
+  }
+
+  size_t workers = strtoul(env, NULL, 0);
+  if (workers < 1) {
+    workers = 1;
+  }
+  if (workers > P9FS_MAX_WORKERS) {
+    workers = P9FS_MAX_WORKERS;
+  }
+  return workers;
+}
+
+RequestPool::RequestPool(P9Core *core, size_t workers, begin_fn begin, respond_fn respond)
+  : m_core(core), m_begin(begin), m_respond(respond),
+    m_ready(P9FS_READY_REQUESTS), m_overflowed(0) {
+  size_t i;
+  for (i = 0; i < workers; i++) {
+    m_workers.push_back(std::thread([this]{ WorkerLoop(); }));
+  }
+}
+
+void RequestPool::Submit(TRequest *trequest) {
+  // visible to TFLUSH from now on, even while it waits behind its fid
+  m_core->RegisterRequest(trequest);
+
+  int64_t fids[2] = { trequest->OrderFid(), trequest->OrderNewFid() };
+  if (fids[0] >= 0 || fids[1] >= 0) {
+    std::lock_guard<std::mutex> guard(m_order_lock);
+    for (auto fid : fids) {
+      if (fid < 0) {
+        continue;
+      }
+      FidOrder &order = m_fids[fid];
+      if (!order.busy) {
+        order.busy = true;
+        continue;
+      }
+      if (order.tail) {
+        FidNext(order.tail, fid) = trequest;
+      } else {
+        order.head = trequest;
+      }
+      order.tail = trequest;
+      trequest->m_fid_waits++;
+    }
+    if (trequest->m_fid_waits) {
+      return;
+    }
+  }
+
+  m_ready.put(trequest);
+}
+
+// hands the fid to its next request, which goes to the workers unless it's
+// still waiting on its other fid, or marks it idle
+void RequestPool::Release(int64_t fid) {
+  if (fid < 0) {
+    return;
+  }
+
+  TRequest *next = NULL;
+  {
+    std::lock_guard<std::mutex> guard(m_order_lock);
+    auto it = m_fids.find(fid);
+    FidOrder &order = it->second;
+    if (order.head) {
+      next = order.head;
+      order.head = FidNext(next, fid);
+      if (!order.head) {
+        order.tail = NULL;
+      }
+      FidNext(next, fid) = NULL;
+      if (--next->m_fid_waits) {
+        next = NULL;
+      }
+    } else if (m_fids.size() > P9FS_IDLE_FIDS) {
+      m_fids.erase(it);
+    } else {
+      order.busy = false;
+    }
+  }
+
+  if (next && !m_ready.try_put(next)) {
+    std::lock_guard<std::mutex> guard(m_overflow_lock);
+    m_overflow.push_back(next);
+    m_overflowed++;
+  }
+}
+
+// the overflow goes first, it's only there because m_ready was full. the
+// worker that filled it is still running and will come back for it
+TRequest *RequestPool::Next() {
+  if (m_overflowed.load(std::memory_order_relaxed)) {
+    std::lock_guard<std::mutex> guard(m_overflow_lock);
+    if (!m_overflow.empty()) {
+      TRequest *trequest = m_overflow.front();
+      m_overflow.pop_front();
+      m_overflowed--;
+      return trequest;
+    }
+  }
+  return m_ready.get();
+}
+
+void RequestPool::WorkerLoop() {
+  std::unique_ptr<IoRing> ring;
+  if (p9fs_uring_enabled()) {
+    ring.reset(IoRing::Create(P9FS_URING_ENTRIES));
+  }
+
+  std::vector<TRequest *> batch;
+  while (1) {
+    TRequest *trequest = Next();
+    if (!ring || !trequest->AsyncIo()) {
+      Run(trequest);
+      continue;
+    }
+
+    // the rest of the batch is the I/O queued up behind it. anything else
+    // ends it and runs once the batch is done
+    TRequest *next = NULL;
+    batch.push_back(trequest);
+    while (batch.size() < P9FS_URING_ENTRIES && m_ready.try_get(next)) {
+      if (!next->AsyncIo()) {
+        break;
+      }
+      batch.push_back(next);
+      next = NULL;
+    }
+
+    // a lone request only adds the ring's round trip on top of the I/O
+    if (batch.size() == 1) {
+      Run(trequest);
+    } else {
+      RunBatch(ring.get(), batch);
+    }
+    batch.clear();
+    if (next) {
+      Run(next);
+    }
+  }
+}
+
+void RequestPool::Run(TRequest *trequest) {
+  // flushed before it got here, 9P says it gets no response
+  if (!m_core->StartRequest(trequest)) {
+    TRACE_PRINT("[%x] flushed before it ran", trequest->Tag());
+    Done(trequest, false);
+    return;
+  }
+
+  m_begin(trequest, true);
+  m_respond(trequest, trequest->Process(m_core));
+  Done(trequest, true);
+}
+
+void RequestPool::RunBatch(IoRing *ring, std::vector<TRequest *> &batch) {
+  size_t queued = 0;
+
+  for (auto trequest : batch) {
+    if (!m_core->StartRequest(trequest)) {
+      TRACE_PRINT("[%x] flushed before it ran", trequest->Tag());
+      Done(trequest, false);
+      continue;
+    }
+
+    // out of reply buffers. what's queued is holding some, answer it so
+    // the guest can hand them back
+    if (!m_begin(trequest, false)) {
+      Reap(ring, queued);
+      queued = 0;
+      m_begin(trequest, true);
+    }
+
+    if (trequest->SubmitIo(m_core, ring)) {
+      queued++;
+      continue;
+    }
+    m_respond(trequest, trequest->Process(m_core));
+    Done(trequest, true);
+  }
+
+  Reap(ring, queued);
+}
+
+// submits what's been queued and answers the requests as they complete
+void RequestPool::Reap(IoRing *ring, size_t queued) {
+  ring->Submit(queued);
+
+  while (queued) {
+    uint64_t data;
+    int32_t res;
+    if (!ring->Reap(&data, &res)) {
+      ring->Submit(queued);
+      continue;
+    }
+
+    TRequest *trequest = (TRequest *)data;
+    m_respond(trequest, trequest->CompleteIo(res));
+    Done(trequest, true);
+    queued--;
+  }
+}
+
+void RequestPool::Done(TRequest *trequest, bool started) {
+  int64_t fid = trequest->OrderFid();
+  int64_t newfid = trequest->OrderNewFid();
+  if (started) {
+    m_core->FinishRequest(trequest);
+  }
+  Release(fid);
+  Release(newfid);
+  delete trequest;
+}
@@ -0,0 +1,90 @@
+#ifndef P9_REQUESTPOOL_H_
+#define P9_REQUESTPOOL_H_
+
+#include "trequests.hpp"
+#include "rresponses.hpp"
+#include "p9core.hpp"
+#include "ioring.hpp"
+#include "../broadcooom/ringqueue.hpp"
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#define P9FS_WORKERS_ENV "OOOWS_P9FS_WORKERS"
+#define P9FS_DEFAULT_WORKERS 4
+#define P9FS_MAX_WORKERS 32
+#define P9FS_IDLE_FIDS 1024
+#define P9FS_READY_REQUESTS 4096
+
+// Runs TRequests on a fixed set of worker threads. Requests naming the same
+// fid (TRequest::OrderFid, or OrderNewFid for a walk's newfid) run one at a
+// time in the order they were submitted, everything else runs concurrently.
+// A fid with a request running parks its later requests in a per-fid
+// backlog instead of holding a worker. One naming two fids runs once it's
+// first in line for both; every backlog is in submission order, so two
+// requests can't each hold a fid the other waits on.
+// Submit blocks once P9FS_READY_REQUESTS are waiting for a worker, which
+// holds the guest's queue back instead of letting the backlog grow.
+//
+// Each worker has its own io_uring when the kernel allows it. A worker that
+// picks up file I/O (TRequest::AsyncIo) takes whatever other I/O is ready
+// along with it, queues all of it with one io_uring_enter and answers each
+// as it completes. Without a ring everything runs in place on the worker.
+class RequestPool {
+  public:
+  // begin gets a started request ready to run, taking its reply buffer if
+  // it needs one up front. without wait it returns false rather than block
+  // for the buffer. respond sends the response, NULL for none. both are
+  // called on the worker, before the request is finished so a TFLUSH
+  // waiting on it answers after it
+  typedef std::function<bool(TRequest *, bool)> begin_fn;
+  typedef std::function<void(TRequest *, RResponse *)> respond_fn;
+
+  RequestPool(P9Core *core, size_t workers, begin_fn begin, respond_fn respond);
+  // takes ownership of trequest. blocks while the workers are too far behind
+  void Submit(TRequest *trequest);
+
+  private:
+  P9Core *m_core;
+  begin_fn m_begin;
+  respond_fn m_respond;
+  MpmcRingQueue<TRequest *> m_ready;
+  // a worker releasing a fid can't wait for room in m_ready, that could be
+  // every worker waiting on itself. what doesn't fit waits here instead
+  std::mutex m_overflow_lock;
+  std::deque<TRequest *> m_overflow;
+  std::atomic<size_t> m_overflowed;
+  std::vector<std::thread> m_workers;
+  // fids with a request queued or running, and what's waiting behind it.
+  // idle fids stay until there are P9FS_IDLE_FIDS of them, so a fid in use
+  // doesn't add and drop its entry with every request
+  struct FidOrder {
+    bool busy;
+    TRequest *head;
+    TRequest *tail;
+  };
+  std::mutex m_order_lock;
+  std::unordered_map<uint32_t, FidOrder> m_fids;
+
+  void WorkerLoop();
+  TRequest *Next();
+  void Run(TRequest *trequest);
+  void RunBatch(IoRing *ring, std::vector<TRequest *> &batch);
+  void Reap(IoRing *ring, size_t queued);
+  void Done(TRequest *trequest, bool started);
+  void Release(int64_t fid);
+  // the link to the request behind trequest in fid's backlog
+  static TRequest *&FidNext(TRequest *trequest, int64_t fid) {
+    return trequest->m_fid_next[trequest->OrderFid() == fid ? 0 : 1];
+  }
+};
+
+// number of workers from P9FS_WORKERS_ENV, clamped to [1, P9FS_MAX_WORKERS]
+size_t p9fs_workers(void);
+
+#endif
@@ -138,6 +138,9 @@ uint32_t RWalk::SerializedBodySize() {
 ROpen::ROpen(uint16_t tag, qid_t qid, uint32_t iounit) :
   m_qid(qid), m_iounit(iounit), RResponse(P9_ROPEN, tag) { }
 
+ROpen::ROpen(uint8_t type, uint16_t tag, qid_t qid, uint32_t iounit) :
+  m_qid(qid), m_iounit(iounit), RResponse(type, tag) { }
+
 void ROpen::SerializeBodyTo(uint8_t *data, size_t limit) {
   size_t offset = 0;
 
@@ -163,20 +166,27 @@ uint32_t RCreate::SerializedBodySize() {
   return sizeof(m_qid) + sizeof(m_iounit);
 }
 
-RRead::RRead(uint16_t tag, uint32_t count, std::unique_ptr<uint8_t[]> data) :
-  m_count(count), m_data(std::move(data)), RResponse(P9_RREAD, tag) { }
+RRead::RRead(uint16_t tag, uint32_t count) :
+  m_count(count), RResponse(P9_RREAD, tag) { }
+
+RRead::RRead(uint8_t type, uint16_t tag, uint32_t count) :
+  m_count(count), RResponse(type, tag) { }
 
 void RRead::SerializeBodyTo(uint8_t *data, size_t limit) {
   size_t offset = 0;
 
+  // the data is already in place, TRead sized it to the reply buffer
   WRITEVAL(m_count);
-  WRITE(m_data.get(), m_count);
 }
 
 uint32_t RRead::SerializedBodySize() {
   return sizeof(uint32_t) + m_count;
 }
 
+uint32_t RRead::SerializedHeadSize() {
+  return P9_RREAD_DATA_OFFSET;
+}
+
 RWrite::RWrite(uint16_t tag, uint32_t count) :
   m_count(count), RResponse(P9_RWRITE, tag) { }
 
@@ -194,15 +204,65 @@ RClunk::RClunk(uint16_t tag) : RResponse(P9_RCLUNK, tag) { }
 
 RRemove::RRemove(uint16_t tag) : RResponse(P9_RREMOVE, tag) { }
 
-RStat::RStat(uint16_t tag, std::unique_ptr<p9_stat_t> stat) :
-  m_stat(std::move(stat)), RResponse(P9_RSTAT, tag) { }
+RStat::RStat(uint16_t tag, const p9_stat_t &stat) :
+  m_stat(stat), RResponse(P9_RSTAT, tag) { }
 
 void RStat::SerializeBodyTo(uint8_t *data, size_t limit) {
   size_t offset = 0;
 
-  WRITE(m_stat.get(), sizeof(p9_stat_t));
+  WRITE(&m_stat, sizeof(p9_stat_t));
 }
 
 uint32_t RStat::SerializedBodySize() {
   return sizeof(p9_stat_t);
 }
+
+RLerror::RLerror(uint16_t tag, uint32_t ecode) :
+  m_ecode(ecode), RResponse(P9_RLERROR, tag) { }
+
+void RLerror::SerializeBodyTo(uint8_t *data, size_t limit) {
+  size_t offset = 0;
+
+  WRITEVAL(m_ecode);
+}
+
+uint32_t RLerror::SerializedBodySize() {
+  return sizeof(uint32_t);
+}
+
+RLopen::RLopen(uint16_t tag, qid_t qid, uint32_t iounit) :
+  ROpen(P9_RLOPEN, tag, qid, iounit) { }
+
+RLcreate::RLcreate(uint16_t tag, qid_t qid, uint32_t iounit) :
+  ROpen(P9_RLCREATE, tag, qid, iounit) { }
+
+RGetattr::RGetattr(uint16_t tag, const p9_attr_t &attr) :
+  m_attr(attr), RResponse(P9_RGETATTR, tag) { }
+
+void RGetattr::SerializeBodyTo(uint8_t *data, size_t limit) {
+  size_t offset = 0;
+
+  WRITEVAL(m_attr);
+}
+
+uint32_t RGetattr::SerializedBodySize() {
+  return sizeof(p9_attr_t);
+}
+
+RReaddir::RReaddir(uint16_t tag, uint32_t count) :
+  RRead(P9_RREADDIR, tag, count) { }
+
+RFsync::RFsync(uint16_t tag) : RResponse(P9_RFSYNC, tag) { }
+
+RLock::RLock(uint16_t tag, uint8_t status) :
+  m_status(status), RResponse(P9_RLOCK, tag) { }
+
+void RLock::SerializeBodyTo(uint8_t *data, size_t limit) {
+  size_t offset = 0;
+
+  WRITEVAL(m_status);
+}
+
+uint32_t RLock::SerializedBodySize() {
+  return sizeof(uint8_t);
+}
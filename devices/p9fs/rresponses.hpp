@@ -2,9 +2,10 @@
 #define P9_RRESPONSE_H_
 
 #include "qidobject.hpp"
+#include "msgpool.hpp"
 #include <list>
 
-class RResponse {
+class RResponse : public Pooled {
   protected:
   uint8_t m_type;
   uint16_t m_tag;
@@ -13,6 +14,9 @@ class RResponse {
   virtual ~RResponse() = default;
   RResponse(uint8_t type, uint16_t tag);
   uint32_t SerializedSize();
+  // how much of SerializedSize SerializeTo writes, less than all of it for
+  // responses whose data was put in place already
+  virtual uint32_t SerializedHeadSize() { return SerializedSize(); }
   void SerializeTo(uint8_t *data, size_t limit);
   virtual void SerializeBodyTo(uint8_t *data, size_t limit) { return; }
   virtual uint32_t SerializedBodySize() { return 0; }
@@ -80,6 +84,10 @@ class ROpen : public RResponse {
   qid_t m_qid;
   uint32_t m_iounit;
 
+  protected:
+  // Rlopen and Rlcreate look the same
+  ROpen(uint8_t type, uint16_t tag, qid_t qid, uint32_t iounit);
+
   public:
   ROpen(uint16_t tag, qid_t qid, uint32_t iounit = 0);
   void SerializeBodyTo(uint8_t *data, size_t limit);
@@ -97,15 +105,21 @@ class RCreate : public RResponse {
   uint32_t SerializedBodySize();
 };
 
+// the data is read straight into the reply buffer at P9_RREAD_DATA_OFFSET
+// by TRead, only the header and count are serialized here
 class RRead : public RResponse {
   private:
   uint32_t m_count;
-  std::unique_ptr<uint8_t[]> m_data;
+
+  protected:
+  // so does Rreaddir
+  RRead(uint8_t type, uint16_t tag, uint32_t count);
 
   public:
-  RRead(uint16_t tag, uint32_t count, std::unique_ptr<uint8_t[]> data);
+  RRead(uint16_t tag, uint32_t count);
   void SerializeBodyTo(uint8_t *data, size_t limit);
   uint32_t SerializedBodySize();
+  uint32_t SerializedHeadSize();
 };
 
 class RWrite : public RResponse {
@@ -130,10 +144,61 @@ class RRemove : public RResponse {
 
 class RStat : public RResponse {
   private:
-  std::unique_ptr<p9_stat_t> m_stat;
+  p9_stat_t m_stat;
+
+  public:
+  RStat(uint16_t tag, const p9_stat_t &stat);
+  void SerializeBodyTo(uint8_t *data, size_t limit);
+  uint32_t SerializedBodySize();
+};
+// 9P2000.L errors are an errno
+class RLerror : public RResponse {
+  private:
+  uint32_t m_ecode;
+
+  public:
+  RLerror(uint16_t tag, uint32_t ecode);
+  void SerializeBodyTo(uint8_t *data, size_t limit);
+  uint32_t SerializedBodySize();
+};
+
+class RLopen : public ROpen {
+  public:
+  RLopen(uint16_t tag, qid_t qid, uint32_t iounit);
+};
+
+class RLcreate : public ROpen {
+  public:
+  RLcreate(uint16_t tag, qid_t qid, uint32_t iounit);
+};
+
+class RGetattr : public RResponse {
+  private:
+  p9_attr_t m_attr;
+
+  public:
+  RGetattr(uint16_t tag, const p9_attr_t &attr);
+  void SerializeBodyTo(uint8_t *data, size_t limit);
+  uint32_t SerializedBodySize();
+};
+
+// the entries are in place already, like Rread's data
+class RReaddir : public RRead {
+  public:
+  RReaddir(uint16_t tag, uint32_t count);
+};
+
+class RFsync : public RResponse {
+  public:
+  RFsync(uint16_t tag);
+};
+
+class RLock : public RResponse {
+  private:
+  uint8_t m_status;
 
   public:
-  RStat(uint16_t tag, std::unique_ptr<p9_stat_t> stat);
+  RLock(uint16_t tag, uint8_t status);
   void SerializeBodyTo(uint8_t *data, size_t limit);
   uint32_t SerializedBodySize();
 };
@@ -0,0 +1,206 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+
+#include "stats.hpp"
+#include "trequests.hpp"
+#include "trace.h"
+
+static unsigned Bucket(uint64_t ns) {
+  if (ns < (2 << P9_STATS_SUB_BITS)) {
+    return ns;
+  }
+  unsigned msb = 63 - __builtin_clzll(ns);
+  unsigned shift = msb - P9_STATS_SUB_BITS;
+  return ((shift + 1) << P9_STATS_SUB_BITS)
+    + ((ns >> shift) & ((1 << P9_STATS_SUB_BITS) - 1));
+}
+
+// the largest latency that lands in bucket
+static uint64_t BucketTop(unsigned bucket) {
+  if (bucket < (2 << P9_STATS_SUB_BITS)) {
+    return bucket;
+  }
+  unsigned shift = (bucket >> P9_STATS_SUB_BITS) - 1;
+  uint64_t sub = bucket & ((1 << P9_STATS_SUB_BITS) - 1);
+  return (((1ULL << P9_STATS_SUB_BITS) + sub + 1) << shift) - 1;
+}
+
+static const char *TypeName(uint8_t type) {
+  switch (type) {
+  case P9_TLOPEN: return "Tlopen";
+  case P9_TLCREATE: return "Tlcreate";
+  case P9_TGETATTR: return "Tgetattr";
+  case P9_TREADDIR: return "Treaddir";
+  case P9_TFSYNC: return "Tfsync";
+  case P9_TLOCK: return "Tlock";
+  case P9_TVERSION: return "Tversion";
+  case P9_TAUTH: return "Tauth";
+  case P9_TATTACH: return "Tattach";
+  case P9_TFLUSH: return "Tflush";
+  case P9_TWALK: return "Twalk";
+  case P9_TOPEN: return "Topen";
+  case P9_TCREATE: return "Tcreate";
+  case P9_TREAD: return "Tread";
+  case P9_TWRITE: return "Twrite";
+  case P9_TCLUNK: return "Tclunk";
+  case P9_TREMOVE: return "Tremove";
+  case P9_TSTAT: return "Tstat";
+  case P9_TWSTAT: return "Twstat";
+  }
+  return NULL;
+}
+
+uint64_t P9Stats::Now() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+P9Stats::P9Stats() {
+  // std::atomic's default constructor leaves them as they were
+  for (auto &op : m_ops) {
+    op.count = 0;
+    op.errors = 0;
+    op.flushed = 0;
+    op.bytes_in = 0;
+    op.bytes_out = 0;
+    op.wait_ns = 0;
+    op.service_ns = 0;
+    op.max_ns = 0;
+    for (auto &bucket : op.latency) {
+      bucket = 0;
+    }
+  }
+
+  char *env = getenv(P9FS_STATS_ENV);
+  if (env && *env) {
+    m_path = env;
+    m_writer = std::thread([this]{ WriterLoop(); });
+  }
+}
+
+P9Stats::~P9Stats() {
+  if (!m_writer.joinable()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> guard(m_lock);
+    m_stop = true;
+  }
+  m_wake.notify_one();
+  m_writer.join();
+}
+
+void P9Stats::Record(uint8_t type, bool error, uint32_t in, uint32_t out,
+                     uint64_t wait_ns, uint64_t service_ns) {
+  P9OpStats &op = m_ops[(type >> 1) % P9_STATS_TYPES];
+  uint64_t total = wait_ns + service_ns;
+
+  op.count.fetch_add(1, std::memory_order_relaxed);
+  if (error) {
+    op.errors.fetch_add(1, std::memory_order_relaxed);
+  }
+  op.bytes_in.fetch_add(in, std::memory_order_relaxed);
+  op.bytes_out.fetch_add(out, std::memory_order_relaxed);
+  op.wait_ns.fetch_add(wait_ns, std::memory_order_relaxed);
+  op.service_ns.fetch_add(service_ns, std::memory_order_relaxed);
+  op.latency[Bucket(total)].fetch_add(1, std::memory_order_relaxed);
+
+  uint64_t max = op.max_ns.load(std::memory_order_relaxed);
+  while (total > max
+         && !op.max_ns.compare_exchange_weak(max, total, std::memory_order_relaxed)) { }
+}
+
+void P9Stats::Flushed(uint8_t type) {
+  m_ops[(type >> 1) % P9_STATS_TYPES].flushed.fetch_add(1, std::memory_order_relaxed);
+}
+
+std::string P9Stats::Format() {
+  std::string out;
+  char line[256];
+
+  snprintf(line, sizeof(line), "%-9s %10s %8s %8s %14s %14s %10s %10s %10s %10s %10s\n",
+           "type", "count", "errors", "flushed", "bytes_in", "bytes_out",
+           "wait_us", "service_us", "p50_us", "p99_us", "max_us");
+  out.append(line);
+
+  int t;
+  for (t = 0; t < P9_STATS_TYPES; t++) {
+    P9OpStats &op = m_ops[t];
+    uint64_t count = op.count.load(std::memory_order_relaxed);
+    uint64_t flushed = op.flushed.load(std::memory_order_relaxed);
+    if (!count && !flushed) {
+      continue;
+    }
+
+    // the buckets can be a little ahead of count, percentiles go by them
+    uint64_t hist[P9_STATS_BUCKETS];
+    uint64_t total = 0;
+    unsigned b;
+    for (b = 0; b < P9_STATS_BUCKETS; b++) {
+      hist[b] = op.latency[b].load(std::memory_order_relaxed);
+      total += hist[b];
+    }
+    uint64_t p50 = 0, p99 = 0, seen = 0;
+    for (b = 0; b < P9_STATS_BUCKETS && total; b++) {
+      seen += hist[b];
+      if (!p50 && seen * 100 >= total * 50) {
+        p50 = BucketTop(b);
+      }
+      if (seen * 100 >= total * 99) {
+        p99 = BucketTop(b);
+        break;
+      }
+    }
+
+    char name[16];
+    const char *known = TypeName(t << 1);
+    if (known) {
+      snprintf(name, sizeof(name), "%s", known);
+    } else {
+      snprintf(name, sizeof(name), "T%d", t << 1);
+    }
+
+    // a bucket's top can be past the largest latency actually in it
+    uint64_t max = op.max_ns.load(std::memory_order_relaxed);
+    p50 = p50 < max ? p50 : max;
+    p99 = p99 < max ? p99 : max;
+
+    uint64_t div = count ? count : 1;
+    snprintf(line, sizeof(line),
+             "%-9s %10lu %8lu %8lu %14lu %14lu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+             name, count, op.errors.load(std::memory_order_relaxed), flushed,
+             op.bytes_in.load(std::memory_order_relaxed),
+             op.bytes_out.load(std::memory_order_relaxed),
+             op.wait_ns.load(std::memory_order_relaxed) / 1000.0 / div,
+             op.service_ns.load(std::memory_order_relaxed) / 1000.0 / div,
+             p50 / 1000.0, p99 / 1000.0, max / 1000.0);
+    out.append(line);
+  }
+  return out;
+}
+
+bool P9Stats::Write() {
+  std::string table = Format();
+  std::string tmp = m_path + ".tmp";
+
+  FILE *f = fopen(tmp.c_str(), "w");
+  if (!f) {
+    return false;
+  }
+  bool ok = fwrite(table.data(), 1, table.size(), f) == table.size();
+  ok = !fclose(f) && ok;
+  return ok && !rename(tmp.c_str(), m_path.c_str());
+}
+
+void P9Stats::WriterLoop() {
+  auto interval = std::chrono::milliseconds(P9FS_STATS_INTERVAL_MS);
+  std::unique_lock<std::mutex> lock(m_lock);
+
+  while (!m_stop) {
+    m_wake.wait_for(lock, interval);
+    if (!Write()) {
+      TRACE_PRINT("Couldn't write stats to %s", m_path.c_str());
+    }
+  }
+}
@@ -0,0 +1,69 @@
+#ifndef P9_STATS_H_
+#define P9_STATS_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#define P9FS_STATS_ENV "OOOWS_P9FS_STATS"
+#define P9FS_STATS_INTERVAL_MS 1000
+// latencies are bucketed by their top P9_STATS_SUB_BITS bits below the
+// leading one, so a percentile is off by at most 1/2^P9_STATS_SUB_BITS
+#define P9_STATS_SUB_BITS 2
+#define P9_STATS_BUCKETS (64 << P9_STATS_SUB_BITS)
+// T-message types are all even and below 128
+#define P9_STATS_TYPES 64
+
+// what's been seen of one message type. the latency is from the request
+// being queued to its response being handed off: wait is the part until a
+// worker started it, behind other requests on its fid included, service
+// the rest
+struct P9OpStats {
+  std::atomic<uint64_t> count;
+  std::atomic<uint64_t> errors;
+  std::atomic<uint64_t> flushed;
+  std::atomic<uint64_t> bytes_in;
+  std::atomic<uint64_t> bytes_out;
+  std::atomic<uint64_t> wait_ns;
+  std::atomic<uint64_t> service_ns;
+  std::atomic<uint64_t> max_ns;
+  std::atomic<uint32_t> latency[P9_STATS_BUCKETS];
+};
+
+// Per message type counters, kept with relaxed atomics so workers never
+// contend on a lock for them. With P9FS_STATS_ENV set to a path, a thread
+// rewrites the file there with the table every P9FS_STATS_INTERVAL_MS,
+// renaming it into place so readers always see a whole one.
+class P9Stats {
+  public:
+  P9Stats();
+  ~P9Stats();
+
+  // a request that ran. in and out are the request and response sizes
+  void Record(uint8_t type, bool error, uint32_t in, uint32_t out,
+              uint64_t wait_ns, uint64_t service_ns);
+  // a request TFLUSH cancelled before it ran
+  void Flushed(uint8_t type);
+  // one line per message type seen so far, after a header
+  std::string Format();
+
+  // monotonic, for the timestamps Record is given the difference of
+  static uint64_t Now();
+
+  private:
+  P9OpStats m_ops[P9_STATS_TYPES];
+
+  std::string m_path;
+  std::mutex m_lock;
+  std::condition_variable m_wake;
+  bool m_stop = false;
+  std::thread m_writer;
+
+  void WriterLoop();
+  bool Write();
+};
+
+#endif
@@ -1,3 +1,4 @@
+#include <fcntl.h>
 #include <string.h>
 #include <string>
 
@@ -39,27 +40,76 @@ static bool LegalName(std::string s) {
   return true;
 }
 
+// the iovecs covering up to len bytes of iov from offset on
+static IoVecs IovSlice(const IoVecs &iov, size_t offset, size_t len) {
+  IoVecs slice;
+  for (auto it = iov.begin(); it != iov.end() && len; it++) {
+    if (offset >= it->iov_len) {
+      offset -= it->iov_len;
+      continue;
+    }
+    struct iovec part;
+    part.iov_base = (uint8_t *)it->iov_base + offset;
+    part.iov_len = it->iov_len - offset;
+    if (part.iov_len > len) {
+      part.iov_len = len;
+    }
+    slice.push_back(part);
+    len -= part.iov_len;
+    offset = 0;
+  }
+  return slice;
+}
+
+size_t P9ParseLength(p9_msg_t *msg, size_t size) {
+  // fid[4] offset[8] count[4], the data is read by TWrite::Execute
+  size_t twrite = sizeof(p9_msg_t) + sizeof(uint32_t) + sizeof(uint64_t)
+    + sizeof(uint32_t);
+  if (msg->type == P9_TWRITE && size > twrite) {
+    return twrite;
+  }
+  return size;
+}
+
 TRequest::TRequest(uint8_t type, uint16_t tag) : m_type(type), m_tag(tag) { }
 
-void TRequest::SetError(std::string err) {
+void TRequest::SetError(std::string err, int ecode) {
   m_errored = true;
   m_error = err;
+  m_ecode = ecode;
 }
 
 RResponse *TRequest::Process(P9Core *core) {
+  m_dotl = core->Dialect() == P9_DIALECT_2000L;
 
-  if (core->HasRequest(m_tag)) {
-    core->CancelRequest(m_tag);
+  if (DotL() && !m_dotl) {
+    SetError("9P2000.L not negotiated", EOPNOTSUPP);
+  } else if (Valid()) {
+    m_completed = Execute(core);
   } else {
-    core->RegisterRequest(this);
+    SetError("Invalid TMesg", EINVAL);
   }
 
-  if (Valid()) {
-    m_completed = Execute(core);
-  } else {
-    SetError("Invalid TMesg");
+  return Finish();
+}
+
+bool TRequest::SubmitIo(P9Core *core, IoRing *ring) {
+  m_dotl = core->Dialect() == P9_DIALECT_2000L;
+
+  // anything that's going to fail goes through Process for the error
+  if ((DotL() && !m_dotl) || !Valid()) {
+    return false;
   }
+  return PrepareIo(core, ring);
+}
+
+RResponse *TRequest::CompleteIo(int32_t res) {
+  IoDone(res);
+  m_completed = !m_errored;
+  return Finish();
+}
 
+RResponse *TRequest::Finish() {
   RResponse *response = NULL;
   if (m_errored) {
     TRACE_PRINT("[%x] errored %s", m_tag, m_error.c_str());
@@ -68,12 +118,13 @@ RResponse *TRequest::Process(P9Core *core) {
     response = Respond();
   }
 
-  core->UnregisterRequest(this);
-
   return response;
 }
 
 RResponse *TRequest::GenerateError() {
+  if (m_dotl) {
+    return new RLerror(m_tag, m_ecode);
+  }
   return new RError(m_tag, m_error);
 }
 
@@ -88,11 +139,27 @@ TVersion::TVersion(uint16_t tag, uint8_t *body, size_t size) : TRequest(P9_TVERS
 bool TVersion::Execute(P9Core *core) {
   // TODO fix this
   // may need to negotiate this before processing further messages
-  if (m_version.compare("P92021")) {
+  int dialect;
+  if (!m_version.compare(P9_VERSION_2000)) {
+    dialect = P9_DIALECT_2000;
+  } else if (!m_version.compare(P9_VERSION_2000L)) {
+    dialect = P9_DIALECT_2000L;
+  } else {
     SetError("Invalid version string");
     return false;
   }
 
+  // the client's msize is what it can take, answer with what we agree to
+  if (m_msize > P9_MAX_MSIZE) {
+    m_msize = P9_MAX_MSIZE;
+  }
+  if (m_msize <= P9_IOHDRSZ) {
+    SetError("msize too small");
+    return false;
+  }
+  core->SetMSize(m_msize);
+  core->SetDialect(dialect);
+
   return true;
 }
 
@@ -138,6 +205,7 @@ TFlush::TFlush(uint16_t tag, uint8_t *body, size_t size) : TRequest(P9_TFLUSH, t
 }
 
 bool TFlush::Execute(P9Core *core) {
+  core->FlushRequest(this, m_oldtag);
   return true;
 }
 
@@ -242,10 +310,19 @@ bool TWalk::Execute(P9Core *core) {
     core->RemoveFid(m_fid);
   }
 
-  // now associate the new fid with the back
+  // now associate the new fid with the back. a clone gets an object of
+  // its own, requests on the two fids aren't ordered against each other and
+  // would share the open file's state
   QidObject *newQid = m_qids.back();
+  bool clone = m_wnames.empty() && m_fid != m_newfid;
+  if (clone) {
+    newQid = base->Clone();
+  }
   TRACE_PRINT("[%x] Binding %lx to %d", m_tag, newQid->Path(), m_newfid);
   if (!core->BindFid(m_newfid, newQid)) {
+    if (clone) {
+      delete newQid;
+    }
     SetError("Newfid already bound");
     return false;
   }
@@ -283,8 +360,13 @@ bool TOpen::Execute(P9Core *core) {
   }
 
   TRACE_PRINT("[%x] Found %d at Qid %lx", m_tag, m_fid, qid->Path());
-  if (qid->Type() != P9_QTFILE) {
-    SetError("Can only read from files");
+  if (qid->Type() != P9_QTFILE && qid->Type() != P9_QTDIR) {
+    SetError("Can only open files and directories");
+    return false;
+  }
+
+  if (qid->Type() == P9_QTDIR && (m_mode & 3) != P9_OREAD) {
+    SetError("Directories can only be opened for reading");
     return false;
   }
 
@@ -294,6 +376,7 @@ bool TOpen::Execute(P9Core *core) {
   }
 
   qid->Qid(&m_qid);
+  m_iounit = core->IOUnit();
 
   return true;
 }
@@ -303,7 +386,7 @@ void TOpen::show(void) {
 }
 
 RResponse *TOpen::Respond() {
-  return new ROpen(m_tag, m_qid);
+  return new ROpen(m_tag, m_qid, m_iounit);
 }
 
 TCreate::TCreate(uint16_t tag, uint8_t *body, size_t size) : TRequest(P9_TCREATE, tag) {
@@ -355,6 +438,7 @@ bool TCreate::Execute(P9Core *core) {
   }
 
   child->Qid(&m_qid);
+  m_iounit = core->IOUnit();
   return true;
 }
 
@@ -363,7 +447,7 @@ void TCreate::show(void) {
 }
 
 RResponse *TCreate::Respond() {
-  return new RCreate(m_tag, m_qid);
+  return new RCreate(m_tag, m_qid, m_iounit);
 }
 
 TRead::TRead(uint16_t tag, uint8_t *body, size_t size) : TRequest(P9_TREAD, tag) {
@@ -374,46 +458,96 @@ TRead::TRead(uint16_t tag, uint8_t *body, size_t size) : TRequest(P9_TREAD, tag)
   READVAL(m_count);
 }
 
-bool TRead::Execute(P9Core *core) {
+QidObject *TRead::Ready(P9Core *core) {
   QidObject *obj = core->GetFid(m_fid);
   if (!obj) {
     SetError("No such fid");
-    return false;
+    return NULL;
   }
 
-  if (obj->Type() != P9_QTFILE) {
-    SetError("Can only read from files");
-    return false;
+  if (obj->Type() != P9_QTFILE && obj->Type() != P9_QTDIR) {
+    SetError("Can only read from files and directories");
+    return NULL;
   }
 
   if (!obj->Opened()) {
     SetError("Fid must be open to read");
-    return false;
+    return NULL;
+  }
+
+  if (m_reply.empty()) {
+    SetError("No reply buffer");
+    return NULL;
   }
 
-  // TODO test count against the core's MSize
-  // TODO simple bug here by setting msize
-  if (m_count > 0x1000) {
-    SetError("Count too large");
+  // read straight into the reply behind the Rread header. anything past
+  // the negotiated msize or what the buffer can hold is left for the next
+  // read
+  if (m_count > core->IOUnit()) {
+    m_count = core->IOUnit();
+  }
+  m_data = IovSlice(m_reply, P9_RREAD_DATA_OFFSET, m_count);
+  return obj;
+}
+
+bool TRead::Execute(P9Core *core) {
+  QidObject *obj = Ready(core);
+  if (!obj) {
     return false;
   }
 
-  m_data = obj->Read(m_offset, m_count);
-  if (!m_data) {
+  // directories read as packed stat records, as many as the count holds
+  ssize_t count;
+  if (obj->Type() == P9_QTDIR) {
+    count = obj->ReadDir(m_offset, m_data.data(), m_data.size());
+  } else {
+    count = obj->Read(m_offset, m_data.data(), m_data.size());
+  }
+  if (count < 0) {
     SetError("Read failed");
     return false;
   }
+  m_count = count;
 
   return true;
 }
 
+bool TRead::PrepareIo(P9Core *core, IoRing *ring) {
+  // directory reads build their records here, they stay synchronous
+  QidObject *obj = core->GetFid(m_fid);
+  if (!obj || obj->Type() != P9_QTFILE) {
+    return false;
+  }
+
+  obj = Ready(core);
+  if (!obj) {
+    // Process reports the error
+    m_errored = false;
+    return false;
+  }
+  if (obj->Buffered(m_offset, m_count, false)) {
+    return false;
+  }
+  return obj->SubmitRead(ring, m_offset, m_data.data(), m_data.size(),
+                         static_cast<TRequest *>(this));
+}
+
+void TRead::IoDone(int32_t res) {
+  if (res < 0) {
+    TRACE_PRINT("Failed to read at offset %lx", m_offset);
+    SetError("Read failed", -res);
+    return;
+  }
+  m_count = res;
+}
+
 void TRead::show() {
   TRACE_PRINT("[%x] Read of %d at %lx %d\n", m_tag, m_fid, m_offset, m_count);
 }
 
 RResponse *TRead::Respond(void) {
-  TRACE_PRINT("[%x] Read complete with %d bytes %s\n", m_tag, m_count, m_data.get());
-  return new RRead(m_tag, m_count, std::move(m_data));
+  TRACE_PRINT("[%x] Read complete with %d bytes\n", m_tag, m_count);
+  return new RRead(m_tag, m_count);
 }
 
 TWrite::TWrite(uint16_t tag, uint8_t *body, size_t size) : TRequest(P9_TWRITE, tag) {
@@ -423,39 +557,84 @@ TWrite::TWrite(uint16_t tag, uint8_t *body, size_t size) : TRequest(P9_TWRITE, t
   READVAL(m_offset);
   READVAL(m_count);
 
-  m_data = std::make_unique<uint8_t[]>(m_count);
-  READ(m_data.get(), m_count);
+  // the data is written out of the request buffer, see SetPayload
+  if (size < m_count) throw std::exception();
+  m_payload_offset = offset;
 }
 
-bool TWrite::Execute(P9Core *core) {
+QidObject *TWrite::Ready(P9Core *core) {
   QidObject *obj = core->GetFid(m_fid);
   if (!obj) {
     SetError("No such fid");
-    return false;
+    return NULL;
   }
 
   TRACE_PRINT("Preparing to write to %d\n", m_fid);
 
   if (obj->Type() != P9_QTFILE) {
     SetError("Can only write to files");
-    return false;
+    return NULL;
   }
 
   if (!obj->Opened()) {
     SetError("Fid must be open to write");
+    return NULL;
+  }
+
+  if (m_count && m_payload.empty()) {
+    SetError("Write data outside the request buffer");
+    return NULL;
+  }
+
+  // like reads, writes past the negotiated msize come back short
+  if (m_count > core->IOUnit()) {
+    m_count = core->IOUnit();
+  }
+  m_data = IovSlice(m_payload, 0, m_count);
+  return obj;
+}
+
+bool TWrite::Execute(P9Core *core) {
+  QidObject *obj = Ready(core);
+  if (!obj) {
     return false;
   }
 
   // update count with how many bytes were written
-  m_count = obj->Write(m_offset, std::move(m_data), m_count);
-  if (!m_count) {
+  ssize_t count = obj->Write(m_offset, m_data.data(), m_data.size());
+  if (count < 0) {
     SetError("Failed to write to fid");
     return false;
   }
+  m_count = count;
 
   return true;
 }
 
+bool TWrite::PrepareIo(P9Core *core, IoRing *ring) {
+  m_obj = Ready(core);
+  if (!m_obj) {
+    // Process reports the error
+    m_errored = false;
+    return false;
+  }
+  if (m_obj->Buffered(m_offset, m_count, true)) {
+    return false;
+  }
+  return m_obj->SubmitWrite(ring, m_offset, m_data.data(), m_data.size(),
+                            static_cast<TRequest *>(this));
+}
+
+void TWrite::IoDone(int32_t res) {
+  if (res < 0) {
+    TRACE_PRINT("Failed to write at offset %lx", m_offset);
+    SetError("Failed to write to fid", -res);
+    return;
+  }
+  m_obj->Written();
+  m_count = res;
+}
+
 RResponse *TWrite::Respond() {
   return new RWrite(m_tag, m_count);
 }
@@ -543,8 +722,7 @@ bool TStat::Execute(P9Core *core) {
     SetError("No such fid");
   }
 
-  m_stat = obj->Stat();
-  if (!m_stat) {
+  if (!obj->Stat(&m_stat)) {
     SetError("Failed to stat");
     return false;
   }
@@ -553,7 +731,7 @@ bool TStat::Execute(P9Core *core) {
 }
 
 RResponse *TStat::Respond() {
-  return new RStat(m_tag, std::move(m_stat));
+  return new RStat(m_tag, m_stat);
 }
 
 TWstat::TWstat(uint16_t tag, uint8_t *body, size_t size) : TRequest(P9_TWSTAT, tag) {
@@ -567,3 +745,245 @@ TWstat::TWstat(uint16_t tag, uint8_t *body, size_t size) : TRequest(P9_TWSTAT, t
   m_stat = std::make_unique<uint8_t[]>(nstat);
   READ(m_stat.get(), nstat);
 }
+
+TLopen::TLopen(uint16_t tag, uint8_t *body, size_t size) : TRequest(P9_TLOPEN, tag) {
+  size_t offset = 0;
+
+  READVAL(m_fid);
+  READVAL(m_flags);
+}
+
+bool TLopen::Execute(P9Core *core) {
+  QidObject *qid = core->GetFid(m_fid);
+  if (!qid) {
+    SetError("No such fid", EBADF);
+    return false;
+  }
+
+  if (qid->Type() != P9_QTFILE && qid->Type() != P9_QTDIR) {
+    SetError("Can only open files and directories", EINVAL);
+    return false;
+  }
+
+  // the access mode is O_RDONLY/O_WRONLY/O_RDWR, the same numbers as
+  // OREAD/OWRITE/ORDWR
+  uint8_t mode = m_flags & O_ACCMODE;
+  if (qid->Type() == P9_QTDIR && mode != P9_OREAD) {
+    SetError("Directories can only be opened for reading", EISDIR);
+    return false;
+  }
+
+  errno = 0;
+  if (!qid->Open(mode, m_flags)) {
+    SetError("Failed to open", errno ? errno : EIO);
+    return false;
+  }
+
+  qid->Qid(&m_qid);
+  m_iounit = core->IOUnit();
+  return true;
+}
+
+RResponse *TLopen::Respond() {
+  return new RLopen(m_tag, m_qid, m_iounit);
+}
+
+TLcreate::TLcreate(uint16_t tag, uint8_t *body, size_t size) : TRequest(P9_TLCREATE, tag) {
+  size_t offset = 0;
+
+  READVAL(m_fid);
+  READSTR(m_name);
+  READVAL(m_flags);
+  READVAL(m_mode);
+  READVAL(m_gid);
+}
+
+bool TLcreate::Valid() {
+  return LegalName(m_name);
+}
+
+bool TLcreate::Execute(P9Core *core) {
+  // fid starts out as the parent directory and ends up as the new file
+  QidObject *base = core->GetFid(m_fid);
+  if (!base) {
+    SetError("No such fid", EBADF);
+    return false;
+  }
+
+  if (base->Type() != P9_QTDIR) {
+    SetError("Fid is not a directory", ENOTDIR);
+    return false;
+  }
+
+  // a plain file, mkdir has a message of its own in 9P2000.L
+  errno = 0;
+  QidObject *child = base->CreateChild(m_name, m_mode & 0777);
+  if (!child) {
+    SetError("Failed to create", errno ? errno : EIO);
+    return false;
+  }
+
+  errno = 0;
+  if (!child->Open(m_flags & O_ACCMODE, m_flags)) {
+    SetError("Failed to open", errno ? errno : EIO);
+    delete child;
+    return false;
+  }
+
+  core->RemoveFid(m_fid);
+  if (!core->BindFid(m_fid, child)) {
+    SetError("Failed to bind to fid", EBADF);
+    return false;
+  }
+
+  child->Qid(&m_qid);
+  m_iounit = core->IOUnit();
+  return true;
+}
+
+RResponse *TLcreate::Respond() {
+  return new RLcreate(m_tag, m_qid, m_iounit);
+}
+
+TGetattr::TGetattr(uint16_t tag, uint8_t *body, size_t size) : TRequest(P9_TGETATTR, tag) {
+  size_t offset = 0;
+
+  READVAL(m_fid);
+  READVAL(m_request_mask);
+}
+
+bool TGetattr::Execute(P9Core *core) {
+  QidObject *obj = core->GetFid(m_fid);
+  if (!obj) {
+    SetError("No such fid", EBADF);
+    return false;
+  }
+
+  if (!obj->GetAttr(m_request_mask, &m_attr)) {
+    SetError("Failed to stat", ENOENT);
+    return false;
+  }
+  return true;
+}
+
+RResponse *TGetattr::Respond() {
+  return new RGetattr(m_tag, m_attr);
+}
+
+TReaddir::TReaddir(uint16_t tag, uint8_t *body, size_t size) : TRequest(P9_TREADDIR, tag) {
+  size_t offset = 0;
+
+  READVAL(m_fid);
+  READVAL(m_offset);
+  READVAL(m_count);
+}
+
+bool TReaddir::Execute(P9Core *core) {
+  QidObject *obj = core->GetFid(m_fid);
+  if (!obj) {
+    SetError("No such fid", EBADF);
+    return false;
+  }
+
+  if (obj->Type() != P9_QTDIR) {
+    SetError("Fid is not a directory", ENOTDIR);
+    return false;
+  }
+
+  if (!obj->Opened()) {
+    SetError("Fid must be open to read", EBADF);
+    return false;
+  }
+
+  if (m_reply.empty()) {
+    SetError("No reply buffer");
+    return false;
+  }
+
+  // Rreaddir's count and data sit where Rread's do
+  if (m_count > core->IOUnit()) {
+    m_count = core->IOUnit();
+  }
+  IoVecs data = IovSlice(m_reply, P9_RREAD_DATA_OFFSET, m_count);
+
+  ssize_t count = obj->ReadDirL(m_offset, data.data(), data.size());
+  if (count < 0) {
+    SetError("Read failed", EINVAL);
+    return false;
+  }
+  m_count = count;
+
+  return true;
+}
+
+RResponse *TReaddir::Respond() {
+  return new RReaddir(m_tag, m_count);
+}
+
+TFsync::TFsync(uint16_t tag, uint8_t *body, size_t size) : TRequest(P9_TFSYNC, tag) {
+  size_t offset = 0;
+
+  READVAL(m_fid);
+  READVAL(m_datasync);
+}
+
+bool TFsync::Execute(P9Core *core) {
+  QidObject *obj = core->GetFid(m_fid);
+  if (!obj) {
+    SetError("No such fid", EBADF);
+    return false;
+  }
+
+  errno = 0;
+  if (!obj->Sync(m_datasync != 0)) {
+    SetError("Failed to sync", errno ? errno : EBADF);
+    return false;
+  }
+  return true;
+}
+
+bool TFsync::PrepareIo(P9Core *core, IoRing *ring) {
+  QidObject *obj = core->GetFid(m_fid);
+  if (!obj || obj->Buffered(0, 0, true)) {
+    return false;
+  }
+  return obj->SubmitSync(ring, m_datasync != 0, static_cast<TRequest *>(this));
+}
+
+void TFsync::IoDone(int32_t res) {
+  if (res < 0) {
+    SetError("Failed to sync", -res);
+  }
+}
+
+RResponse *TFsync::Respond() {
+  return new RFsync(m_tag);
+}
+
+TLock::TLock(uint16_t tag, uint8_t *body, size_t size) : TRequest(P9_TLOCK, tag) {
+  size_t offset = 0;
+
+  READVAL(m_fid);
+  READVAL(m_locktype);
+  READVAL(m_flags);
+  READVAL(m_start);
+  READVAL(m_length);
+  READVAL(m_proc_id);
+  READSTR(m_client_id);
+}
+
+bool TLock::Execute(P9Core *core) {
+  QidObject *obj = core->GetFid(m_fid);
+  if (!obj) {
+    SetError("No such fid", EBADF);
+    return false;
+  }
+
+  // a conflicting lock is a status, not an error
+  m_status = obj->Lock(m_locktype, m_start, m_length);
+  return true;
+}
+
+RResponse *TLock::Respond() {
+  return new RLock(m_tag, m_status);
+}
@@ -4,10 +4,33 @@
 #include "rresponses.hpp"
 #include "iostructs.h"
 #include "p9core.hpp"
+#include "msgpool.hpp"
+#include <errno.h>
 #include <unistd.h>
+#include <sys/uio.h>
+#include <functional>
 #include <memory>
 #include <string>
 #include <list>
+#include <vector>
+
+// 9P2000.L additions, only accepted once TVERSION negotiated it
+enum {
+    P9_TLERROR = 6,
+    P9_RLERROR,
+    P9_TLOPEN = 12,
+    P9_RLOPEN,
+    P9_TLCREATE = 14,
+    P9_RLCREATE,
+    P9_TGETATTR = 24,
+    P9_RGETATTR,
+    P9_TREADDIR = 40,
+    P9_RREADDIR,
+    P9_TFSYNC = 50,
+    P9_RFSYNC,
+    P9_TLOCK = 52,
+    P9_RLOCK,
+};
 
 enum {
     P9_TVERSION = 100,
@@ -51,28 +74,152 @@ typedef struct __attribute__((packed)) {
   p9_msg_t msg;
 } p9_pkt_t;
 
-class TRequest {
+// Rread is size[4] type[1] tag[2] count[4] data[count]
+#define P9_RREAD_DATA_OFFSET (sizeof(p9_pkt_t) + sizeof(uint32_t))
+
+// how many bytes of a message (type onwards, size long) have to be copied
+// out of the guest to parse it. TWrite's data stays in the request buffer
+size_t P9ParseLength(p9_msg_t *msg, size_t size);
+
+// the most iovecs a request buffer comes in, a descriptor chain's worth
+#define P9_MAX_IOVS 16
+
+// iovecs kept inline, so requests don't allocate for them
+class IoVecs {
+  public:
+  struct iovec *data() { return m_iov; }
+  const struct iovec *begin() const { return m_iov; }
+  const struct iovec *end() const { return m_iov + m_count; }
+  size_t size() const { return m_count; }
+  bool empty() const { return !m_count; }
+  void clear() { m_count = 0; }
+  // false once it's full
+  bool push_back(const struct iovec &iov) {
+    if (m_count == P9_MAX_IOVS) {
+      return false;
+    }
+    m_iov[m_count++] = iov;
+    return true;
+  }
+
+  private:
+  struct iovec m_iov[P9_MAX_IOVS];
+  size_t m_count = 0;
+};
+
+// a device buffer a request's iovecs point into. it goes with the request
+// and is deleted along with it, unless the device takes it back first
+class RequestBuffer : public Pooled {
+  public:
+  virtual ~RequestBuffer() = default;
+};
+
+class TRequest : public Pooled {
   protected:
   uint8_t m_type;
   uint16_t m_tag;
+  // virtio queue pair the request arrived on, the response goes back there
+  uint32_t m_queue_pair = 0;
 
   bool m_completed = true;
   bool m_errored = false;
+  // 9P2000.L answers errors with Rlerror and this errno
+  bool m_dotl = false;
+  int m_ecode = EIO;
+  // both protected by P9Core's request lock
   bool m_cancelled = false;
+  bool m_started = false;
   std::string m_error;
 
+  // buffer the response is going to, for requests that build their reply
+  // in place (RepliesInPlace). set by the device before Process
+  IoVecs m_reply;
+  std::unique_ptr<RequestBuffer> m_reply_buf;
+  // bulk data left in the request buffer (PayloadSize), and the buffer
+  // itself, handed back once the request is gone. empty if the device
+  // couldn't point us at it
+  IoVecs m_payload;
+  std::unique_ptr<RequestBuffer> m_payload_buf;
+
+  // for P9Stats: when P9Core registered and started the request, and the
+  // sizes of the message and its response
+  uint64_t m_queued_ns = 0;
+  uint64_t m_started_ns = 0;
+  uint32_t m_msg_size = 0;
+  uint32_t m_reply_size = 0;
+
+  // the next request waiting on each of its fids (OrderFid, OrderNewFid)
+  // and how many of them it's still waiting for, see RequestPool
+  friend class RequestPool;
+  TRequest *m_fid_next[2] = { NULL, NULL };
+  int m_fid_waits = 0;
+
+  // the response once the request's run, or its error
+  RResponse *Finish();
+
   public:
   TRequest(uint8_t type, uint16_t tag);
-  void SetError(std::string error);
+  void SetError(std::string error, int ecode = EIO);
 
   uint8_t Type() { return m_type; }
   uint16_t Tag() { return m_tag; }
+  uint32_t QueuePair() { return m_queue_pair; }
+  void SetQueuePair(uint32_t pair) { m_queue_pair = pair; }
   RResponse *Process(P9Core *core);
+  // the io_uring alternative to Process: queues the request's I/O on ring
+  // and returns true, CompleteIo then takes the result and builds the
+  // response. false if the request has to go through Process instead
+  bool SubmitIo(P9Core *core, IoRing *ring);
+  RResponse *CompleteIo(int32_t res);
   RResponse *GenerateError();
-
+  bool Cancelled() { return m_cancelled; }
+  bool Started() { return m_started; }
+  bool Errored() { return m_errored; }
+  void Start() { m_started = true; }
+  void SetQueuedAt(uint64_t ns) { m_queued_ns = ns; }
+  void SetStartedAt(uint64_t ns) { m_started_ns = ns; }
+  uint64_t QueuedAt() { return m_queued_ns; }
+  uint64_t StartedAt() { return m_started_ns; }
+  void SetMessageSize(uint32_t size) { m_msg_size = size; }
+  void SetReplySize(uint32_t size) { m_reply_size = size; }
+  uint32_t MessageSize() { return m_msg_size; }
+  uint32_t ReplySize() { return m_reply_size; }
+  void SetReplyBuffer(const IoVecs &reply, std::unique_ptr<RequestBuffer> buf) {
+    m_reply = reply;
+    m_reply_buf = std::move(buf);
+  }
+  std::unique_ptr<RequestBuffer> TakeReplyBuffer() {
+    m_reply.clear();
+    return std::move(m_reply_buf);
+  }
+  void SetPayload(const IoVecs &payload, std::unique_ptr<RequestBuffer> buf) {
+    m_payload = payload;
+    m_payload_buf = std::move(buf);
+  }
+  // requests on the same fid run in arrival order, -1 if the request
+  // doesn't name one and can run whenever
+  virtual int64_t OrderFid() { return -1; }
+  // a second fid the request binds, ordered the same way. -1 for none
+  virtual int64_t OrderNewFid() { return -1; }
+
+  // whether the request needs its reply buffer before it runs
+  virtual bool RepliesInPlace() { return false; }
+  // where in the message body bulk data starts and how long it is, 0 for
+  // requests that copy everything they need when parsed
+  virtual size_t PayloadOffset() { return 0; }
+  virtual uint32_t PayloadSize() { return 0; }
+
+  virtual ~TRequest() = default;
   virtual void show() { return; }
   virtual void Cancel() { m_cancelled = true; }
   virtual bool Valid() { return true; }
+  // only valid once 9P2000.L has been negotiated
+  virtual bool DotL() { return false; }
+  // whether the request does file I/O SubmitIo can queue. PrepareIo is
+  // the request's part of SubmitIo, IoDone gets the result once it's back
+  virtual bool AsyncIo() { return false; }
+  virtual bool PrepareIo(P9Core *core, IoRing *ring) { return false; }
+  virtual void IoDone(int32_t res) { }
   virtual bool Execute(P9Core *core) { return false; }
   virtual RResponse *Respond() { return NULL; }
 };
@@ -106,7 +253,7 @@ class TAuth : public TRequest {
 
 class TFlush : public TRequest {
   private:
-  uint32_t m_oldtag;
+  uint16_t m_oldtag;
 
   public:
   TFlush(uint16_t tag, uint8_t *body, size_t size);
@@ -126,6 +273,7 @@ class TAttach : public TRequest {
 
   public:
   TAttach(uint16_t tag, uint8_t *body, size_t size);
+  int64_t OrderFid() { return m_fid; }
   bool Execute(P9Core *core);
   RResponse *Respond();
 };
@@ -140,6 +288,8 @@ class TWalk : public TRequest {
 
   public:
   TWalk(uint16_t tag, uint8_t *body, size_t size);
+  int64_t OrderFid() { return m_fid; }
+  int64_t OrderNewFid() { return m_newfid == m_fid ? -1 : m_newfid; }
   void show(void);
   bool Valid();
   bool Execute(P9Core *core);
@@ -152,9 +302,11 @@ class TOpen : public TRequest {
   uint8_t m_mode;
 
   qid_t m_qid;
+  uint32_t m_iounit;
 
   public:
   TOpen(uint16_t tag, uint8_t *body, size_t size);
+  int64_t OrderFid() { return m_fid; }
   void show(void);
   bool Execute(P9Core *core);
   RResponse *Respond();
@@ -168,9 +320,11 @@ class TCreate : public TRequest {
   uint8_t m_mode;
 
   qid_t m_qid;
+  uint32_t m_iounit;
 
   public:
   TCreate(uint16_t tag, uint8_t *body, size_t size);
+  int64_t OrderFid() { return m_fid; }
   void show(void);
   bool Valid();
   bool Execute(P9Core *core);
@@ -183,10 +337,19 @@ class TRead : public TRequest {
   uint64_t m_offset;
   uint32_t m_count;
 
-  std::unique_ptr<uint8_t[]> m_data;
+  // what's being read into, which stays put while it's queued
+  IoVecs m_data;
+
+  // the fid's object once the read can go ahead
+  QidObject *Ready(P9Core *core);
 
   public:
   TRead(uint16_t tag, uint8_t *body, size_t size);
+  int64_t OrderFid() { return m_fid; }
+  bool RepliesInPlace() { return true; }
+  bool AsyncIo() { return true; }
+  bool PrepareIo(P9Core *core, IoRing *ring);
+  void IoDone(int32_t res);
   void show(void);
   bool Execute(P9Core *core);
   RResponse *Respond(void);
@@ -197,10 +360,23 @@ class TWrite : public TRequest {
   uint32_t m_fid;
   uint64_t m_offset;
   uint32_t m_count;
-  std::unique_ptr<uint8_t[]> m_data;
+  size_t m_payload_offset;
+
+  // what's being written while it's queued
+  QidObject *m_obj = NULL;
+  IoVecs m_data;
+
+  // the fid's object once the write can go ahead
+  QidObject *Ready(P9Core *core);
 
   public:
   TWrite(uint16_t tag, uint8_t *body, size_t size);
+  int64_t OrderFid() { return m_fid; }
+  size_t PayloadOffset() { return m_payload_offset; }
+  uint32_t PayloadSize() { return m_count; }
+  bool AsyncIo() { return true; }
+  bool PrepareIo(P9Core *core, IoRing *ring);
+  void IoDone(int32_t res);
   bool Execute(P9Core *core);
   RResponse *Respond(void);
 };
@@ -211,6 +387,7 @@ class TClunk : public TRequest {
 
   public:
   TClunk(uint16_t tag, uint8_t *body, size_t size);
+  int64_t OrderFid() { return m_fid; }
   bool Execute(P9Core *core);
   RResponse *Respond();
 };
@@ -221,6 +398,7 @@ class TRemove : public TRequest {
 
   public:
   TRemove(uint16_t tag, uint8_t *body, size_t size);
+  int64_t OrderFid() { return m_fid; }
   bool Execute(P9Core *core);
   RResponse *Respond();
 };
@@ -229,10 +407,11 @@ class TStat : public TRequest {
   private:
   uint32_t m_fid;
 
-  std::unique_ptr<p9_stat_t> m_stat;
+  p9_stat_t m_stat;
 
   public:
   TStat(uint16_t tag, uint8_t *body, size_t size);
+  int64_t OrderFid() { return m_fid; }
   bool Execute(P9Core *core);
   RResponse *Respond();
 };
@@ -244,6 +423,109 @@ class TWstat : public TRequest {
 
   public:
   TWstat(uint16_t tag, uint8_t *body, size_t size);
+  int64_t OrderFid() { return m_fid; }
+};
+
+class TLopen : public TRequest {
+  private:
+  uint32_t m_fid;
+  uint32_t m_flags;
+
+  qid_t m_qid;
+  uint32_t m_iounit;
+
+  public:
+  TLopen(uint16_t tag, uint8_t *body, size_t size);
+  int64_t OrderFid() { return m_fid; }
+  bool DotL() { return true; }
+  bool Execute(P9Core *core);
+  RResponse *Respond();
+};
+
+class TLcreate : public TRequest {
+  private:
+  uint32_t m_fid;
+  std::string m_name;
+  uint32_t m_flags;
+  uint32_t m_mode;
+  uint32_t m_gid;
+
+  qid_t m_qid;
+  uint32_t m_iounit;
+
+  public:
+  TLcreate(uint16_t tag, uint8_t *body, size_t size);
+  int64_t OrderFid() { return m_fid; }
+  bool DotL() { return true; }
+  bool Valid();
+  bool Execute(P9Core *core);
+  RResponse *Respond();
+};
+
+class TGetattr : public TRequest {
+  private:
+  uint32_t m_fid;
+  uint64_t m_request_mask;
+
+  p9_attr_t m_attr;
+
+  public:
+  TGetattr(uint16_t tag, uint8_t *body, size_t size);
+  int64_t OrderFid() { return m_fid; }
+  bool DotL() { return true; }
+  bool Execute(P9Core *core);
+  RResponse *Respond();
+};
+
+class TReaddir : public TRequest {
+  private:
+  uint32_t m_fid;
+  uint64_t m_offset;
+  uint32_t m_count;
+
+  public:
+  TReaddir(uint16_t tag, uint8_t *body, size_t size);
+  int64_t OrderFid() { return m_fid; }
+  bool DotL() { return true; }
+  bool RepliesInPlace() { return true; }
+  bool Execute(P9Core *core);
+  RResponse *Respond();
+};
+
+class TFsync : public TRequest {
+  private:
+  uint32_t m_fid;
+  uint32_t m_datasync;
+
+  public:
+  TFsync(uint16_t tag, uint8_t *body, size_t size);
+  int64_t OrderFid() { return m_fid; }
+  bool DotL() { return true; }
+  bool AsyncIo() { return true; }
+  bool PrepareIo(P9Core *core, IoRing *ring);
+  void IoDone(int32_t res);
+  bool Execute(P9Core *core);
+  RResponse *Respond();
+};
+
+class TLock : public TRequest {
+  private:
+  uint32_t m_fid;
+  uint8_t m_locktype;
+  uint32_t m_flags;
+  uint64_t m_start;
+  uint64_t m_length;
+  uint32_t m_proc_id;
+  std::string m_client_id;
+
+  uint8_t m_status;
+
+  public:
+  TLock(uint16_t tag, uint8_t *body, size_t size);
+  int64_t OrderFid() { return m_fid; }
+  bool DotL() { return true; }
+  bool Execute(P9Core *core);
+  RResponse *Respond();
 };
 
 #endif
@@ -0,0 +1,247 @@
+// Compares ThreadedQueue against SpscRingQueue and MpmcRingQueue.
+//
+//   queue-bench [-n items] [-p producers] [-c consumers] [-b batch] [-q capacity]
+//
+// Throughput: producers put n items between them, batch at a time, and
+// consumers get them back up to batch at a time. SpscRingQueue only runs
+// with one of each. ThreadedQueue has no batch calls, so its batches are
+// loops of put and try_get. Ping-pong: two threads bounce one item through
+// a pair of queues, which measures a blocked get being woken.
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "broadcooom/myqueue.hpp"
+#include "broadcooom/ringqueue.hpp"
+
+#define DONE (~0ULL)
+
+struct Threaded {
+   ThreadedQueue<uint64_t> q;
+
+   Threaded(size_t) { }
+   void put(uint64_t v) { q.put(v); }
+   uint64_t get() { return q.get(); }
+   void put_batch(uint64_t *v, size_t n)
+   {
+      for (size_t i = 0; i < n; i++)
+      {
+         q.put(v[i]);
+      }
+   }
+   size_t get_batch(uint64_t *v, size_t max)
+   {
+      size_t n = 1;
+      v[0] = q.get();
+      while (n < max && q.try_get(v[n]))
+      {
+         n++;
+      }
+      return n;
+   }
+};
+
+template <class Q>
+struct Ring {
+   Q q;
+
+   Ring(size_t capacity) : q(capacity) { }
+   void put(uint64_t v) { q.put(v); }
+   uint64_t get() { return q.get(); }
+   void put_batch(uint64_t *v, size_t n) { q.put_batch(v, n); }
+   size_t get_batch(uint64_t *v, size_t max) { return q.get_batch(v, max); }
+};
+
+static double now()
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// items per second through the queue, or 0 if the items that came out
+// aren't the ones that went in
+template <class Q>
+static double throughput(size_t items, int producers, int consumers,
+                         size_t batch, size_t capacity)
+{
+   Q queue(capacity);
+   std::atomic<uint64_t> sum{0};
+   std::vector<std::thread> threads;
+
+   double start = now();
+   for (int c = 0; c < consumers; c++)
+   {
+      threads.push_back(std::thread([&]{
+         std::vector<uint64_t> buf(batch);
+         uint64_t local = 0;
+         while (1)
+         {
+            size_t n = batch == 1 ? (buf[0] = queue.get(), 1) : queue.get_batch(buf.data(), batch);
+            size_t done = 0;
+            for (size_t i = 0; i < n; i++)
+            {
+               if (buf[i] == DONE)
+               {
+                  done++;
+               }
+               else
+               {
+                  local += buf[i];
+               }
+            }
+            if (done)
+            {
+               // one each, hand back any we took for the others
+               for (size_t i = 1; i < done; i++)
+               {
+                  queue.put(DONE);
+               }
+               break;
+            }
+         }
+         sum += local;
+      }));
+   }
+
+   std::vector<std::thread> puts;
+   for (int p = 0; p < producers; p++)
+   {
+      puts.push_back(std::thread([&, p]{
+         std::vector<uint64_t> buf(batch);
+         for (size_t i = p; i < items; )
+         {
+            size_t n = 0;
+            for (; n < batch && i < items; n++, i += producers)
+            {
+               buf[n] = i;
+            }
+            if (batch == 1)
+            {
+               queue.put(buf[0]);
+            }
+            else
+            {
+               queue.put_batch(buf.data(), n);
+            }
+         }
+      }));
+   }
+   for (auto &t : puts)
+   {
+      t.join();
+   }
+   for (int c = 0; c < consumers; c++)
+   {
+      queue.put(DONE);
+   }
+   for (auto &t : threads)
+   {
+      t.join();
+   }
+   double elapsed = now() - start;
+
+   if (sum != (uint64_t)items * (items - 1) / 2)
+   {
+      return 0;
+   }
+   return items / elapsed;
+}
+
+// average round trip in nanoseconds
+template <class Q>
+static double pingpong(size_t rounds, size_t capacity)
+{
+   Q ping(capacity), pong(capacity);
+
+   std::thread echo([&]{
+      while (1)
+      {
+         uint64_t v = ping.get();
+         pong.put(v);
+         if (v == DONE)
+         {
+            break;
+         }
+      }
+   });
+
+   double start = now();
+   for (size_t i = 0; i < rounds; i++)
+   {
+      ping.put(i);
+      pong.get();
+   }
+   double elapsed = now() - start;
+   ping.put(DONE);
+   pong.get();
+   echo.join();
+   return elapsed * 1e9 / rounds;
+}
+
+static void usage(const char *prog)
+{
+   fprintf(stderr, "usage: %s [-n items] [-p producers] [-c consumers] [-b batch] [-q capacity]\n", prog);
+   exit(1);
+}
+
+int main(int argc, char **argv)
+{
+   size_t items = 2000000;
+   int producers = 1;
+   int consumers = 1;
+   size_t batch = 1;
+   size_t capacity = RING_QUEUE_DEFAULT_CAPACITY;
+   int c;
+
+   while ((c = getopt(argc, argv, "n:p:c:b:q:")) != -1)
+   {
+      switch (c)
+      {
+         case 'n':
+            items = strtoul(optarg, NULL, 0);
+            break;
+         case 'p':
+            producers = atoi(optarg);
+            break;
+         case 'c':
+            consumers = atoi(optarg);
+            break;
+         case 'b':
+            batch = strtoul(optarg, NULL, 0);
+            break;
+         case 'q':
+            capacity = strtoul(optarg, NULL, 0);
+            break;
+         default:
+            usage(argv[0]);
+      }
+   }
+   if (!items || producers < 1 || consumers < 1 || !batch || capacity < 2)
+   {
+      usage(argv[0]);
+   }
+
+   printf("%zu items, %d producers, %d consumers, batch %zu, capacity %zu\n",
+          items, producers, consumers, batch, capacity);
+   printf("%-14s %14s %14s\n", "queue", "Mitems/s", "pingpong ns");
+
+   size_t rounds = items / 10 ? items / 10 : 1;
+   printf("%-14s %14.2f %14.0f\n", "ThreadedQueue",
+          throughput<Threaded>(items, producers, consumers, batch, capacity) / 1e6,
+          pingpong<Threaded>(rounds, capacity));
+   if (producers == 1 && consumers == 1)
+   {
+      printf("%-14s %14.2f %14.0f\n", "SpscRingQueue",
+             throughput<Ring<SpscRingQueue<uint64_t> > >(items, 1, 1, batch, capacity) / 1e6,
+             pingpong<Ring<SpscRingQueue<uint64_t> > >(rounds, capacity));
+   }
+   printf("%-14s %14.2f %14.0f\n", "MpmcRingQueue",
+          throughput<Ring<MpmcRingQueue<uint64_t> > >(items, producers, consumers, batch, capacity) / 1e6,
+          pingpong<Ring<MpmcRingQueue<uint64_t> > >(rounds, capacity));
+   return 0;
+}
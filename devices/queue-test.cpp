@@ -0,0 +1,424 @@
+// Stress test for SpscRingQueue and MpmcRingQueue.
+//
+//   queue-test [-n items] [-t seconds]
+//
+// Producers put n items between them with a random mix of put, try_put
+// and put_batch, and consumers take them with get, try_get, get_batch and
+// try_get_batch. Every item has to come out exactly once, and in the order
+// its producer put it as far as any one consumer can tell. Capacities as
+// small as 2 keep the queue wrapping around and both sides parking. The
+// parking checks then hold one side still long enough for the other to
+// park on an empty or full queue and make sure it's woken. Anything that
+// doesn't finish in time counts as a lost wakeup. Exits non-zero on any
+// failure.
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "broadcooom/ringqueue.hpp"
+
+#define DONE (~0ULL)
+// items are the producer in the top half and its count in the bottom
+#define ITEM(p, i) (((uint64_t)(p) << 32) | (i))
+#define ITEM_PRODUCER(v) ((v) >> 32)
+#define ITEM_SEQ(v) ((v) & 0xffffffff)
+// a batch can be bigger than the queue, which it then goes in in pieces
+#define MAX_BATCH 40
+// long enough for the other side to have spun out and parked
+#define PARK_MS 20
+
+enum ops { OPS_SINGLE, OPS_BATCH, OPS_MIXED };
+static const char *op_names[] = { "single", "batch", "mixed" };
+
+static const char *current = "";
+static int failures;
+
+static void timeout(int)
+{
+   // stdio isn't safe here
+   static const char msg[] = "FAIL timed out, lost wakeup in ";
+   ssize_t ret = write(1, msg, sizeof(msg) - 1);
+   ret = write(1, current, strlen(current));
+   ret = write(1, "\n", 1);
+   (void)ret;
+   _exit(1);
+}
+
+static void fail(const char *what, const char *why)
+{
+   printf("FAIL %s: %s\n", what, why);
+   failures++;
+}
+
+static void sleep_ms(int ms)
+{
+   std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+// xorshift, so every thread has its own
+static uint32_t next_rand(uint32_t &state)
+{
+   state ^= state << 13;
+   state ^= state >> 17;
+   state ^= state << 5;
+   return state;
+}
+
+template <class Q>
+static void produce(Q &queue, int p, size_t items, enum ops ops)
+{
+   uint32_t rng = 0x9e3779b9 * (p + 1);
+   uint64_t buf[MAX_BATCH];
+   size_t i = 0;
+   while (i < items)
+   {
+      uint32_t r = next_rand(rng);
+      int op = ops == OPS_MIXED ? r % 3 : ops == OPS_BATCH ? 2 : r % 2;
+      if (op == 2)
+      {
+         size_t n = 1 + (r >> 8) % MAX_BATCH;
+         if (n > items - i)
+         {
+            n = items - i;
+         }
+         for (size_t k = 0; k < n; k++)
+         {
+            buf[k] = ITEM(p, i + k);
+         }
+         queue.put_batch(buf, n);
+         i += n;
+      }
+      else if (op == 1)
+      {
+         uint64_t v = ITEM(p, i);
+         while (!queue.try_put(v))
+         {
+            std::this_thread::yield();
+         }
+         i++;
+      }
+      else
+      {
+         queue.put(ITEM(p, i));
+         i++;
+      }
+   }
+}
+
+// takes items until it gets a DONE, into got
+template <class Q>
+static void consume(Q &queue, int c, enum ops ops, std::vector<uint64_t> &got)
+{
+   uint32_t rng = 0x85ebca6b * (c + 1);
+   uint64_t buf[MAX_BATCH];
+   while (1)
+   {
+      uint32_t r = next_rand(rng);
+      int op = ops == OPS_MIXED ? r % 4 : ops == OPS_BATCH ? 2 + r % 2 : r % 2;
+      size_t max = 1 + (r >> 8) % MAX_BATCH;
+      size_t n;
+      switch (op)
+      {
+         case 0:
+            buf[0] = queue.get();
+            n = 1;
+            break;
+         case 1:
+            n = queue.try_get(buf[0]) ? 1 : 0;
+            break;
+         case 2:
+            n = queue.get_batch(buf, max);
+            break;
+         default:
+            n = queue.try_get_batch(buf, max);
+            break;
+      }
+      if (!n)
+      {
+         std::this_thread::yield();
+         continue;
+      }
+
+      size_t done = 0;
+      for (size_t i = 0; i < n; i++)
+      {
+         if (buf[i] == DONE)
+         {
+            done++;
+         }
+         else
+         {
+            got.push_back(buf[i]);
+         }
+      }
+      if (done)
+      {
+         // one each, hand back any we took for the others
+         for (size_t i = 1; i < done; i++)
+         {
+            queue.put(DONE);
+         }
+         return;
+      }
+   }
+}
+
+// every item came out once, and each consumer saw a producer's items in
+// the order they went in
+static const char *check(std::vector<std::vector<uint64_t> > &got, int producers, size_t items)
+{
+   std::vector<uint8_t> seen(producers * items);
+   size_t total = 0;
+   for (auto &items_got : got)
+   {
+      std::vector<int64_t> last(producers, -1);
+      for (uint64_t v : items_got)
+      {
+         uint64_t p = ITEM_PRODUCER(v);
+         uint64_t i = ITEM_SEQ(v);
+         if (p >= (uint64_t)producers || i >= items)
+         {
+            return "got an item nobody put";
+         }
+         if (seen[p * items + i]++)
+         {
+            return "got an item twice";
+         }
+         if ((int64_t)i <= last[p])
+         {
+            return "got a producer's items out of order";
+         }
+         last[p] = i;
+         total++;
+      }
+   }
+   if (total != producers * items)
+   {
+      return "lost items";
+   }
+   return NULL;
+}
+
+template <class Q>
+static void stress(const char *name, size_t capacity, int producers, int consumers,
+                   enum ops ops, size_t items, int seconds)
+{
+   char what[128];
+   snprintf(what, sizeof(what), "%s capacity %zu, %d producers, %d consumers, %s",
+            name, capacity, producers, consumers, op_names[ops]);
+   current = what;
+   alarm(seconds);
+
+   Q queue(capacity);
+   std::vector<std::vector<uint64_t> > got(consumers);
+   std::vector<std::thread> gets;
+   for (int c = 0; c < consumers; c++)
+   {
+      gets.push_back(std::thread([&, c]{ consume(queue, c, ops, got[c]); }));
+   }
+   std::vector<std::thread> puts;
+   for (int p = 0; p < producers; p++)
+   {
+      puts.push_back(std::thread([&, p]{ produce(queue, p, items / producers, ops); }));
+   }
+   for (auto &t : puts)
+   {
+      t.join();
+   }
+   for (int c = 0; c < consumers; c++)
+   {
+      queue.put(DONE);
+   }
+   for (auto &t : gets)
+   {
+      t.join();
+   }
+   alarm(0);
+
+   const char *why = check(got, producers, items / producers);
+   if (why)
+   {
+      fail(what, why);
+   }
+   else if (queue.size() != 0)
+   {
+      fail(what, "not empty at the end");
+   }
+   else
+   {
+      printf("ok   %s\n", what);
+   }
+}
+
+// consumers park on an empty queue and have to be woken by a put, then a
+// producer parks on a full one and has to be woken as it's drained
+template <class Q>
+static void parking(const char *name, size_t capacity, int consumers, bool batch, int seconds)
+{
+   char what[128];
+   snprintf(what, sizeof(what), "%s capacity %zu, %d parked consumers, %s, parked producer",
+            name, capacity, consumers, batch ? "batch" : "single");
+   current = what;
+   alarm(seconds);
+
+   Q queue(capacity);
+   std::atomic<int> woken{0};
+   std::vector<std::thread> gets;
+   for (int c = 0; c < consumers; c++)
+   {
+      gets.push_back(std::thread([&]{
+         uint64_t v;
+         if (batch)
+         {
+            queue.get_batch(&v, 1);
+         }
+         else
+         {
+            v = queue.get();
+         }
+         woken++;
+      }));
+   }
+   sleep_ms(PARK_MS);
+   // one item at a time, so each put has to wake a consumer of its own
+   for (int c = 0; c < consumers; c++)
+   {
+      queue.put(ITEM(0, c));
+      while (woken.load() < c + 1)
+      {
+         std::this_thread::yield();
+      }
+   }
+   for (auto &t : gets)
+   {
+      t.join();
+   }
+
+   uint64_t v = 0;
+   size_t full = 0;
+   while (queue.try_put(v))
+   {
+      v = ++full;
+   }
+   size_t extra = capacity + MAX_BATCH;
+   std::atomic<bool> put_done{false};
+   std::thread put([&]{
+      std::vector<uint64_t> buf(extra);
+      for (size_t i = 0; i < extra; i++)
+      {
+         buf[i] = full + i;
+      }
+      if (batch)
+      {
+         queue.put_batch(buf.data(), extra);
+      }
+      else
+      {
+         for (size_t i = 0; i < extra; i++)
+         {
+            queue.put(buf[i]);
+         }
+      }
+      put_done = true;
+   });
+   sleep_ms(PARK_MS);
+   const char *why = NULL;
+   if (put_done.load())
+   {
+      why = "put didn't block on a full queue";
+   }
+   // drain one at a time, the parked put has to be woken to fill it again
+   for (size_t i = 0; i < full + extra && !why; i++)
+   {
+      if (queue.get() != i)
+      {
+         why = "items came out of order";
+      }
+   }
+   put.join();
+   alarm(0);
+
+   if (!why && full != capacity)
+   {
+      why = "queue held the wrong number of items";
+   }
+   if (why)
+   {
+      fail(what, why);
+   }
+   else
+   {
+      printf("ok   %s\n", what);
+   }
+}
+
+static void usage(const char *prog)
+{
+   fprintf(stderr, "usage: %s [-n items] [-t seconds]\n", prog);
+   exit(2);
+}
+
+int main(int argc, char **argv)
+{
+   size_t items = 120000;
+   int seconds = 60;
+   int c;
+
+   while ((c = getopt(argc, argv, "n:t:")) != -1)
+   {
+      switch (c)
+      {
+         case 'n':
+            items = strtoul(optarg, NULL, 0);
+            break;
+         case 't':
+            seconds = atoi(optarg);
+            break;
+         default:
+            usage(argv[0]);
+      }
+   }
+   if (!items || seconds < 1)
+   {
+      usage(argv[0]);
+   }
+   signal(SIGALRM, timeout);
+   setvbuf(stdout, NULL, _IOLBF, 0);
+
+   static const size_t capacities[] = { 2, 8, RING_QUEUE_DEFAULT_CAPACITY };
+   static const int threads[][2] = { { 1, 1 }, { 4, 1 }, { 1, 4 }, { 4, 4 } };
+   for (size_t capacity : capacities)
+   {
+      for (int ops = OPS_SINGLE; ops <= OPS_MIXED; ops++)
+      {
+         stress<SpscRingQueue<uint64_t> >("SpscRingQueue", capacity, 1, 1,
+                                          (enum ops)ops, items, seconds);
+         for (auto &t : threads)
+         {
+            stress<MpmcRingQueue<uint64_t> >("MpmcRingQueue", capacity, t[0], t[1],
+                                             (enum ops)ops, items, seconds);
+         }
+      }
+
+      for (int batch = 0; batch < 2; batch++)
+      {
+         parking<SpscRingQueue<uint64_t> >("SpscRingQueue", capacity, 1, batch, seconds);
+         parking<MpmcRingQueue<uint64_t> >("MpmcRingQueue", capacity, 4, batch, seconds);
+      }
+   }
+
+   if (failures)
+   {
+      printf("%d failed\n", failures);
+      return 1;
+   }
+   printf("all passed\n");
+   return 0;
+}
@@ -0,0 +1,181 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "eventloop.h"
+
+#define EVENT_LOOP_BATCH 16
+
+int EventLoopRequested(size_t *workers) {
+  char *env = getenv(EVENT_LOOP_ENV);
+  if (!env)
+    return 0;
+
+  *workers = strtoul(env, NULL, 0);
+  if (*workers > EVENT_LOOP_MAX_WORKERS)
+    *workers = EVENT_LOOP_MAX_WORKERS;
+  return 1;
+}
+
+static int ArmSource(struct event_source *src, int op) {
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  // oneshot keeps a source on at most one worker at a time. a vCPU has a
+  // single request in flight anyway, and an event handler sees kicks that
+  // land while it runs on its next pass
+  ev.events = EPOLLIN | EPOLLONESHOT;
+  ev.data.ptr = src;
+  return epoll_ctl(src->loop->epfd, op, src->fd, &ev);
+}
+
+static void DropChannel(struct event_source *src) {
+  struct event_loop *loop = src->loop;
+  uint64_t one = 1;
+
+  epoll_ctl(loop->epfd, EPOLL_CTL_DEL, src->fd, NULL);
+  if (__atomic_sub_fetch(&loop->nchannels, 1, __ATOMIC_ACQ_REL) == 0) {
+    if (write(loop->done_fd, &one, sizeof(one)) != sizeof(one))
+      perror("event loop done");
+  }
+  free(src);
+}
+
+static void ServiceSource(struct event_source *src) {
+  struct event_loop *loop = src->loop;
+
+  if (src->is_channel) {
+    struct io_request io;
+    memset(&io, 0, sizeof(io));
+    if (read(src->fd, &io, sizeof(io)) != sizeof(io)
+        || loop->channel_handler(loop->ctx, src->fd, &io)) {
+      DropChannel(src);
+      return;
+    }
+  }
+  else {
+    uint64_t count;
+    if (read(src->fd, &count, sizeof(count)) == sizeof(count))
+      loop->event_handler(loop->ctx, src->id);
+  }
+
+  ArmSource(src, EPOLL_CTL_MOD);
+}
+
+static int ServiceWork(void *data) {
+  ServiceSource(*(struct event_source **)data);
+  return 0;
+}
+
+struct event_loop *CreateEventLoop(size_t workers,
+                                   channel_handler_t channel_handler,
+                                   event_handler_t event_handler,
+                                   void *ctx) {
+  struct event_loop *loop = (struct event_loop *)calloc(1, sizeof(struct event_loop));
+  if (loop == NULL)
+    return NULL;
+
+  loop->channel_handler = channel_handler;
+  loop->event_handler = event_handler;
+  loop->ctx = ctx;
+  loop->done_fd = -1;
+
+  loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (loop->epfd < 0)
+    goto err;
+
+  loop->done_fd = eventfd(0, EFD_CLOEXEC);
+  if (loop->done_fd < 0)
+    goto err;
+
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->done_fd, &ev) < 0)
+    goto err;
+
+  if (workers) {
+    loop->tp = create_threadpool(workers, ServiceWork);
+    if (loop->tp == NULL)
+      goto err;
+  }
+
+  return loop;
+ err:
+  perror("CreateEventLoop");
+  if (loop->epfd >= 0)
+    close(loop->epfd);
+  if (loop->done_fd >= 0)
+    close(loop->done_fd);
+  free(loop);
+  return NULL;
+}
+
+static int AddSource(struct event_loop *loop, int fd, int is_channel, uint32_t id) {
+  struct event_source *src = (struct event_source *)calloc(1, sizeof(struct event_source));
+  if (src == NULL)
+    return -1;
+
+  src->loop = loop;
+  src->fd = fd;
+  src->is_channel = is_channel;
+  src->id = id;
+
+  if (is_channel)
+    __atomic_add_fetch(&loop->nchannels, 1, __ATOMIC_ACQ_REL);
+
+  if (ArmSource(src, EPOLL_CTL_ADD) < 0) {
+    if (is_channel)
+      __atomic_sub_fetch(&loop->nchannels, 1, __ATOMIC_ACQ_REL);
+    free(src);
+    return -1;
+  }
+  return 0;
+}
+
+int EventLoopAddChannel(struct event_loop *loop, int fd) {
+  return AddSource(loop, fd, 1, 0);
+}
+
+int EventLoopAddEvent(struct event_loop *loop, int fd, uint32_t id) {
+  return AddSource(loop, fd, 0, id);
+}
+
+int EventLoopRun(struct event_loop *loop) {
+  struct epoll_event events[EVENT_LOOP_BATCH];
+
+  if (__atomic_load_n(&loop->nchannels, __ATOMIC_ACQUIRE) == 0)
+    return 0;
+
+  while (1) {
+    int n = epoll_wait(loop->epfd, events, EVENT_LOOP_BATCH, -1);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("epoll_wait");
+      return -1;
+    }
+
+    int i;
+    for (i=0; i < n; i++) {
+      struct event_source *src = (struct event_source *)events[i].data.ptr;
+      // every vCPU channel is gone, the vmm tore the device down
+      if (src == NULL)
+        return 0;
+
+      if (loop->tp) {
+        if (queue_work(loop->tp, &src, sizeof(src)) < 0)
+          ServiceSource(src);
+      }
+      else {
+        ServiceSource(src);
+      }
+    }
+  }
+
+  return 0;
+}
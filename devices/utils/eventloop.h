@@ -0,0 +1,60 @@
+#ifndef EVENTLOOP_H_
+#define EVENTLOOP_H_
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "iostructs.h"
+#include "threadpool.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// set in a device's environment to service every vCPU channel from one
+// epoll loop instead of a thread per channel. the value is the number of
+// pool workers requests are dispatched to, 0 handles them on the loop thread
+#define EVENT_LOOP_ENV "OOOWS_DEVICE_EVENT_LOOP"
+#define EVENT_LOOP_MAX_WORKERS 16
+
+// handles one request read from a vCPU channel and replies on fd. a non-zero
+// return stops servicing that channel
+typedef int (*channel_handler_t)(void *ctx, int fd, struct io_request *io);
+// called when an event fd added with EventLoopAddEvent fired, id is the one
+// it was added with
+typedef void (*event_handler_t)(void *ctx, uint32_t id);
+
+struct event_source {
+  struct event_loop *loop;
+  int fd;
+  int is_channel;
+  uint32_t id;
+};
+
+struct event_loop {
+  int epfd;
+  // written once the last channel goes away so Run returns
+  int done_fd;
+  int nchannels;
+  threadpool_t *tp;
+  channel_handler_t channel_handler;
+  event_handler_t event_handler;
+  void *ctx;
+};
+
+// returns 1 and the worker count if EVENT_LOOP_ENV is set
+int EventLoopRequested(size_t *workers);
+struct event_loop *CreateEventLoop(size_t workers,
+                                   channel_handler_t channel_handler,
+                                   event_handler_t event_handler,
+                                   void *ctx);
+int EventLoopAddChannel(struct event_loop *loop, int fd);
+// fd is drained (read 8 bytes, i.e. an eventfd) before the handler runs
+int EventLoopAddEvent(struct event_loop *loop, int fd, uint32_t id);
+// runs until every channel has been closed by the vmm
+int EventLoopRun(struct event_loop *loop);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -5,67 +5,87 @@
 #include <string.h>
 
 
+MemoryManager::MemoryManager(void) {
+}
+
 MemoryManager::MemoryManager(int fd,
                              uint64_t start_addr,
                              uint64_t size,
                              void *addr) {
   // setup our system mem
-  m_memory = (char *)mmap(addr,
-                      size,
-                      PROT_READ|PROT_WRITE,
-                      MAP_SHARED,
-                      fd,
-                      0);
-  if (m_memory == MAP_FAILED)
+  if (add_region(fd, start_addr, size, addr) < 0)
     throw std::bad_alloc();
-  m_guest_start_paddr = start_addr;
-  m_mem_size = size;
-  m_guest_end_paddr = start_addr + size;
 }
 
 MemoryManager::~MemoryManager(void) {
-  munmap(m_memory, m_mem_size);
+  for (auto &region : m_regions) {
+    munmap(region.host, region.guest_end - region.guest_start);
+  }
 }
 
-bool MemoryManager::oob(uint64_t guest_addr, uint64_t size) {
-  if (guest_addr < m_guest_start_paddr) {
-    return true;
-  }
-  if (guest_addr + size < m_guest_start_paddr) {
-    return true;
-  }
+int MemoryManager::add_region(int fd,
+                              uint64_t start_addr,
+                              uint64_t size,
+                              void *addr) {
+  if (size == 0 || (start_addr | size) & (MEM_PAGE_SIZE - 1))
+    return -1;
+  if (m_regions.size() >= MEM_NO_REGION)
+    return -1;
 
-  if (guest_addr >= m_guest_end_paddr) {
-    return true;
+  uint64_t first_page = start_addr >> MEM_PAGE_SHIFT;
+  uint64_t end_page = (start_addr + size) >> MEM_PAGE_SHIFT;
+  uint64_t page;
+  for (page = first_page; page < end_page && page < m_pages.size(); page++) {
+    if (m_pages[page] != MEM_NO_REGION)
+      return -1;
   }
 
-  if (guest_addr + size > m_guest_end_paddr) {
-    return true;
-  }
+  char *host = (char *)mmap(addr,
+                            size,
+                            PROT_READ|PROT_WRITE,
+                            MAP_SHARED,
+                            fd,
+                            0);
+  if (host == MAP_FAILED)
+    return -1;
 
-  if (size > m_guest_end_paddr - m_guest_start_paddr) {
-    return true;
+  struct MemoryRegion region;
+  region.guest_start = start_addr;
+  region.guest_end = start_addr + size;
+  region.host = host;
+  m_regions.push_back(region);
+
+  if (m_pages.size() < end_page)
+    m_pages.resize(end_page, MEM_NO_REGION);
+  for (page = first_page; page < end_page; page++) {
+    m_pages[page] = m_regions.size() - 1;
   }
 
-  return false;
+  return 0;
+}
+
+bool MemoryManager::oob(uint64_t guest_addr, uint64_t size) {
+  return translate(guest_addr, size) == NULL;
 }
 
 void *MemoryManager::host_addr(uint64_t guest_addr) {
-  return m_memory + guest_addr - m_guest_start_paddr;
+  return translate(guest_addr, 0);
 }
 
 int MemoryManager::read(uint64_t guest_addr, void * buf, uint64_t size) {
-  if (oob(guest_addr, size)) {
+  void *src = translate(guest_addr, size);
+  if (!src) {
     return -1;
   }
-  memcpy(buf, host_addr(guest_addr), size);
+  memcpy(buf, src, size);
   return 0;
 }
 
 int MemoryManager::write(uint64_t guest_addr, void *data, uint64_t size) {
-  if (oob(guest_addr, size)) {
+  void *dst = translate(guest_addr, size);
+  if (!dst) {
     return -1;
   }
-  memcpy(host_addr(guest_addr), data, size);
+  memcpy(dst, data, size);
   return 0;
 }
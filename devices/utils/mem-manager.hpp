@@ -2,46 +2,135 @@
 #include <stdint.h>
 #include <exception>
 #include <stdexcept>
+#include <vector>
 
+#define MEM_PAGE_SHIFT 12
+#define MEM_PAGE_SIZE (1UL << MEM_PAGE_SHIFT)
+// value in the page table for pages no region covers
+#define MEM_NO_REGION 0xff
 
-class MemoryManager {
+// a run of count T's in guest memory that has already been bounds checked,
+// so indexing it is a plain load/store. get one from MemoryManager::span.
+// the guest can change the contents underneath us at any time, so copy out
+// anything that gets validated before using it
+template <typename T>
+class GuestSpan {
   public:
-    uint64_t m_guest_start_paddr;
-    uint64_t m_guest_end_paddr;
-    uint64_t m_mem_size;
-    char *m_memory;
+    GuestSpan() = default;
+    GuestSpan(T *base, uint64_t count) : m_base(base), m_count(count) { }
+
+    bool valid() const { return m_base != NULL; }
+    uint64_t size() const { return m_count; }
+    T *data() const { return m_base; }
+    // unchecked, the caller keeps idx below size()
+    T &operator[](uint64_t idx) const { return m_base[idx]; }
+    T *operator->() const { return m_base; }
+
+  private:
+    T *m_base;
+    uint64_t m_count;
+};
+
+// ordered accesses for fields shared with the guest driver, e.g. ring
+// indices. an acquire load of the avail idx makes the ring entries and
+// descriptors the guest wrote before it visible, a release store of the
+// used idx publishes the used elements written before it
+template <typename T>
+  inline T guest_load_acquire(const T *p) {
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+  }
+
+template <typename T>
+  inline void guest_store_release(T *p, T val) {
+    __atomic_store_n(p, val, __ATOMIC_RELEASE);
+  }
 
+// one guest memory slot the vmm shares with us, mapped from its memfd
+struct MemoryRegion {
+  uint64_t guest_start;
+  uint64_t guest_end;
+  char *host;
+};
+
+class MemoryManager {
+  public:
+    MemoryManager(void);
     MemoryManager(int fd, uint64_t start_addr, uint64_t size, void *addr = NULL);
     ~MemoryManager();
 
+    // maps size bytes of fd and makes them visible at guest paddr
+    // start_addr. regions must be page aligned and must not overlap.
+    // returns -1 if the mapping fails
+    int add_region(int fd, uint64_t start_addr, uint64_t size, void *addr = NULL);
+
     template <typename T>
       int readX(uint64_t guest_addr, T *out);
     template <typename T>
       int writeX(uint64_t guest_addr, T data);
+    // validates count T's at guest_addr once. the span is invalid if they
+    // aren't all inside one region
+    template <typename T>
+      GuestSpan<T> span(uint64_t guest_addr, uint64_t count);
+
+    // host address of [guest_addr, guest_addr+size), or NULL unless the
+    // whole range sits inside one region
+    inline void *translate(uint64_t guest_addr, uint64_t size);
 
     bool oob(uint64_t guest_addr, uint64_t size);
     int read(uint64_t guest_addr, void * buf, uint64_t size);
     int write(uint64_t guest_addr, void *data, uint64_t size);
     void *host_addr(uint64_t guest_addr);
 
+  private:
+    std::vector<struct MemoryRegion> m_regions;
+    // index into m_regions for every guest page from 0 up to the end of
+    // the highest region
+    std::vector<uint8_t> m_pages;
 };
 
+inline void *MemoryManager::translate(uint64_t guest_addr, uint64_t size) {
+  uint64_t page = guest_addr >> MEM_PAGE_SHIFT;
+  if (page >= m_pages.size() || m_pages[page] == MEM_NO_REGION) {
+    return NULL;
+  }
+
+  struct MemoryRegion *region = &m_regions[m_pages[page]];
+  // guest_addr is inside the region, so this can't wrap
+  if (size > region->guest_end - guest_addr) {
+    return NULL;
+  }
+
+  return region->host + (guest_addr - region->guest_start);
+}
+
+template <typename T>
+  GuestSpan<T> MemoryManager::span(uint64_t guest_addr, uint64_t count) {
+    if (count > UINT64_MAX / sizeof(T)) {
+      return GuestSpan<T>(NULL, 0);
+    }
+    T *base = (T *)translate(guest_addr, count * sizeof(T));
+    if (!base) {
+      return GuestSpan<T>(NULL, 0);
+    }
+    return GuestSpan<T>(base, count);
+  }
+
 template <typename T>
   int MemoryManager::readX(uint64_t guest_addr, T *out) {
-    if (oob(guest_addr, sizeof(T))) {
+    T *src = (T *)translate(guest_addr, sizeof(T));
+    if (!src) {
       return -1;
     }
-    uint64_t offset = guest_addr - m_guest_start_paddr;
-    *out = ((T *)(m_memory + offset))[0];
+    *out = src[0];
     return 0;
   }
 
 template <typename T>
   int MemoryManager::writeX(uint64_t guest_addr, T data) {
-    if (oob(guest_addr, sizeof(T))) {
+    T *dst = (T *)translate(guest_addr, sizeof(T));
+    if (!dst) {
       return -1;
     }
-    uint64_t offset = guest_addr - m_guest_start_paddr;
-    ((T *)(m_memory+offset))[0] = data;
+    dst[0] = data;
     return 0;
   }
@@ -0,0 +1,157 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// register access modes
+#define MODE_R 1
+#define MODE_W 2
+#define MODE_RW 3
+
+// Compile time register maps for MMIO devices. Each register is declared with
+// its offset, access width, mode and accessor members:
+//
+//   typedef RegMap<Dev, 0x100, 4,
+//                  Reg<Dev, 0x00, 4, MODE_R, &Dev::reg_magic, nullptr>,
+//                  Reg<Dev, 0x04, 4, MODE_RW, &Dev::reg_ctrl, &Dev::set_ctrl>
+//                  > Regs;
+//   Regs::read(dev, offset, size, &val);
+//
+// RegMap turns the list into a dense table with one slot per granule of the
+// register window, so decoding an access is one bounds check and one
+// indexed load. Misaligned or overlapping registers, widths that aren't
+// 1/2/4/8, registers outside the window and modes without the matching
+// accessor are all rejected at compile time. At run time an access has to
+// match the register's width exactly and respect its mode, anything else
+// fails.
+//
+// Only C++11 here, net still builds with it.
+
+template <typename Dev>
+struct RegEntry {
+  typedef uint64_t (Dev::*read_fn)(void);
+  typedef void (Dev::*write_fn)(uint64_t);
+
+  uint8_t width;
+  uint8_t mode;
+  read_fn read;
+  write_fn write;
+
+  constexpr RegEntry() : width(0), mode(0), read(nullptr), write(nullptr) { }
+  constexpr RegEntry(uint8_t w, uint8_t m, read_fn r, write_fn wr)
+    : width(w), mode(m), read(r), write(wr) { }
+};
+
+template <typename Dev, uint32_t Offset, uint8_t Width, uint8_t Mode,
+          typename RegEntry<Dev>::read_fn Read,
+          typename RegEntry<Dev>::write_fn Write>
+struct Reg {
+  static_assert(Width == 1 || Width == 2 || Width == 4 || Width == 8,
+                "register width must be 1, 2, 4 or 8 bytes");
+  static_assert(Offset % Width == 0, "register is not aligned to its width");
+  static_assert(Mode != 0 && (Mode & ~MODE_RW) == 0, "bad register mode");
+  static_assert(!(Mode & MODE_R) || Read != nullptr,
+                "readable register needs a read accessor");
+  static_assert(!(Mode & MODE_W) || Write != nullptr,
+                "writable register needs a write accessor");
+
+  static const uint32_t offset = Offset;
+  static const uint8_t width = Width;
+
+  static constexpr RegEntry<Dev> entry() {
+    return RegEntry<Dev>(Width, Mode,
+                         (Mode & MODE_R) ? Read : nullptr,
+                         (Mode & MODE_W) ? Write : nullptr);
+  }
+};
+
+namespace regmap_detail {
+
+template <size_t... I> struct Indices { };
+template <size_t N, size_t... I>
+struct MakeIndices : MakeIndices<N - 1, N - 1, I...> { };
+template <size_t... I>
+struct MakeIndices<0, I...> { typedef Indices<I...> type; };
+
+// the register covering table slot, or an empty entry
+template <typename Dev, uint32_t Granule>
+constexpr RegEntry<Dev> entry_at(size_t) { return RegEntry<Dev>(); }
+
+template <typename Dev, uint32_t Granule, typename R, typename... Rest>
+constexpr RegEntry<Dev> entry_at(size_t slot) {
+  return R::offset / Granule == slot
+    ? R::entry()
+    : entry_at<Dev, Granule, Rest...>(slot);
+}
+
+// whether any of the registers touches [start, end)
+template <uint32_t Start, uint32_t End>
+constexpr bool overlaps() { return false; }
+
+template <uint32_t Start, uint32_t End, typename R, typename... Rest>
+constexpr bool overlaps() {
+  return (R::offset < End && Start < R::offset + R::width)
+    || overlaps<Start, End, Rest...>();
+}
+
+template <uint32_t Span, uint32_t Granule, typename... Regs>
+struct Check { static const bool value = true; };
+
+template <uint32_t Span, uint32_t Granule, typename R, typename... Rest>
+struct Check<Span, Granule, R, Rest...> {
+  static const bool value =
+    R::offset + R::width <= Span
+    && R::offset % Granule == 0
+    && !overlaps<R::offset, R::offset + R::width, Rest...>()
+    && Check<Span, Granule, Rest...>::value;
+};
+
+}
+
+template <typename Dev, uint32_t Span, uint32_t Granule, typename... Regs>
+class RegMap {
+  static_assert(Span % Granule == 0, "window must be a whole number of granules");
+  static_assert(regmap_detail::Check<Span, Granule, Regs...>::value,
+                "registers overlap, fall outside the window or aren't on a granule");
+
+  static const size_t num_slots = Span / Granule;
+
+  template <size_t... I>
+  static const RegEntry<Dev> *build(regmap_detail::Indices<I...>) {
+    // all constant expressions, so this is laid out at compile time
+    static const RegEntry<Dev> table[] = {
+      regmap_detail::entry_at<Dev, Granule, Regs...>(I)...
+    };
+    return table;
+  }
+
+  static const RegEntry<Dev> *decode(uint64_t offset, uint32_t size, uint8_t mode) {
+    const RegEntry<Dev> *table =
+      build(typename regmap_detail::MakeIndices<num_slots>::type());
+
+    if (offset >= Span || offset % Granule)
+      return nullptr;
+    const RegEntry<Dev> *entry = &table[offset / Granule];
+    if (entry->width != size || !(entry->mode & mode))
+      return nullptr;
+    return entry;
+  }
+
+  public:
+  // -1 if nothing readable of that width lives at offset
+  static int read(Dev *dev, uint64_t offset, uint32_t size, uint64_t *out) {
+    const RegEntry<Dev> *entry = decode(offset, size, MODE_R);
+    if (!entry)
+      return -1;
+    *out = (dev->*entry->read)();
+    return 0;
+  }
+
+  // -1 if nothing writable of that width lives at offset
+  static int write(Dev *dev, uint64_t offset, uint32_t size, uint64_t data) {
+    const RegEntry<Dev> *entry = decode(offset, size, MODE_W);
+    if (!entry)
+      return -1;
+    (dev->*entry->write)(data);
+    return 0;
+  }
+};
@@ -25,7 +25,7 @@ work_t *dequeue_work_unlocked(threadpool_t *tp) {
 }
 
 int queue_work(threadpool_t *tp, void *data, size_t sz) {
-  work_t *work = calloc(1, sizeof(work_t) + sz);
+  work_t *work = (work_t *)calloc(1, sizeof(work_t) + sz);
   if (work == NULL) {
     return -1;
   }
@@ -78,7 +78,7 @@ void *_routine_stub(void *t) {
 
 threadpool_t *create_threadpool(size_t n, int (*routine)(void *)) {
 
-  threadpool_t *tp = calloc(1, sizeof(threadpool_t));
+  threadpool_t *tp = (threadpool_t *)calloc(1, sizeof(threadpool_t));
   if (tp == NULL) {
     return NULL;
   }
@@ -89,12 +89,12 @@ threadpool_t *create_threadpool(size_t n, int (*routine)(void *)) {
 
   tp->routine = routine;
 
-  tp->workers = calloc(n, sizeof(pthread_t));
+  tp->workers = (pthread_t *)calloc(n, sizeof(pthread_t));
   if (tp->workers == NULL) {
     goto err;
   }
 
-  int i = 0;
+  int i;
   for(i=0;i<n;i++) {
     if (pthread_create(&tp->workers[i], NULL, _routine_stub, tp) < 0) {
       perror("pthread_create");
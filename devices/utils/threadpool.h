@@ -2,8 +2,13 @@
 #define THREADPOOL_H_
 
 #include <stdlib.h>
+#include <pthread.h>
 #include <sys/types.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 typedef struct work work_t;
 
 typedef struct work {
@@ -28,4 +33,9 @@ typedef struct threadpool {
 
 threadpool_t *create_threadpool(size_t n, int (*routine)(void *));
 int queue_work(threadpool_t *tp, void *data, size_t sz);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
@@ -0,0 +1,319 @@
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "virtio-driver.hpp"
+#include "iostructs.h"
+#include "mem-manager.hpp"
+
+extern char **environ;
+
+// keep everything we hand the child clear of the fixed fds 3-6 so the dup2s
+// below can't clobber each other
+#define DRIVER_FD_BASE 16
+
+static int move_fd_high(int fd) {
+  int high = fcntl(fd, F_DUPFD, DRIVER_FD_BASE);
+  close(fd);
+  return high;
+}
+
+void VirtioDriverQueue::add(uint16_t buf_id, uint32_t len) {
+  uint16_t avail_idx = m_avail->head_idx;
+  uint32_t seg_size = m_buf_size / m_segs;
+  uint16_t head = buf_id * m_segs;
+  uint16_t i;
+  // spread len over the chain, the segments past it are empty
+  for (i=0; i < m_segs; i++) {
+    uint32_t seg_len = len < seg_size ? len : seg_size;
+    m_desc[head + i].len = seg_len;
+    len -= seg_len;
+  }
+  m_avail_ring[avail_idx % m_num] = head;
+  // the device acquires the idx, so the ring entry and buffer go first
+  guest_store_release(&m_avail->head_idx, (uint16_t)(avail_idx + 1));
+}
+
+bool VirtioDriverQueue::get_used(struct VirtqUsedElem *elem) {
+  uint16_t used_idx = guest_load_acquire(&m_used->head_idx);
+  if (used_idx == m_last_used)
+    return false;
+
+  *elem = m_used_ring[m_last_used % m_num];
+  elem->id /= m_segs;
+  m_last_used++;
+  return true;
+}
+
+bool VirtioDriverQueue::no_notify(void) {
+  // order our avail idx store before reading the device's flags
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  return __atomic_load_n(&m_used->flags, __ATOMIC_RELAXED) & VIRTQ_USED_F_NO_NOTIFY;
+}
+
+VirtioDriver::VirtioDriver(uint64_t mmio_start, uint32_t nvcpus) {
+  m_mmio_start = mmio_start;
+  m_nvcpus = nvcpus > NR_MAX_VCPUS ? NR_MAX_VCPUS : nvcpus;
+  m_pid = 0;
+  m_fw_memfd = -1;
+  m_sys_memfd = -1;
+  m_fw = (char *)MAP_FAILED;
+  m_sys = (char *)MAP_FAILED;
+  // leave the first page alone so a zero gpa is never a valid buffer
+  m_sys_brk = GUEST_SYS_MEM_PADDR + MEM_PAGE_SIZE;
+  m_ioapic = -1;
+  memset(m_channel, -1, sizeof(m_channel));
+}
+
+VirtioDriver::~VirtioDriver(void) {
+  stop();
+  for (auto vq : m_queues)
+    delete vq;
+  if (m_fw != MAP_FAILED)
+    munmap(m_fw, HOST_FW_SIZE);
+  if (m_sys != MAP_FAILED)
+    munmap(m_sys, HOST_SYS_MEM_SIZE);
+  if (m_fw_memfd >= 0)
+    close(m_fw_memfd);
+  if (m_sys_memfd >= 0)
+    close(m_sys_memfd);
+}
+
+int VirtioDriver::start(const char *device_path) {
+  int sv[NR_MAX_VCPUS][2];
+  int ioapic[2];
+  uint32_t i;
+
+  m_fw_memfd = memfd_create("vmram", 0);
+  m_sys_memfd = memfd_create("vmsysmem", 0);
+  if (m_fw_memfd < 0 || m_sys_memfd < 0)
+    return -1;
+  if (ftruncate(m_fw_memfd, HOST_FW_SIZE) < 0
+      || ftruncate(m_sys_memfd, HOST_SYS_MEM_SIZE) < 0)
+    return -1;
+  m_fw_memfd = move_fd_high(m_fw_memfd);
+  m_sys_memfd = move_fd_high(m_sys_memfd);
+
+  m_fw = (char *)mmap(NULL, HOST_FW_SIZE, PROT_READ|PROT_WRITE,
+                      MAP_SHARED, m_fw_memfd, 0);
+  m_sys = (char *)mmap(NULL, HOST_SYS_MEM_SIZE, PROT_READ|PROT_WRITE,
+                       MAP_SHARED, m_sys_memfd, 0);
+  if (m_fw == MAP_FAILED || m_sys == MAP_FAILED)
+    return -1;
+
+  if (socketpair(AF_UNIX, SOCK_DGRAM, 0, ioapic) < 0)
+    return -1;
+  ioapic[0] = move_fd_high(ioapic[0]);
+  ioapic[1] = move_fd_high(ioapic[1]);
+
+  for (i=0; i < m_nvcpus; i++) {
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv[i]) < 0)
+      return -1;
+    sv[i][0] = move_fd_high(sv[i][0]);
+    sv[i][1] = move_fd_high(sv[i][1]);
+  }
+
+  pid_t child = fork();
+  if (child < 0)
+    return -1;
+
+  if (!child) {
+    for (i=0; i < m_nvcpus; i++)
+      close(sv[i][0]);
+    close(ioapic[0]);
+
+    if (dup2(ioapic[1], CHILD_DEVICE_IOAPIC_FD) < 0
+        || dup2(sv[0][1], CHILD_DEVICE_CHANNEL_FD) < 0
+        || dup2(m_fw_memfd, CHILD_DEVICE_FW_MEMFD) < 0
+        || dup2(m_sys_memfd, CHILD_DEVICE_SYS_MEMFD) < 0) {
+      perror("dup2");
+      exit(1);
+    }
+
+    char *argv[] = {(char *)device_path, NULL};
+    execve(device_path, argv, environ);
+    perror("Failed to exec device bin");
+    exit(1);
+  }
+
+  m_pid = child;
+  close(ioapic[1]);
+  m_ioapic = ioapic[0];
+
+  // same exchange devicebus.c does, the vcpu fds are valid in the child
+  // because it inherited them
+  uint32_t handshake = 0;
+  if (recv(sv[0][0], &handshake, sizeof(handshake), MSG_WAITALL)
+      != sizeof(handshake)
+      || memcmp(&handshake, "INIT", sizeof(handshake))) {
+    fprintf(stderr, "Unexpected handshake from device\n");
+    return -1;
+  }
+
+  struct init_response response;
+  memset(&response, 0, sizeof(response));
+  memcpy(&response.magic, "TINI", sizeof(response.magic));
+  for (i=0; i < m_nvcpus; i++)
+    response.fds[i] = sv[i][1];
+
+  if (send(sv[0][0], &response, sizeof(response), 0) != sizeof(response))
+    return -1;
+
+  for (i=0; i < m_nvcpus; i++) {
+    close(sv[i][1]);
+    m_channel[i] = sv[i][0];
+  }
+
+  return 0;
+}
+
+void VirtioDriver::stop(void) {
+  uint32_t i;
+  if (m_pid) {
+    kill(m_pid, SIGTERM);
+    waitpid(m_pid, NULL, 0);
+    m_pid = 0;
+  }
+  for (i=0; i < NR_MAX_VCPUS; i++) {
+    if (m_channel[i] >= 0)
+      close(m_channel[i]);
+    m_channel[i] = -1;
+  }
+  if (m_ioapic >= 0)
+    close(m_ioapic);
+  m_ioapic = -1;
+}
+
+static int mmio_access(int fd, uint64_t phys_addr, uint32_t data,
+                       uint32_t len, uint8_t is_write, int *value) {
+  struct io_request io;
+  memset(&io, 0, sizeof(io));
+  io.type = IOTYPE_MMIO;
+  io.mmio.phys_addr = phys_addr;
+  io.mmio.data = data;
+  io.mmio.len = len;
+  io.mmio.is_write = is_write;
+
+  if (send(fd, &io, sizeof(io), 0) != sizeof(io))
+    return -1;
+  if (recv(fd, value, sizeof(*value), MSG_WAITALL) != sizeof(*value))
+    return -1;
+  return 0;
+}
+
+int VirtioDriver::mmio_read(uint64_t offset, uint32_t *out, uint32_t len, uint32_t vcpu) {
+  int value = 0;
+  if (vcpu >= m_nvcpus)
+    return -1;
+  if (mmio_access(m_channel[vcpu], m_mmio_start + offset, 0, len, 0, &value))
+    return -1;
+  *out = value;
+  return 0;
+}
+
+int VirtioDriver::mmio_write(uint64_t offset, uint32_t data, uint32_t len, uint32_t vcpu) {
+  int value = 0;
+  if (vcpu >= m_nvcpus)
+    return -1;
+  return mmio_access(m_channel[vcpu], m_mmio_start + offset, data, len, 1, &value);
+}
+
+uint64_t VirtioDriver::alloc(uint64_t size, uint64_t align) {
+  uint64_t addr = (m_sys_brk + align - 1) & ~(align - 1);
+  if (addr + size > GUEST_SYS_MEM_PADDR + HOST_SYS_MEM_SIZE)
+    return 0;
+  m_sys_brk = addr + size;
+  return addr;
+}
+
+void *VirtioDriver::host_addr(uint64_t guest_addr) {
+  return m_sys + (guest_addr - GUEST_SYS_MEM_PADDR);
+}
+
+VirtioDriverQueue *VirtioDriver::setup_queue(uint16_t idx, uint16_t nbufs,
+                                             uint32_t buf_size, uint16_t segs) {
+  if (segs == 0 || segs > buf_size || (uint32_t)nbufs * segs > MAX_VQ_SIZE)
+    return NULL;
+  uint16_t num = nbufs * segs;
+  // every segment the same size
+  uint32_t seg_size = (buf_size + segs - 1) / segs;
+  buf_size = seg_size * segs;
+  uint64_t desc = alloc(sizeof(struct VirtqDesc) * num);
+  uint64_t avail = alloc(sizeof(struct VirtqAvail) + sizeof(uint16_t) * num);
+  uint64_t used = alloc(sizeof(struct VirtqUsed) + sizeof(struct VirtqUsedElem) * num);
+  if (!desc || !avail || !used)
+    return NULL;
+
+  VirtioDriverQueue *vq = new VirtioDriverQueue();
+  vq->m_idx = idx;
+  vq->m_num = num;
+  vq->m_segs = segs;
+  vq->m_buf_size = buf_size;
+  vq->m_desc = (struct VirtqDesc *)host_addr(desc);
+  vq->m_avail = (struct VirtqAvail *)host_addr(avail);
+  vq->m_avail_ring = vq->m_avail->ring;
+  vq->m_used = (struct VirtqUsed *)host_addr(used);
+  vq->m_used_ring = vq->m_used->ring;
+  vq->m_last_used = 0;
+  m_queues.push_back(vq);
+
+  // each buffer is contiguous here, the device only sees the chain
+  uint16_t i, s;
+  for (i=0; i < nbufs; i++) {
+    uint64_t buf = alloc(buf_size);
+    if (!buf)
+      return NULL;
+    for (s=0; s < segs; s++) {
+      struct VirtqDesc *d = &vq->m_desc[i * segs + s];
+      d->addr = buf + s * seg_size;
+      d->len = seg_size;
+      d->flags = s + 1 < segs ? VIRTQ_DESC_F_NEXT : 0;
+      d->next = s + 1 < segs ? i * segs + s + 1 : 0;
+    }
+    vq->m_bufs.push_back((char *)host_addr(buf));
+  }
+
+  // same sequence as the guest kernel's setup_virtq/commit_and_ready_vq
+  if (mmio_write(REG_QUEUE_SELECT, idx)
+      || mmio_write(REG_QUEUE_NUM, num)
+      || mmio_write(REG_QUEUE_DESC_LOW, desc & 0xffffffff)
+      || mmio_write(REG_QUEUE_DESC_HIGH, desc >> 32)
+      || mmio_write(REG_QUEUE_DRIVER_LOW, avail & 0xffffffff)
+      || mmio_write(REG_QUEUE_DRIVER_HIGH, avail >> 32)
+      || mmio_write(REG_QUEUE_DEVICE_LOW, used & 0xffffffff)
+      || mmio_write(REG_QUEUE_DEVICE_HIGH, used >> 32)
+      || mmio_write(REG_QUEUE_READY, 1))
+    return NULL;
+
+  uint32_t ready = 0;
+  if (mmio_read(REG_QUEUE_READY, &ready) || !ready)
+    return NULL;
+
+  return vq;
+}
+
+int VirtioDriver::kick(VirtioDriverQueue *vq, uint32_t vcpu) {
+  if (vq->no_notify())
+    return 0;
+  return mmio_write(REG_QUEUE_NOTIFY, vq->m_idx, 4, vcpu);
+}
+
+int VirtioDriver::wait_irq(int timeout_ms) {
+  struct pollfd pfd;
+  pfd.fd = m_ioapic;
+  pfd.events = POLLIN;
+  if (poll(&pfd, 1, timeout_ms) <= 0)
+    return -1;
+
+  uint8_t irq;
+  if (read(m_ioapic, &irq, sizeof(irq)) != sizeof(irq))
+    return -1;
+  return irq;
+}
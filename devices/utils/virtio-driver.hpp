@@ -0,0 +1,87 @@
+#pragma once
+#include <stdint.h>
+#include <sys/types.h>
+#include <vector>
+
+#include "vmm.h"
+#include "virtio.hpp"
+
+// Host side stand-in for the vmm and a guest driver. It sets up the memfds,
+// vcpu channels and ioapic socket the way devicebus.c:instantiateDevice does,
+// execs a device binary, does the handshake and then drives virtqueues living
+// in the shared "guest" memory. Used by virtio-bench to exercise devices
+// without booting a VM.
+
+// one driver side virtqueue with a fixed buffer per descriptor, or per
+// chain of m_segs descriptors splitting it up
+class VirtioDriverQueue {
+  public:
+  uint16_t m_idx;
+  // descriptors, m_num / m_segs buffers
+  uint16_t m_num;
+  uint16_t m_segs;
+  uint32_t m_buf_size;
+  struct VirtqDesc *m_desc;
+  struct VirtqAvail *m_avail;
+  uint16_t *m_avail_ring;
+  struct VirtqUsed *m_used;
+  struct VirtqUsedElem *m_used_ring;
+  // host address of each buffer
+  std::vector<char *> m_bufs;
+  // next used entry we haven't looked at
+  uint16_t m_last_used;
+
+  void *buf(uint16_t buf_id) { return m_bufs[buf_id]; }
+  // puts buf_id on the avail ring with len valid bytes. doesn't notify
+  void add(uint16_t buf_id, uint32_t len);
+  // pops the next used element, false if the device hasn't returned any.
+  // elem->id is the buffer id
+  bool get_used(struct VirtqUsedElem *elem);
+  // whether the device asked not to be notified (busy polling)
+  bool no_notify(void);
+};
+
+class VirtioDriver {
+  public:
+  VirtioDriver(uint64_t mmio_start, uint32_t nvcpus = 1);
+  ~VirtioDriver();
+
+  // fork and exec the device binary and do the INIT/TINI handshake
+  int start(const char *device_path);
+  // SIGTERM the device and reap it
+  void stop(void);
+
+  // register access through a vcpu channel, like a guest MMIO exit
+  int mmio_read(uint64_t offset, uint32_t *out, uint32_t len = 4, uint32_t vcpu = 0);
+  int mmio_write(uint64_t offset, uint32_t data, uint32_t len = 4, uint32_t vcpu = 0);
+
+  // allocates rings and num buffers of buf_size in guest memory and readies
+  // queue idx. each buffer is handed over as a chain of segs descriptors.
+  // returns NULL if guest memory ran out or the device refused
+  VirtioDriverQueue *setup_queue(uint16_t idx, uint16_t num, uint32_t buf_size,
+                                 uint16_t segs = 1);
+  // QUEUE_NOTIFY, skipped if the device set VIRTQ_USED_F_NO_NOTIFY
+  int kick(VirtioDriverQueue *vq, uint32_t vcpu = 0);
+
+  // next irq the device raised, waiting at most timeout_ms (0 to poll).
+  // -1 if none
+  int wait_irq(int timeout_ms);
+
+  // bump allocator over the sys memory region
+  uint64_t alloc(uint64_t size, uint64_t align = 16);
+  void *host_addr(uint64_t guest_addr);
+
+  private:
+  uint64_t m_mmio_start;
+  uint32_t m_nvcpus;
+  pid_t m_pid;
+  int m_fw_memfd;
+  int m_sys_memfd;
+  char *m_fw;
+  char *m_sys;
+  uint64_t m_sys_brk;
+  // our ends of the vcpu channels and the ioapic socket
+  int m_channel[NR_MAX_VCPUS];
+  int m_ioapic;
+  std::vector<VirtioDriverQueue *> m_queues;
+};
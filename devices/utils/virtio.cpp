@@ -1,8 +1,12 @@
 #include <fcntl.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/eventfd.h>
 #include <string.h>
 #include <assert.h>
+#include <time.h>
+#include <new>
 #include <thread>
 
 #include "virtio.hpp"
@@ -10,12 +14,22 @@
 #include "vmm.h"
 #include "mem-manager.hpp"
 #include "handshake.h"
+#include "eventloop.h"
 
 #define DEBUG 0
 
+static uint64_t monotonic_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 VirtBuf::VirtBuf(uint64_t guest_addr, class MemoryManager *mem) {
   m_head = guest_addr;
   m_mem = mem;
+  m_nbytes_written = 0;
+  m_nsegs = 0;
+  m_total_len = 0;
 }
 
 void *VirtBuf::host_addr(uint64_t offset) {
@@ -58,6 +72,111 @@ void VirtBuf::reset_head(uint64_t addr) {
   return;
 }
 
+int VirtBuf::iov(uint64_t offset, uint64_t size, struct iovec *iov, int max) {
+  if (offset > m_total_len || size > m_total_len - offset)
+    return -1;
+
+  int n = 0;
+  uint16_t i;
+  for (i=0; i < m_nsegs && size; i++) {
+    struct VirtBufSeg *seg = &m_segs[i];
+    if (offset >= seg->len) {
+      offset -= seg->len;
+      continue;
+    }
+    if (n == max)
+      return -1;
+
+    uint64_t len = seg->len - offset;
+    if (len > size)
+      len = size;
+    iov[n].iov_base = m_mem->host_addr(seg->guest_addr + offset);
+    iov[n].iov_len = len;
+    n++;
+    size -= len;
+    offset = 0;
+  }
+  return n;
+}
+
+int VirtBuf::gather(uint64_t offset, void *buf, uint64_t size) {
+  struct iovec iovs[VIRTBUF_MAX_SEGS];
+  int n = iov(offset, size, iovs, VIRTBUF_MAX_SEGS);
+  if (n < 0)
+    return -1;
+
+  int i;
+  for (i=0; i < n; i++) {
+    memcpy(buf, iovs[i].iov_base, iovs[i].iov_len);
+    buf = (uint8_t *)buf + iovs[i].iov_len;
+  }
+  return 0;
+}
+
+int VirtBuf::scatter(uint64_t offset, const void *data, uint64_t size) {
+  struct iovec iovs[VIRTBUF_MAX_SEGS];
+  int n = iov(offset, size, iovs, VIRTBUF_MAX_SEGS);
+  if (n < 0)
+    return -1;
+
+  int i;
+  for (i=0; i < n; i++) {
+    memcpy(iovs[i].iov_base, data, iovs[i].iov_len);
+    data = (const uint8_t *)data + iovs[i].iov_len;
+  }
+  return 0;
+}
+
+uint32_t virtio_queue_pairs(const char *env, uint32_t max_pairs) {
+  char *val = getenv(env);
+  if (!val)
+    return 1;
+
+  uint32_t pairs = strtoul(val, NULL, 0);
+  if (pairs == 0)
+    return 1;
+  if (pairs > max_pairs)
+    return max_pairs;
+  return pairs;
+}
+
+VirtBufPool::VirtBufPool(uint32_t nslots) {
+  m_slab = (VirtBuf *)calloc(nslots, sizeof(VirtBuf));
+  m_free = (uint16_t *)calloc(nslots, sizeof(uint16_t));
+  if (!m_slab || !m_free)
+    throw std::bad_alloc();
+  uint32_t i;
+  for (i=0; i < nslots; i++) {
+    m_free[i] = nslots - 1 - i;
+  }
+  m_nslots = nslots;
+  m_nfree = nslots;
+  pthread_mutex_init(&m_lock, NULL);
+}
+
+VirtBufPool::~VirtBufPool(void) {
+  free(m_free);
+  free(m_slab);
+}
+
+VirtBuf *VirtBufPool::alloc(void) {
+  VirtBuf *vbuf = NULL;
+  pthread_mutex_lock(&m_lock);
+  if (m_nfree)
+    vbuf = &m_slab[m_free[--m_nfree]];
+  pthread_mutex_unlock(&m_lock);
+  return vbuf;
+}
+
+void VirtBufPool::release(VirtBuf *vbuf) {
+  uint16_t slot = vbuf - m_slab;
+  assert(slot < m_nslots);
+  vbuf->~VirtBuf();
+  pthread_mutex_lock(&m_lock);
+  m_free[m_nfree++] = slot;
+  pthread_mutex_unlock(&m_lock);
+}
+
 MMIOVirtioDev::MMIOVirtioDev(uint64_t mmio_start,
                              uint32_t num_vqs,
                              void *host_addr) {
@@ -70,8 +189,17 @@ MMIOVirtioDev::MMIOVirtioDev(uint64_t mmio_start,
     m_vqs[i] = (struct VirtQueue *)calloc(1, sizeof(struct VirtQueue));
     if (!m_vqs[i])
       throw std::bad_alloc();
+    pthread_mutex_init(&m_vqs[i]->lock, NULL);
+    pthread_mutex_init(&m_vqs[i]->notify_lock, NULL);
+    pthread_cond_init(&m_vqs[i]->kick, NULL);
+    m_vqs[i]->irq = -1;
+    m_vqs[i]->kick_fd = -1;
   }
-  pthread_mutex_init(&m_lock, NULL);
+  pthread_mutex_init(&m_config_lock, NULL);
+  pthread_mutex_init(&m_poll_lock, NULL);
+  pthread_cond_init(&m_poll_wake, NULL);
+  m_busy_poll_us = 0;
+  m_poll_parked = false;
   m_num_queues = num_vqs;
   m_mmio_start = mmio_start;
   m_mmio_end_regs = mmio_start + CONFIG_SPACE_START;
@@ -89,6 +217,7 @@ MMIOVirtioDev::MMIOVirtioDev(uint64_t mmio_start,
   m_isr_ack = 0;
   m_status = STATUS_ACKNOWLEDGE;
   m_config_gen = 0;
+  m_ready_vq = -1;
   memset(m_config_space, 0, CONFIG_SPACE_MAX);
   m_config_space_size = CONFIG_SPACE_MAX;
   // setup our memory manager
@@ -96,6 +225,11 @@ MMIOVirtioDev::MMIOVirtioDev(uint64_t mmio_start,
                             GUEST_SYS_MEM_PADDR,
                             HOST_SYS_MEM_SIZE,
                             host_addr);
+  // low memory is handed to us as well so rings and buffers can live
+  // anywhere in guest ram. not every harness passes it, so it's optional
+  m_mem->add_region(CHILD_DEVICE_FW_MEMFD,
+                    GUEST_FW_PADDR,
+                    HOST_FW_SIZE);
 }
 
 MMIOVirtioDev::~MMIOVirtioDev(void) {
@@ -104,6 +238,7 @@ MMIOVirtioDev::~MMIOVirtioDev(void) {
   if (m_num_queues > 0) {
     int i;
     for (i=0; i < m_num_queues; i++) {
+      delete m_vqs[i]->pool;
       free(m_vqs[i]);
     }
     free(m_vqs);
@@ -123,6 +258,37 @@ int MMIOVirtioDev::set_config_space(void *data, uint32_t size) {
   return 0;
 }
 
+int MMIOVirtioDev::set_queue_async(uint16_t vq_idx) {
+  if (vq_idx >= m_num_queues)
+    return -1;
+  m_vqs[vq_idx]->async = true;
+  return 0;
+}
+
+int MMIOVirtioDev::set_queue_nonblocking(uint16_t vq_idx) {
+  if (vq_idx >= m_num_queues)
+    return -1;
+  m_vqs[vq_idx]->nonblocking = true;
+  return 0;
+}
+
+void MMIOVirtioDev::set_busy_poll(uint32_t idle_us) {
+  m_busy_poll_us = idle_us;
+}
+
+int MMIOVirtioDev::set_queue_irq(uint16_t vq_idx, uint8_t irq) {
+  if (vq_idx >= m_num_queues)
+    return -1;
+  m_vqs[vq_idx]->irq = irq;
+  return 0;
+}
+
+int MMIOVirtioDev::send_queue_irq(uint16_t vq_idx) {
+  if (vq_idx >= m_num_queues || m_vqs[vq_idx]->irq < 0)
+    return -1;
+  return send_irq(m_vqs[vq_idx]->irq);
+}
+
 int MMIOVirtioDev::send_irq(uint8_t irq) {
   int err = 0;
   err = write(CHILD_DEVICE_IOAPIC_FD, &irq, sizeof(irq));
@@ -136,38 +302,237 @@ int MMIOVirtioDev::send_irq(uint8_t irq) {
 int MMIOVirtioDev::handle_MMIO(struct mmio_request *mmio) {
   int ret = 0;
   uint64_t offset = mmio->phys_addr - m_mmio_start;
+  int notify_vq = -1;
 
-  pthread_mutex_lock(&m_lock);
+  // notifies only touch their own queue, keep them off the config lock so
+  // different queues can be serviced from different vCPUs at once
+  if (mmio->is_write && offset == REG_QUEUE_NOTIFY) {
+    notify_queue(mmio->data);
+    return ret;
+  }
+
+  pthread_mutex_lock(&m_config_lock);
   if (mmio->is_write) {
-    mmio_write(offset, mmio->len, mmio->data);
+    mmio_write(offset, mmio->len, mmio->data, &notify_vq);
   }
   else {
     ret = mmio_read(offset, mmio->len);
   }
-  pthread_mutex_unlock(&m_lock);
+  pthread_mutex_unlock(&m_config_lock);
+
+  // a queue that just went ready may already have buffers waiting
+  if (notify_vq >= 0)
+    notify_queue(notify_vq);
 
   return ret;
 }
 
-int MMIOVirtioDev::IO_loop(int fd) {
-  int err = 0;
+int MMIOVirtioDev::notify_queue(uint64_t vq_idx) {
+  if (vq_idx >= m_num_queues)
+    return -1;
+
+  // the guest kicked us, so the poller (if it's parked) should pick the
+  // queues back up
+  if (m_busy_poll_us) {
+    pthread_mutex_lock(&m_poll_lock);
+    if (m_poll_parked) {
+      m_poll_parked = false;
+      pthread_cond_signal(&m_poll_wake);
+    }
+    pthread_mutex_unlock(&m_poll_lock);
+  }
+
+  return kick_queue(vq_idx);
+}
+
+int MMIOVirtioDev::kick_queue(uint16_t vq_idx) {
+  int ret = 0;
+  struct VirtQueue *vq = m_vqs[vq_idx];
+  pthread_mutex_lock(&vq->notify_lock);
+  if (vq->async) {
+    // just wake the worker, the vCPU doesn't wait on the device
+    if (vq->kick_fd >= 0) {
+      uint64_t one = 1;
+      if (write(vq->kick_fd, &one, sizeof(one)) != sizeof(one))
+        ret = -1;
+    }
+    else {
+      vq->kicked = true;
+      pthread_cond_signal(&vq->kick);
+    }
+  }
+  else {
+    ret = got_data(vq_idx);
+  }
+  pthread_mutex_unlock(&vq->notify_lock);
+
+  return ret;
+}
+
+void MMIOVirtioDev::queue_worker(uint16_t vq_idx) {
+  struct VirtQueue *vq = m_vqs[vq_idx];
+  while (1) {
+    pthread_mutex_lock(&vq->notify_lock);
+    while (!vq->kicked)
+      pthread_cond_wait(&vq->kick, &vq->notify_lock);
+    vq->kicked = false;
+    pthread_mutex_unlock(&vq->notify_lock);
+
+    // notifies that land while we're in here set kicked again and buy
+    // one more pass
+    got_data(vq_idx);
+  }
+}
+
+// kicks every ready queue that has buffers waiting, and sets or clears
+// VIRTQ_USED_F_NO_NOTIFY to match polling. returns true if any queue had
+// work
+bool MMIOVirtioDev::poll_queues(bool polling) {
+  bool found = false;
+  uint32_t i;
+  for (i=0; i < m_num_queues; i++) {
+    struct VirtQueue *vq = m_vqs[i];
+    bool empty = true;
+
+    pthread_mutex_lock(&vq->lock);
+    if (vq->ready) {
+      if (vq->no_notify != polling) {
+        uint16_t flags = polling ? VIRTQ_USED_F_NO_NOTIFY : 0;
+        // the guest checks flags after publishing its avail idx, so this
+        // has to be visible before we look at the ring below
+        __atomic_store_n(&vq->used->flags, flags, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        vq->no_notify = polling;
+      }
+      empty = avail_empty(i);
+    }
+    pthread_mutex_unlock(&vq->lock);
 
+    if (!empty) {
+      kick_queue(i);
+      found = true;
+    }
+  }
+
+  return found;
+}
+
+void MMIOVirtioDev::poll_loop(void) {
+  uint64_t last_work = monotonic_us();
+  while (1) {
+    if (poll_queues(true)) {
+      last_work = monotonic_us();
+      continue;
+    }
+
+    if (monotonic_us() - last_work < m_busy_poll_us) {
+      __builtin_ia32_pause();
+      continue;
+    }
+
+    // gone idle, let the guest notify us again. park first so a notify
+    // that races the flag clear can't be lost, then look once more for
+    // buffers posted while the guest still saw NO_NOTIFY
+    pthread_mutex_lock(&m_poll_lock);
+    m_poll_parked = true;
+    pthread_mutex_unlock(&m_poll_lock);
+
+    if (poll_queues(false)) {
+      pthread_mutex_lock(&m_poll_lock);
+      m_poll_parked = false;
+      pthread_mutex_unlock(&m_poll_lock);
+    }
+
+    pthread_mutex_lock(&m_poll_lock);
+    while (m_poll_parked)
+      pthread_cond_wait(&m_poll_wake, &m_poll_lock);
+    pthread_mutex_unlock(&m_poll_lock);
+
+    last_work = monotonic_us();
+  }
+}
+
+int MMIOVirtioDev::IO_loop(int fd) {
   struct io_request io = {0};
   while (read(fd, &io, sizeof(io)) == sizeof(io)) {
     switch(io.type) {
       case IOTYPE_MMIO:
-        err = handle_MMIO(&io.mmio);
-        HandledRequest(fd, err);
+        // this is the register value for reads, not an error, so a
+        // non-zero one mustn't end the loop
+        HandledRequest(fd, handle_MMIO(&io.mmio));
         break;
       default:
         fprintf(stderr, "Unsupported IO type encountered: %d\n", io.type);
         return -1;
     }
+  }
 
-    if (err) return err;
+  return 0;
+}
+
+int MMIOVirtioDev::event_loop_channel(void *ctx, int fd, struct io_request *io) {
+  MMIOVirtioDev *dev = (MMIOVirtioDev *)ctx;
+  if (io->type != IOTYPE_MMIO) {
+    fprintf(stderr, "Unsupported IO type encountered: %d\n", io->type);
+    return -1;
   }
 
-  return err;
+  HandledRequest(fd, dev->handle_MMIO(&io->mmio));
+  return 0;
+}
+
+void MMIOVirtioDev::event_loop_kick(void *ctx, uint32_t vq_idx) {
+  MMIOVirtioDev *dev = (MMIOVirtioDev *)ctx;
+  // the loop won't hand us this queue again until we return, kicks that
+  // land meanwhile leave the eventfd readable for one more pass
+  dev->got_data(vq_idx);
+}
+
+// one epoll loop services every vCPU channel and nonblocking async queue
+// kick, handing them to a pool of at most workers threads instead of a
+// thread each. an async queue that may block, like net rx waiting for a
+// packet, would hold one of those for good (or the loop itself with no
+// workers), so it keeps its own worker thread
+int MMIOVirtioDev::event_loop(int *vcpu_fds, size_t nvcpus, size_t workers) {
+  struct event_loop *loop = CreateEventLoop(workers,
+                                            event_loop_channel,
+                                            event_loop_kick,
+                                            this);
+  if (!loop)
+    return -1;
+
+  uint32_t i;
+  for (i=0; i < m_num_queues; i++) {
+    struct VirtQueue *vq = m_vqs[i];
+    if (!vq->async)
+      continue;
+    if (!vq->nonblocking) {
+      std::thread([this] (uint16_t vq_idx) {
+                    queue_worker(vq_idx);
+                  }, i).detach();
+      continue;
+    }
+
+    int kick_fd = eventfd(0, EFD_CLOEXEC);
+    if (kick_fd < 0 || EventLoopAddEvent(loop, kick_fd, i) < 0)
+      return -1;
+    pthread_mutex_lock(&vq->notify_lock);
+    vq->kick_fd = kick_fd;
+    pthread_mutex_unlock(&vq->notify_lock);
+  }
+
+  if (m_busy_poll_us) {
+    std::thread([this] {
+                  poll_loop();
+                }).detach();
+  }
+
+  for (i=0; i < nvcpus; i++) {
+    if (EventLoopAddChannel(loop, vcpu_fds[i]) < 0)
+      return -1;
+  }
+
+  return EventLoopRun(loop);
 }
 
 int MMIOVirtioDev::handle_IO(void) {
@@ -181,9 +546,32 @@ int MMIOVirtioDev::handle_IO(void) {
     return -1;
   }
 
+  char *busy_poll = getenv(BUSY_POLL_ENV);
+  if (busy_poll)
+    set_busy_poll(strtoul(busy_poll, NULL, 0));
+
+  size_t loop_workers;
+  if (EventLoopRequested(&loop_workers))
+    return event_loop(vcpu_fds, nvcpus, loop_workers);
+
   // process requests in worker loops
   // TODO uncomment when virtio is protected against race conditions
   int i = 0;
+  // async queue workers go first so no notify can beat them
+  for (i=0; i < m_num_queues; i++) {
+    if (m_vqs[i]->async) {
+      std::thread([this] (uint16_t vq_idx) {
+                    queue_worker(vq_idx);
+                  }, i).detach();
+    }
+  }
+
+  if (m_busy_poll_us) {
+    std::thread([this] {
+                  poll_loop();
+                }).detach();
+  }
+
   std::thread *workers = new std::thread[NR_MAX_VCPUS];
   for(i=0;i<nvcpus;i++) {
     workers[i] = std::thread([this] (int fd) {
@@ -234,6 +622,188 @@ uint32_t MMIOVirtioDev::get_device_feature_bits(void) {
   return features;
 }
 
+// the common registers below the config space. QUEUE_NOTIFY is left out,
+// handle_MMIO takes it before the config lock
+struct MMIOVirtioDev::CommonRegs
+  : RegMap<MMIOVirtioDev, CONFIG_SPACE_START, 4,
+  Reg<MMIOVirtioDev, REG_MAGIC_VAL, 4, MODE_MAGIC_VAL,
+      &MMIOVirtioDev::read_magic, nullptr>,
+  Reg<MMIOVirtioDev, REG_DEVICE_VERS, 4, MODE_DEVICE_VERS,
+      &MMIOVirtioDev::read_device_version, nullptr>,
+  Reg<MMIOVirtioDev, REG_SUBSYS_DEV_ID, 4, MODE_SUBSYS_DEV_ID,
+      &MMIOVirtioDev::read_device_id, nullptr>,
+  Reg<MMIOVirtioDev, REG_SUBSYS_VEND_ID, 4, MODE_SUBSYS_VEND_ID,
+      &MMIOVirtioDev::read_vendor_id, nullptr>,
+  Reg<MMIOVirtioDev, REG_DEVICE_FEATURES, 4, MODE_DEVICE_FEATURES,
+      &MMIOVirtioDev::read_device_features, nullptr>,
+  Reg<MMIOVirtioDev, REG_DEVICE_FEATURES_SELECT, 4, MODE_DEVICE_FEATURES_SELECT,
+      nullptr, &MMIOVirtioDev::write_device_features_sel>,
+  Reg<MMIOVirtioDev, REG_DRIVER_FEATURES, 4, MODE_DRIVER_FEATURES,
+      nullptr, &MMIOVirtioDev::write_driver_features>,
+  Reg<MMIOVirtioDev, REG_DRIVER_FEATURES_SELECT, 4, MODE_DRIVER_FEATURES_SELECT,
+      nullptr, &MMIOVirtioDev::write_driver_features_sel>,
+  Reg<MMIOVirtioDev, REG_QUEUE_SELECT, 4, MODE_QUEUE_SELECT,
+      nullptr, &MMIOVirtioDev::write_queue_sel>,
+  Reg<MMIOVirtioDev, REG_QUEUE_NUM_MAX, 4, MODE_QUEUE_NUM_MAX,
+      &MMIOVirtioDev::read_queue_num_max, nullptr>,
+  Reg<MMIOVirtioDev, REG_QUEUE_NUM, 4, MODE_QUEUE_NUM,
+      nullptr, &MMIOVirtioDev::write_queue_num>,
+  Reg<MMIOVirtioDev, REG_QUEUE_READY, 4, MODE_QUEUE_READY,
+      &MMIOVirtioDev::read_queue_ready, &MMIOVirtioDev::write_queue_ready>,
+  Reg<MMIOVirtioDev, REG_ISR, 4, MODE_ISR,
+      &MMIOVirtioDev::read_isr, nullptr>,
+  Reg<MMIOVirtioDev, REG_INTR_ACK, 4, MODE_INTR_ACK,
+      nullptr, &MMIOVirtioDev::write_intr_ack>,
+  Reg<MMIOVirtioDev, REG_DEVICE_STATUS, 4, MODE_DEVICE_STATUS,
+      &MMIOVirtioDev::read_status, &MMIOVirtioDev::write_status>,
+  Reg<MMIOVirtioDev, REG_QUEUE_DESC_LOW, 4, MODE_QUEUE_DESC_LOW,
+      nullptr, &MMIOVirtioDev::write_queue_desc_low>,
+  Reg<MMIOVirtioDev, REG_QUEUE_DESC_HIGH, 4, MODE_QUEUE_DESC_HIGH,
+      nullptr, &MMIOVirtioDev::write_queue_desc_high>,
+  Reg<MMIOVirtioDev, REG_QUEUE_DRIVER_LOW, 4, MODE_QUEUE_DRIVER_LOW,
+      nullptr, &MMIOVirtioDev::write_queue_driver_low>,
+  Reg<MMIOVirtioDev, REG_QUEUE_DRIVER_HIGH, 4, MODE_QUEUE_DRIVER_HIGH,
+      nullptr, &MMIOVirtioDev::write_queue_driver_high>,
+  Reg<MMIOVirtioDev, REG_QUEUE_DEVICE_LOW, 4, MODE_QUEUE_DEVICE_LOW,
+      nullptr, &MMIOVirtioDev::write_queue_device_low>,
+  Reg<MMIOVirtioDev, REG_QUEUE_DEVICE_HIGH, 4, MODE_QUEUE_DEVICE_HIGH,
+      nullptr, &MMIOVirtioDev::write_queue_device_high>,
+  Reg<MMIOVirtioDev, REG_CONFIG_GEN, 4, MODE_CONFIG_GEN,
+      &MMIOVirtioDev::read_config_gen, nullptr>
+  > { };
+
+uint64_t MMIOVirtioDev::read_magic(void) {
+  // 0x74726976 "virt"
+  return m_magic;
+}
+
+uint64_t MMIOVirtioDev::read_device_version(void) {
+  // 0x2
+  return m_device_version;
+}
+
+uint64_t MMIOVirtioDev::read_device_id(void) {
+  return m_device_id;
+}
+
+uint64_t MMIOVirtioDev::read_vendor_id(void) {
+  return m_vendor_id;
+}
+
+uint64_t MMIOVirtioDev::read_device_features(void) {
+  // NOTE: uint32_t conversion
+  return get_device_feature_bits();
+}
+
+void MMIOVirtioDev::write_device_features_sel(uint64_t data) {
+  if (data)
+    m_device_features_sel = 1;
+  else
+    m_device_features_sel = 0;
+}
+
+void MMIOVirtioDev::write_driver_features(uint64_t data) {
+  // if m_driver_features_sel is 1, set bits 32-63
+  if (m_driver_features_sel) {
+    m_driver_features &= 0x00000000ffffffff;
+    m_driver_features |= ((data & 0xffffffff) << 32);
+  }
+  // else, set bits 0-31
+  else {
+    m_driver_features &= 0xffffffff00000000;
+    m_driver_features |= (data & 0xffffffff);
+  }
+  if (DEBUG) {
+    printf("m_driver_features_sel=0x%x\n", m_driver_features_sel);
+  }
+}
+
+void MMIOVirtioDev::write_driver_features_sel(uint64_t data) {
+  if (data)
+    m_driver_features_sel = 1;
+  else
+    m_driver_features_sel = 0;
+}
+
+void MMIOVirtioDev::write_queue_sel(uint64_t data) {
+  if (data < m_num_queues)
+    m_queue_sel = data;
+}
+
+uint64_t MMIOVirtioDev::read_queue_num_max(void) {
+  if (m_vqs[m_queue_sel]->ready)
+    return MAX_VQ_SIZE;
+  return 0;
+}
+
+// this is how many buffers are in our desc table
+void MMIOVirtioDev::write_queue_num(uint64_t data) {
+  if (data < MAX_VQ_SIZE) {
+    // driver cannot change num bufs when the queue is ready
+    if (m_vqs[m_queue_sel]->ready == false)
+      m_vqs[m_queue_sel]->num_bufs = data;
+  }
+}
+
+uint64_t MMIOVirtioDev::read_queue_ready(void) {
+  return m_vqs[m_queue_sel]->ready;
+}
+
+void MMIOVirtioDev::write_queue_ready(uint64_t data) {
+  if (data) {
+    // handle_MMIO notifies once the config lock is dropped
+    if (ready_queue() == 0)
+      m_ready_vq = m_queue_sel;
+  }
+  else {
+    // unready queue TODO
+  }
+}
+
+uint64_t MMIOVirtioDev::read_isr(void) {
+  return m_isr;
+}
+
+void MMIOVirtioDev::write_intr_ack(uint64_t data) {
+  m_isr_ack = data;
+}
+
+uint64_t MMIOVirtioDev::read_status(void) {
+  return m_status;
+}
+
+void MMIOVirtioDev::write_status(uint64_t data) {
+  m_status = data;
+}
+
+void MMIOVirtioDev::write_queue_desc_low(uint64_t data) {
+  m_vqs[m_queue_sel]->queue_desc_low = data;
+}
+
+void MMIOVirtioDev::write_queue_desc_high(uint64_t data) {
+  m_vqs[m_queue_sel]->queue_desc_high = data;
+}
+
+void MMIOVirtioDev::write_queue_driver_low(uint64_t data) {
+  m_vqs[m_queue_sel]->queue_driver_low = data;
+}
+
+void MMIOVirtioDev::write_queue_driver_high(uint64_t data) {
+  m_vqs[m_queue_sel]->queue_driver_high = data;
+}
+
+void MMIOVirtioDev::write_queue_device_low(uint64_t data) {
+  m_vqs[m_queue_sel]->queue_device_low = data;
+}
+
+void MMIOVirtioDev::write_queue_device_high(uint64_t data) {
+  m_vqs[m_queue_sel]->queue_device_high = data;
+}
+
+uint64_t MMIOVirtioDev::read_config_gen(void) {
+  return m_config_gen;
+}
+
 int MMIOVirtioDev::mmio_read(uint64_t offset, uint32_t size) {
 
   // check if it's a config space read
@@ -244,48 +814,16 @@ int MMIOVirtioDev::mmio_read(uint64_t offset, uint32_t size) {
     return val;
   }
 
-
-  switch(offset) {
-    case REG_MAGIC_VAL:
-      // 0x74726976 "virt"
-      return m_magic;
-      break;
-    case REG_DEVICE_VERS:
-      // 0x2
-      return m_device_version;
-      break;
-    case REG_SUBSYS_DEV_ID:
-      return m_device_id;
-      break;
-    case REG_SUBSYS_VEND_ID:
-      return m_vendor_id;
-      break;
-    case REG_DEVICE_FEATURES:
-      // NOTE: uint32_t conversion
-      return get_device_feature_bits();
-      break;
-    case REG_QUEUE_NUM_MAX:
-      if (m_vqs[m_queue_sel]->ready)
-        return MAX_VQ_SIZE;
-      return 0;
-      break;
-    case REG_QUEUE_READY:
-      return m_vqs[m_queue_sel]->ready;
-      break;
-    case REG_ISR:
-      return m_isr;
-      break;
-    case REG_DEVICE_STATUS:
-      return m_status;
-      break;
-  }
-
-  return 0;
+  // unmapped registers and bad widths read as 0
+  uint64_t val = 0;
+  CommonRegs::read(this, offset, size, &val);
+  return val;
 }
 
-int MMIOVirtioDev::mmio_write(uint64_t offset, uint32_t size, uint64_t data) {
-  int ret = 0;
-  int err = 0;
+int MMIOVirtioDev::mmio_write(uint64_t offset,
+    uint32_t size,
+    uint64_t data,
+    int *notify_vq) {
 
   // check if it's a config space write
   if (offset >= CONFIG_SPACE_START
@@ -293,101 +831,27 @@ int MMIOVirtioDev::mmio_write(uint64_t offset, uint32_t size, uint64_t data) {
     return config_space_write(offset, data, size);
   }
 
-
-  // TODO: Enforce reads/writes of len 4 (32bit),
-  // unless reading/writing config space(?)
-  switch(offset) {
-    case REG_DEVICE_FEATURES_SELECT:
-      if (data)
-        m_device_features_sel = 1;
-      else
-        m_device_features_sel = 0;
-      break;
-    case REG_DRIVER_FEATURES:
-      // if m_driver_features_sel is 1, set bits 32-63
-      if (m_driver_features_sel) {
-        m_driver_features &= 0x00000000ffffffff;
-        m_driver_features |= ((data & 0xffffffff) << 32);
-      }
-      // else, set bits 0-31
-      else {
-        m_driver_features &= 0xffffffff00000000;
-        m_driver_features |= (data & 0xffffffff);
-      }
-      if (DEBUG) {
-         printf("m_driver_features_sel=0x%x\n", m_driver_features_sel);
-      }
-      break;
-    case REG_DRIVER_FEATURES_SELECT:
-      if (data)
-        m_driver_features_sel = 1;
-      else
-        m_driver_features_sel = 0;
-      break;
-    case REG_QUEUE_SELECT:
-      if (data < m_num_queues)
-        m_queue_sel = data;
-      break;
-    // this is how many buffers are in our desc table
-    case REG_QUEUE_NUM:
-      if (data < MAX_VQ_SIZE) {
-        // driver cannot change num bufs when the queue is ready
-        if (m_vqs[m_queue_sel]->ready == false)
-          m_vqs[m_queue_sel]->num_bufs = data;
-      }
-      break;
-    case REG_QUEUE_READY:
-      if (data) {
-        // TODO: Check return val and notify device if good (0)
-        err = ready_queue();
-        if (err == 0) {
-          ret = got_data(m_queue_sel);
-        }
-      }
-      else {
-        // unready queue TODO
-      }
-      break;
-    case REG_QUEUE_NOTIFY:
-      ret = got_data(data);
-      break;
-    case REG_INTR_ACK:
-      m_isr_ack = data;
-      break;
-    case REG_QUEUE_DESC_LOW:
-      m_vqs[m_queue_sel]->queue_desc_low = data;
-      break;
-    case REG_QUEUE_DESC_HIGH:
-      m_vqs[m_queue_sel]->queue_desc_high = data;
-      break;
-    case REG_QUEUE_DRIVER_LOW:
-      m_vqs[m_queue_sel]->queue_driver_low = data;
-      break;
-    case REG_QUEUE_DRIVER_HIGH:
-      m_vqs[m_queue_sel]->queue_driver_high = data;
-      break;
-    case REG_QUEUE_DEVICE_LOW:
-      m_vqs[m_queue_sel]->queue_device_low = data;
-      break;
-    case REG_QUEUE_DEVICE_HIGH:
-      m_vqs[m_queue_sel]->queue_device_high = data;
-      break;
-  }
+  // writes to unmapped or read-only registers, or of the wrong width, are
+  // dropped
+  m_ready_vq = -1;
+  CommonRegs::write(this, offset, size, data);
+  *notify_vq = m_ready_vq;
 
   return 0;
 }
 
 int MMIOVirtioDev::ready_queue(void) {
+  struct VirtQueue *vq = m_vqs[m_queue_sel];
   // check if num bufs has been set
-  if (m_vqs[m_queue_sel]->num_bufs == 0)
+  if (vq->num_bufs == 0)
     return -1;
 
-  uint64_t desc_table_addr = ((uint64_t)m_vqs[m_queue_sel]->queue_desc_high << 32)
-    | (m_vqs[m_queue_sel]->queue_desc_low);
-  uint64_t avail_addr = ((uint64_t)m_vqs[m_queue_sel]->queue_driver_high << 32)
-    | (m_vqs[m_queue_sel]->queue_driver_low);
-  uint64_t used_addr = ((uint64_t)m_vqs[m_queue_sel]->queue_device_high << 32)
-    | (m_vqs[m_queue_sel]->queue_device_low);
+  uint64_t desc_table_addr = ((uint64_t)vq->queue_desc_high << 32)
+    | (vq->queue_desc_low);
+  uint64_t avail_addr = ((uint64_t)vq->queue_driver_high << 32)
+    | (vq->queue_driver_low);
+  uint64_t used_addr = ((uint64_t)vq->queue_device_high << 32)
+    | (vq->queue_device_low);
 
   if (DEBUG) {
     printf("desc_table_addr: 0x%lx\n", desc_table_addr);
@@ -395,26 +859,39 @@ int MMIOVirtioDev::ready_queue(void) {
     printf("used_addr: 0x%lx\n", used_addr);
   }
 
-  uint32_t num_bufs = m_vqs[m_queue_sel]->num_bufs;
-  // do bounds checks on all the spaces
-  uint64_t desc_table_sz = sizeof(struct VirtqDesc) * num_bufs;
-  if (m_mem->oob(desc_table_addr, desc_table_sz))
-    return -1;
-
-  uint64_t avail_sz = sizeof(struct VirtqAvail)
-    + (num_bufs * sizeof(uint16_t));
-  if (m_mem->oob(avail_addr, avail_sz))
+  uint32_t num_bufs = vq->num_bufs;
+  // do bounds checks on all the spaces, once. after this the ring
+  // accessors index the spans directly
+  GuestSpan<struct VirtqDesc> desc =
+    m_mem->span<struct VirtqDesc>(desc_table_addr, num_bufs);
+  GuestSpan<struct VirtqAvail> avail =
+    m_mem->span<struct VirtqAvail>(avail_addr, 1);
+  GuestSpan<uint16_t> avail_ring =
+    m_mem->span<uint16_t>(avail_addr + offsetof(struct VirtqAvail, ring),
+                          num_bufs);
+  GuestSpan<struct VirtqUsed> used =
+    m_mem->span<struct VirtqUsed>(used_addr, 1);
+  GuestSpan<struct VirtqUsedElem> used_ring =
+    m_mem->span<struct VirtqUsedElem>(used_addr + offsetof(struct VirtqUsed, ring),
+                                      num_bufs);
+
+  if (!desc.valid() || !avail.valid() || !avail_ring.valid()
+      || !used.valid() || !used_ring.valid())
     return -1;
 
-  uint64_t used_sz = sizeof(struct VirtqUsed)
-    + (num_bufs * sizeof(struct VirtqUsedElem));
-  if (m_mem->oob(used_addr, used_sz))
-    return -1;
+  // the queue length is fixed once ready, so the slab is sized once
+  if (!vq->pool)
+    vq->pool = new VirtBufPool(num_bufs);
 
-  m_vqs[m_queue_sel]->desc_table_gaddr = desc_table_addr;
-  m_vqs[m_queue_sel]->avail_gaddr = avail_addr;
-  m_vqs[m_queue_sel]->used_gaddr = used_addr;
-  m_vqs[m_queue_sel]->ready = true;
+  // publish under the ring lock, get_buf/put_buf check ready with it held
+  pthread_mutex_lock(&vq->lock);
+  vq->desc = desc;
+  vq->avail = avail;
+  vq->avail_ring = avail_ring;
+  vq->used = used;
+  vq->used_ring = used_ring;
+  vq->ready = true;
+  pthread_mutex_unlock(&vq->lock);
 
   return 0;
 }
@@ -422,56 +899,63 @@ int MMIOVirtioDev::ready_queue(void) {
 // NOTE: assumes the queue is ready
 bool MMIOVirtioDev::avail_empty(uint16_t vq_idx) {
   struct VirtQueue *vq = m_vqs[vq_idx];
-  int err = 0;
-  uint16_t avail_head_idx;
-  err = m_mem->readX<uint16_t>(vq->avail_gaddr
-      + offsetof(struct VirtqAvail, head_idx),
-      &avail_head_idx);
-
-  // figure out a better solution for error handling here
-  if (err != 0)
-    throw std::out_of_range("");
+  // pairs with the guest's write of the ring entry before it bumps idx
+  uint16_t avail_head_idx = guest_load_acquire(&vq->avail->head_idx);
 
   // if avail_head_idx == tail_idx, we're empty
-  //printf("head_idx: %d    vq->avail_tail_idx: %d\n", head_idx, vq->avail_tail_idx);
   return avail_head_idx == vq->avail_tail_idx;
 }
 
 // NOTE: assumes the queue is ready
 bool MMIOVirtioDev::used_full(uint16_t vq_idx) {
   struct VirtQueue *vq = m_vqs[vq_idx];
-  int err = 0;
-  uint16_t used_head_idx;
-  err = m_mem->readX<uint16_t>(vq->used_gaddr
-      + offsetof(struct VirtqUsed, head_idx),
-      &used_head_idx);
-
-  // figure out a better solution for error handling here
-  if (err != 0)
-    throw std::out_of_range("");
+  // we're the only writer of the used idx
+  uint16_t used_head_idx = vq->used->head_idx;
 
   // if used_head_idx == avail_tail we've given back all the bufs we've consumed
-  //printf("used_head_idx: %d    vq->avail_tail_idx: %d\n", used_head_idx, vq->avail_tail_idx);
   return used_head_idx == vq->avail_tail_idx;
 }
 
-VirtBuf * MMIOVirtioDev::get_buf(uint16_t vq_idx) {
+VirtBufHandle MMIOVirtioDev::get_buf(uint16_t vq_idx) {
   if (vq_idx >= m_num_queues)
-    return NULL;
+    return VirtBufHandle();
+
+  struct VirtQueue *vq = m_vqs[vq_idx];
+  pthread_mutex_lock(&vq->lock);
+  VirtBufHandle vbuf = get_buf_locked(vq_idx);
+  pthread_mutex_unlock(&vq->lock);
+
+  return vbuf;
+}
+
+int MMIOVirtioDev::put_buf(uint16_t vq_idx, VirtBufHandle vbuf) {
+  int ret = 0;
+  if (vq_idx >= m_num_queues)
+    return -1;
+
+  struct VirtQueue *vq = m_vqs[vq_idx];
+  pthread_mutex_lock(&vq->lock);
+  ret = put_buf_locked(vq_idx, vbuf);
+  pthread_mutex_unlock(&vq->lock);
+
+  // on error the slot goes back to the pool as vbuf goes out of scope
+  return ret;
+}
+
+// NOTE: caller holds the queue's ring lock
+VirtBufHandle MMIOVirtioDev::get_buf_locked(uint16_t vq_idx) {
   // first check if the currently selected vq is ready
   if (!m_vqs[vq_idx]->ready)
-    return NULL;
+    return VirtBufHandle();
 
   // check if our available ring buffer is empty
   if (avail_empty(vq_idx))
-    return NULL;
+    return VirtBufHandle();
 
-  int err = 0;
   struct VirtQueue *vq = m_vqs[vq_idx];
   uint16_t avail_tail_idx = vq->avail_tail_idx;
   // mod before indexing for wrap
   avail_tail_idx %= vq->num_bufs;
-  uint64_t avail_addr = vq->avail_gaddr;
   // avail
   //   ...
   //   ring [
@@ -480,49 +964,64 @@ VirtBuf * MMIOVirtioDev::get_buf(uint16_t vq_idx) {
   //       id     avail_tail_idx
   //     ...      ...
   //   ]
-  uint16_t desc_id;
-  err = m_mem->readX<uint16_t>(avail_addr
-      + offsetof(struct VirtqAvail, ring)
-      + sizeof(uint16_t)*avail_tail_idx,
-      &desc_id);
-
-  if (err != 0)
-    return NULL;
+  uint16_t desc_id = vq->avail_ring[avail_tail_idx];
+
   // check their desc_id against the number of buffers they say are available
-  if (desc_id > vq->num_bufs)
-    return NULL;
-  // now lets pull out the proper descriptor
-  uint64_t desc_table_addr = vq->desc_table_gaddr;
-  struct VirtqDesc desc;
-  err = m_mem->read(desc_table_addr
-      + (sizeof(struct VirtqDesc)*desc_id),
-      &desc,
-      sizeof(struct VirtqDesc));
-
-  if (err != 0)
-    return NULL;
+  if (desc_id >= vq->num_bufs)
+    return VirtBufHandle();
+  // now lets pull out the proper descriptor. copy it so the guest can't
+  // change it between the check below and its use
+  struct VirtqDesc desc = vq->desc[desc_id];
 
   // do a bounds check on the buffer they handed us to ensure it's
-  // within the system memory
+  // within guest memory
   if (m_mem->oob(desc.addr, desc.len)) {
-    return NULL;
+    return VirtBufHandle();
   }
-  // TODO: Handle chaining
-  VirtBuf *vbuf = new VirtBuf(desc.addr, m_mem);
+
+  // follow the chain, each descriptor copied and checked like the head.
+  // the segment limit also stops a looping chain
+  struct VirtBufSeg segs[VIRTBUF_MAX_SEGS];
+  uint16_t nsegs = 1;
+  uint64_t total_len = desc.len;
+  segs[0].guest_addr = desc.addr;
+  segs[0].len = desc.len;
+  struct VirtqDesc next = desc;
+  while (next.flags & VIRTQ_DESC_F_NEXT) {
+    if (nsegs == VIRTBUF_MAX_SEGS || next.next >= vq->num_bufs)
+      return VirtBufHandle();
+    next = vq->desc[next.next];
+    if (m_mem->oob(next.addr, next.len))
+      return VirtBufHandle();
+    segs[nsegs].guest_addr = next.addr;
+    segs[nsegs].len = next.len;
+    total_len += next.len;
+    nsegs++;
+  }
+
+  // every slot is checked out, the guest has handed us more buffers than
+  // the queue can hold. leave them on the ring
+  VirtBuf *slot = vq->pool->alloc();
+  if (!slot)
+    return VirtBufHandle();
+
+  VirtBuf *vbuf = new (slot) VirtBuf(desc.addr, m_mem);
   vbuf->m_guest_addr = desc.addr;
   vbuf->m_len = desc.len;
   vbuf->flags = desc.flags;
   vbuf->m_id = desc_id;
+  memcpy(vbuf->m_segs, segs, nsegs * sizeof(segs[0]));
+  vbuf->m_nsegs = nsegs;
+  vbuf->m_total_len = total_len;
 
   // finally, increment the avail tail idx
   vq->avail_tail_idx += 1;
 
-  return vbuf;
+  return VirtBufHandle(vbuf, vq->pool);
 }
 
-int MMIOVirtioDev::put_buf(uint16_t vq_idx, VirtBuf *vbuf) {
-  if (vq_idx >= m_num_queues)
-    return -1;
+// NOTE: caller holds the queue's ring lock
+int MMIOVirtioDev::put_buf_locked(uint16_t vq_idx, VirtBufHandle &vbuf) {
   // first check if the currently selected vq is ready
   if (!m_vqs[vq_idx]->ready)
     return -1;
@@ -533,20 +1032,10 @@ int MMIOVirtioDev::put_buf(uint16_t vq_idx, VirtBuf *vbuf) {
   if (used_full(vq_idx))
     return -1;
 
-  int err = 0;
   struct VirtQueue *vq = m_vqs[vq_idx];
-  struct VirtqUsedElem used_elem;
-  used_elem.id = vbuf->m_id;
-  used_elem.len = vbuf->m_nbytes_written;
 
   // get our head idx which is in guest mem but we're responsible for updating
-  uint16_t head_idx;
-  err = m_mem->readX<uint16_t>(vq->used_gaddr
-      + offsetof(struct VirtqUsed, head_idx),
-      &head_idx);
-
-  if (err !=0 )
-    return -1;
+  uint16_t head_idx = vq->used->head_idx;
   // inc new head before we mod
   uint16_t new_head_idx = head_idx + 1;
   // mod before indexing for wrap
@@ -556,24 +1045,18 @@ int MMIOVirtioDev::put_buf(uint16_t vq_idx, VirtBuf *vbuf) {
         vbuf->m_id, vbuf->m_guest_addr, head_idx);
   }
   // so now we write out filled in used_elem to the proper idx in the used_ring
-  uint64_t addr_to_write = vq->used_gaddr
-    + offsetof(struct VirtqUsed, ring)
-    + sizeof(struct VirtqUsedElem)*vq->num_bufs;
-
-  err = m_mem->write(addr_to_write,
-      (void *)&used_elem,
-      sizeof(struct VirtqUsedElem));
-
-  if (err != 0)
-    return -1;
-
-  // finally update the head idx
-  err = m_mem->writeX<uint16_t>(vq->used_gaddr
-      + offsetof(struct VirtqUsed, head_idx),
-      new_head_idx);
-
-  if (err != 0)
-    return -1;
+  vq->used_ring[head_idx].id = vbuf->m_id;
+  vq->used_ring[head_idx].len = vbuf->m_nbytes_written;
+
+  // the slot has to be free before the guest can see the descriptor is
+  // back: it may repost it and notify straight away, and get_buf would
+  // find every slot checked out and leave it on the ring with no kick to
+  // come
+  vbuf.reset();
+
+  // finally update the head idx. release so the guest sees the element (and
+  // whatever we wrote into the buffer) before it sees the new idx
+  guest_store_release(&vq->used->head_idx, new_head_idx);
 
   return 0;
 }
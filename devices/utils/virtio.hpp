@@ -1,14 +1,21 @@
 #pragma once
 #include <stdint.h>
+#include <pthread.h>
+#include <sys/uio.h>
 #include <string>
 
 #include "vmm.h"
+#include "mem-manager.hpp"
+#include "regmap.hpp"
 
 #define MAGIC 0x74726976
 #define VIRTIO_DEVICE_VERS 0x2
 #define CONFIG_SPACE_MAX 0x400
 #define CONFIG_SPACE_START 0x100
 #define MAX_VQ_SIZE 32768
+// longest descriptor chain a VirtBuf takes, head included. longer chains
+// are left on the ring like any other bad buffer
+#define VIRTBUF_MAX_SEGS 16
 
 // ####################
 // # Status bit masks #
@@ -84,10 +91,6 @@
 #define REG_CONFIG_SPACE 0x100
 
 
-#define MODE_R 1
-#define MODE_W 2
-#define MODE_RW 3
-
 // ##################
 // # Register Modes #
 // ##################
@@ -127,6 +130,16 @@
 /* This means the buffer contains a list of buffer descriptors. */
 #define VIRTQ_DESC_F_INDIRECT   4
 
+// ####################
+// # VirtqUsed flags  #
+// ####################
+// device tells the driver not to kick it, set while busy polling
+#define VIRTQ_USED_F_NO_NOTIFY  1
+
+// env var enabling busy polling for any device, value is the idle period
+// in microseconds before falling back to notifies
+#define BUSY_POLL_ENV "OOOWS_VIRTIO_BUSY_POLL_US"
+
 typedef uint64_t guest_paddr;
 
 union virtio_features_t {
@@ -179,7 +192,31 @@ struct VirtqUsed {
 };
 
 struct VirtQueue {
+  // guards the ring state (avail/used indices) in get_buf/put_buf
   pthread_mutex_t lock;
+  // serializes got_data for this queue only. lock order is
+  // m_config_lock -> notify_lock -> lock
+  pthread_mutex_t notify_lock;
+  // async queues hand notifies to a per-queue worker thread instead of
+  // running got_data on the vCPU's IO thread, see set_queue_async
+  bool async;
+  // set by a notify, cleared by the worker before it calls got_data.
+  // protected by notify_lock
+  bool kicked;
+  pthread_cond_t kick;
+  // got_data never blocks, so the event loop may run it on its own threads,
+  // see set_queue_nonblocking
+  bool nonblocking;
+  // in event loop mode an eventfd the loop watches stands in for the
+  // worker thread of a nonblocking queue, -1 otherwise
+  int kick_fd;
+  // irq line raised by send_queue_irq, -1 if none was assigned
+  int16_t irq;
+  // whether VIRTQ_USED_F_NO_NOTIFY is currently set in the used ring.
+  // protected by lock
+  bool no_notify;
+  // slab of VirtBufs handed out by get_buf, created when the queue goes ready
+  class VirtBufPool *pool;
   uint32_t num_bufs;
   bool ready;
   bool enabled;
@@ -195,10 +232,18 @@ struct VirtQueue {
   // used
   uint32_t queue_device_low;
   uint32_t queue_device_high;
-  // helpers
-  uint64_t desc_table_gaddr;
-  uint64_t avail_gaddr;
-  uint64_t used_gaddr;
+  // validated views of the rings, set up once in ready_queue
+  GuestSpan<struct VirtqDesc> desc;
+  GuestSpan<struct VirtqAvail> avail;
+  GuestSpan<uint16_t> avail_ring;
+  GuestSpan<struct VirtqUsed> used;
+  GuestSpan<struct VirtqUsedElem> used_ring;
+};
+
+// one descriptor of a chain, bounds checked when the buffer was taken
+struct VirtBufSeg {
+  uint64_t guest_addr;
+  uint32_t len;
 };
 
 // helper class for devices
@@ -214,6 +259,11 @@ class VirtBuf {
   uint16_t flags;
   // bytes written by the device
   uint32_t m_nbytes_written;
+  // every descriptor of the chain, the head first. m_guest_addr/m_len and
+  // the accessors below only see the head, gather/scatter/iov the lot
+  struct VirtBufSeg m_segs[VIRTBUF_MAX_SEGS];
+  uint16_t m_nsegs;
+  uint64_t m_total_len;
 
   VirtBuf(uint64_t guest_addr, class MemoryManager *mem);
   // reads from supplied offset
@@ -228,11 +278,83 @@ class VirtBuf {
   void *host_addr(uint64_t offset);
   // resets head to given value, or back to start_addr if not specified
   void reset_head(uint64_t addr=0);
+  // host iovecs covering [offset, offset+size) of the chain. returns how
+  // many were filled in, or -1 if the range runs off the end of the chain
+  // or needs more than max
+  int iov(uint64_t offset, uint64_t size, struct iovec *iov, int max);
+  // copy out of / into [offset, offset+size) of the chain
+  int gather(uint64_t offset, void *buf, uint64_t size);
+  int scatter(uint64_t offset, const void *data, uint64_t size);
 private:
   class MemoryManager *m_mem;
   uint64_t m_head;
 };
 
+// fixed size slab of VirtBufs backing one virtqueue. it is sized to the
+// queue length so the hot path never has to touch the heap
+class VirtBufPool {
+  public:
+  VirtBufPool(uint32_t nslots);
+  ~VirtBufPool();
+  // returns NULL when every slot is checked out
+  VirtBuf *alloc(void);
+  void release(VirtBuf *vbuf);
+
+private:
+  VirtBuf *m_slab;
+  // stack of free slot indices
+  uint16_t *m_free;
+  uint32_t m_nslots;
+  uint32_t m_nfree;
+  pthread_mutex_t m_lock;
+};
+
+// move-only owner of a pooled VirtBuf. the slot goes back to its pool when
+// the handle is destroyed or reset, so a buffer can't leak once it has been
+// taken off the avail ring
+class VirtBufHandle {
+  public:
+  VirtBufHandle() : m_vbuf(NULL), m_pool(NULL) { }
+  VirtBufHandle(VirtBuf *vbuf, VirtBufPool *pool) : m_vbuf(vbuf), m_pool(pool) { }
+  VirtBufHandle(VirtBufHandle &&other) : m_vbuf(other.m_vbuf), m_pool(other.m_pool) {
+    other.m_vbuf = NULL;
+    other.m_pool = NULL;
+  }
+  VirtBufHandle &operator=(VirtBufHandle &&other) {
+    if (this != &other) {
+      reset();
+      m_vbuf = other.m_vbuf;
+      m_pool = other.m_pool;
+      other.m_vbuf = NULL;
+      other.m_pool = NULL;
+    }
+    return *this;
+  }
+  VirtBufHandle(const VirtBufHandle &) = delete;
+  VirtBufHandle &operator=(const VirtBufHandle &) = delete;
+  ~VirtBufHandle() { reset(); }
+
+  VirtBuf *get(void) const { return m_vbuf; }
+  VirtBuf *operator->() const { return m_vbuf; }
+  VirtBuf &operator*() const { return *m_vbuf; }
+  explicit operator bool() const { return m_vbuf != NULL; }
+  // hands the slot back to the pool
+  void reset(void) {
+    if (m_vbuf)
+      m_pool->release(m_vbuf);
+    m_vbuf = NULL;
+    m_pool = NULL;
+  }
+
+private:
+  VirtBuf *m_vbuf;
+  VirtBufPool *m_pool;
+};
+
+// number of queue pairs a multi-queue device should expose, read from the
+// given env var. defaults to 1 and is clamped to max_pairs
+uint32_t virtio_queue_pairs(const char *env, uint32_t max_pairs);
+
 class MMIOVirtioDev {
   public:
   // strict regs
@@ -252,6 +374,9 @@ class MMIOVirtioDev {
   uint8_t m_status;
   uint32_t m_config_gen;
   uint32_t m_config_space[CONFIG_SPACE_MAX];
+  // queue a QUEUE_READY write just readied, -1 if none. set under
+  // m_config_lock by the register handler and picked up by mmio_write
+  int m_ready_vq;
 
   // helpers
   std::string m_dev_name;
@@ -263,7 +388,14 @@ class MMIOVirtioDev {
   uint32_t m_num_queues;
   struct VirtQueue **m_vqs;
   class MemoryManager *m_mem;
-  pthread_mutex_t m_lock;
+  // device-global registers (selectors, features, status, queue setup).
+  // queue notifies don't take it
+  pthread_mutex_t m_config_lock;
+  // busy polling, see set_busy_poll. 0 when disabled
+  uint32_t m_busy_poll_us;
+  bool m_poll_parked;
+  pthread_mutex_t m_poll_lock;
+  pthread_cond_t m_poll_wake;
 
   // constructor
   MMIOVirtioDev(uint64_t start_addr, uint32_t num_vqs, void *host_addr = NULL);
@@ -277,14 +409,33 @@ class MMIOVirtioDev {
   // for exposing supported features. DEVICES SHOULD USE THIS WHEN INITIALIZING
   void set_device_features(uint64_t features);
   // for devices to retreive virtbufs after receiving a notif
-  VirtBuf * get_buf(uint16_t vq_idx);
-  // for devices to put back used buffers
-  int put_buf(uint16_t vq_idx, VirtBuf *vbuf);
+  VirtBufHandle get_buf(uint16_t vq_idx);
+  // for devices to put back used buffers, the handle is consumed
+  int put_buf(uint16_t vq_idx, VirtBufHandle vbuf);
   // for devives to send interrupts to the guest
   // (e.g. to notify them of buffers placed in the used ring buffer via put_buf)
   int send_irq(uint8_t irq);
   // devices SHOULD USE THIS DURING INITIALIZATION to set their config space
   int set_config_space(void *data, uint32_t size);
+  // call during initialization to service a queue from its own worker thread.
+  // the notify returns to the guest right away and back to back notifies are
+  // coalesced, so got_data must drain the queue and signal completion with
+  // send_irq. queues are synchronous by default
+  int set_queue_async(uint16_t vq_idx);
+  // call during initialization for an async queue whose got_data never waits
+  // on anything. in event loop mode only those are run by the loop, the
+  // rest keep a worker thread each so they can't hold up the loop's threads
+  int set_queue_nonblocking(uint16_t vq_idx);
+  // call during initialization to have a thread watch every ready queue's
+  // avail index instead of waiting for notifies. while it is busy the guest
+  // is told not to notify at all; after idle_us without new buffers it falls
+  // back to notifies until the next one arrives. 0 disables
+  void set_busy_poll(uint32_t idle_us);
+  // give a queue its own irq line so completions on different queues can be
+  // routed to different vCPUs through the ioapic redir table
+  int set_queue_irq(uint16_t vq_idx, uint8_t irq);
+  // raise the irq assigned to a queue with set_queue_irq
+  int send_queue_irq(uint16_t vq_idx);
 
   // ######################################
   // # functions for devices to implement #
@@ -303,9 +454,46 @@ private:
   int ready_queue(void);
   bool avail_empty(uint16_t vq_idx);
   bool used_full(uint16_t vq_idx);
+  VirtBufHandle get_buf_locked(uint16_t vq_idx);
+  int put_buf_locked(uint16_t vq_idx, VirtBufHandle &vbuf);
   int handle_MMIO(struct mmio_request *mmio);
+  int notify_queue(uint64_t vq_idx);
+  int kick_queue(uint16_t vq_idx);
+  void queue_worker(uint16_t vq_idx);
+  bool poll_queues(bool polling);
+  void poll_loop(void);
   int IO_loop(int fd);
+  int event_loop(int *vcpu_fds, size_t nvcpus, size_t workers);
+  static int event_loop_channel(void *ctx, int fd, struct io_request *io);
+  static void event_loop_kick(void *ctx, uint32_t vq_idx);
   int mmio_read(uint64_t offset, uint32_t size);
-  int mmio_write(uint64_t offset, uint32_t size, uint64_t data);
+  int mmio_write(uint64_t offset, uint32_t size, uint64_t data, int *notify_vq);
+
+  // accessors for the common registers, dispatched through CommonRegs
+  struct CommonRegs;
+  uint64_t read_magic(void);
+  uint64_t read_device_version(void);
+  uint64_t read_device_id(void);
+  uint64_t read_vendor_id(void);
+  uint64_t read_device_features(void);
+  void write_device_features_sel(uint64_t data);
+  void write_driver_features(uint64_t data);
+  void write_driver_features_sel(uint64_t data);
+  void write_queue_sel(uint64_t data);
+  uint64_t read_queue_num_max(void);
+  void write_queue_num(uint64_t data);
+  uint64_t read_queue_ready(void);
+  void write_queue_ready(uint64_t data);
+  uint64_t read_isr(void);
+  void write_intr_ack(uint64_t data);
+  uint64_t read_status(void);
+  void write_status(uint64_t data);
+  void write_queue_desc_low(uint64_t data);
+  void write_queue_desc_high(uint64_t data);
+  void write_queue_driver_low(uint64_t data);
+  void write_queue_driver_high(uint64_t data);
+  void write_queue_device_low(uint64_t data);
+  void write_queue_device_high(uint64_t data);
+  uint64_t read_config_gen(void);
 
 };
@@ -0,0 +1,596 @@
+// Drives a device binary through VirtioDriver and reports requests/sec and
+// latency, so device changes can be measured without booting the guest.
+//
+//   virtio-bench [-d depth] [-n requests] [-s size] [-o op] [-f fids] [-c segs] [-S span] <p9fs|net|ogx> <device bin>
+//
+// p9fs sends Tstat (or Tversion, Twalk down P9_WALK_PATH to a fresh fid,
+// size byte Tread/Twrite at offset 0 of a scratch file per fid, size byte
+// Treads of the share's listing, or after negotiating 9P2000.L Tgetattr
+// and size byte Treaddirs with -o) on the tmesg queue and counts a request
+// done when its response shows up on the rmesg queue. requests are spread
+// round robin over -f attached fids, and the msize is negotiated to fit
+// size. -S streams reads and writes through the first span bytes of each
+// file instead, every fid's requests following on from its last one. -c
+// hands every buffer over as a chain of segs descriptors. net
+// and ogx post size byte messages on their tx/write queue and count a
+// request done when the device hands the buffer back. ogx messages aren't
+// encrypted, so that only measures the transport and the rejection path.
+//
+// p9fs shares $OOOWS_VM_STORE_DIR$OOOWS_VM_NAME/9pshare, defaulting to
+// /tmp/virtio-bench/9pshare. net loads ./devices-bin/net-firmware relative
+// to the cwd, so run it from the repo root.
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "utils/virtio-driver.hpp"
+
+#define P9FS_MMIO_START 0x9b000000
+#define P9FS_VQ_TMESG 0
+#define P9FS_VQ_RMESG 1
+#define NET_MMIO_START 0xe1b00000
+#define NET_VQ_DATA_TX 1
+#define OGX_MMIO_START 0xefff0000
+#define OGX_VQ_WRITE 1
+
+#define P9_TLOPEN 12
+#define P9_TGETATTR 24
+#define P9_TREADDIR 40
+#define P9_TVERSION 100
+#define P9_TATTACH 104
+#define P9_TWALK 110
+#define P9_TOPEN 112
+#define P9_RERROR 107
+#define P9_TCREATE 114
+#define P9_TREAD 116
+#define P9_TWRITE 118
+#define P9_TREMOVE 122
+#define P9_TSTAT 124
+#define P9_OREAD 0
+#define P9_GETATTR_BASIC 0x7ffULL
+#define P9_ORDWR 2
+#define P9_BENCH_FID 1
+// directories the walk op descends, made in the share before the device
+// starts
+#define P9_WALK_PATH "walk/a/b/c"
+// files the readdir op puts in the share so the listing has something in it
+#define P9_READDIR_FILES 64
+#define P9_BUF_SIZE 0x1000
+// room for the Twrite header in front of the data
+#define P9_IO_HDR 0x20
+#define P9_MAX_MSIZE (512 * 1024)
+#define P9_MAX_IO_SIZE (P9_MAX_MSIZE - P9_IO_HDR)
+#define TX_MAX_SIZE 0x1000
+
+// give up if the device makes no progress for this long
+#define BENCH_STALL_NS (5 * 1000000000ULL)
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s [-d depth] [-n requests] [-s size] [-o stat|version|walk|read|write|readdir|getattr|lreaddir] "
+          "[-f fids] [-c segs] [-S span] <p9fs|net|ogx> <device bin>\n", prog);
+  exit(1);
+}
+
+struct Bench {
+  VirtioDriver *drv;
+  uint32_t depth;
+  uint32_t requests;
+  uint32_t size;
+  uint32_t fids;
+  uint16_t segs;
+  // -S, 0 for every read and write at offset 0
+  uint64_t span;
+  // p9fs buffer size and msize
+  uint32_t msize;
+  const char *version;
+  std::vector<double> latencies_us;
+  uint64_t irqs;
+};
+
+static void drain_irqs(struct Bench *b) {
+  while (b->drv->wait_irq(0) >= 0)
+    b->irqs++;
+}
+
+static void report(struct Bench *b, const char *what, uint64_t elapsed_ns) {
+  std::vector<double> &lat = b->latencies_us;
+  if (lat.empty()) {
+    printf("%s: no requests completed\n", what);
+    return;
+  }
+  std::sort(lat.begin(), lat.end());
+  double sum = 0;
+  for (double l : lat)
+    sum += l;
+
+  printf("%s: %zu requests, depth %u, %.3f s\n",
+         what, lat.size(), b->depth, elapsed_ns / 1e9);
+  printf("  %.0f req/s, %lu irqs\n",
+         lat.size() / (elapsed_ns / 1e9), (unsigned long)b->irqs);
+  printf("  latency us: avg %.1f p50 %.1f p99 %.1f max %.1f\n",
+         sum / lat.size(),
+         lat[lat.size() / 2],
+         lat[(lat.size() * 99) / 100],
+         lat.back());
+}
+
+// 9p strings are len[2] followed by the bytes. the device's READSTR treats
+// the bytes as a C string, so the terminator goes on the wire too
+static uint32_t p9_put_str(uint8_t *p, const char *s) {
+  uint16_t len = strlen(s) + 1;
+  memcpy(p, &len, sizeof(len));
+  memcpy(p + sizeof(len), s, len);
+  return sizeof(len) + len;
+}
+
+// writes the size[4] type[1] tag[2] header in front of a body built at
+// msg + 7 and returns the message length
+static uint32_t p9_finish(uint8_t *msg, uint8_t type, uint16_t tag, uint32_t body_len) {
+  uint32_t size = 7 + body_len;
+  memcpy(msg, &size, sizeof(size));
+  msg[4] = type;
+  memcpy(msg + 5, &tag, sizeof(tag));
+  return size;
+}
+
+// seq numbers the requests of a phase
+static uint32_t p9_build(struct Bench *b, uint8_t *msg, uint8_t type,
+                         uint16_t tag, uint32_t fid, uint32_t seq) {
+  uint8_t *body = msg + 7;
+  uint32_t len = 0;
+  uint32_t val;
+  uint64_t offset = 0;
+  uint64_t mask = P9_GETATTR_BASIC;
+  char name[64];
+  char path[] = P9_WALK_PATH;
+  char *elem, *save;
+  uint16_t nwname = 0;
+
+  switch (type) {
+    case P9_TVERSION:
+      val = b->msize;
+      memcpy(body, &val, sizeof(val));
+      len = sizeof(val);
+      len += p9_put_str(body + len, b->version);
+      break;
+    case P9_TATTACH:
+      val = fid;
+      memcpy(body, &val, sizeof(val));
+      val = -1;
+      memcpy(body + 4, &val, sizeof(val));
+      len = 8;
+      len += p9_put_str(body + len, "bench");
+      len += p9_put_str(body + len, "share");
+      break;
+    case P9_TWALK:
+      // every walk binds a new fid past the attached ones, nothing clunks
+      // them
+      val = fid;
+      memcpy(body, &val, sizeof(val));
+      val = P9_BENCH_FID + b->fids + seq;
+      memcpy(body + 4, &val, sizeof(val));
+      len = 10;
+      for (elem = strtok_r(path, "/", &save); elem; elem = strtok_r(NULL, "/", &save)) {
+        len += p9_put_str(body + len, elem);
+        nwname++;
+      }
+      memcpy(body + 8, &nwname, sizeof(nwname));
+      break;
+    case P9_TOPEN:
+      val = fid;
+      memcpy(body, &val, sizeof(val));
+      body[4] = P9_OREAD;
+      len = 5;
+      break;
+    case P9_TLOPEN:
+      val = fid;
+      memcpy(body, &val, sizeof(val));
+      val = O_RDONLY;
+      memcpy(body + 4, &val, sizeof(val));
+      len = 8;
+      break;
+    case P9_TGETATTR:
+      val = fid;
+      memcpy(body, &val, sizeof(val));
+      memcpy(body + 4, &mask, sizeof(mask));
+      len = 12;
+      break;
+    case P9_TSTAT:
+    case P9_TREMOVE:
+      val = fid;
+      memcpy(body, &val, sizeof(val));
+      len = sizeof(val);
+      break;
+    case P9_TCREATE:
+      val = fid;
+      memcpy(body, &val, sizeof(val));
+      len = sizeof(val);
+      snprintf(name, sizeof(name), "bench-%d-%u", getpid(), fid);
+      len += p9_put_str(body + len, name);
+      val = 0644;
+      memcpy(body + len, &val, sizeof(val));
+      len += sizeof(val);
+      body[len++] = P9_ORDWR;
+      break;
+    case P9_TREAD:
+    case P9_TREADDIR:
+    case P9_TWRITE:
+      if (type != P9_TREADDIR && b->span) {
+        offset = ((uint64_t)(seq / b->fids) * b->size) % b->span;
+      }
+      val = fid;
+      memcpy(body, &val, sizeof(val));
+      memcpy(body + 4, &offset, sizeof(offset));
+      memcpy(body + 12, &b->size, sizeof(b->size));
+      len = 16;
+      if (type == P9_TWRITE) {
+        memset(body + len, 0x41, b->size);
+        len += b->size;
+      }
+      break;
+  }
+
+  return p9_finish(msg, type, tag, len);
+}
+
+struct P9Phase {
+  uint8_t type;
+  uint32_t total;
+  bool measured;
+};
+
+// keeps depth 9p requests in flight, tags index the in flight slots
+static int bench_p9fs(struct Bench *b, const char *op) {
+  VirtioDriver *drv = b->drv;
+  std::vector<struct P9Phase> phases;
+  const char *what;
+
+  // negotiate the msize and attach the fids up front, give read/write a
+  // file each (with data in it for read) and remove them again at the end
+  phases.push_back({P9_TVERSION, 1, false});
+  phases.push_back({P9_TATTACH, b->fids, false});
+  if (!strcmp(op, "version")) {
+    phases.push_back({P9_TVERSION, b->requests, true});
+    what = "p9fs Tversion";
+  } else if (!strcmp(op, "walk")) {
+    phases.push_back({P9_TWALK, b->requests, true});
+    what = "p9fs Twalk";
+  } else if (!strcmp(op, "readdir")) {
+    phases.push_back({P9_TOPEN, b->fids, false});
+    phases.push_back({P9_TREAD, b->requests, true});
+    what = "p9fs Tread (directory)";
+  } else if (!strcmp(op, "getattr")) {
+    phases.push_back({P9_TGETATTR, b->requests, true});
+    what = "p9fs Tgetattr";
+  } else if (!strcmp(op, "lreaddir")) {
+    phases.push_back({P9_TLOPEN, b->fids, false});
+    phases.push_back({P9_TREADDIR, b->requests, true});
+    what = "p9fs Treaddir";
+  } else if (!strcmp(op, "read") || !strcmp(op, "write")) {
+    phases.push_back({P9_TCREATE, b->fids, false});
+    if (!strcmp(op, "read")) {
+      // the whole span has to be there to stream through
+      uint32_t fill = b->span ? b->span / b->size : 1;
+      phases.push_back({P9_TWRITE, b->fids * fill, false});
+      phases.push_back({P9_TREAD, b->requests, true});
+      what = "p9fs Tread";
+    } else {
+      phases.push_back({P9_TWRITE, b->requests, true});
+      what = "p9fs Twrite";
+    }
+    phases.push_back({P9_TREMOVE, b->fids, false});
+  } else {
+    phases.push_back({P9_TSTAT, b->requests, true});
+    what = "p9fs Tstat";
+  }
+
+  VirtioDriverQueue *tq = drv->setup_queue(P9FS_VQ_TMESG, b->depth, b->msize, b->segs);
+  VirtioDriverQueue *rq = drv->setup_queue(P9FS_VQ_RMESG, b->depth, b->msize, b->segs);
+  if (!tq || !rq) {
+    fprintf(stderr, "Failed to set up the 9p queues, guest memory is 1MiB\n");
+    return -1;
+  }
+
+  uint16_t i;
+  for (i=0; i < b->depth; i++)
+    rq->add(i, b->msize);
+  drv->kick(rq);
+
+  std::vector<uint16_t> free_tdesc;
+  std::vector<uint16_t> free_tags;
+  std::vector<uint64_t> sent_at(b->depth, 0);
+  for (i=0; i < b->depth; i++) {
+    free_tdesc.push_back(i);
+    free_tags.push_back(i);
+  }
+
+  uint64_t start = 0, elapsed = 0;
+  for (auto &phase : phases) {
+    uint8_t type = phase.type;
+    uint32_t total = phase.total;
+    uint32_t sent = 0, done = 0;
+    uint64_t last_progress = now_ns();
+
+    if (phase.measured)
+      start = now_ns();
+
+    while (done < total) {
+      bool kick = false;
+      while (sent < total && !free_tdesc.empty() && !free_tags.empty()) {
+        uint16_t desc_id = free_tdesc.back();
+        uint16_t tag = free_tags.back();
+        free_tdesc.pop_back();
+        free_tags.pop_back();
+
+        uint32_t fid = P9_BENCH_FID + sent % b->fids;
+        uint32_t len = p9_build(b, (uint8_t *)tq->buf(desc_id), type, tag, fid, sent);
+        sent_at[tag] = now_ns();
+        tq->add(desc_id, len);
+        kick = true;
+        sent++;
+      }
+      if (kick)
+        drv->kick(tq);
+
+      struct VirtqUsedElem elem;
+      while (tq->get_used(&elem))
+        free_tdesc.push_back(elem.id);
+
+      kick = false;
+      while (rq->get_used(&elem)) {
+        uint8_t *resp = (uint8_t *)rq->buf(elem.id);
+        uint16_t tag;
+        memcpy(&tag, resp + 5, sizeof(tag));
+        if (resp[4] == P9_RERROR) {
+          fprintf(stderr, "Device returned an error for tag %u\n", tag);
+          return -1;
+        }
+        if (tag >= b->depth) {
+          fprintf(stderr, "Response with unknown tag %u\n", tag);
+          return -1;
+        }
+        // every file was written with size bytes of 'A' before the reads
+        if (type == P9_TREAD && !strcmp(op, "read")) {
+          uint32_t count;
+          memcpy(&count, resp + 7, sizeof(count));
+          if (count != b->size || (count && resp[11] != 0x41)) {
+            fprintf(stderr, "Short or bad read for tag %u\n", tag);
+            return -1;
+          }
+        }
+
+        if (phase.measured)
+          b->latencies_us.push_back((now_ns() - sent_at[tag]) / 1000.0);
+        free_tags.push_back(tag);
+        rq->add(elem.id, b->msize);
+        kick = true;
+        done++;
+        last_progress = now_ns();
+      }
+      if (kick)
+        drv->kick(rq);
+
+      drain_irqs(b);
+      if (now_ns() - last_progress > BENCH_STALL_NS) {
+        fprintf(stderr, "Device stalled after %u of %u requests\n", done, total);
+        return -1;
+      }
+    }
+
+    if (phase.measured)
+      elapsed = now_ns() - start;
+  }
+
+  report(b, what, elapsed);
+  return 0;
+}
+
+// keeps depth messages of {uint16_t size; data[]} posted on a queue the
+// device consumes, a message is done when its buffer comes back
+static int bench_tx(struct Bench *b, uint16_t vq_idx, const char *what) {
+  VirtioDriver *drv = b->drv;
+  uint32_t buf_size = sizeof(uint16_t) + b->size;
+  VirtioDriverQueue *vq = drv->setup_queue(vq_idx, b->depth, buf_size, b->segs);
+  if (!vq) {
+    fprintf(stderr, "Failed to set up queue %u\n", vq_idx);
+    return -1;
+  }
+
+  std::vector<uint16_t> free_desc;
+  std::vector<uint64_t> sent_at(b->depth, 0);
+  uint16_t i;
+  for (i=0; i < b->depth; i++) {
+    uint8_t *msg = (uint8_t *)vq->buf(i);
+    uint16_t size = b->size;
+    memcpy(msg, &size, sizeof(size));
+    memset(msg + sizeof(size), 0x41, b->size);
+    free_desc.push_back(i);
+  }
+
+  uint32_t sent = 0, done = 0;
+  uint64_t start = now_ns();
+  uint64_t last_progress = start;
+  while (done < b->requests) {
+    bool kick = false;
+    while (sent < b->requests && !free_desc.empty()) {
+      uint16_t desc_id = free_desc.back();
+      free_desc.pop_back();
+      sent_at[desc_id] = now_ns();
+      vq->add(desc_id, buf_size);
+      kick = true;
+      sent++;
+    }
+    if (kick)
+      drv->kick(vq);
+
+    struct VirtqUsedElem elem;
+    while (vq->get_used(&elem)) {
+      if (elem.id >= b->depth) {
+        fprintf(stderr, "Device returned bad descriptor %u\n", elem.id);
+        return -1;
+      }
+      b->latencies_us.push_back((now_ns() - sent_at[elem.id]) / 1000.0);
+      free_desc.push_back(elem.id);
+      done++;
+      last_progress = now_ns();
+    }
+
+    drain_irqs(b);
+    if (now_ns() - last_progress > BENCH_STALL_NS) {
+      fprintf(stderr, "Device stalled after %u of %u requests\n", done, b->requests);
+      return -1;
+    }
+  }
+
+  report(b, what, now_ns() - start);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  struct Bench b;
+  const char *op = "stat";
+  int c;
+
+  b.depth = 16;
+  b.requests = 100000;
+  b.size = 64;
+  b.fids = 1;
+  b.segs = 1;
+  b.span = 0;
+  b.irqs = 0;
+
+  while ((c = getopt(argc, argv, "d:n:s:o:f:c:S:")) != -1) {
+    switch (c) {
+      case 'd':
+        b.depth = strtoul(optarg, NULL, 0);
+        break;
+      case 'n':
+        b.requests = strtoul(optarg, NULL, 0);
+        break;
+      case 's':
+        b.size = strtoul(optarg, NULL, 0);
+        break;
+      case 'o':
+        op = optarg;
+        break;
+      case 'f':
+        b.fids = strtoul(optarg, NULL, 0);
+        break;
+      case 'c':
+        b.segs = strtoul(optarg, NULL, 0);
+        break;
+      case 'S':
+        b.span = strtoull(optarg, NULL, 0);
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (argc - optind != 2)
+    usage(argv[0]);
+  // queue sizes have to be powers of two
+  if (b.depth == 0 || b.depth > 256 || (b.depth & (b.depth - 1))) {
+    fprintf(stderr, "depth must be a power of two up to 256\n");
+    return 1;
+  }
+  if (b.fids == 0) {
+    fprintf(stderr, "need at least one fid\n");
+    return 1;
+  }
+  if (b.segs == 0 || b.segs > 16) {
+    fprintf(stderr, "segs must be between 1 and 16\n");
+    return 1;
+  }
+  if (b.span && (b.span < b.size || b.span % b.size)) {
+    fprintf(stderr, "span must be a multiple of size\n");
+    return 1;
+  }
+  bool p9_io = !strcmp(op, "read") || !strcmp(op, "write")
+    || !strcmp(op, "readdir") || !strcmp(op, "lreaddir");
+  if (p9_io && b.size > P9_MAX_IO_SIZE) {
+    fprintf(stderr, "read/write size must be at most %u\n", P9_MAX_IO_SIZE);
+    return 1;
+  }
+  if (!p9_io && b.size > TX_MAX_SIZE) {
+    fprintf(stderr, "size must be at most %u\n", TX_MAX_SIZE);
+    return 1;
+  }
+  b.msize = P9_BUF_SIZE;
+  b.version = "P92021";
+  if (!strcmp(op, "getattr") || !strcmp(op, "lreaddir"))
+    b.version = "9P2000.L";
+  if (p9_io && b.size + P9_IO_HDR > b.msize)
+    b.msize = b.size + P9_IO_HDR;
+
+  const char *type = argv[optind];
+  const char *bin = argv[optind + 1];
+  uint64_t mmio_start;
+  if (!strcmp(type, "p9fs")) {
+    mmio_start = P9FS_MMIO_START;
+    // the device mkdirs the share but not its parent
+    if (!getenv("OOOWS_VM_STORE_DIR") && !getenv("OOOWS_VM_NAME")) {
+      mkdir("/tmp/virtio-bench", 0755);
+      setenv("OOOWS_VM_STORE_DIR", "/tmp/", 1);
+      setenv("OOOWS_VM_NAME", "virtio-bench", 1);
+    }
+    std::string dir = std::string(getenv("OOOWS_VM_STORE_DIR"))
+      + getenv("OOOWS_VM_NAME") + "/9pshare/";
+    mkdir(dir.c_str(), 0755);
+    if (!strcmp(op, "walk")) {
+      char path[] = P9_WALK_PATH;
+      char *elem, *save;
+      for (elem = strtok_r(path, "/", &save); elem; elem = strtok_r(NULL, "/", &save)) {
+        dir += elem;
+        mkdir(dir.c_str(), 0755);
+        dir += "/";
+      }
+    } else if (!strcmp(op, "readdir") || !strcmp(op, "lreaddir")) {
+      int i;
+      for (i = 0; i < P9_READDIR_FILES; i++) {
+        std::string file = dir + "readdir-" + std::to_string(i);
+        FILE *f = fopen(file.c_str(), "a");
+        if (f)
+          fclose(f);
+      }
+    }
+  } else if (!strcmp(type, "net")) {
+    mmio_start = NET_MMIO_START;
+  } else if (!strcmp(type, "ogx")) {
+    mmio_start = OGX_MMIO_START;
+  } else {
+    usage(argv[0]);
+  }
+
+  b.drv = new VirtioDriver(mmio_start);
+  if (b.drv->start(bin)) {
+    fprintf(stderr, "Failed to start %s\n", bin);
+    delete b.drv;
+    return 1;
+  }
+
+  int err;
+  if (!strcmp(type, "p9fs"))
+    err = bench_p9fs(&b, op);
+  else if (!strcmp(type, "net"))
+    err = bench_tx(&b, NET_VQ_DATA_TX, "net tx");
+  else
+    err = bench_tx(&b, OGX_VQ_WRITE, "ogx write");
+
+  delete b.drv;
+  return err ? 1 : 0;
+}
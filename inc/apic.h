@@ -38,8 +38,9 @@ bool ioApicAccess(uint64_t);
 int ioApicMmio(vcpu_t *vcpu, uint64_t phys_addr, uint64_t *data, uint32_t len, uint8_t is_write);
 
 int queueInterrupt(ioapic_t *ioapic, uint8_t irq);
-struct interrupt_entry * dequeueInterrupt(ioapic_t *ioapic);
-bool haveInterrupts(ioapic_t *ioapic);
+struct interrupt_entry * dequeueInterrupt(ioapic_t *ioapic, uint32_t vcpu_id);
+bool haveInterrupts(ioapic_t *ioapic, uint32_t vcpu_id);
+bool haltVcpu(hv_t *hv, vcpu_t *vcpu);
 int checkAndSendInterrupt(hv_t *hv, vcpu_t *vcpu);
 
 #endif
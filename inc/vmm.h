@@ -162,9 +162,12 @@ typedef struct ioapic {
   int s[2];
   hv_t *hv;
   pthread_t ioapic_thread;
-  pthread_mutex_t queue_lock;
-  uint32_t nr_pending;
-  struct interrupt_entry *interrupt_queue;
+  // pending interrupts, one queue per destination vcpu. an irq is routed
+  // through the redir table when it is queued so each vcpu only ever
+  // injects its own
+  pthread_mutex_t queue_lock[NR_MAX_VCPUS];
+  uint32_t nr_pending[NR_MAX_VCPUS];
+  struct interrupt_entry *interrupt_queue[NR_MAX_VCPUS];
 } ioapic_t;
 
 typedef struct vcpu {
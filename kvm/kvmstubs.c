@@ -373,8 +373,8 @@ int hvRunVcpu(vcpu_t *vcpu) {
         ioctl(vcpu->driver_fd, KVM_GET_REGS, &regs);
         printf("vcpu %d halted at eip: 0x%llx\n", vcpu->id, regs.rip);
       }
-      vcpu->state = STATE_HALTED;
-      ret = waitForSipi(vcpu);
+      if (haltVcpu(vcpu->hv, vcpu))
+        ret = waitForSipi(vcpu);
       break;
     case KVM_EXIT_SHUTDOWN:
       get_and_dump_sregs(vcpu->driver_fd);